@@ -83,6 +83,16 @@ struct allocator_functions {
                uint64_t count, uint64_t offset)
   __attribute__((__nonnull__ (1, 2)));
 
+  /* As for read, but ranges which are holes are not copied into buf.
+   * Instead the whole range is described by adding extents: type 0
+   * for data copied into buf, and NBDKIT_EXTENT_HOLE|NBDKIT_EXTENT_ZERO
+   * for holes, which are left untouched in buf.
+   */
+  int (*read_sparse) (struct allocator *a, void *buf,
+                      uint64_t count, uint64_t offset,
+                      struct nbdkit_extents *extents)
+  __attribute__((__nonnull__ (1, 2, 5)));
+
   /* Write bytes from buf to [offset, offset+count-1].  Because this
    * can allocate memory, it can fail (returning -1).
    */
@@ -46,6 +46,7 @@
 #include <nbdkit-plugin.h>
 
 #include "cleanup.h"
+#include "minmax.h"
 #include "vector.h"
 
 #include "allocator.h"
@@ -181,6 +182,30 @@ m_alloc_read (struct allocator *a, void *buf,
   return 0;
 }
 
+static int
+m_alloc_read_sparse (struct allocator *a, void *buf,
+                     uint64_t count, uint64_t offset,
+                     struct nbdkit_extents *extents)
+{
+  struct m_alloc *ma = (struct m_alloc *) a;
+  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&ma->lock);
+  uint64_t n = 0;
+
+  /* Only the part beyond the end of the allocated array is a hole. */
+  if (offset < ma->ba.cap) {
+    n = MIN (count, ma->ba.cap - offset);
+    memcpy (buf, ma->ba.ptr + offset, n);
+    if (nbdkit_add_extent (extents, offset, n, 0) == -1)
+      return -1;
+  }
+  if (n < count &&
+      nbdkit_add_extent (extents, offset + n, count - n,
+                         NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO) == -1)
+    return -1;
+
+  return 0;
+}
+
 static int
 m_alloc_write (struct allocator *a, const void *buf,
                uint64_t count, uint64_t offset)
@@ -308,6 +333,7 @@ static struct allocator_functions functions = {
   .free = m_alloc_free,
   .set_size_hint = m_alloc_set_size_hint,
   .read = m_alloc_read,
+  .read_sparse = m_alloc_read_sparse,
   .write = m_alloc_write,
   .fill = m_alloc_fill,
   .zero = m_alloc_zero,
@@ -322,6 +322,39 @@ sparse_array_read (struct allocator *a,
   return 0;
 }
 
+static int
+sparse_array_read_sparse (struct allocator *a,
+                          void *buf, uint64_t count, uint64_t offset,
+                          struct nbdkit_extents *extents)
+{
+  struct sparse_array *sa = (struct sparse_array *) a;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&sa->lock);
+  uint64_t n;
+  uint32_t type;
+  void *p;
+
+  while (count > 0) {
+    p = lookup (sa, offset, false, &n, NULL);
+    if (n > count)
+      n = count;
+
+    if (p == NULL)
+      type = NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO;
+    else {
+      memcpy (buf, p, n);
+      type = 0;
+    }
+    if (nbdkit_add_extent (extents, offset, n, type) == -1)
+      return -1;
+
+    buf += n;
+    count -= n;
+    offset += n;
+  }
+
+  return 0;
+}
+
 static int
 sparse_array_write (struct allocator *a,
                     const void *buf, uint64_t count, uint64_t offset)
@@ -529,6 +562,7 @@ static struct allocator_functions functions = {
   .free = sparse_array_free,
   .set_size_hint = sparse_array_set_size_hint,
   .read = sparse_array_read,
+  .read_sparse = sparse_array_read_sparse,
   .write = sparse_array_write,
   .fill = sparse_array_fill,
   .zero = sparse_array_zero,
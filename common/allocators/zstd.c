@@ -382,6 +382,48 @@ zstd_array_read (struct allocator *a,
   return 0;
 }
 
+static int
+zstd_array_read_sparse (struct allocator *a,
+                        void *buf, uint64_t count, uint64_t offset,
+                        struct nbdkit_extents *extents)
+{
+  struct zstd_array *za = (struct zstd_array *) a;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&za->lock);
+  CLEANUP_FREE void *tbuf = NULL;
+  uint64_t n;
+  uint32_t type;
+  void *p;
+  struct l2_entry *l2_entry;
+
+  tbuf = malloc (PAGE_SIZE);
+  if (tbuf == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+
+  while (count > 0) {
+    l2_entry = NULL;
+    p = lookup_decompress (za, offset, tbuf, &n, &l2_entry);
+    if (n > count)
+      n = count;
+
+    if (l2_entry == NULL || l2_entry->page == NULL)
+      type = NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO;
+    else {
+      memcpy (buf, p, n);
+      type = 0;
+    }
+    if (nbdkit_add_extent (extents, offset, n, type) == -1)
+      return -1;
+
+    buf += n;
+    count -= n;
+    offset += n;
+  }
+
+  return 0;
+}
+
 static int
 zstd_array_write (struct allocator *a,
                   const void *buf, uint64_t count, uint64_t offset)
@@ -638,6 +680,7 @@ static struct allocator_functions functions = {
   .free = zstd_array_free,
   .set_size_hint = zstd_array_set_size_hint,
   .read = zstd_array_read,
+  .read_sparse = zstd_array_read_sparse,
   .write = zstd_array_write,
   .fill = zstd_array_fill,
   .zero = zstd_array_zero,
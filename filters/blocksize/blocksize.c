@@ -156,6 +156,25 @@ blocksize_get_size (nbdkit_next *next,
   return ROUND_DOWN (size, minblock);
 }
 
+/* Requests of any size and alignment are accepted, but requests
+ * aligned to minblock avoid the bounce buffer.
+ */
+static int
+blocksize_block_size (nbdkit_next *next, void *handle,
+                      uint32_t *minimum, uint32_t *preferred,
+                      uint32_t *maximum)
+{
+  if (next->block_size (next, minimum, preferred, maximum) == -1)
+    return -1;
+
+  if (*preferred == 0)
+    *preferred = 4096;
+  *preferred = MAX (*preferred, minblock);
+  *minimum = 1;
+  *maximum = 0xffffffff;
+  return 0;
+}
+
 static int
 blocksize_pread (nbdkit_next *next,
                  void *handle, void *b, uint32_t count, uint64_t offs,
@@ -432,6 +451,7 @@ static struct nbdkit_filter filter = {
   .config_complete   = blocksize_config_complete,
   .config_help       = blocksize_config_help,
   .get_size          = blocksize_get_size,
+  .block_size        = blocksize_block_size,
   .pread             = blocksize_pread,
   .pwrite            = blocksize_pwrite,
   .trim              = blocksize_trim,
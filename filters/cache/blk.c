@@ -46,6 +46,9 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <errno.h>
+#include <assert.h>
+
+#include <pthread.h>
 
 #ifdef HAVE_SYS_STATVFS_H
 #include <sys/statvfs.h>
@@ -54,6 +57,8 @@
 #include <nbdkit-filter.h>
 
 #include "bitmap.h"
+#include "cleanup.h"
+#include "iszero.h"
 #include "minmax.h"
 #include "rounding.h"
 #include "utils.h"
@@ -61,38 +66,104 @@
 #include "cache.h"
 #include "blk.h"
 #include "lru.h"
+#include "persist.h"
+#include "policy.h"
+#include "ram.h"
 #include "reclaim.h"
 
 /* The cache. */
 static int fd = -1;
 
+/* This lock protects the bitmap, the LRU structures and the reclaim
+ * state from parallel access.  Reads and writes of the cache file and
+ * the plugin are done without it.  The exceptions are blk_set_size,
+ * which runs before any requests, and reclaim, which calls fstat and
+ * punches holes in the cache file with the lock held.  That is safe
+ * because only clean blocks which are not in flight are reclaimed, so
+ * no other thread is using them, and because no other thread can find
+ * a block in the cache between punching the hole and marking it as
+ * not cached.  Other requests wait for at most two blocks to be
+ * reclaimed.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* List of block ranges which are currently in flight, protected by
+ * ranges_lock.  ranges_cond is signalled whenever a range is removed.
+ * The number of ranges is bounded by the number of threads so a
+ * simple linked list is sufficient.
+ */
+static pthread_mutex_t ranges_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ranges_cond = PTHREAD_COND_INITIALIZER;
+static struct blk_range *ranges = NULL;
+
 /* Bitmap.  There are two bits per block which are updated as we read,
  * write back or write through blocks.
  *
  * 00 = not in cache
  * 01 = block cached and clean
- * 10 = <unused>
+ * 10 = block reads as zeroes in the plugin
  * 11 = block cached and dirty
  *
- * Future enhancement:
- *
- * We need to cache information about holes, ie. blocks which read as
- * zeroes but are not explicitly stored in the cache.  This
- * information could be set when clients call cache_zero (and defer
- * calling plugin->zero until flush).  The information could also
- * interact with extents, so when plugin->extents returns information
- * that a hole exists we can record this information in the cache and
- * not have to query the plugin a second time (especially useful for
- * VDDK where querying extents is slow, and for qemu which [in 2019]
- * repeatedly requests the same information with REQ_ONE set).
+ * Blocks in the zero state are not stored in the cache file (which
+ * has a hole there), and reads are satisfied without touching either
+ * the plugin or the cache file.  This state is set when the client
+ * zeroes whole blocks and the zero is written through to the plugin,
+ * and (with cache-on-read) when a block read from the plugin turns
+ * out to be all zeroes or when the plugin's extents report that the
+ * block is a zero hole.  When the client zeroes blocks in writeback
+ * mode we instead punch a hole in the cache file and mark the block
+ * dirty, and the zeroes are written to the plugin on flush.
  */
 static struct bitmap bm;
 
-enum bm_entry {
-  BLOCK_NOT_CACHED = 0, /* assumed to be zero by reclaim code */
-  BLOCK_CLEAN = 1,
-  BLOCK_DIRTY = 3,
-};
+/* Number of dirty blocks, and a second bitmap (one bit per block)
+ * of blocks which were made dirty since the last call to
+ * blk_age_dirty_blocks.  These are used by the background writeback
+ * thread (see writeback.c).  Protected by the lock.
+ */
+static uint64_t nr_dirty = 0;
+static struct bitmap young;
+
+/* Number of blocks read by the client which were served from the
+ * cache (including blocks known to be zero), how many of those came
+ * from the RAM tier, and how many had to be read from the plugin.
+ * Protected by the lock.
+ */
+static uint64_t read_hits = 0, ram_hits = 0, read_misses = 0;
+
+/* Generation number which is incremented before and after each write
+ * to the plugin, and the number of writes in progress.  See
+ * blk_get_write_generation.  Protected by the lock.
+ */
+static uint64_t write_gen = 0;
+static unsigned writes_in_flight = 0;
+
+/* Set the state of a block, keeping track of dirty blocks.  Must be
+ * called with the lock held.
+ */
+static void
+set_state (uint64_t blknum, enum bm_entry state)
+{
+  if (bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED) == BLOCK_DIRTY)
+    nr_dirty--;
+  if (state == BLOCK_DIRTY) {
+    nr_dirty++;
+    bitmap_set_blk (&young, blknum, 1);
+  }
+  if (state == BLOCK_NOT_CACHED || state == BLOCK_ZERO)
+    policy_forget (blknum);
+  bitmap_set_blk (&bm, blknum, state);
+}
+
+/* Tell the replacement policy that a cached block was accessed.
+ * Must be called with the lock held.
+ */
+static void
+block_accessed (uint64_t blknum)
+{
+  policy_access (blknum);
+  lru_set_recently_accessed (blknum);
+}
 
 static const char *
 state_to_string (enum bm_entry state)
@@ -100,6 +171,7 @@ state_to_string (enum bm_entry state)
   switch (state) {
   case BLOCK_NOT_CACHED: return "not cached";
   case BLOCK_CLEAN: return "clean";
+  case BLOCK_ZERO: return "zero";
   case BLOCK_DIRTY: return "dirty";
   default: abort ();
   }
@@ -108,13 +180,15 @@ state_to_string (enum bm_entry state)
 /* Extra debugging (-D cache.verbose=1). */
 NBDKIT_DLL_PUBLIC int cache_debug_verbose = 0;
 
-int
-blk_init (void)
+/* Create the unlinked temporary file used when the cache is not
+ * persistent.
+ */
+static int
+open_temporary_file (void)
 {
   const char *tmpdir;
   size_t len;
   char *template;
-  struct statvfs statvfs;
 
   tmpdir = getenv ("TMPDIR");
   if (!tmpdir)
@@ -148,6 +222,20 @@ blk_init (void)
   }
 
   unlink (template);
+  return fd;
+}
+
+int
+blk_init (void)
+{
+  struct statvfs statvfs;
+
+  if (persist_enabled ())
+    fd = persist_open ();
+  else
+    fd = open_temporary_file ();
+  if (fd == -1)
+    return -1;
 
   /* Choose the block size.
    *
@@ -157,43 +245,83 @@ blk_init (void)
    * least as large as the filesystem block size.
    */
   if (fstatvfs (fd, &statvfs) == -1) {
-    nbdkit_error ("fstatvfs: %s: %m", tmpdir);
+    nbdkit_error ("fstatvfs: %m");
     return -1;
   }
   blksize = MAX (min_block_size, statvfs.f_bsize);
   nbdkit_debug ("cache: block size: %u", blksize);
 
   bitmap_init (&bm, blksize, 2 /* bits per block */);
+  bitmap_init (&young, blksize, 1 /* bits per block */);
 
   lru_init ();
+  policy_init ();
+  if (ram_init () == -1)
+    return -1;
+
+  if (persist_enabled () && persist_load (fd) == -1)
+    return -1;
 
   return 0;
 }
 
+/* Because blk_set_size is called before the other blk_* functions
+ * this should be set to the true size before we need it.
+ */
+static uint64_t size = 0;
+
 void
 blk_free (void)
 {
-  if (fd >= 0)
+  if (fd >= 0) {
+    if (persist_enabled ())
+      persist_save (fd, &bm, size);
     close (fd);
+  }
 
   bitmap_free (&bm);
+  bitmap_free (&young);
 
   lru_free ();
+  policy_free ();
+  ram_free ();
+
+  if (read_hits + read_misses > 0)
+    nbdkit_debug ("cache: read hits: %" PRIu64 " blocks "
+                  "(%" PRIu64 " from RAM), "
+                  "misses: %" PRIu64 " blocks, hit rate: %.1f%%",
+                  read_hits, ram_hits, read_misses,
+                  100.0 * read_hits / (read_hits + read_misses));
 }
 
-/* Because blk_set_size is called before the other blk_* functions
- * this should be set to the true size before we need it.
- */
-static uint64_t size = 0;
-
 int
 blk_set_size (uint64_t new_size)
 {
+  int64_t blknum;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
   size = new_size;
 
   if (bitmap_resize (&bm, size) == -1)
     return -1;
 
+  if (persist_enabled () && persist_set_size (fd, &bm, size) == -1)
+    return -1;
+
+  if (bitmap_resize (&young, size) == -1)
+    return -1;
+
+  /* Blocks may have been dropped by shrinking the bitmap, or restored
+   * from a persistent cache, so count the dirty blocks again.
+   */
+  nr_dirty = 0;
+  for (blknum = bitmap_next (&bm, 0); blknum >= 0;
+       blknum = bitmap_next (&bm, blknum + 1)) {
+    if (bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED) == BLOCK_DIRTY)
+      nr_dirty++;
+  }
+
   if (ftruncate (fd, ROUND_UP (size, blksize)) == -1) {
     nbdkit_error ("ftruncate: %m");
     return -1;
@@ -202,39 +330,254 @@ blk_set_size (uint64_t new_size)
   if (lru_set_size (size) == -1)
     return -1;
 
+  if (policy_set_size (size) == -1)
+    return -1;
+
+  if (ram_set_size (size) == -1)
+    return -1;
+
+  return 0;
+}
+
+static bool
+ranges_overlap (const struct blk_range *r1, const struct blk_range *r2)
+{
+  return r1->blknum < r2->blknum + r2->nrblocks &&
+    r2->blknum < r1->blknum + r1->nrblocks;
+}
+
+void
+blk_lock_range (struct blk_range *range)
+{
+  const struct blk_range *r;
+
+  assert (range->nrblocks > 0);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&ranges_lock);
+ again:
+  for (r = ranges; r != NULL; r = r->next) {
+    if (ranges_overlap (range, r)) {
+      pthread_cond_wait (&ranges_cond, &ranges_lock);
+      goto again;
+    }
+  }
+
+  range->next = ranges;
+  ranges = range;
+}
+
+void
+blk_unlock_range (struct blk_range *range)
+{
+  struct blk_range **rp;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&ranges_lock);
+  for (rp = &ranges; *rp != NULL; rp = &(*rp)->next) {
+    if (*rp == range) {
+      *rp = range->next;
+      pthread_cond_broadcast (&ranges_cond);
+      return;
+    }
+  }
+  abort (); /* range was not locked */
+}
+
+bool
+blk_is_locked (uint64_t blknum)
+{
+  const struct blk_range *r;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&ranges_lock);
+  for (r = ranges; r != NULL; r = r->next) {
+    if (r->blknum <= blknum && blknum < r->blknum + r->nrblocks)
+      return true;
+  }
+  return false;
+}
+
+enum bm_entry
+blk_get_state (uint64_t blknum)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  return bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
+}
+
+int64_t
+blk_get_write_generation (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  return writes_in_flight ? -1 : (int64_t) write_gen;
+}
+
+void
+blk_set_zero_if_unchanged (uint64_t blknum, uint64_t nrblocks, int64_t gen)
+{
+  uint64_t b;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  if (gen == -1 || gen != write_gen)
+    return;
+
+  for (b = 0; b < nrblocks; ++b) {
+    if (bitmap_get_blk (&bm, blknum + b, BLOCK_DIRTY) == BLOCK_NOT_CACHED)
+      set_state (blknum + b, BLOCK_ZERO);
+  }
+}
+
+static void
+begin_plugin_write (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  writes_in_flight++;
+  write_gen++;
+}
+
+static void
+end_plugin_write (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  writes_in_flight--;
+  write_gen++;
+}
+
+/* Discard the contents of blocks in the cache file so they read back
+ * as zeroes and (if the filesystem supports it) take no space.
+ */
+static int
+discard_blocks (uint64_t blknum, uint64_t nrblocks, int *err)
+{
+  off_t offset = blknum * blksize;
+  CLEANUP_FREE uint8_t *zeroes = NULL;
+  uint64_t b;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ram_drop (blknum, nrblocks);
+  }
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if (fallocate (fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                 offset, nrblocks * blksize) == 0)
+    return 0;
+  if (errno != EOPNOTSUPP) {
+    *err = errno;
+    nbdkit_error ("fallocate: FALLOC_FL_PUNCH_HOLE: %m");
+    return -1;
+  }
+#endif
+
+  /* Fallback: write zeroes. */
+  zeroes = calloc (1, blksize);
+  if (zeroes == NULL) {
+    *err = errno;
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  for (b = 0; b < nrblocks; ++b) {
+    if (full_pwrite (fd, zeroes, blksize, offset + b * blksize) == -1) {
+      *err = errno;
+      nbdkit_error ("pwrite: %m");
+      return -1;
+    }
+  }
   return 0;
 }
 
+/* Copy blocks just read from the plugin into the cache, except for
+ * blocks which are all zeroes which are marked as such instead.
+ */
+static int
+save_blocks (uint64_t blknum, uint64_t nrblocks, const uint8_t *block,
+             int *err)
+{
+  uint64_t b, i, runblocks;
+
+  for (b = 0; b < nrblocks; b += runblocks) {
+    const bool z = is_zero ((const char *) &block[b * blksize], blksize);
+
+    for (runblocks = 1; b + runblocks < nrblocks; ++runblocks) {
+      if (is_zero ((const char *) &block[(b + runblocks) * blksize],
+                   blksize) != z)
+        break;
+    }
+
+    if (!z &&
+        full_pwrite (fd, &block[b * blksize], blksize * runblocks,
+                     (blknum + b) * blksize) == -1) {
+      *err = errno;
+      nbdkit_error ("pwrite: %m");
+      return -1;
+    }
+    if (!z)
+      ram_store (&lock, blknum + b, runblocks, &block[b * blksize]);
+
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    for (i = b; i < b + runblocks; ++i) {
+      if (z)
+        set_state (blknum + i, BLOCK_ZERO);
+      else {
+        set_state (blknum + i, BLOCK_CLEAN);
+        block_accessed (blknum + i);
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* For the purposes of reading, clean and dirty blocks are the same. */
+static enum bm_entry
+read_state (enum bm_entry state)
+{
+  return state == BLOCK_DIRTY ? BLOCK_CLEAN : state;
+}
+
 static int
 _blk_read_multiple (nbdkit_next *next,
                     uint64_t blknum, uint64_t nrblocks,
                     uint8_t *block, int *err)
 {
   off_t offset = blknum * blksize;
-  bool not_cached =
-    bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED) == BLOCK_NOT_CACHED;
+  enum bm_entry state;
+  bool in_ram;
   uint64_t b, runblocks;
 
   assert (nrblocks > 0);
 
-  if (cache_debug_verbose)
-    nbdkit_debug ("cache: blk_read_multiple block %" PRIu64
-                  " (offset %" PRIu64 ") is %s",
-                  blknum, (uint64_t) offset,
-                  not_cached ? "not cached" : "cached");
-
   /* Find out how many of the following blocks form a "run" with the
-   * same cached/not-cached state.  We can process that many blocks in
-   * one go.
+   * same state (and for cached blocks, which are either all in the
+   * RAM tier or all not).  We can process that many blocks in one go.
+   *
+   * The caller holds the range lock so the state of these blocks
+   * cannot be changed by another request (nor can they be
+   * reclaimed or evicted) while we drop the lock to do I/O.
    */
-  for (b = 1, runblocks = 1; b < nrblocks; ++b, ++runblocks) {
-    bool s =
-      bitmap_get_blk (&bm, blknum + b, BLOCK_NOT_CACHED) == BLOCK_NOT_CACHED;
-    if (not_cached != s)
-      break;
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    state = read_state (bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED));
+    in_ram = state == BLOCK_CLEAN && ram_lookup (blknum);
+    for (b = 1, runblocks = 1; b < nrblocks; ++b, ++runblocks) {
+      enum bm_entry s =
+        read_state (bitmap_get_blk (&bm, blknum + b, BLOCK_NOT_CACHED));
+      if (state != s ||
+          (s == BLOCK_CLEAN && ram_lookup (blknum + b) != in_ram))
+        break;
+    }
+    if (state == BLOCK_NOT_CACHED)
+      read_misses += runblocks;
+    else
+      read_hits += runblocks;
+    if (in_ram)
+      ram_hits += runblocks;
   }
 
-  if (not_cached) {             /* Read underlying plugin. */
+  if (cache_debug_verbose)
+    nbdkit_debug ("cache: blk_read_multiple block %" PRIu64
+                  " (offset %" PRIu64 ") run of length %" PRIu64 " is %s",
+                  blknum, (uint64_t) offset, runblocks,
+                  state_to_string (state));
+
+  if (state == BLOCK_NOT_CACHED) { /* Read underlying plugin. */
     unsigned n, tail = 0;
 
     assert (blksize * runblocks <= UINT_MAX);
@@ -261,25 +604,26 @@ _blk_read_multiple (nbdkit_next *next,
                       " (offset %" PRIu64 ")",
                       blknum, (uint64_t) offset);
 
-      if (full_pwrite (fd, block, blksize * runblocks, offset) == -1) {
-        *err = errno;
-        nbdkit_error ("pwrite: %m");
+      if (save_blocks (blknum, runblocks, block, err) == -1)
         return -1;
-      }
-      for (b = 0; b < runblocks; ++b) {
-        bitmap_set_blk (&bm, blknum + b, BLOCK_CLEAN);
-        lru_set_recently_accessed (blknum + b);
-      }
     }
   }
-  else {                        /* Read cache. */
-    if (full_pread (fd, block, blksize * runblocks, offset) == -1) {
-      *err = errno;
-      nbdkit_error ("pread: %m");
-      return -1;
+  else if (state == BLOCK_CLEAN) { /* Read cache. */
+    if (!in_ram || ram_read (blknum, runblocks, block) == -1) {
+      if (full_pread (fd, block, blksize * runblocks, offset) == -1) {
+        *err = errno;
+        nbdkit_error ("pread: %m");
+        return -1;
+      }
+      if (!in_ram)
+        ram_store (&lock, blknum, runblocks, block);
     }
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
     for (b = 0; b < runblocks; ++b)
-      lru_set_recently_accessed (blknum + b);
+      block_accessed (blknum + b);
+  }
+  else /* state == BLOCK_ZERO */ {
+    memset (block, 0, blksize * runblocks);
   }
 
   /* If all done, return. */
@@ -299,7 +643,10 @@ blk_read_multiple (nbdkit_next *next,
                    uint64_t blknum, uint64_t nrblocks,
                    uint8_t *block, int *err)
 {
-  reclaim (fd, &bm);
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    reclaim (fd, &bm);
+  }
   return _blk_read_multiple (next, blknum, nrblocks, block, err);
 }
 
@@ -310,14 +657,45 @@ blk_read (nbdkit_next *next,
   return blk_read_multiple (next, blknum, 1, block, err);
 }
 
+int
+blk_pread_fd (uint64_t blknum, uint64_t nrblocks, int *fdp)
+{
+  uint64_t b;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+  /* The data is sent after the range lock has been released, so we
+   * cannot do this if the blocks might be reclaimed in the meantime.
+   */
+  if (max_size != -1)
+    return 0;
+
+  for (b = 0; b < nrblocks; ++b) {
+    if (read_state (bitmap_get_blk (&bm, blknum + b, BLOCK_NOT_CACHED)) !=
+        BLOCK_CLEAN)
+      return 0;
+  }
+
+  read_hits += nrblocks;
+  for (b = 0; b < nrblocks; ++b)
+    block_accessed (blknum + b);
+
+  *fdp = fd;
+  return 1;
+}
+
 int
 blk_cache (nbdkit_next *next,
            uint64_t blknum, uint8_t *block, int *err)
 {
   off_t offset = blknum * blksize;
-  enum bm_entry state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
+  enum bm_entry state;
 
-  reclaim (fd, &bm);
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    reclaim (fd, &bm);
+    state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
+  }
 
   if (cache_debug_verbose)
     nbdkit_debug ("cache: blk_cache block %" PRIu64
@@ -347,15 +725,10 @@ blk_cache (nbdkit_next *next,
       nbdkit_debug ("cache: cache block %" PRIu64 " (offset %" PRIu64 ")",
                     blknum, (uint64_t) offset);
 
-    if (full_pwrite (fd, block, blksize, offset) == -1) {
-      *err = errno;
-      nbdkit_error ("pwrite: %m");
+    if (save_blocks (blknum, 1, block, err) == -1)
       return -1;
-    }
-    bitmap_set_blk (&bm, blknum, BLOCK_CLEAN);
-    lru_set_recently_accessed (blknum);
   }
-  else {
+  else if (state != BLOCK_ZERO) {
 #if HAVE_POSIX_FADVISE
     int r = posix_fadvise (fd, offset, blksize, POSIX_FADV_WILLNEED);
     if (r) {
@@ -364,8 +737,48 @@ blk_cache (nbdkit_next *next,
       return -1;
     }
 #endif
-    lru_set_recently_accessed (blknum);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    block_accessed (blknum);
+  }
+  return 0;
+}
+
+/* Write zeroes through to the plugin, and remember that the blocks
+ * are zero.
+ */
+static int
+zero_through (nbdkit_next *next, uint64_t blknum, uint64_t nrblocks,
+              uint32_t flags, int *err)
+{
+  off_t offset = blknum * blksize;
+  uint64_t n = blksize * nrblocks, b;
+  int r, tmp;
+
+  if (offset + n > size)
+    n = size - offset;
+  assert (n <= UINT32_MAX);
+
+  if (cache_debug_verbose)
+    nbdkit_debug ("cache: zero through %" PRIu64 " blocks "
+                  "at block %" PRIu64 " (offset %" PRIu64 ")",
+                  nrblocks, blknum, (uint64_t) offset);
+
+  begin_plugin_write ();
+  r = next->zero (next, n, offset, flags & NBDKIT_FLAG_FUA, err);
+  end_plugin_write ();
+  if (r == -1)
+    return -1;
+
+  /* The plugin is correct now, so failure to punch holes in the cache
+   * is not fatal as long as we don't use the old cached data.
+   */
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    for (b = 0; b < nrblocks; ++b)
+      set_state (blknum + b, BLOCK_ZERO);
   }
+  discard_blocks (blknum, nrblocks, &tmp);
+
   return 0;
 }
 
@@ -376,13 +789,22 @@ blk_writethrough (nbdkit_next *next,
 {
   off_t offset = blknum * blksize;
   unsigned n = blksize, tail = 0;
+  int r;
 
   if (offset + n > size) {
     tail = offset + n - size;
     n -= tail;
   }
 
-  reclaim (fd, &bm);
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    reclaim (fd, &bm);
+  }
+
+  /* Writing zeroes can usually be done more efficiently. */
+  if (is_zero ((const char *) block, blksize) &&
+      next->can_zero (next) > NBDKIT_ZERO_NONE)
+    return zero_through (next, blknum, 1, flags, err);
 
   if (cache_debug_verbose)
     nbdkit_debug ("cache: writethrough block %" PRIu64 " (offset %" PRIu64 ")",
@@ -393,12 +815,17 @@ blk_writethrough (nbdkit_next *next,
     nbdkit_error ("pwrite: %m");
     return -1;
   }
+  ram_store (&lock, blknum, 1, block);
 
-  if (next->pwrite (next, block, n, offset, flags, err) == -1)
+  begin_plugin_write ();
+  r = next->pwrite (next, block, n, offset, flags, err);
+  end_plugin_write ();
+  if (r == -1)
     return -1;
 
-  bitmap_set_blk (&bm, blknum, BLOCK_CLEAN);
-  lru_set_recently_accessed (blknum);
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  set_state (blknum, BLOCK_CLEAN);
+  block_accessed (blknum);
 
   return 0;
 }
@@ -416,7 +843,14 @@ blk_write (nbdkit_next *next,
 
   offset = blknum * blksize;
 
-  reclaim (fd, &bm);
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    reclaim (fd, &bm);
+  }
+
+  /* Zero blocks are stored as holes in the cache file. */
+  if (is_zero ((const char *) block, blksize))
+    return blk_zero_multiple (next, blknum, 1, flags, err);
 
   if (cache_debug_verbose)
     nbdkit_debug ("cache: writeback block %" PRIu64 " (offset %" PRIu64 ")",
@@ -427,25 +861,209 @@ blk_write (nbdkit_next *next,
     nbdkit_error ("pwrite: %m");
     return -1;
   }
-  bitmap_set_blk (&bm, blknum, BLOCK_DIRTY);
-  lru_set_recently_accessed (blknum);
+  ram_store (&lock, blknum, 1, block);
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  set_state (blknum, BLOCK_DIRTY);
+  block_accessed (blknum);
 
   return 0;
 }
 
 int
-for_each_dirty_block (block_callback f, void *vp)
+blk_zero_multiple (nbdkit_next *next,
+                   uint64_t blknum, uint64_t nrblocks, uint32_t flags,
+                   int *err)
 {
-  uint64_t blknum;
-  enum bm_entry state;
+  uint64_t b;
 
-  bitmap_for (&bm, blknum) {
-    state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
-    if (state == BLOCK_DIRTY) {
-      if (f (blknum, vp) == -1)
+  assert (nrblocks > 0);
+
+  if (cache_mode == CACHE_MODE_WRITETHROUGH ||
+      (cache_mode == CACHE_MODE_WRITEBACK && (flags & NBDKIT_FLAG_FUA)))
+    return zero_through (next, blknum, nrblocks, flags, err);
+
+  if (cache_debug_verbose)
+    nbdkit_debug ("cache: writeback zero %" PRIu64 " blocks "
+                  "at block %" PRIu64 " (offset %" PRIu64 ")",
+                  nrblocks, blknum, blknum * blksize);
+
+  /* If the blocks already read as zeroes in the plugin then there is
+   * nothing to do.
+   */
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    for (b = 0; b < nrblocks; ++b) {
+      if (bitmap_get_blk (&bm, blknum + b, BLOCK_NOT_CACHED) != BLOCK_ZERO)
+        break;
+    }
+    if (b == nrblocks)
+      return 0;
+  }
+
+  if (discard_blocks (blknum, nrblocks, err) == -1)
+    return -1;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  for (b = 0; b < nrblocks; ++b) {
+    set_state (blknum + b, BLOCK_DIRTY);
+    block_accessed (blknum + b);
+  }
+
+  return 0;
+}
+
+int
+blk_trim_multiple (uint64_t blknum, uint64_t nrblocks, int *err)
+{
+  uint64_t b;
+
+  if (cache_debug_verbose)
+    nbdkit_debug ("cache: trim %" PRIu64 " blocks "
+                  "at block %" PRIu64 " (offset %" PRIu64 ")",
+                  nrblocks, blknum, blknum * blksize);
+
+  /* After a trim the contents of the plugin are unspecified, so all
+   * we can do is to drop the blocks from the cache.
+   */
+  if (discard_blocks (blknum, nrblocks, err) == -1)
+    return -1;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  for (b = 0; b < nrblocks; ++b)
+    set_state (blknum + b, BLOCK_NOT_CACHED);
+  return 0;
+}
+
+int
+blk_writeback_multiple (nbdkit_next *next,
+                        uint64_t blknum, uint64_t nrblocks,
+                        uint8_t *block, uint32_t flags, int *err)
+{
+  uint64_t b, i, runblocks, n;
+  off_t offset;
+  bool z;
+  int r;
+
+  for (b = 0; b < nrblocks; b += runblocks) {
+    /* Find the next run of dirty blocks.  Other requests cannot
+     * change the state of blocks in the range while we hold the
+     * range lock, but they might have been written back already.
+     */
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+      if (bitmap_get_blk (&bm, blknum + b, BLOCK_NOT_CACHED) != BLOCK_DIRTY) {
+        runblocks = 1;
+        continue;
+      }
+      for (runblocks = 1; b + runblocks < nrblocks; ++runblocks) {
+        if (bitmap_get_blk (&bm, blknum + b + runblocks, BLOCK_NOT_CACHED)
+            != BLOCK_DIRTY)
+          break;
+      }
+    }
+
+    offset = (blknum + b) * blksize;
+    if (full_pread (fd, block, blksize * runblocks, offset) == -1) {
+      *err = errno;
+      nbdkit_error ("pread: %m");
+      return -1;
+    }
+
+    /* Blocks which were zeroed in writeback mode are holes in the
+     * cache, and can usually be written more efficiently.
+     */
+    z = is_zero ((const char *) block, blksize * runblocks) &&
+      next->can_zero (next) > NBDKIT_ZERO_NONE;
+    if (z) {
+      if (zero_through (next, blknum + b, runblocks, flags, err) == -1)
         return -1;
+      continue;
     }
+
+    if (cache_debug_verbose)
+      nbdkit_debug ("cache: writeback %" PRIu64 " blocks "
+                    "at block %" PRIu64 " (offset %" PRIu64 ")",
+                    runblocks, blknum + b, (uint64_t) offset);
+
+    n = blksize * runblocks;
+    if (offset + n > size)
+      n = size - offset;
+    assert (n <= UINT32_MAX);
+
+    begin_plugin_write ();
+    r = next->pwrite (next, block, n, offset, flags, err);
+    end_plugin_write ();
+    if (r == -1)
+      return -1;
+
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    for (i = b; i < b + runblocks; ++i)
+      set_state (blknum + i, BLOCK_CLEAN);
   }
 
   return 0;
 }
+
+uint64_t
+blk_get_dirty_blocks (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  return nr_dirty;
+}
+
+void
+blk_get_read_stats (uint64_t *hits_ret, uint64_t *ram_hits_ret,
+                    uint64_t *misses_ret)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  *hits_ret = read_hits;
+  *ram_hits_ret = ram_hits;
+  *misses_ret = read_misses;
+}
+
+void
+blk_age_dirty_blocks (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  if (young.size > 0)
+    memset (young.bitmap, 0, young.size);
+}
+
+int
+for_each_dirty_run (uint64_t max_nrblocks, bool old_only,
+                    run_callback f, void *vp)
+{
+  int64_t blknum = 0;
+  uint64_t nrblocks, limit;
+
+  assert (max_nrblocks > 0);
+
+  for (;;) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+      for (;;) {
+        blknum = bitmap_next (&bm, blknum);
+        if (blknum == -1)
+          return 0;
+        if (bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED) == BLOCK_DIRTY &&
+            !(old_only && bitmap_get_blk (&young, blknum, 0)))
+          break;
+        blknum++;
+      }
+
+      limit = bm.size * bm.ibpb;
+      for (nrblocks = 1;
+           nrblocks < max_nrblocks && blknum + nrblocks < limit;
+           ++nrblocks) {
+        if (bitmap_get_blk (&bm, blknum + nrblocks, BLOCK_NOT_CACHED)
+            != BLOCK_DIRTY ||
+            (old_only && bitmap_get_blk (&young, blknum + nrblocks, 0)))
+          break;
+      }
+    }
+
+    if (f (blknum, nrblocks, vp) == -1)
+      return -1;
+    blknum += nrblocks;
+  }
+}
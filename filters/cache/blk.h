@@ -33,22 +33,87 @@
 #ifndef NBDKIT_BLK_H
 #define NBDKIT_BLK_H
 
+#include <stdbool.h>
+
+#include "unique-name.h"
+
+/* The state of each block, stored in the bitmap (see blk.c). */
+enum bm_entry {
+  BLOCK_NOT_CACHED = 0, /* assumed to be zero by reclaim code */
+  BLOCK_CLEAN = 1,
+  BLOCK_ZERO = 2,
+  BLOCK_DIRTY = 3,
+};
+
 /* Initialize the cache and bitmap. */
 extern int blk_init (void);
 
 /* Close the cache, free the bitmap. */
 extern void blk_free (void);
 
+/* Allocate or resize the cache file and bitmap. */
+extern int blk_set_size (uint64_t new_size);
+
+/* In order to handle parallel requests safely, a range of blocks
+ * must be locked before calling any of the blk_* I/O functions below
+ * on those blocks, and the lock must be held across read-modify-write
+ * cycles.  Requests touching disjoint ranges run in parallel.  A
+ * request which overlaps a range that is in flight (for example a
+ * cache miss which is being fetched from the plugin) waits until the
+ * other request has finished.
+ *
+ * The bitmap and LRU structures are protected by a separate lock
+ * internal to blk.c which is never held across I/O.
+ */
+struct blk_range {
+  uint64_t blknum;              /* First block in the range. */
+  uint64_t nrblocks;            /* Number of blocks in the range. */
+  struct blk_range *next;       /* Linked list of ranges in flight. */
+};
+
+extern void blk_lock_range (struct blk_range *range)
+  __attribute__((__nonnull__ (1)));
+extern void blk_unlock_range (struct blk_range *range)
+  __attribute__((__nonnull__ (1)));
+
+/* Returns true if the block is part of a range that is in flight. */
+extern bool blk_is_locked (uint64_t blknum);
+
+/* Return the current state of a block.  This is needed when
+ * calculating extents.  The state may change as soon as this returns
+ * unless the caller has locked the block.
+ */
+extern enum bm_entry blk_get_state (uint64_t blknum);
+
+/* Returns a generation number which changes whenever this filter
+ * writes to the plugin, or -1 if a write to the plugin is in
+ * progress.  This is used to detect if extents information read from
+ * the plugin might be stale.
+ */
+extern int64_t blk_get_write_generation (void);
+
+/* Record that blocks which are not cached read as zeroes in the
+ * plugin, as long as the write generation has not changed since
+ * ‘gen’ was obtained from blk_get_write_generation.
+ */
+extern void blk_set_zero_if_unchanged (uint64_t blknum, uint64_t nrblocks,
+                                       int64_t gen);
+
+#define CLEANUP_BLK_UNLOCK_RANGE \
+  __attribute__((cleanup (blk_unlock_range)))
+
+#define ACQUIRE_BLK_RANGE_FOR_CURRENT_SCOPE(first, n)                   \
+  CLEANUP_BLK_UNLOCK_RANGE struct blk_range NBDKIT_UNIQUE_NAME(_range) = \
+    { .blknum = (first), .nrblocks = (n), .next = NULL };               \
+  blk_lock_range (&NBDKIT_UNIQUE_NAME(_range))
+
 /*----------------------------------------------------------------------
  * ** NOTE **
  *
- * An exclusive lock must be held when you call any function below
- * this line.
+ * The range of blocks must be locked (see above) when you call any
+ * function below this line.
  */
 
-/* Allocate or resize the cache file and bitmap. */
-extern int blk_set_size (uint64_t new_size);
-
 /* Read a single block from the cache or plugin. If cache_on_read is set,
  * also ensure it is cached. */
 extern int blk_read (nbdkit_next *next,
@@ -61,6 +126,14 @@ extern int blk_read_multiple (nbdkit_next *next,
                               uint8_t *block, int *err)
   __attribute__((__nonnull__ (1, 4, 5)));
 
+/* If all the blocks are cached, return the cache file descriptor in
+ * *fd so the server can send the data directly from the cache file
+ * (at the same offset as in the plugin), and return 1.  Otherwise
+ * return 0 and the caller should use blk_read_multiple.
+ */
+extern int blk_pread_fd (uint64_t blknum, uint64_t nrblocks, int *fd)
+  __attribute__((__nonnull__ (3)));
+
 /* If a single block is not cached, copy it from the plugin. */
 extern int blk_cache (nbdkit_next *next,
                       uint64_t blknum, uint8_t *block, int *err)
@@ -85,9 +158,65 @@ extern int blk_write (nbdkit_next *next,
                       uint32_t flags, int *err)
   __attribute__((__nonnull__ (1, 3, 5)));
 
-/* Iterates over each dirty block in the cache. */
-typedef int (*block_callback) (uint64_t blknum, void *vp);
-extern int for_each_dirty_block (block_callback f, void *vp)
-  __attribute__((__nonnull__ (1)));
+/* Zero whole blocks.
+ *
+ * If the cache is in writethrough mode, or the FUA flag is set, then
+ * the plugin is zeroed and the blocks are remembered as reading as
+ * zeroes.  Otherwise the blocks are zeroed in the cache and marked as
+ * dirty.  Either way the blocks do not take any space in the cache.
+ */
+extern int blk_zero_multiple (nbdkit_next *next,
+                              uint64_t blknum, uint64_t nrblocks,
+                              uint32_t flags, int *err)
+  __attribute__((__nonnull__ (1, 5)));
+
+/* Drop whole blocks from the cache after they have been trimmed in
+ * the plugin.
+ */
+extern int blk_trim_multiple (uint64_t blknum, uint64_t nrblocks, int *err)
+  __attribute__((__nonnull__ (3)));
+
+/* Write back dirty blocks in the range to the plugin and mark them
+ * clean.  Blocks in the range which are not dirty are skipped.  The
+ * buffer must be large enough to hold nrblocks blocks.
+ */
+extern int blk_writeback_multiple (nbdkit_next *next,
+                                   uint64_t blknum, uint64_t nrblocks,
+                                   uint8_t *block, uint32_t flags, int *err)
+  __attribute__((__nonnull__ (1, 4, 6)));
+
+/*----------------------------------------------------------------------
+ * The functions below do not need any range to be locked.
+ */
+
+/* Return the number of dirty blocks in the cache. */
+extern uint64_t blk_get_dirty_blocks (void);
+
+/* Return the number of blocks read by the client which were served
+ * from the cache, how many of those came from the RAM tier, and how
+ * many were read from the plugin.
+ */
+extern void blk_get_read_stats (uint64_t *hits, uint64_t *ram_hits,
+                                uint64_t *misses);
+
+/* Forget which dirty blocks were made dirty recently.  Blocks made
+ * dirty after this call are skipped by for_each_dirty_run when
+ * old_only is true, until the next call.
+ */
+extern void blk_age_dirty_blocks (void);
+
+/* Iterates over runs of at most max_nrblocks contiguous dirty blocks
+ * in the cache.  If old_only is true, blocks which were made dirty
+ * since the last call to blk_age_dirty_blocks are skipped.
+ *
+ * The callback is called without any lock held, so it must lock the
+ * range itself, and the blocks may no longer be dirty by the time it
+ * does.  If the callback returns -1 the iteration stops and this
+ * returns -1.
+ */
+typedef int (*run_callback) (uint64_t blknum, uint64_t nrblocks, void *vp);
+extern int for_each_dirty_run (uint64_t max_nrblocks, bool old_only,
+                               run_callback f, void *vp)
+  __attribute__((__nonnull__ (3)));
 
 #endif /* NBDKIT_BLK_H */
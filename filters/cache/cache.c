@@ -61,17 +61,16 @@
 
 #include "cache.h"
 #include "blk.h"
+#include "persist.h"
+#include "policy.h"
+#include "ram.h"
 #include "reclaim.h"
+#include "writeback.h"
 #include "isaligned.h"
 #include "ispowerof2.h"
 #include "minmax.h"
 #include "rounding.h"
 
-/* In order to handle parallel requests safely, this lock must be held
- * when calling any blk_* functions.
- */
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-
 unsigned blksize;            /* actual block size (picked by blk.c) */
 unsigned min_block_size = 65536;
 enum cache_mode cache_mode = CACHE_MODE_WRITEBACK;
@@ -170,6 +169,33 @@ cache_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
     return -1;
   }
 #endif /* !HAVE_CACHE_RECLAIM */
+  else if (strcmp (key, "cache-policy") == 0) {
+    if (strcmp (value, "lru") == 0) {
+      cache_policy = POLICY_LRU;
+      return 0;
+    }
+    else if (strcmp (value, "2q") == 0) {
+      cache_policy = POLICY_2Q;
+      return 0;
+    }
+    else {
+      nbdkit_error ("invalid cache-policy parameter, should be lru|2q");
+      return -1;
+    }
+  }
+  else if (strcmp (key, "cache-ram-size") == 0) {
+    int64_t r;
+
+    r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    ram_size = r;
+    return 0;
+  }
+  else if (strcmp (key, "cache-ram-allocator") == 0) {
+    ram_allocator = value;
+    return 0;
+  }
   else if (strcmp (key, "cache-on-read") == 0) {
     if (value[0] == '/') {
       cor_path = value;
@@ -183,7 +209,42 @@ cache_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
     }
     return 0;
   }
+  else if (strcmp (key, "cache-dirty-ratio") == 0) {
+    if (nbdkit_parse_unsigned ("cache-dirty-ratio",
+                               value, &dirty_ratio) == -1)
+      return -1;
+    if (dirty_ratio == 0 || dirty_ratio > 100) {
+      nbdkit_error ("cache-dirty-ratio must be between 1 and 100");
+      return -1;
+    }
+    return 0;
+  }
+  else if (strcmp (key, "cache-dirty-age") == 0) {
+    if (nbdkit_parse_unsigned ("cache-dirty-age", value, &dirty_age) == -1)
+      return -1;
+    if (dirty_age == 0) {
+      nbdkit_error ("cache-dirty-age must be greater than zero");
+      return -1;
+    }
+    return 0;
+  }
+  else if (strcmp (key, "cache-file") == 0) {
+    cache_file = value;
+    return 0;
+  }
+  else if (strcmp (key, "cache-dir") == 0) {
+    cache_dir = value;
+    return 0;
+  }
+  else if (strcmp (key, "cache-id") == 0) {
+    cache_id = value;
+    return 0;
+  }
   else {
+    /* Parameters of the underlying layers determine the identity of
+     * a persistent cache.
+     */
+    persist_add_identity (key, value);
     return next (nxdata, key, value);
   }
 }
@@ -191,14 +252,23 @@ cache_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
 #define cache_config_help_common \
   "cache=MODE                Set cache MODE, one of writeback (default),\n" \
   "                          writethrough, or unsafe.\n" \
-  "cache-on-read=BOOL|/PATH  Set to true to cache on reads (default false).\n"
+  "cache-on-read=BOOL|/PATH  Set to true to cache on reads (default false).\n" \
+  "cache-dirty-ratio=PCT     Write back in the background above PCT% dirty.\n" \
+  "cache-dirty-age=SECS      Write back blocks dirty for SECS seconds.\n" \
+  "cache-ram-size=SIZE       Keep up to SIZE of hot blocks in RAM.\n" \
+  "cache-ram-allocator=sparse|zstd|malloc\n" \
+  "                          Allocator used for blocks in RAM.\n" \
+  "cache-file=FILE           Keep a persistent cache in FILE.\n" \
+  "cache-dir=DIR             Keep a persistent cache in DIR.\n" \
+  "cache-id=ID               Identity of the persistent cache.\n"
 #ifndef HAVE_CACHE_RECLAIM
 #define cache_config_help cache_config_help_common
 #else
 #define cache_config_help cache_config_help_common \
   "cache-max-size=SIZE       Set maximum space used by cache.\n" \
   "cache-high-threshold=PCT  Percentage of max size where reclaim begins.\n" \
-  "cache-low-threshold=PCT   Percentage of max size where reclaim ends.\n"
+  "cache-low-threshold=PCT   Percentage of max size where reclaim ends.\n" \
+  "cache-policy=lru|2q       Policy for choosing blocks to reclaim.\n"
 #endif
 
 /* Decide if cache-on-read is currently on or off. */
@@ -217,6 +287,21 @@ static int
 cache_config_complete (nbdkit_next_config_complete *next,
                        nbdkit_backend *nxdata)
 {
+  if (cache_file && cache_dir) {
+    nbdkit_error ("cache-file and cache-dir cannot be used together");
+    return -1;
+  }
+  if ((dirty_ratio > 0 || dirty_age > 0) &&
+      cache_mode != CACHE_MODE_WRITEBACK) {
+    nbdkit_error ("cache-dirty-ratio and cache-dirty-age "
+                  "require cache=writeback");
+    return -1;
+  }
+  if (cache_id && !persist_enabled ()) {
+    nbdkit_error ("cache-id requires cache-file or cache-dir");
+    return -1;
+  }
+
   /* If cache-max-size was set then check the thresholds. */
   if (max_size != -1) {
     if (lo_thresh >= hi_thresh) {
@@ -229,15 +314,71 @@ cache_config_complete (nbdkit_next_config_complete *next,
   return next (nxdata);
 }
 
+/* Thread model, saved for cache_after_fork. */
+static int thread_model;
+
+/* Metrics. */
+static uint64_t
+read_hits (void)
+{
+  uint64_t hits, ram_hits, misses;
+
+  blk_get_read_stats (&hits, &ram_hits, &misses);
+  return hits;
+}
+
+static uint64_t
+ram_read_hits (void)
+{
+  uint64_t hits, ram_hits, misses;
+
+  blk_get_read_stats (&hits, &ram_hits, &misses);
+  return ram_hits;
+}
+
+static uint64_t
+read_misses (void)
+{
+  uint64_t hits, ram_hits, misses;
+
+  blk_get_read_stats (&hits, &ram_hits, &misses);
+  return misses;
+}
+
 static int
-cache_get_ready (int thread_model)
+cache_get_ready (int tm)
 {
   if (blk_init () == -1)
     return -1;
 
+  if (nbdkit_add_metric ("cache_read_hits_total",
+                         "Blocks read by the client from the cache.",
+                         NBDKIT_METRIC_COUNTER, read_hits) == -1 ||
+      nbdkit_add_metric ("cache_ram_read_hits_total",
+                         "Blocks read by the client from the RAM tier.",
+                         NBDKIT_METRIC_COUNTER, ram_read_hits) == -1 ||
+      nbdkit_add_metric ("cache_read_misses_total",
+                         "Blocks read by the client from the plugin.",
+                         NBDKIT_METRIC_COUNTER, read_misses) == -1)
+    return -1;
+
+  thread_model = tm;
   return 0;
 }
 
+/* Start the background writeback thread, if enabled. */
+static int
+cache_after_fork (nbdkit_backend *nxdata)
+{
+  return writeback_start (nxdata, thread_model);
+}
+
+static void
+cache_cleanup (nbdkit_backend *nxdata)
+{
+  writeback_stop ();
+}
+
 /* Get the file size, set the cache size. */
 static int64_t
 cache_get_size (nbdkit_next *next,
@@ -252,7 +393,6 @@ cache_get_size (nbdkit_next *next,
 
   nbdkit_debug ("cache: underlying file size: %" PRIi64, size);
 
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
   r = blk_set_size (size);
   if (r == -1)
     return -1;
@@ -260,6 +400,32 @@ cache_get_size (nbdkit_next *next,
   return size;
 }
 
+/* Requests of any alignment are accepted, but whole cache
+ * blocks avoid a read-modify-write cycle, so advertise the block size
+ * as the preferred size.
+ */
+static int
+cache_block_size (nbdkit_next *next, void *handle,
+                  uint32_t *minimum, uint32_t *preferred, uint32_t *maximum)
+{
+  uint32_t block_preferred;
+
+  if (next->block_size (next, minimum, preferred, maximum) == -1)
+    return -1;
+
+  /* Requests are passed on as runs of whole blocks, so they must not
+   * be larger than the plugin's maximum (0 means it has no limit).
+   */
+  if (*maximum == 0)
+    *maximum = 0xffffffff;
+
+  *minimum = 1;
+  block_preferred = MIN (blksize, 32 * 1024 * 1024);
+  if (block_preferred <= *maximum)
+    *preferred = MAX (*preferred, block_preferred);
+  return 0;
+}
+
 /* Force an early call to cache_get_size because we have to set the
  * backing file size and bitmap size before any other read or write
  * calls.
@@ -369,7 +535,7 @@ cache_pread (nbdkit_next *next,
     uint64_t n = MIN (blksize - blkoffs, count);
 
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_BLK_RANGE_FOR_CURRENT_SCOPE (blknum, 1);
     r = blk_read (next, blknum, block, err);
     if (r == -1)
       return -1;
@@ -385,7 +551,7 @@ cache_pread (nbdkit_next *next,
   /* Aligned body */
   nrblocks = count / blksize;
   if (nrblocks > 0) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_BLK_RANGE_FOR_CURRENT_SCOPE (blknum, nrblocks);
     r = blk_read_multiple (next, blknum, nrblocks, buf, err);
     if (r == -1)
       return -1;
@@ -399,7 +565,7 @@ cache_pread (nbdkit_next *next,
   /* Unaligned tail */
   if (count) {
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_BLK_RANGE_FOR_CURRENT_SCOPE (blknum, 1);
     r = blk_read (next, blknum, block, err);
     if (r == -1)
       return -1;
@@ -410,6 +576,29 @@ cache_pread (nbdkit_next *next,
   return 0;
 }
 
+/* Read data directly from the cache file, if it is all cached. */
+static int
+cache_pread_fd (nbdkit_next *next,
+                void *handle, uint32_t count, uint64_t offset,
+                uint32_t flags, int *fd, uint64_t *fd_offset, int *err)
+{
+  uint64_t blknum, nrblocks;
+
+  assert (!flags);
+  if (count == 0)
+    return 0;
+
+  blknum = offset / blksize;
+  nrblocks = DIV_ROUND_UP (offset + count, blksize) - blknum;
+
+  ACQUIRE_BLK_RANGE_FOR_CURRENT_SCOPE (blknum, nrblocks);
+  if (blk_pread_fd (blknum, nrblocks, fd) == 0)
+    return 0;
+
+  *fd_offset = offset;
+  return 1;
+}
+
 /* Write data. */
 static int
 cache_pwrite (nbdkit_next *next,
@@ -448,7 +637,7 @@ cache_pwrite (nbdkit_next *next,
      * Hold the lock over the whole operation.
      */
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_BLK_RANGE_FOR_CURRENT_SCOPE (blknum, 1);
     r = blk_read (next, blknum, block, err);
     if (r != -1) {
       memcpy (&block[blkoffs], buf, n);
@@ -465,7 +654,7 @@ cache_pwrite (nbdkit_next *next,
 
   /* Aligned body */
   while (count >= blksize) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_BLK_RANGE_FOR_CURRENT_SCOPE (blknum, 1);
     r = blk_write (next, blknum, buf, flags, err);
     if (r == -1)
       return -1;
@@ -479,7 +668,7 @@ cache_pwrite (nbdkit_next *next,
   /* Unaligned tail */
   if (count) {
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_BLK_RANGE_FOR_CURRENT_SCOPE (blknum, 1);
     r = blk_read (next, blknum, block, err);
     if (r != -1) {
       memcpy (block, buf, count);
@@ -489,6 +678,7 @@ cache_pwrite (nbdkit_next *next,
       return -1;
   }
 
+  writeback_kick ();
   if (need_flush)
     return cache_flush (next, handle, 0, err);
   return 0;
@@ -501,12 +691,13 @@ cache_zero (nbdkit_next *next,
             int *err)
 {
   CLEANUP_FREE uint8_t *block = NULL;
-  uint64_t blknum, blkoffs;
+  uint64_t blknum, blkoffs, nrblocks;
   int r;
   bool need_flush = false;
 
-  /* We are purposefully avoiding next->zero, so a zero request is
-   * never faster than plain writes.
+  /* Unaligned parts of the request turn into read-modify-write, and
+   * in writeback mode we never call next->zero until flush, so a zero
+   * request is never faster than plain writes.
    */
   if (flags & NBDKIT_FLAG_FAST_ZERO) {
     *err = ENOTSUP;
@@ -538,7 +729,7 @@ cache_zero (nbdkit_next *next,
     /* Do a read-modify-write operation on the current block.
      * Hold the lock over the whole operation.
      */
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_BLK_RANGE_FOR_CURRENT_SCOPE (blknum, 1);
     r = blk_read (next, blknum, block, err);
     if (r != -1) {
       memset (&block[blkoffs], 0, n);
@@ -553,23 +744,21 @@ cache_zero (nbdkit_next *next,
   }
 
   /* Aligned body */
-  if (count >= blksize)
-    memset (block, 0, blksize);
-  while (count >=blksize) {
-    /* Intentional that we do not use next->zero */
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    r = blk_write (next, blknum, block, flags, err);
+  nrblocks = count / blksize;
+  if (nrblocks > 0) {
+    ACQUIRE_BLK_RANGE_FOR_CURRENT_SCOPE (blknum, nrblocks);
+    r = blk_zero_multiple (next, blknum, nrblocks, flags, err);
     if (r == -1)
       return -1;
 
-    count -= blksize;
-    offset += blksize;
-    blknum++;
+    count -= nrblocks * blksize;
+    offset += nrblocks * blksize;
+    blknum += nrblocks;
   }
 
   /* Unaligned tail */
   if (count) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_BLK_RANGE_FOR_CURRENT_SCOPE (blknum, 1);
     r = blk_read (next, blknum, block, err);
     if (r != -1) {
       memset (block, 0, count);
@@ -579,87 +768,89 @@ cache_zero (nbdkit_next *next,
       return -1;
   }
 
+  writeback_kick ();
   if (need_flush)
     return cache_flush (next, handle, 0, err);
   return 0;
 }
 
-/* Flush: Go through all the dirty blocks, flushing them to disk. */
-struct flush_data {
-  uint8_t *block;               /* bounce buffer */
-  unsigned errors;              /* count of errors seen */
-  int first_errno;              /* first errno seen */
-  nbdkit_next *next;
-};
+/* Trim data. */
+static int
+cache_trim (nbdkit_next *next,
+            void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+            int *err)
+{
+  uint64_t blknum, end;
+  int64_t size;
+  bool need_flush = false;
 
-static int flush_dirty_block (uint64_t blknum, void *);
+  if ((flags & NBDKIT_FLAG_FUA) &&
+      (cache_mode == CACHE_MODE_UNSAFE ||
+       next->can_fua (next) == NBDKIT_FUA_EMULATE)) {
+    flags &= ~NBDKIT_FLAG_FUA;
+    need_flush = true;
+  }
 
+  /* Find the whole blocks covered by the request.  The partial block
+   * at the end of the disk counts as a whole block.
+   */
+  size = next->get_size (next);
+  if (size == -1) {
+    *err = EIO;
+    return -1;
+  }
+  blknum = DIV_ROUND_UP (offset, blksize);
+  if (offset + count == size)
+    end = DIV_ROUND_UP (offset + count, blksize);
+  else
+    end = (offset + count) / blksize;
+
+  /* The trim is always passed to the plugin.  Hold the lock on whole
+   * blocks so that any cached (possibly dirty) copy is discarded
+   * atomically, otherwise it could be written back over the trim.
+   */
+  if (end > blknum) {
+    ACQUIRE_BLK_RANGE_FOR_CURRENT_SCOPE (blknum, end - blknum);
+    if (next->trim (next, count, offset, flags, err) == -1)
+      return -1;
+    if (blk_trim_multiple (blknum, end - blknum, err) == -1)
+      return -1;
+  }
+  else {
+    if (next->trim (next, count, offset, flags, err) == -1)
+      return -1;
+  }
+
+  if (need_flush)
+    return cache_flush (next, handle, 0, err);
+  return 0;
+}
+
+/* Flush: Go through all the dirty blocks, flushing them to disk. */
 static int
 cache_flush (nbdkit_next *next, void *handle,
              uint32_t flags, int *err)
 {
-  CLEANUP_FREE uint8_t *block = NULL;
-  struct flush_data data =
-    { .errors = 0, .first_errno = 0, .next = next };
-  int tmp;
+  int errors = 0, tmp;
 
   if (cache_mode == CACHE_MODE_UNSAFE)
     return 0;
 
   assert (!flags);
 
-  /* Allocate the bounce buffer. */
-  block = malloc (blksize);
-  if (block == NULL) {
-    *err = errno;
-    nbdkit_error ("malloc: %m");
-    return -1;
-  }
-  data.block = block;
-
   /* In theory if cache_mode == CACHE_MODE_WRITETHROUGH then there
    * should be no dirty blocks.  However we go through the cache here
    * to be sure.  Also we still need to issue the flush to the
    * underlying storage.
    */
-  {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    for_each_dirty_block (flush_dirty_block, &data);
-  }
+  if (writeback_dirty_blocks (next, false, 0, 0, err) == -1)
+    errors++;
 
   /* Now issue a flush request to the underlying storage. */
-  if (next->flush (next, 0, data.errors ? &tmp : &data.first_errno) == -1)
-    data.errors++;
+  if (next->flush (next, 0, errors ? &tmp : err) == -1)
+    errors++;
 
-  if (data.errors > 0) {
-    *err = data.first_errno;
-    return -1;
-  }
-  return 0;
-}
-
-static int
-flush_dirty_block (uint64_t blknum, void *datav)
-{
-  struct flush_data *data = datav;
-  int tmp;
-
-  /* Perform a read + writethrough which will read from the
-   * cache and write it through to the underlying storage.
-   */
-  if (blk_read (data->next, blknum, data->block,
-                data->errors ? &tmp : &data->first_errno) == -1)
-    goto err;
-  if (blk_writethrough (data->next, blknum, data->block, 0,
-                        data->errors ? &tmp : &data->first_errno) == -1)
-    goto err;
-
-  return 0;
-
- err:
-  nbdkit_error ("cache: flush of block %" PRIu64 " failed", blknum);
-  data->errors++;
-  return 0; /* continue scanning and flushing. */
+  return errors ? -1 : 0;
 }
 
 /* Cache data. */
@@ -693,7 +884,7 @@ cache_cache (nbdkit_next *next,
 
   /* Aligned body */
   while (remaining) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_BLK_RANGE_FOR_CURRENT_SCOPE (blknum, 1);
     r = blk_cache (next, blknum, block, err);
     if (r == -1)
       return -1;
@@ -706,6 +897,163 @@ cache_cache (nbdkit_next *next,
   return 0;
 }
 
+/* Override the plugin's .can_extents, because we know which blocks
+ * are zero or dirty in the cache.
+ */
+static int
+cache_can_extents (nbdkit_next *next, void *handle)
+{
+  return 1;
+}
+
+/* Extents. */
+static int
+cache_extents (nbdkit_next *next,
+               void *handle, uint32_t count32, uint64_t offset,
+               uint32_t flags,
+               struct nbdkit_extents *extents, int *err)
+{
+  const bool can_extents = next->can_extents (next);
+  const bool req_one = flags & NBDKIT_FLAG_REQ_ONE;
+  uint64_t count = count32;
+  uint64_t end;
+  uint64_t blknum;
+  int64_t size;
+
+  size = next->get_size (next);
+  if (size == -1)
+    return -1;
+
+  /* To make this easier, align the requested extents to whole blocks.
+   * Note that count is a 64 bit variable containing at most a 32 bit
+   * value so rounding up is safe here.
+   */
+  end = offset + count;
+  offset = ROUND_DOWN (offset, blksize);
+  end = ROUND_UP (end, blksize);
+  count = end - offset;
+  blknum = offset / blksize;
+
+  assert (IS_ALIGNED (offset, blksize));
+  assert (IS_ALIGNED (count, blksize));
+  assert (count > 0);           /* We must make forward progress. */
+
+  while (count > 0) {
+    enum bm_entry state = blk_get_state (blknum);
+    struct nbdkit_extent e;
+
+    /* Zero or dirty in the cache, so we know the answer. */
+    if (state == BLOCK_ZERO || state == BLOCK_DIRTY) {
+      e.offset = offset;
+      e.length = blksize;
+
+      if (state == BLOCK_ZERO)
+        e.type = NBDKIT_EXTENT_HOLE|NBDKIT_EXTENT_ZERO;
+      else
+        e.type = 0;
+
+      if (nbdkit_add_extent (extents, e.offset, e.length, e.type) == -1) {
+        *err = errno;
+        return -1;
+      }
+
+      blknum++;
+      offset += blksize;
+      count -= blksize;
+    }
+
+    /* Not cached, or cached and clean, so we can ask the plugin. */
+    else if (can_extents) {
+      uint64_t range_offset = offset;
+      uint32_t range_count = 0;
+      int64_t gen;
+      size_t i;
+
+      /* Asking the plugin for a single block of extents is not
+       * efficient for some plugins (eg. VDDK) so ask for as much data
+       * as we can.
+       */
+      for (;;) {
+        /* nbdkit_extents_full cannot read more than a 32 bit range
+         * (range_count), but count is a 64 bit quantity, so don't
+         * overflow range_count here.
+         */
+        if (range_count >= UINT32_MAX - blksize + 1) break;
+
+        blknum++;
+        offset += blksize;
+        count -= blksize;
+        range_count += blksize;
+
+        if (count == 0) break;
+        state = blk_get_state (blknum);
+        if (state == BLOCK_ZERO || state == BLOCK_DIRTY) break;
+      }
+
+      /* Don't ask for extent data beyond the end of the plugin. */
+      if (range_offset + range_count > size) {
+        unsigned tail = range_offset + range_count - size;
+        range_count -= tail;
+      }
+
+      gen = blk_get_write_generation ();
+
+      CLEANUP_EXTENTS_FREE struct nbdkit_extents *extents2 =
+        nbdkit_extents_full (next, range_count, range_offset, flags, err);
+      if (extents2 == NULL)
+        return -1;
+
+      for (i = 0; i < nbdkit_extents_count (extents2); ++i) {
+        e = nbdkit_get_extent (extents2, i);
+        if (nbdkit_add_extent (extents, e.offset, e.length, e.type) == -1) {
+          *err = errno;
+          return -1;
+        }
+
+        /* If cache-on-read, remember whole blocks which the plugin
+         * says read as zeroes, so that later reads and extents
+         * requests don't need to go to the plugin.
+         */
+        if ((e.type & NBDKIT_EXTENT_ZERO) && cache_on_read ()) {
+          uint64_t first = DIV_ROUND_UP (e.offset, blksize);
+          uint64_t last = e.offset + e.length == size ?
+            DIV_ROUND_UP (size, blksize) :
+            (e.offset + e.length) / blksize;
+
+          if (last > first)
+            blk_set_zero_if_unchanged (first, last - first, gen);
+        }
+      }
+    }
+
+    /* Otherwise assume the block is non-sparse. */
+    else {
+      e.offset = offset;
+      e.length = blksize;
+      e.type = 0;
+
+      if (nbdkit_add_extent (extents, e.offset, e.length, e.type) == -1) {
+        *err = errno;
+        return -1;
+      }
+
+      blknum++;
+      offset += blksize;
+      count -= blksize;
+    }
+
+    /* If the caller only wanted the first extent, and we've managed
+     * to add at least one extent to the list, then we can drop out
+     * now.  (Note calling nbdkit_add_extent above does not mean the
+     * extent got added since it might be before the first offset.)
+     */
+    if (req_one && nbdkit_extents_count (extents) > 0)
+      break;
+  }
+
+  return 0;
+}
+
 static struct nbdkit_filter filter = {
   .name              = "cache",
   .longname          = "nbdkit caching filter",
@@ -714,18 +1062,25 @@ static struct nbdkit_filter filter = {
   .config_complete   = cache_config_complete,
   .config_help       = cache_config_help,
   .get_ready         = cache_get_ready,
+  .after_fork        = cache_after_fork,
+  .cleanup           = cache_cleanup,
   .prepare           = cache_prepare,
   .get_size          = cache_get_size,
+  .block_size        = cache_block_size,
   .can_cache         = cache_can_cache,
+  .can_extents       = cache_can_extents,
   .can_fast_zero     = cache_can_fast_zero,
   .can_flush         = cache_can_flush,
   .can_fua           = cache_can_fua,
   .can_multi_conn    = cache_can_multi_conn,
   .pread             = cache_pread,
+  .pread_fd          = cache_pread_fd,
   .pwrite            = cache_pwrite,
   .zero              = cache_zero,
+  .trim              = cache_trim,
   .flush             = cache_flush,
   .cache             = cache_cache,
+  .extents           = cache_extents,
 };
 
 NBDKIT_REGISTER_FILTER(filter)
@@ -0,0 +1,401 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Persistent cache.
+ *
+ * With cache-file=FILE or cache-dir=DIR the cache is stored in a
+ * regular file which survives restarts of nbdkit, instead of a
+ * deleted temporary file.  Next to the cache file is a metadata file
+ * (with the extension .meta) containing a header followed by a copy
+ * of the bitmap.
+ *
+ * The header records the block size, the size of the underlying
+ * plugin and an identity which is a hash of the parameters passed to
+ * the underlying plugin and filters (or of cache-id if set).  If any
+ * of these don't match on startup then the old contents of the cache
+ * are discarded.
+ *
+ * The bitmap is only written when nbdkit shuts down cleanly.  While
+ * nbdkit is running the header is marked as in use, so if nbdkit
+ * crashes the cache is discarded on the next start.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include <nbdkit-filter.h>
+
+#include "bitmap.h"
+#include "byte-swapping.h"
+#include "cleanup.h"
+#include "fdatasync.h"
+#include "fsync.h"
+#include "utils.h"
+
+#include "cache.h"
+#include "persist.h"
+
+#define PERSIST_MAGIC "NBDKCACH"
+#define PERSIST_VERSION 1
+
+/* Flags in the header. */
+#define PERSIST_CLEAN 1         /* Bitmap was written on clean shutdown. */
+
+struct persist_header {
+  char magic[8];                /* PERSIST_MAGIC */
+  uint32_t version;             /* PERSIST_VERSION */
+  uint32_t blksize;             /* Block size of the cache. */
+  uint64_t size;                /* Size of the underlying plugin. */
+  uint64_t identity;            /* Hash of parameters or cache-id. */
+  uint32_t flags;               /* PERSIST_* flags. */
+  uint32_t reserved;
+  uint64_t bitmap_size;         /* Size of bitmap following in bytes. */
+} __attribute__((__packed__));
+
+const char *cache_file = NULL;
+const char *cache_dir = NULL;
+const char *cache_id = NULL;
+
+/* Paths of the cache file and metadata file (if persistent). */
+static char *data_path = NULL;
+static char *meta_path = NULL;
+
+/* FNV-1a hash of the parameters passed to the underlying layers. */
+static uint64_t identity = UINT64_C(0xcbf29ce484222325);
+
+/* If the metadata was valid on startup, the bitmap and size which
+ * were saved.  These are applied on the first call to
+ * persist_set_size.
+ */
+static uint8_t *saved_bitmap = NULL;
+static uint64_t saved_bitmap_size;
+static uint64_t saved_size;
+
+/* True once the size has been set, so the bitmap is meaningful. */
+static bool size_set = false;
+
+static void
+hash_string (uint64_t *h, const char *str)
+{
+  /* Include the terminating \0 as a separator. */
+  do {
+    *h ^= (unsigned char) *str;
+    *h *= UINT64_C(0x100000001b3);
+  } while (*str++);
+}
+
+void
+persist_add_identity (const char *key, const char *value)
+{
+  hash_string (&identity, key);
+  hash_string (&identity, value);
+}
+
+bool
+persist_enabled (void)
+{
+  return cache_file != NULL || cache_dir != NULL;
+}
+
+int
+persist_open (void)
+{
+  struct flock lock;
+  int fd;
+
+  if (cache_id) {
+    identity = UINT64_C(0xcbf29ce484222325);
+    hash_string (&identity, cache_id);
+  }
+
+  if (cache_file) {
+    data_path = strdup (cache_file);
+    if (data_path == NULL) {
+      nbdkit_error ("strdup: %m");
+      return -1;
+    }
+  }
+  else {
+    if (asprintf (&data_path, "%s/nbdkit-cache-%016" PRIx64,
+                  cache_dir, identity) == -1) {
+      nbdkit_error ("asprintf: %m");
+      return -1;
+    }
+  }
+  if (asprintf (&meta_path, "%s.meta", data_path) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+
+  nbdkit_debug ("cache: persistent cache file: %s", data_path);
+
+  fd = open (data_path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+  if (fd == -1) {
+    nbdkit_error ("open: %s: %m", data_path);
+    return -1;
+  }
+
+  /* Prevent two instances of nbdkit from using the same cache. */
+  memset (&lock, 0, sizeof lock);
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = 0;
+  lock.l_len = 0;
+  if (fcntl (fd, F_SETLK, &lock) == -1) {
+    if (errno == EACCES || errno == EAGAIN)
+      nbdkit_error ("%s: cache file is in use by another process",
+                    data_path);
+    else
+      nbdkit_error ("fcntl: %s: %m", data_path);
+    close (fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Write the metadata file atomically. */
+static int
+write_meta (uint64_t size, uint32_t flags,
+            const uint8_t *bitmap, uint64_t bitmap_size)
+{
+  CLEANUP_FREE char *tmp_path = NULL;
+  struct persist_header h;
+  int fd;
+
+  if (asprintf (&tmp_path, "%s.tmp", meta_path) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+
+  memset (&h, 0, sizeof h);
+  memcpy (h.magic, PERSIST_MAGIC, sizeof h.magic);
+  h.version = htobe32 (PERSIST_VERSION);
+  h.blksize = htobe32 (blksize);
+  h.size = htobe64 (size);
+  h.identity = htobe64 (identity);
+  h.flags = htobe32 (flags);
+  h.bitmap_size = htobe64 (bitmap_size);
+
+  fd = open (tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+  if (fd == -1) {
+    nbdkit_error ("open: %s: %m", tmp_path);
+    return -1;
+  }
+  if (full_pwrite (fd, &h, sizeof h, 0) == -1 ||
+      (bitmap_size > 0 &&
+       full_pwrite (fd, bitmap, bitmap_size, sizeof h) == -1)) {
+    nbdkit_error ("write: %s: %m", tmp_path);
+    goto err;
+  }
+  if (fsync (fd) == -1) {
+    nbdkit_error ("fsync: %s: %m", tmp_path);
+    goto err;
+  }
+  if (close (fd) == -1) {
+    fd = -1;
+    nbdkit_error ("close: %s: %m", tmp_path);
+    goto err;
+  }
+  if (rename (tmp_path, meta_path) == -1) {
+    nbdkit_error ("rename: %s: %s: %m", tmp_path, meta_path);
+    unlink (tmp_path);
+    return -1;
+  }
+  return 0;
+
+ err:
+  if (fd >= 0)
+    close (fd);
+  unlink (tmp_path);
+  return -1;
+}
+
+/* Read and validate the metadata file.  Returns true if it is valid,
+ * in which case the saved bitmap is loaded into memory.
+ */
+static bool
+read_meta (void)
+{
+  struct persist_header h;
+  int fd;
+  uint64_t bitmap_size;
+
+  fd = open (meta_path, O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    if (errno != ENOENT)
+      nbdkit_debug ("cache: open: %s: %m", meta_path);
+    return false;
+  }
+
+  if (full_pread (fd, &h, sizeof h, 0) == -1) {
+    nbdkit_debug ("cache: %s: could not read header", meta_path);
+    goto invalid;
+  }
+  if (memcmp (h.magic, PERSIST_MAGIC, sizeof h.magic) != 0 ||
+      be32toh (h.version) != PERSIST_VERSION) {
+    nbdkit_debug ("cache: %s: bad magic or unknown version", meta_path);
+    goto invalid;
+  }
+  if (!(be32toh (h.flags) & PERSIST_CLEAN)) {
+    nbdkit_debug ("cache: %s: nbdkit was not shut down cleanly", meta_path);
+    goto invalid;
+  }
+  if (be32toh (h.blksize) != blksize) {
+    nbdkit_debug ("cache: %s: block size changed", meta_path);
+    goto invalid;
+  }
+  if (be64toh (h.identity) != identity) {
+    nbdkit_debug ("cache: %s: identity changed", meta_path);
+    goto invalid;
+  }
+
+  bitmap_size = be64toh (h.bitmap_size);
+  if (bitmap_size > SIZE_MAX) {
+    nbdkit_debug ("cache: %s: bitmap too large", meta_path);
+    goto invalid;
+  }
+  if (bitmap_size > 0) {
+    saved_bitmap = malloc (bitmap_size);
+    if (saved_bitmap == NULL) {
+      nbdkit_debug ("cache: malloc: %m");
+      goto invalid;
+    }
+    if (full_pread (fd, saved_bitmap, bitmap_size, sizeof h) == -1) {
+      nbdkit_debug ("cache: %s: could not read bitmap", meta_path);
+      free (saved_bitmap);
+      saved_bitmap = NULL;
+      goto invalid;
+    }
+  }
+  saved_bitmap_size = bitmap_size;
+  saved_size = be64toh (h.size);
+
+  close (fd);
+  return true;
+
+ invalid:
+  close (fd);
+  return false;
+}
+
+int
+persist_load (int fd)
+{
+  if (read_meta ()) {
+    nbdkit_debug ("cache: reusing persistent cache from %s", data_path);
+    /* Remember that the saved metadata is valid even if the bitmap
+     * happens to be empty.
+     */
+    if (saved_bitmap == NULL)
+      saved_bitmap = calloc (1, 1);
+  }
+  else {
+    nbdkit_debug ("cache: discarding old contents of %s", data_path);
+    if (ftruncate (fd, 0) == -1) {
+      nbdkit_error ("ftruncate: %s: %m", data_path);
+      return -1;
+    }
+  }
+
+  /* Mark the cache as in use.  If we crash before persist_save is
+   * called then the cache will be discarded on the next start.
+   */
+  return write_meta (0, 0, NULL, 0);
+}
+
+int
+persist_set_size (int fd, struct bitmap *bm, uint64_t size)
+{
+  size_set = true;
+
+  if (saved_bitmap == NULL)
+    return 0;
+
+  if (size == saved_size && bm->size == saved_bitmap_size) {
+    if (saved_bitmap_size > 0)
+      memcpy (bm->bitmap, saved_bitmap, saved_bitmap_size);
+  }
+  else {
+    nbdkit_debug ("cache: size of plugin changed, "
+                  "discarding old contents of %s", data_path);
+    if (ftruncate (fd, 0) == -1) {
+      nbdkit_error ("ftruncate: %s: %m", data_path);
+      return -1;
+    }
+  }
+
+  free (saved_bitmap);
+  saved_bitmap = NULL;
+  return 0;
+}
+
+void
+persist_save (int fd, const struct bitmap *bm, uint64_t size)
+{
+  if (meta_path == NULL)
+    return;
+
+  /* If no client connected then write back what we loaded. */
+  if (!size_set) {
+    if (saved_bitmap != NULL)
+      write_meta (saved_size, PERSIST_CLEAN,
+                  saved_bitmap, saved_bitmap_size);
+    goto out;
+  }
+
+  /* The data must be on disk before the bitmap says it is there. */
+  if (fdatasync (fd) == -1) {
+    nbdkit_error ("fdatasync: %s: %m", data_path);
+    goto out;
+  }
+  if (write_meta (size, PERSIST_CLEAN, bm->bitmap, bm->size) == 0)
+    nbdkit_debug ("cache: saved persistent cache metadata to %s", meta_path);
+
+ out:
+  free (saved_bitmap);
+  saved_bitmap = NULL;
+  free (data_path);
+  data_path = NULL;
+  free (meta_path);
+  meta_path = NULL;
+}
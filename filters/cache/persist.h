@@ -0,0 +1,70 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_PERSIST_H
+#define NBDKIT_PERSIST_H
+
+#include <stdbool.h>
+
+#include "bitmap.h"
+
+/* Persistent cache parameters (cache-file, cache-dir, cache-id). */
+extern const char *cache_file, *cache_dir, *cache_id;
+
+/* Add a parameter passed to the underlying layers to the identity of
+ * the persistent cache.
+ */
+extern void persist_add_identity (const char *key, const char *value);
+
+/* Returns true if cache-file or cache-dir was used. */
+extern bool persist_enabled (void);
+
+/* Open and lock the persistent cache file.  Returns the file
+ * descriptor or -1 on error.
+ */
+extern int persist_open (void);
+
+/* Read and validate the metadata.  If it is not valid then the old
+ * contents of the cache file are discarded.  Must be called after the
+ * block size is known.  Returns -1 on error.
+ */
+extern int persist_load (int fd);
+
+/* Called when the size of the plugin is known, after the bitmap has
+ * been resized.  Restores the saved bitmap if it is still valid.
+ */
+extern int persist_set_size (int fd, struct bitmap *bm, uint64_t size);
+
+/* Write the bitmap to the metadata file on clean shutdown. */
+extern void persist_save (int fd, const struct bitmap *bm, uint64_t size);
+
+#endif /* NBDKIT_PERSIST_H */
@@ -0,0 +1,231 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Scan-resistant replacement policy (cache-policy=2q).
+ *
+ * The default policy (cache-policy=lru) reclaims blocks which have
+ * not been recently accessed according to lru.c.  A single large
+ * sequential read such as a backup touches every block once, which
+ * makes the whole previous working set look old so it is reclaimed.
+ *
+ * The 2Q policy (Johnson and Shasha, VLDB 1994) separates blocks
+ * which have been accessed once from blocks which have proven to be
+ * useful:
+ *
+ * A1 (probation): blocks which entered the cache and have not been
+ *   referenced since, apart from correlated references (which we
+ *   take to be references while lru.c says the block was recently
+ *   accessed).  When the cache needs space, blocks are reclaimed
+ *   from A1 first, as long as A1 holds more than Kin blocks (1/4 of
+ *   the cache).
+ *
+ * A1out (ghost): blocks recently reclaimed from A1.  These are not
+ *   in the cache; we only remember their block numbers (up to Kout,
+ *   1/2 of the cache).  A block which enters the cache while it is in
+ *   A1out has been referenced twice at a distance, so it goes to Am.
+ *
+ * Am (protected): blocks which were referenced again while in A1
+ *   (other than correlated references) or in A1out.  Blocks are only
+ *   reclaimed from Am when A1 is small, using lru.c.
+ *
+ * Membership of A1 and Am is kept in a bitmap with 2 bits per block.
+ * A1out is kept in two bitmaps of 1 bit per block which are rotated
+ * like the LRU bitmaps in lru.c, so we remember between Kout/2 and
+ * Kout recently reclaimed blocks.  A1 is not a strict FIFO: when
+ * reclaiming from A1 we pick blocks which lru.c says are not recently
+ * accessed, in the order that reclaim.c scans the cache.
+ *
+ * All functions in this file must be called with the lock in blk.c
+ * held.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include <nbdkit-filter.h>
+
+#include "bitmap.h"
+#include "minmax.h"
+
+#include "cache.h"
+#include "lru.h"
+#include "policy.h"
+
+enum cache_policy cache_policy = POLICY_LRU;
+
+/* Entries in the queue bitmap. */
+enum queue {
+  QUEUE_NONE = 0,               /* Not cached, or not tracked. */
+  QUEUE_A1 = 1,                 /* Probation. */
+  QUEUE_AM = 2,                 /* Protected. */
+};
+
+static struct bitmap queue;
+static struct bitmap ghost[2];
+static uint64_t nr_a1 = 0;      /* Number of blocks in A1. */
+static uint64_t nr_ghost0 = 0;  /* Number of bits set in ghost[0]. */
+static uint64_t kin = 0, kout = 0;
+
+void
+policy_init (void)
+{
+  bitmap_init (&queue, blksize, 2 /* bits per block */);
+  bitmap_init (&ghost[0], blksize, 1 /* bits per block */);
+  bitmap_init (&ghost[1], blksize, 1 /* bits per block */);
+}
+
+void
+policy_free (void)
+{
+  bitmap_free (&queue);
+  bitmap_free (&ghost[0]);
+  bitmap_free (&ghost[1]);
+}
+
+int
+policy_set_size (uint64_t new_size)
+{
+  uint64_t nr_blocks;
+  int64_t blk;
+
+  if (cache_policy != POLICY_2Q)
+    return 0;
+
+  if (bitmap_resize (&queue, new_size) == -1 ||
+      bitmap_resize (&ghost[0], new_size) == -1 ||
+      bitmap_resize (&ghost[1], new_size) == -1)
+    return -1;
+
+  if (max_size != -1)
+    nr_blocks = max_size / blksize;
+  else
+    nr_blocks = new_size / blksize;
+  kin = MAX (nr_blocks / 4, 1);
+  kout = MAX (nr_blocks / 2, 2);
+
+  /* Blocks may have been dropped by shrinking the bitmap. */
+  nr_a1 = 0;
+  for (blk = bitmap_next (&queue, 0); blk >= 0;
+       blk = bitmap_next (&queue, blk + 1)) {
+    if (bitmap_get_blk (&queue, blk, QUEUE_NONE) == QUEUE_A1)
+      nr_a1++;
+  }
+
+  return 0;
+}
+
+void
+policy_access (uint64_t blknum)
+{
+  if (cache_policy != POLICY_2Q)
+    return;
+
+  switch (bitmap_get_blk (&queue, blknum, QUEUE_NONE)) {
+  case QUEUE_NONE:
+    /* The block is entering the cache. */
+    if (bitmap_get_blk (&ghost[0], blknum, false) ||
+        bitmap_get_blk (&ghost[1], blknum, false))
+      bitmap_set_blk (&queue, blknum, QUEUE_AM);
+    else {
+      bitmap_set_blk (&queue, blknum, QUEUE_A1);
+      nr_a1++;
+    }
+    break;
+
+  case QUEUE_A1:
+    /* If the block has been accessed recently this is a correlated
+     * reference and the block stays on probation.  Otherwise it has
+     * proven to be useful.
+     */
+    if (! lru_has_been_recently_accessed (blknum)) {
+      bitmap_set_blk (&queue, blknum, QUEUE_AM);
+      nr_a1--;
+    }
+    break;
+
+  case QUEUE_AM:
+    break;
+  }
+}
+
+void
+policy_forget (uint64_t blknum)
+{
+  if (cache_policy != POLICY_2Q)
+    return;
+
+  if (bitmap_get_blk (&queue, blknum, QUEUE_NONE) == QUEUE_A1)
+    nr_a1--;
+  bitmap_set_blk (&queue, blknum, QUEUE_NONE);
+}
+
+void
+policy_reclaimed (uint64_t blknum)
+{
+  if (cache_policy != POLICY_2Q)
+    return;
+
+  if (bitmap_get_blk (&queue, blknum, QUEUE_NONE) == QUEUE_A1 &&
+      !bitmap_get_blk (&ghost[0], blknum, false)) {
+    bitmap_set_blk (&ghost[0], blknum, true);
+    nr_ghost0++;
+
+    /* Rotate the ghost bitmaps, see lru_set_recently_accessed. */
+    if (nr_ghost0 >= kout / 2) {
+      struct bitmap tmp;
+
+      tmp = ghost[0];
+      ghost[0] = ghost[1];
+      ghost[1] = tmp;
+      bitmap_clear (&ghost[0]);
+      nr_ghost0 = 0;
+    }
+  }
+  policy_forget (blknum);
+}
+
+bool
+policy_reclaim_probation (void)
+{
+  return cache_policy == POLICY_2Q && nr_a1 > kin;
+}
+
+bool
+policy_on_probation (uint64_t blknum)
+{
+  return bitmap_get_blk (&queue, blknum, QUEUE_NONE) == QUEUE_A1;
+}
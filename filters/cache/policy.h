@@ -0,0 +1,66 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_POLICY_H
+#define NBDKIT_POLICY_H
+
+#include <stdbool.h>
+
+/* Replacement policy (cache-policy parameter). */
+extern enum cache_policy {
+  POLICY_LRU,
+  POLICY_2Q,
+} cache_policy;
+
+/* Initialize and free the policy structures. */
+extern void policy_init (void);
+extern void policy_free (void);
+
+/* Notify the policy that the virtual size has changed. */
+extern int policy_set_size (uint64_t new_size);
+
+/* A cached block was accessed (read, written or newly cached). */
+extern void policy_access (uint64_t blknum);
+
+/* A block left the cache, other than by being reclaimed. */
+extern void policy_forget (uint64_t blknum);
+
+/* A block was reclaimed. */
+extern void policy_reclaimed (uint64_t blknum);
+
+/* Returns true if reclaim should pick blocks on probation first. */
+extern bool policy_reclaim_probation (void);
+
+/* Returns true if the block is on probation. */
+extern bool policy_on_probation (uint64_t blknum);
+
+#endif /* NBDKIT_POLICY_H */
@@ -0,0 +1,245 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Optional in-memory tier of the cache (cache-ram-size).
+ *
+ * The RAM tier holds copies of hot blocks from the cache file so
+ * that reads can be served without calling pread on the cache file.
+ * It is inclusive: every block in RAM is also in the cache file with
+ * identical contents, so blocks evicted from RAM are simply dropped
+ * (demoted to the file tier), and writeback, reclaim and persistence
+ * of the cache file are not affected.  Any change to a block in the
+ * cache file must update or drop the RAM copy.
+ *
+ * The blocks are stored in an allocator from common/allocators,
+ * using the same offsets as the cache file.  Which blocks are present
+ * is kept in a bitmap, and blocks are evicted using the CLOCK
+ * algorithm with a second bitmap of reference bits.
+ *
+ * Functions in this file must be called with the lock in blk.c held,
+ * except for ram_read and ram_store.  The caller must have locked
+ * the range of blocks (see blk.h), and blocks in ranges which are
+ * locked are never evicted.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include <nbdkit-filter.h>
+
+#include "allocator.h"
+#include "bitmap.h"
+#include "cleanup.h"
+
+#include "cache.h"
+#include "blk.h"
+#include "ram.h"
+
+int64_t ram_size = 0;
+const char *ram_allocator = "sparse";
+
+static struct allocator *a = NULL;
+
+/* present: block is in RAM.  ref: block was accessed since the clock
+ * hand last passed it.
+ */
+static struct bitmap present, ref;
+static uint64_t nr_ram = 0;     /* Number of blocks in RAM. */
+static uint64_t max_nr_ram = 0; /* Maximum number of blocks in RAM. */
+static int64_t hand = -1;       /* Clock hand. */
+static uint64_t size = 0;
+
+int
+ram_init (void)
+{
+  if (ram_size == 0)
+    return 0;
+
+  a = create_allocator (ram_allocator, false);
+  if (a == NULL)
+    return -1;
+
+  bitmap_init (&present, blksize, 1 /* bits per block */);
+  bitmap_init (&ref, blksize, 1 /* bits per block */);
+  max_nr_ram = ram_size / blksize;
+  nbdkit_debug ("cache: RAM tier: %" PRIu64 " blocks, allocator %s",
+                max_nr_ram, ram_allocator);
+  return 0;
+}
+
+void
+ram_free (void)
+{
+  if (a) {
+    a->f->free (a);
+    a = NULL;
+  }
+  bitmap_free (&present);
+  bitmap_free (&ref);
+}
+
+bool
+ram_enabled (void)
+{
+  return a != NULL;
+}
+
+int
+ram_set_size (uint64_t new_size)
+{
+  if (!a || new_size == size)
+    return 0;
+
+  /* The size of the plugin changed, so drop everything. */
+  if (nr_ram > 0) {
+    a->f->zero (a, size, 0 /* offset */);
+    bitmap_clear (&present);
+    bitmap_clear (&ref);
+    nr_ram = 0;
+  }
+  hand = -1;
+
+  if (bitmap_resize (&present, new_size) == -1 ||
+      bitmap_resize (&ref, new_size) == -1)
+    return -1;
+  size = new_size;
+  return 0;
+}
+
+bool
+ram_lookup (uint64_t blknum)
+{
+  if (!a || !bitmap_get_blk (&present, blknum, false))
+    return false;
+  bitmap_set_blk (&ref, blknum, true);
+  return true;
+}
+
+static void
+drop_block (uint64_t blknum)
+{
+  a->f->zero (a, blksize, blknum * blksize);
+  bitmap_set_blk (&present, blknum, false);
+  bitmap_set_blk (&ref, blknum, false);
+  nr_ram--;
+}
+
+void
+ram_drop (uint64_t blknum, uint64_t nrblocks)
+{
+  uint64_t b;
+
+  if (!a || nr_ram == 0)
+    return;
+
+  for (b = 0; b < nrblocks; ++b) {
+    if (bitmap_get_blk (&present, blknum + b, false))
+      drop_block (blknum + b);
+  }
+}
+
+/* Evict one block using the CLOCK algorithm.  Returns false if no
+ * block could be evicted because they are all in use.
+ */
+static bool
+evict_one (void)
+{
+  uint64_t i;
+
+  /* Each block is passed at most twice, once to clear the reference
+   * bit and once to evict it.
+   */
+  for (i = 0; i <= 2 * nr_ram; ++i) {
+    hand = bitmap_next (&present, hand + 1);
+    if (hand == -1)             /* wrap around */
+      hand = bitmap_next (&present, 0);
+    if (hand == -1)
+      return false;
+
+    if (blk_is_locked (hand))
+      continue;
+    if (bitmap_get_blk (&ref, hand, false)) {
+      bitmap_set_blk (&ref, hand, false);
+      continue;
+    }
+    drop_block (hand);
+    return true;
+  }
+  return false;
+}
+
+int
+ram_read (uint64_t blknum, uint64_t nrblocks, uint8_t *block)
+{
+  return a->f->read (a, block, nrblocks * blksize, blknum * blksize);
+}
+
+void
+ram_store (pthread_mutex_t *lock, uint64_t blknum, uint64_t nrblocks,
+           const uint8_t *block)
+{
+  uint64_t b;
+
+  if (!a || max_nr_ram == 0)
+    return;
+
+  /* Make room for the blocks.  We set the present bits before writing
+   * the data, but the caller has locked the range so nothing else can
+   * look at these blocks until we have finished.
+   */
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (lock);
+    for (b = 0; b < nrblocks; ++b) {
+      if (bitmap_get_blk (&present, blknum + b, false))
+        continue;
+      if (nr_ram >= max_nr_ram && !evict_one ())
+        break;
+      bitmap_set_blk (&present, blknum + b, true);
+      nr_ram++;
+    }
+    nrblocks = b;
+  }
+
+  if (nrblocks == 0)
+    return;
+
+  if (a->f->write (a, block, nrblocks * blksize, blknum * blksize) == -1) {
+    /* Not fatal since the blocks are still in the cache file. */
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (lock);
+    ram_drop (blknum, nrblocks);
+  }
+}
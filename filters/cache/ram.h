@@ -0,0 +1,79 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_RAM_H
+#define NBDKIT_RAM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+/* Maximum size of the RAM tier (cache-ram-size, 0 = disabled), and
+ * the allocator used (cache-ram-allocator).
+ */
+extern int64_t ram_size;
+extern const char *ram_allocator;
+
+/* Create and free the RAM tier. */
+extern int ram_init (void);
+extern void ram_free (void);
+
+/* Returns true if the RAM tier is enabled. */
+extern bool ram_enabled (void);
+
+/* Notify the RAM tier that the virtual size has changed. */
+extern int ram_set_size (uint64_t new_size);
+
+/* Returns true if the block is in RAM, and marks it as referenced. */
+extern bool ram_lookup (uint64_t blknum);
+
+/* Drop blocks from RAM because they changed in the cache file. */
+extern void ram_drop (uint64_t blknum, uint64_t nrblocks);
+
+/* Read blocks which ram_lookup said are in RAM.  Called without the
+ * lock held.
+ */
+extern int ram_read (uint64_t blknum, uint64_t nrblocks, uint8_t *block)
+  __attribute__((__nonnull__ (3)));
+
+/* Store a copy of blocks which have just been written to the cache
+ * file, evicting other blocks if necessary.  Failure is not fatal.
+ * Called without the lock held, which is passed in so it can be
+ * acquired.
+ */
+extern void ram_store (pthread_mutex_t *lock,
+                       uint64_t blknum, uint64_t nrblocks,
+                       const uint8_t *block)
+  __attribute__((__nonnull__ (1, 4)));
+
+#endif /* NBDKIT_RAM_H */
@@ -48,8 +48,11 @@
 #include "bitmap.h"
 
 #include "cache.h"
+#include "blk.h"
 #include "reclaim.h"
 #include "lru.h"
+#include "policy.h"
+#include "ram.h"
 
 #ifndef HAVE_CACHE_RECLAIM
 
@@ -65,8 +68,11 @@ reclaim (int fd, struct bitmap *bm)
  *
  * The state machine starts in the NOT_RECLAIMING state.  When the
  * size of the cache exceeds the high threshold, we move to
- * RECLAIMING_LRU.  Once we have exhausted all LRU blocks, we move to
- * RECLAIMING_ANY (reclaiming any blocks).
+ * RECLAIMING_LRU, or with cache-policy=2q to RECLAIMING_PROBATION
+ * (reclaiming LRU blocks which are on probation, see policy.c) until
+ * the policy says that enough blocks are left on probation.  Once we
+ * have exhausted all LRU blocks, we move to RECLAIMING_ANY
+ * (reclaiming any blocks).
  *
  * If at any time the size of the cache goes below the low threshold
  * we move back to the NOT_RECLAIMING state.
@@ -78,14 +84,17 @@ reclaim (int fd, struct bitmap *bm)
  */
 enum reclaim_state {
   NOT_RECLAIMING = 0,
-  RECLAIMING_LRU = 1,
-  RECLAIMING_ANY = 2,
+  RECLAIMING_PROBATION = 1,
+  RECLAIMING_LRU = 2,
+  RECLAIMING_ANY = 3,
 };
 
 static enum reclaim_state reclaiming = NOT_RECLAIMING;
 static int64_t reclaim_blk;
 
+static bool can_reclaim (struct bitmap *bm, int64_t blk);
 static void reclaim_one (int fd, struct bitmap *bm);
+static void reclaim_probation (int fd, struct bitmap *bm);
 static void reclaim_lru (int fd, struct bitmap *bm);
 static void reclaim_any (int fd, struct bitmap *bm);
 static void reclaim_block (int fd, struct bitmap *bm);
@@ -120,7 +129,8 @@ reclaim (int fd, struct bitmap *bm)
 
     /* Start reclaiming if the cache size goes over the high threshold. */
     nbdkit_debug ("cache: start reclaiming");
-    reclaiming = RECLAIMING_LRU;
+    reclaiming =
+      cache_policy == POLICY_2Q ? RECLAIMING_PROBATION : RECLAIMING_LRU;
   }
 
   /* Reclaim up to 2 cache blocks. */
@@ -128,16 +138,84 @@ reclaim (int fd, struct bitmap *bm)
   reclaim_one (fd, bm);
 }
 
+/* Only clean blocks can be reclaimed.  Blocks which read as zero
+ * take no space in the cache, dirty blocks have not been written to
+ * the plugin yet, and blocks which another request is using must not
+ * be touched.
+ */
+static bool
+can_reclaim (struct bitmap *bm, int64_t blk)
+{
+  return
+    bitmap_get_blk (bm, blk, BLOCK_NOT_CACHED) == BLOCK_CLEAN &&
+    ! blk_is_locked (blk);
+}
+
 /* Reclaim a single cache block. */
 static void
 reclaim_one (int fd, struct bitmap *bm)
 {
   assert (reclaiming);
 
-  if (reclaiming == RECLAIMING_LRU)
-    reclaim_lru (fd, bm);
-  else
-    reclaim_any (fd, bm);
+  /* If blocks have been added to probation since we moved on to
+   * reclaiming other blocks, go back to reclaiming those first.
+   */
+  if (reclaiming != RECLAIMING_PROBATION && policy_reclaim_probation ())
+    reclaiming = RECLAIMING_PROBATION;
+
+  switch (reclaiming) {
+  case RECLAIMING_PROBATION: reclaim_probation (fd, bm); break;
+  case RECLAIMING_LRU: reclaim_lru (fd, bm); break;
+  default: reclaim_any (fd, bm);
+  }
+}
+
+static void
+reclaim_probation (int fd, struct bitmap *bm)
+{
+  int64_t old_reclaim_blk, fallback = -1;
+
+  if (policy_reclaim_probation ()) {
+    /* Find the next block in the cache. */
+    reclaim_blk = bitmap_next (bm, reclaim_blk+1);
+    if (reclaim_blk == -1)      /* wrap around */
+      reclaim_blk = bitmap_next (bm, 0);
+    old_reclaim_blk = reclaim_blk;
+
+    /* Search for an LRU block on probation, or failing that any
+     * block on probation.
+     */
+    while (reclaim_blk >= 0) {
+      if (policy_on_probation (reclaim_blk) &&
+          can_reclaim (bm, reclaim_blk)) {
+        if (! lru_has_been_recently_accessed (reclaim_blk)) {
+          reclaim_block (fd, bm);
+          return;
+        }
+        if (fallback == -1)
+          fallback = reclaim_blk;
+      }
+
+      reclaim_blk = bitmap_next (bm, reclaim_blk+1);
+      if (reclaim_blk == -1)    /* wrap around */
+        reclaim_blk = bitmap_next (bm, 0);
+      if (reclaim_blk == old_reclaim_blk)
+        break;
+    }
+
+    if (fallback >= 0) {
+      reclaim_blk = fallback;
+      reclaim_block (fd, bm);
+      return;
+    }
+  }
+
+  /* Not enough blocks on probation, so reclaim from the rest of the
+   * cache.
+   */
+  nbdkit_debug ("cache: reclaiming LRU blocks");
+  reclaiming = RECLAIMING_LRU;
+  reclaim_lru (fd, bm);
 }
 
 static void
@@ -147,11 +225,14 @@ reclaim_lru (int fd, struct bitmap *bm)
 
   /* Find the next block in the cache. */
   reclaim_blk = bitmap_next (bm, reclaim_blk+1);
+  if (reclaim_blk == -1)        /* wrap around */
+    reclaim_blk = bitmap_next (bm, 0);
   old_reclaim_blk = reclaim_blk;
 
   /* Search for an LRU block after this one. */
-  do {
-    if (! lru_has_been_recently_accessed (reclaim_blk)) {
+  while (reclaim_blk >= 0) {
+    if (! lru_has_been_recently_accessed (reclaim_blk) &&
+        can_reclaim (bm, reclaim_blk)) {
       reclaim_block (fd, bm);
       return;
     }
@@ -159,23 +240,35 @@ reclaim_lru (int fd, struct bitmap *bm)
     reclaim_blk = bitmap_next (bm, reclaim_blk+1);
     if (reclaim_blk == -1)    /* wrap around */
       reclaim_blk = bitmap_next (bm, 0);
-  } while (reclaim_blk >= 0 && old_reclaim_blk != reclaim_blk);
-
-  if (old_reclaim_blk == reclaim_blk) {
-    /* Run out of LRU blocks, so start reclaiming any block in the cache. */
-    nbdkit_debug ("cache: reclaiming any blocks");
-    reclaiming = RECLAIMING_ANY;
-    reclaim_any (fd, bm);
+    if (reclaim_blk == old_reclaim_blk)
+      break;
   }
+
+  /* Run out of LRU blocks, so start reclaiming any block in the cache. */
+  nbdkit_debug ("cache: reclaiming any blocks");
+  reclaiming = RECLAIMING_ANY;
+  reclaim_any (fd, bm);
 }
 
 static void
 reclaim_any (int fd, struct bitmap *bm)
 {
+  int64_t old_reclaim_blk;
+
   /* Find the next block in the cache. */
   reclaim_blk = bitmap_next (bm, reclaim_blk+1);
   if (reclaim_blk == -1)        /* wrap around */
     reclaim_blk = bitmap_next (bm, 0);
+  old_reclaim_blk = reclaim_blk;
+
+  /* Skip blocks which cannot be reclaimed. */
+  while (reclaim_blk >= 0 && ! can_reclaim (bm, reclaim_blk)) {
+    reclaim_blk = bitmap_next (bm, reclaim_blk+1);
+    if (reclaim_blk == -1)      /* wrap around */
+      reclaim_blk = bitmap_next (bm, 0);
+    if (reclaim_blk == old_reclaim_blk)
+      return;
+  }
 
   reclaim_block (fd, bm);
 }
@@ -188,6 +281,9 @@ reclaim_block (int fd, struct bitmap *bm)
     return;
   }
 
+  if (! can_reclaim (bm, reclaim_blk))
+    return;
+
   nbdkit_debug ("cache: reclaiming block %" PRIu64, reclaim_blk);
 #ifdef FALLOC_FL_PUNCH_HOLE
   if (fallocate (fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
@@ -200,7 +296,9 @@ reclaim_block (int fd, struct bitmap *bm)
 #error "no implementation for punching holes"
 #endif
 
-  bitmap_set_blk (bm, reclaim_blk, 0);
+  bitmap_set_blk (bm, reclaim_blk, BLOCK_NOT_CACHED);
+  policy_reclaimed (reclaim_blk);
+  ram_drop (reclaim_blk, 1);
 }
 
 #endif /* HAVE_CACHE_RECLAIM */
@@ -43,9 +43,9 @@
 #endif
 
 /* Check if we need to reclaim blocks, and if so reclaim up to two
- * blocks.
+ * blocks.  Blocks which are in flight are never reclaimed.
  *
- * Note this must be called with the blk lock held.
+ * Note this must be called with the blk.c lock held.
  */
 extern void reclaim (int fd, struct bitmap *bm);
 
@@ -0,0 +1,326 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Background writeback of dirty blocks.
+ *
+ * In cache=writeback mode dirty blocks are normally only written to
+ * the plugin when the client sends a flush, so the time taken by the
+ * flush is proportional to the amount of dirty data.  If
+ * cache-dirty-ratio or cache-dirty-age is set, a background thread
+ * writes dirty blocks back to the plugin ahead of the flush, so that
+ * the flush only has to write back what remains.
+ *
+ * The thread uses its own context into the plugin, opened with
+ * nbdkit_next_context_open.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "cleanup.h"
+#include "minmax.h"
+
+#include "cache.h"
+#include "blk.h"
+#include "writeback.h"
+
+/* Maximum size of a single write to the plugin. */
+#define MAX_WRITEBACK_RUN (4 * 1024 * 1024)
+
+unsigned dirty_ratio = 0;
+unsigned dirty_age = 0;
+
+/* The lock protects the fields below, and cond is used to wake up
+ * the thread.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static bool running = false;    /* Background thread is running. */
+static bool stopping = false;   /* Background thread should exit. */
+static bool kicked = false;     /* Dirty ratio has been exceeded. */
+static uint64_t threshold = UINT64_MAX; /* Dirty ratio in blocks. */
+static pthread_t thread;
+
+struct writeback_data {
+  nbdkit_next *next;
+  uint8_t *block;               /* Bounce buffer. */
+  uint64_t target;              /* Stop when this many blocks are dirty. */
+  uint32_t flags;               /* Flags for writes to the plugin. */
+  unsigned errors;              /* Count of errors seen. */
+  int first_errno;              /* First errno seen. */
+};
+
+static int
+writeback_run (uint64_t blknum, uint64_t nrblocks, void *datav)
+{
+  struct writeback_data *data = datav;
+  int tmp;
+
+  if (blk_get_dirty_blocks () <= data->target)
+    return -1; /* stop scanning */
+
+  ACQUIRE_BLK_RANGE_FOR_CURRENT_SCOPE (blknum, nrblocks);
+  if (blk_writeback_multiple (data->next, blknum, nrblocks,
+                              data->block, data->flags,
+                              data->errors ? &tmp : &data->first_errno)
+      == -1) {
+    nbdkit_error ("cache: writeback of %" PRIu64 " blocks "
+                  "at block %" PRIu64 " failed", nrblocks, blknum);
+    data->errors++;
+  }
+  return 0; /* continue scanning and writing back. */
+}
+
+int
+writeback_dirty_blocks (nbdkit_next *next, bool old_only, uint64_t target,
+                        uint32_t flags, int *err)
+{
+  CLEANUP_FREE uint8_t *block = NULL;
+  uint32_t minimum, preferred, maximum;
+  uint64_t max_nrblocks;
+  struct writeback_data data = {
+    .next = next,
+    .target = target,
+    .flags = flags,
+  };
+
+  /* Don't write runs larger than the plugin's maximum block size. */
+  if (next->block_size (next, &minimum, &preferred, &maximum) == -1) {
+    *err = EIO;
+    return -1;
+  }
+  if (maximum == 0 || maximum > MAX_WRITEBACK_RUN)
+    maximum = MAX_WRITEBACK_RUN;
+  max_nrblocks = MAX (1, maximum / blksize);
+
+  /* Allocate the bounce buffer. */
+  block = malloc (max_nrblocks * blksize);
+  if (block == NULL) {
+    *err = errno;
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  data.block = block;
+
+  for_each_dirty_run (max_nrblocks, old_only, writeback_run, &data);
+
+  if (data.errors > 0) {
+    *err = data.first_errno;
+    return -1;
+  }
+  return 0;
+}
+
+/* Open a context into the plugin for the background thread. */
+static nbdkit_next *
+open_next (nbdkit_backend *backend, uint32_t *flags)
+{
+  nbdkit_next *next;
+  int64_t size;
+  uint64_t base;
+
+  next = nbdkit_next_context_open (backend, false, "", true);
+  if (next == NULL)
+    return NULL;
+  if (next->prepare (next) == -1)
+    goto err;
+  if (next->can_write (next) != 1) {
+    nbdkit_error ("cache: plugin is not writable");
+    goto err;
+  }
+
+  /* The dirty ratio is a percentage of the maximum size of the cache
+   * if set, else of the size of the plugin.
+   */
+  size = next->get_size (next);
+  if (size == -1)
+    goto err;
+  base = max_size != -1 ? max_size : size;
+
+  /* The client flushes a different context, so unless the plugin
+   * says that a flush is visible across connections we must write
+   * back with FUA.
+   */
+  *flags = 0;
+  if (next->can_multi_conn (next) != 1 &&
+      next->can_fua (next) > NBDKIT_FUA_NONE)
+    *flags = NBDKIT_FLAG_FUA;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  if (dirty_ratio > 0)
+    threshold = base / 100 * dirty_ratio / blksize;
+  nbdkit_debug ("cache: writeback threshold: %" PRIu64 " blocks, "
+                "age: %u seconds%s",
+                dirty_ratio > 0 ? threshold : 0, dirty_age,
+                *flags & NBDKIT_FLAG_FUA ? ", using FUA" : "");
+  return next;
+
+ err:
+  next->finalize (next);
+  nbdkit_next_context_close (next);
+  return NULL;
+}
+
+static void *
+writeback_thread (void *vp)
+{
+  nbdkit_backend *backend = vp;
+  nbdkit_next *next;
+  struct timespec deadline;
+  uint32_t flags;
+  uint64_t limit;
+  bool age_expired;
+  int err;
+
+  next = open_next (backend, &flags);
+  if (next == NULL) {
+    nbdkit_error ("cache: could not open plugin for background writeback");
+    return NULL;
+  }
+
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += dirty_age;
+
+  for (;;) {
+    age_expired = false;
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+      while (!stopping && !kicked && !age_expired) {
+        if (dirty_age == 0)
+          pthread_cond_wait (&cond, &lock);
+        else if (pthread_cond_timedwait (&cond, &lock, &deadline) == ETIMEDOUT)
+          age_expired = true;
+      }
+      if (stopping)
+        break;
+      kicked = false;
+      limit = threshold;
+    }
+
+    /* Write back blocks which were dirty at the start of the previous
+     * period, so they have been dirty for at least dirty_age seconds.
+     */
+    if (age_expired) {
+      writeback_dirty_blocks (next, true, 0, flags, &err);
+      blk_age_dirty_blocks ();
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += dirty_age;
+    }
+
+    /* If there are too many dirty blocks, write back until the number
+     * is half the threshold.
+     */
+    if (dirty_ratio > 0 && blk_get_dirty_blocks () > limit)
+      writeback_dirty_blocks (next, false, limit / 2, flags, &err);
+  }
+
+  next->finalize (next);
+  nbdkit_next_context_close (next);
+  return NULL;
+}
+
+int
+writeback_start (nbdkit_backend *backend, int thread_model)
+{
+  int err;
+
+  if (cache_mode != CACHE_MODE_WRITEBACK ||
+      (dirty_ratio == 0 && dirty_age == 0))
+    return 0;
+
+  /* The thread calls into the plugin concurrently with client
+   * requests.
+   */
+  if (thread_model != NBDKIT_THREAD_MODEL_PARALLEL &&
+      thread_model != NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT) {
+    nbdkit_debug ("cache: background writeback disabled because "
+                  "the thread model is not parallel");
+    return 0;
+  }
+
+  err = pthread_create (&thread, NULL, writeback_thread, backend);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  running = true;
+  return 0;
+}
+
+void
+writeback_stop (void)
+{
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    if (!running)
+      return;
+    stopping = true;
+    pthread_cond_signal (&cond);
+  }
+
+  pthread_join (thread, NULL);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  running = false;
+}
+
+void
+writeback_kick (void)
+{
+  uint64_t dirty;
+
+  if (dirty_ratio == 0)
+    return;
+
+  dirty = blk_get_dirty_blocks ();
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  if (running && !kicked && dirty > threshold) {
+    kicked = true;
+    pthread_cond_signal (&cond);
+  }
+}
@@ -0,0 +1,64 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_WRITEBACK_H
+#define NBDKIT_WRITEBACK_H
+
+#include <stdbool.h>
+
+#include <nbdkit-filter.h>
+
+/* Background writeback parameters (cache-dirty-ratio, as a
+ * percentage, and cache-dirty-age, in seconds).  0 = disabled.
+ */
+extern unsigned dirty_ratio, dirty_age;
+
+/* Write back dirty blocks to the plugin, until at most target blocks
+ * are dirty.  If old_only is true,
+ * only blocks which were dirty before the last call to
+ * blk_age_dirty_blocks are written.  Errors are reported after
+ * trying to write back all of the blocks.
+ */
+extern int writeback_dirty_blocks (nbdkit_next *next, bool old_only,
+                                   uint64_t target, uint32_t flags, int *err)
+  __attribute__((__nonnull__ (1, 5)));
+
+/* Start and stop the background writeback thread (if enabled). */
+extern int writeback_start (nbdkit_backend *backend, int thread_model);
+extern void writeback_stop (void);
+
+/* Called after blocks are made dirty, to wake up the background
+ * thread if the dirty ratio has been exceeded.
+ */
+extern void writeback_kick (void);
+
+#endif /* NBDKIT_WRITEBACK_H */
@@ -62,11 +62,22 @@
  *
  * When trimming we set the trimmed flag in the bitmap for whole
  * blocks, and handle the unaligned portions like writing zeroes
- * above.  We could punch holes in the overlay as an optimization, but
- * for simplicity we do not do that yet.
+ * above.  Whole blocks of zeroes (whether from a zero request or a
+ * write of a block which is all zero) are handled like trims.  If the
+ * block was allocated in the overlay we punch a hole there, so the
+ * space used by the overlay tracks the number of allocated blocks
+ * rather than growing for as long as the client keeps writing.
+ * Because blocks are stored at the same offset in the overlay as in
+ * the plugin there is nothing else to compact.
  *
  * Since the overlay is a deleted temporary file, we can ignore FUA
  * and flush commands.
+ *
+ * If cow-allocator is used then instead of the temporary file the
+ * overlay is stored in memory using one of the allocators from
+ * common/allocators.  The bitmap and locking work in exactly the same
+ * way, only the functions which read and write the overlay
+ * (overlay_pread, overlay_pwrite) differ.
  */
 
 #include <config.h>
@@ -91,9 +102,11 @@
 
 #include <nbdkit-filter.h>
 
+#include "allocator.h"
 #include "bitmap.h"
 #include "cleanup.h"
 #include "fdatasync.h"
+#include "iszero.h"
 #include "rounding.h"
 #include "pread.h"
 #include "pwrite.h"
@@ -102,15 +115,33 @@
 #include "cow.h"
 #include "blk.h"
 
-/* The temporary overlay. */
+/* The temporary overlay.  This is either a file (fd) or, if
+ * cow-allocator was used, an allocator (a).
+ */
 static int fd = -1;
+static struct allocator *a = NULL;
 
 /* This lock protects the bitmap from parallel access. */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Locks for read-modify-write of blocks, see blk_lock.  Blocks are
+ * hashed onto a fixed number of locks, so that operations on
+ * different blocks can usually proceed in parallel.
+ */
+#define NR_BLOCK_LOCKS 64
+static pthread_mutex_t block_locks[NR_BLOCK_LOCKS];
+
 /* Bitmap. */
 static struct bitmap bm;
 
+/* Number of blocks allocated in the overlay, and the peak.  Protected
+ * by the lock.
+ */
+static uint64_t nr_allocated = 0, max_allocated = 0;
+
+/* Set if the overlay cannot punch holes. */
+static bool no_punch = false;
+
 enum bm_entry {
   BLOCK_NOT_ALLOCATED = 0,
   BLOCK_ALLOCATED = 1,
@@ -128,6 +159,24 @@ state_to_string (enum bm_entry state)
   }
 }
 
+/* Set the state of a block, keeping track of the number of allocated
+ * blocks.  Must be called with the lock held.
+ */
+static void
+set_state (uint64_t blknum, enum bm_entry state)
+{
+  enum bm_entry old = bitmap_get_blk (&bm, blknum, BLOCK_NOT_ALLOCATED);
+
+  if (old == BLOCK_ALLOCATED && state != BLOCK_ALLOCATED)
+    nr_allocated--;
+  else if (old != BLOCK_ALLOCATED && state == BLOCK_ALLOCATED) {
+    nr_allocated++;
+    if (nr_allocated > max_allocated)
+      max_allocated = nr_allocated;
+  }
+  bitmap_set_blk (&bm, blknum, state);
+}
+
 /* Extra debugging (-D cow.verbose=1). */
 NBDKIT_DLL_PUBLIC int cow_debug_verbose = 0;
 
@@ -137,9 +186,22 @@ blk_init (void)
   const char *tmpdir;
   size_t len;
   char *template;
+  size_t i;
 
   bitmap_init (&bm, blksize, 2 /* bits per block */);
 
+  for (i = 0; i < NR_BLOCK_LOCKS; ++i)
+    pthread_mutex_init (&block_locks[i], NULL);
+
+  if (cow_allocator) {
+    a = create_allocator (cow_allocator, cow_debug_verbose);
+    if (a == NULL)
+      return -1;
+    nbdkit_debug ("cow: overlay stored in memory, allocator %s",
+                  cow_allocator);
+    return 0;
+  }
+
   tmpdir = getenv ("TMPDIR");
   if (!tmpdir)
     tmpdir = LARGE_TMPDIR;
@@ -178,10 +240,17 @@ blk_init (void)
 void
 blk_free (void)
 {
+  size_t i;
+
   if (fd >= 0)
     close (fd);
+  if (a)
+    a->f->free (a);
 
   bitmap_free (&bm);
+
+  for (i = 0; i < NR_BLOCK_LOCKS; ++i)
+    pthread_mutex_destroy (&block_locks[i]);
 }
 
 /* Because blk_set_size is called before the other blk_* functions
@@ -200,7 +269,11 @@ blk_set_size (uint64_t new_size)
   if (bitmap_resize (&bm, size) == -1)
     return -1;
 
-  if (ftruncate (fd, ROUND_UP (size, blksize)) == -1) {
+  if (a) {
+    if (a->f->set_size_hint (a, ROUND_UP (size, blksize)) == -1)
+      return -1;
+  }
+  else if (ftruncate (fd, ROUND_UP (size, blksize)) == -1) {
     nbdkit_error ("ftruncate: %m");
     return -1;
   }
@@ -208,6 +281,41 @@ blk_set_size (uint64_t new_size)
   return 0;
 }
 
+/* Read and write the overlay. */
+static int
+overlay_pread (void *buf, size_t count, off_t offset, int *err)
+{
+  if (a) {
+    if (a->f->read (a, buf, count, offset) == -1) {
+      *err = errno;
+      return -1;
+    }
+  }
+  else if (full_pread (fd, buf, count, offset) == -1) {
+    *err = errno;
+    nbdkit_error ("pread: %m");
+    return -1;
+  }
+  return 0;
+}
+
+static int
+overlay_pwrite (const void *buf, size_t count, off_t offset, int *err)
+{
+  if (a) {
+    if (a->f->write (a, buf, count, offset) == -1) {
+      *err = errno;
+      return -1;
+    }
+  }
+  else if (full_pwrite (fd, buf, count, offset) == -1) {
+    *err = errno;
+    nbdkit_error ("pwrite: %m");
+    return -1;
+  }
+  return 0;
+}
+
 /* This is a bit of a hack since usually this information is hidden in
  * the blk module.  However it is needed when calculating extents.
  */
@@ -221,6 +329,20 @@ blk_status (uint64_t blknum, bool *present, bool *trimmed)
   *trimmed = state == BLOCK_TRIMMED;
 }
 
+void
+blk_occupancy (uint64_t *allocated, uint64_t *peak)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  *allocated = nr_allocated * blksize;
+  *peak = max_allocated * blksize;
+}
+
+pthread_mutex_t *
+blk_lock (uint64_t blknum)
+{
+  return &block_locks[blknum % NR_BLOCK_LOCKS];
+}
+
 /* These are the block operations.  They always read or write whole
  * blocks of size ‘blksize’.
  */
@@ -289,21 +411,16 @@ blk_read_multiple (nbdkit_next *next,
                       "at offset %" PRIu64 " into the cache",
                       runblocks, offset);
 
-      if (full_pwrite (fd, block, blksize * runblocks, offset) == -1) {
-        *err = errno;
-        nbdkit_error ("pwrite: %m");
+      if (overlay_pwrite (block, blksize * runblocks, offset, err) == -1)
         return -1;
-      }
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
       for (b = 0; b < runblocks; ++b)
-        bitmap_set_blk (&bm, blknum+b, BLOCK_ALLOCATED);
+        set_state (blknum+b, BLOCK_ALLOCATED);
     }
   }
   else if (state == BLOCK_ALLOCATED) { /* Read overlay. */
-    if (full_pread (fd, block, blksize * runblocks, offset) == -1) {
-      *err = errno;
-      nbdkit_error ("pread: %m");
+    if (overlay_pread (block, blksize * runblocks, offset, err) == -1)
       return -1;
-    }
   }
   else /* state == BLOCK_TRIMMED */ {
     memset (block, 0, blksize * runblocks);
@@ -332,12 +449,19 @@ int
 blk_cache (nbdkit_next *next,
            uint64_t blknum, uint8_t *block, enum cache_mode mode, int *err)
 {
-  /* XXX Could make this lock more fine-grained with some thought. */
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  /* Hold the lock on the block so that copying it into the overlay
+   * cannot race with a read-modify-write of the same block.
+   */
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_lock (blknum));
   off_t offset = blknum * blksize;
-  enum bm_entry state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_ALLOCATED);
+  enum bm_entry state;
   unsigned n = blksize, tail = 0;
 
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_ALLOCATED);
+  }
+
   if (offset + n > size) {
     tail = offset + n - size;
     n -= tail;
@@ -349,11 +473,13 @@ blk_cache (nbdkit_next *next,
 
   if (state == BLOCK_ALLOCATED) {
 #if HAVE_POSIX_FADVISE
-    int r = posix_fadvise (fd, offset, blksize, POSIX_FADV_WILLNEED);
-    if (r) {
-      errno = r;
-      nbdkit_error ("posix_fadvise: %m");
-      return -1;
+    if (fd >= 0) {
+      int r = posix_fadvise (fd, offset, blksize, POSIX_FADV_WILLNEED);
+      if (r) {
+        errno = r;
+        nbdkit_error ("posix_fadvise: %m");
+        return -1;
+      }
     }
 #endif
     return 0;
@@ -374,33 +500,78 @@ blk_cache (nbdkit_next *next,
   memset (block + n, 0, tail);
 
   if (mode == BLK_CACHE_COW) {
-    if (full_pwrite (fd, block, blksize, offset) == -1) {
-      *err = errno;
-      nbdkit_error ("pwrite: %m");
+    if (overlay_pwrite (block, blksize, offset, err) == -1)
       return -1;
-    }
-    bitmap_set_blk (&bm, blknum, BLOCK_ALLOCATED);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    set_state (blknum, BLOCK_ALLOCATED);
   }
   return 0;
 }
 
+/* Punch a hole in the overlay for a block which is no longer
+ * allocated.  The bitmap already records the block as trimmed, so
+ * this only frees space and failure is not fatal.
+ */
+static void
+punch_block (uint64_t blknum)
+{
+  off_t offset = blknum * blksize;
+
+  if (a) {
+    a->f->zero (a, blksize, offset);
+    return;
+  }
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if (!no_punch &&
+      fallocate (fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                 offset, blksize) == -1) {
+    nbdkit_debug ("cow: cannot punch holes in the overlay: %m");
+    no_punch = true;
+  }
+#endif
+}
+
+/* Mark a block as trimmed and free its space in the overlay. */
+static void
+trim_block (uint64_t blknum)
+{
+  enum bm_entry old;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    old = bitmap_get_blk (&bm, blknum, BLOCK_NOT_ALLOCATED);
+    set_state (blknum, BLOCK_TRIMMED);
+  }
+
+  if (old == BLOCK_ALLOCATED)
+    punch_block (blknum);
+}
+
 int
 blk_write (uint64_t blknum, const uint8_t *block, int *err)
 {
   off_t offset = blknum * blksize;
 
+  /* A block of zeroes need not be stored at all. */
+  if (is_zero ((const char *) block, blksize)) {
+    if (cow_debug_verbose)
+      nbdkit_debug ("cow: blk_write block %" PRIu64 " (offset %" PRIu64 ") "
+                    "is zero",
+                    blknum, (uint64_t) offset);
+    trim_block (blknum);
+    return 0;
+  }
+
   if (cow_debug_verbose)
     nbdkit_debug ("cow: blk_write block %" PRIu64 " (offset %" PRIu64 ")",
                   blknum, (uint64_t) offset);
 
-  if (full_pwrite (fd, block, blksize, offset) == -1) {
-    *err = errno;
-    nbdkit_error ("pwrite: %m");
+  if (overlay_pwrite (block, blksize, offset, err) == -1)
     return -1;
-  }
 
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  bitmap_set_blk (&bm, blknum, BLOCK_ALLOCATED);
+  set_state (blknum, BLOCK_ALLOCATED);
 
   return 0;
 }
@@ -414,11 +585,7 @@ blk_trim (uint64_t blknum, int *err)
     nbdkit_debug ("cow: blk_trim block %" PRIu64 " (offset %" PRIu64 ")",
                   blknum, (uint64_t) offset);
 
-  /* XXX As an optimization we could punch a whole in the overlay
-   * here.  However it's not trivial since blksize is unrelated to the
-   * overlay filesystem block size.
-   */
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  bitmap_set_blk (&bm, blknum, BLOCK_TRIMMED);
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_lock (blknum));
+  trim_block (blknum);
   return 0;
 }
@@ -45,6 +45,17 @@ extern int blk_set_size (uint64_t new_size);
 /* Returns the status of the block in the overlay. */
 extern void blk_status (uint64_t blknum, bool *present, bool *trimmed);
 
+/* Return the number of bytes currently allocated in the overlay, and
+ * the peak since nbdkit started.
+ */
+extern void blk_occupancy (uint64_t *allocated, uint64_t *peak);
+
+/* Return the lock which must be held while doing a read-modify-write
+ * of a block.  The same lock may be shared by several blocks, so only
+ * one block lock may be held at a time.
+ */
+extern pthread_mutex_t *blk_lock (uint64_t blknum);
+
 /* Read a single block from the overlay or plugin. */
 extern int blk_read (nbdkit_next *next,
                      uint64_t blknum, uint8_t *block,
@@ -72,11 +83,15 @@ extern int blk_cache (nbdkit_next *next,
                       int *err)
   __attribute__((__nonnull__ (1, 3, 5)));
 
-/* Write a single block. */
+/* Write a single block.  If the block is all zeroes it is trimmed
+ * instead.
+ */
 extern int blk_write (uint64_t blknum, const uint8_t *block, int *err)
   __attribute__((__nonnull__ (2, 3)));
 
-/* Trim a single block. */
+/* Trim a single block, freeing its space in the overlay.  This takes
+ * the lock on the block, so it must not already be held.
+ */
 extern int blk_trim (uint64_t blknum, int *err)
   __attribute__((__nonnull__ (2)));
 
@@ -56,13 +56,8 @@
 #include "cow.h"
 #include "blk.h"
 
-/* Read-modify-write requests are serialized through this global lock.
- * This is only used for unaligned requests which should be
- * infrequent.
- */
-static pthread_mutex_t rmw_lock = PTHREAD_MUTEX_INITIALIZER;
-
 unsigned blksize = 65536;       /* block size */
+const char *cow_allocator = NULL; /* cow-allocator, NULL = temporary file */
 
 static bool cow_on_cache;
 
@@ -78,6 +73,13 @@ const char *cor_path;
 static void
 cow_unload (void)
 {
+  uint64_t allocated, peak;
+
+  blk_occupancy (&allocated, &peak);
+  nbdkit_debug ("cow: overlay occupancy: %" PRIu64 " bytes, "
+                "peak: %" PRIu64 " bytes",
+                allocated, peak);
+
   blk_free ();
 }
 
@@ -97,6 +99,10 @@ cow_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
     blksize = r;
     return 0;
   }
+  else if (strcmp (key, "cow-allocator") == 0) {
+    cow_allocator = value;
+    return 0;
+  }
   else if (strcmp (key, "cow-on-cache") == 0) {
     int r;
 
@@ -126,15 +132,44 @@ cow_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
 
 #define cow_config_help \
   "cow-block-size=<N>       Set COW block size.\n" \
+  "cow-allocator=sparse|zstd|malloc\n" \
+  "                         Store the overlay in memory.\n" \
   "cow-on-cache=<BOOL>      Copy cache (prefetch) requests to the overlay.\n" \
   "cow-on-read=<BOOL>|/PATH Copy read requests to the overlay."
 
+/* Metrics. */
+static uint64_t
+overlay_bytes (void)
+{
+  uint64_t allocated, peak;
+
+  blk_occupancy (&allocated, &peak);
+  return allocated;
+}
+
+static uint64_t
+overlay_peak_bytes (void)
+{
+  uint64_t allocated, peak;
+
+  blk_occupancy (&allocated, &peak);
+  return peak;
+}
+
 static int
 cow_get_ready (int thread_model)
 {
   if (blk_init () == -1)
     return -1;
 
+  if (nbdkit_add_metric ("cow_overlay_bytes",
+                         "Bytes of data stored in the overlay.",
+                         NBDKIT_METRIC_GAUGE, overlay_bytes) == -1 ||
+      nbdkit_add_metric ("cow_overlay_peak_bytes",
+                         "Largest number of bytes stored in the overlay.",
+                         NBDKIT_METRIC_GAUGE, overlay_peak_bytes) == -1)
+    return -1;
+
   return 0;
 }
 
@@ -182,6 +217,32 @@ cow_get_size (nbdkit_next *next,
   return size;
 }
 
+/* Requests of any alignment are accepted, but whole overlay
+ * blocks avoid a read-modify-write cycle, so advertise the block size
+ * as the preferred size.
+ */
+static int
+cow_block_size (nbdkit_next *next, void *handle,
+                uint32_t *minimum, uint32_t *preferred, uint32_t *maximum)
+{
+  uint32_t block_preferred;
+
+  if (next->block_size (next, minimum, preferred, maximum) == -1)
+    return -1;
+
+  /* Requests are passed on as runs of whole blocks, so they must not
+   * be larger than the plugin's maximum (0 means it has no limit).
+   */
+  if (*maximum == 0)
+    *maximum = 0xffffffff;
+
+  *minimum = 1;
+  block_preferred = MIN (blksize, 32 * 1024 * 1024);
+  if (block_preferred <= *maximum)
+    *preferred = MAX (*preferred, block_preferred);
+  return 0;
+}
+
 /* Force an early call to cow_get_size because we have to set the
  * backing file size and bitmap size before any other read or write
  * calls.
@@ -352,10 +413,10 @@ cow_pwrite (nbdkit_next *next,
     uint64_t n = MIN (blksize - blkoffs, count);
 
     /* Do a read-modify-write operation on the current block.
-     * Hold the rmw_lock over the whole operation.
+     * Hold the lock on the block over the whole operation.
      */
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rmw_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_lock (blknum));
     r = blk_read (next, blknum, block, cow_on_read (), err);
     if (r != -1) {
       memcpy (&block[blkoffs], buf, n);
@@ -385,7 +446,7 @@ cow_pwrite (nbdkit_next *next,
   /* Unaligned tail */
   if (count) {
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rmw_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_lock (blknum));
     r = blk_read (next, blknum, block, cow_on_read (), err);
     if (r != -1) {
       memcpy (block, buf, count);
@@ -433,9 +494,9 @@ cow_zero (nbdkit_next *next,
     uint64_t n = MIN (blksize - blkoffs, count);
 
     /* Do a read-modify-write operation on the current block.
-     * Hold the rmw_lock over the whole operation.
+     * Hold the lock on the block over the whole operation.
      */
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rmw_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_lock (blknum));
     r = blk_read (next, blknum, block, cow_on_read (), err);
     if (r != -1) {
       memset (&block[blkoffs], 0, n);
@@ -449,14 +510,11 @@ cow_zero (nbdkit_next *next,
     blknum++;
   }
 
-  /* Aligned body */
-  if (count >= blksize)
-    memset (block, 0, blksize);
+  /* Aligned body.  Trimmed blocks read as zeroes, so this is the same
+   * as trimming.
+   */
   while (count >= blksize) {
-    /* XXX There is the possibility of optimizing this: since this loop is
-     * writing a whole, aligned block, we should use FALLOC_FL_ZERO_RANGE.
-     */
-    r = blk_write (blknum, block, err);
+    r = blk_trim (blknum, err);
     if (r == -1)
       return -1;
 
@@ -467,7 +525,7 @@ cow_zero (nbdkit_next *next,
 
   /* Unaligned tail */
   if (count) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rmw_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_lock (blknum));
     r = blk_read (next, blknum, block, cow_on_read (), err);
     if (r != -1) {
       memset (block, 0, count);
@@ -509,9 +567,9 @@ cow_trim (nbdkit_next *next,
     uint64_t n = MIN (blksize - blkoffs, count);
 
     /* Do a read-modify-write operation on the current block.
-     * Hold the lock over the whole operation.
+     * Hold the lock on the block over the whole operation.
      */
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rmw_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_lock (blknum));
     r = blk_read (next, blknum, block, cow_on_read (), err);
     if (r != -1) {
       memset (&block[blkoffs], 0, n);
@@ -538,7 +596,7 @@ cow_trim (nbdkit_next *next,
 
   /* Unaligned tail */
   if (count) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&rmw_lock);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (blk_lock (blknum));
     r = blk_read (next, blknum, block, cow_on_read (), err);
     if (r != -1) {
       memset (block, 0, count);
@@ -762,6 +820,7 @@ static struct nbdkit_filter filter = {
   .get_ready         = cow_get_ready,
   .prepare           = cow_prepare,
   .get_size          = cow_get_size,
+  .block_size        = cow_block_size,
   .can_write         = cow_can_write,
   .can_flush         = cow_can_flush,
   .can_trim          = cow_can_trim,
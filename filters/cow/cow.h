@@ -36,4 +36,7 @@
 /* Size of a block in the cache. */
 extern unsigned blksize;
 
+/* Allocator used for the overlay, or NULL to use a temporary file. */
+extern const char *cow_allocator;
+
 #endif /* NBDKIT_COW_H */
@@ -1,5 +1,5 @@
 /* nbdkit
- * Copyright (C) 2019-2021 Red Hat Inc.
+ * Copyright (C) 2019-2022 Red Hat Inc.
  *
  * Redistribution and use in source and binary forms, with or without
  * modification, are permitted provided that the following conditions are
@@ -30,11 +30,24 @@
  * SUCH DAMAGE.
  */
 
+/* The readahead filter tracks several sequential streams of reads
+ * per connection.  Once a stream is detected, the next window of the
+ * stream is queued to be prefetched into a buffer from a small
+ * per-connection pool.  With the parallel thread model a background
+ * thread per connection fetches queued buffers through the
+ * connection's next context, so the client does not have to wait for
+ * the prefetch.  Otherwise (and if the client catches up with the
+ * background thread) queued buffers are fetched by the request which
+ * needs them.
+ */
+
 #include <config.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
 #include <string.h>
 #include <errno.h>
 
@@ -45,48 +58,192 @@
 #include "cleanup.h"
 #include "minmax.h"
 
-/* Copied from server/plugins.c. */
-#define MAX_REQUEST_SIZE (64 * 1024 * 1024)
-
 /* These could be made configurable in future. */
 #define READAHEAD_MIN 65536
-#define READAHEAD_MAX MAX_REQUEST_SIZE
+#define READAHEAD_MAX (4 * 1024 * 1024)
+#define NR_STREAMS 4
+#define NR_BUFFERS (2 * NR_STREAMS)
+
+/* A prefetch buffer. */
+enum buffer_state {
+  BUFFER_EMPTY = 0,             /* Unused. */
+  BUFFER_QUEUED,                /* Waiting to be fetched. */
+  BUFFER_FETCHING,              /* Being fetched, do not touch. */
+  BUFFER_READY,                 /* Contains data. */
+};
 
-/* This lock protects the global state. */
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+struct buffer {
+  enum buffer_state state;
+  bool invalid;         /* Overlapping write while fetching, discard. */
+  int stream;           /* Stream which owns this buffer, or -1. */
+  uint64_t seq;         /* Order in which buffers were last used. */
+  uint64_t offset;
+  uint32_t length;
+  char *data;
+  size_t cap;           /* Allocated size of data. */
+};
+
+/* A sequential stream of reads. */
+struct stream {
+  bool used;
+  uint64_t seq;         /* Order in which streams were last used. */
+  uint64_t next;        /* End of the last read in the stream. */
+  uint64_t ahead;       /* End of the data queued for prefetch. */
+  uint32_t window;      /* Size of the next prefetch. */
+};
 
-/* The real size of the underlying plugin. */
-static uint64_t size;
+struct readahead_handle {
+  struct readahead_handle *next_handle; /* List of handles, see below. */
+
+  /* The lock protects everything below. */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;          /* Signalled when a fetch finishes. */
+  pthread_cond_t bg_cond;       /* Signalled when a buffer is queued. */
+
+  uint64_t size;                /* Size of the plugin. */
+  uint64_t seq;
+  struct stream streams[NR_STREAMS];
+  struct buffer buffers[NR_BUFFERS];
+  uint64_t hits, misses;        /* Bytes read from buffers / plugin. */
+
+  /* Background thread, and the context it uses for reading. */
+  nbdkit_next *bg_next;
+  bool bg_running;
+  bool bg_quit;
+  pthread_t bg_thread;
+};
 
-/* Size of the readahead window. */
-static uint64_t window = READAHEAD_MIN;
+/* The thread model, saved in .get_ready. */
+static int thread_model = -1;
 
-/* The single prefetch buffer shared by all threads, and its virtual
- * location in the virtual disk.  The prefetch buffer grows
- * dynamically as required, but never shrinks.
+/* List of all open handles, so that writes from any connection can
+ * invalidate the prefetched data of every connection.  The list is
+ * protected by handles_lock, which is acquired before the lock in
+ * any handle.
  */
-static char *buffer = NULL;
-static size_t bufsize = 0;
-static uint64_t position;
-static uint32_t length = 0;
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct readahead_handle *handles = NULL;
 
-static void
-readahead_unload (void)
+static int
+readahead_get_ready (int tm)
 {
-  free (buffer);
+  thread_model = tm;
+  return 0;
 }
 
-static int64_t readahead_get_size (nbdkit_next *next, void *handle);
+static void *
+readahead_open (nbdkit_next_open *next, nbdkit_context *nxdata,
+                int readonly, const char *exportname, int is_tls)
+{
+  struct readahead_handle *h;
+  size_t i;
+
+  if (next (nxdata, readonly, exportname) == -1)
+    return NULL;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  pthread_mutex_init (&h->lock, NULL);
+  pthread_cond_init (&h->cond, NULL);
+  pthread_cond_init (&h->bg_cond, NULL);
+  for (i = 0; i < NR_BUFFERS; ++i)
+    h->buffers[i].stream = -1;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&handles_lock);
+  h->next_handle = handles;
+  handles = h;
+  return h;
+}
 
-/* In prepare, force a call to get_size which sets the size global. */
+static void *readahead_thread (void *vp);
+
+/* Start the background thread.  It calls into the same next context
+ * as client requests, which is only safe if the plugin can handle
+ * parallel requests.  The thread is stopped in .finalize before the
+ * next context is finalized.
+ */
 static int
 readahead_prepare (nbdkit_next *next,
                    void *handle, int readonly)
 {
+  struct readahead_handle *h = handle;
   int64_t r;
+  int err;
+
+  r = next->get_size (next);
+  if (r == -1)
+    return -1;
+  h->size = r;
 
-  r = readahead_get_size (next, handle);
-  return r >= 0 ? 0 : -1;
+  if (thread_model != NBDKIT_THREAD_MODEL_PARALLEL &&
+      thread_model != NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT)
+    return 0;
+
+  h->bg_next = next;
+  err = pthread_create (&h->bg_thread, NULL, readahead_thread, h);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+  h->bg_running = true;
+  return 0;
+}
+
+/* Stop the background thread. */
+static void
+stop_background (struct readahead_handle *h)
+{
+  if (h->bg_running) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
+      h->bg_quit = true;
+      pthread_cond_signal (&h->bg_cond);
+    }
+    pthread_join (h->bg_thread, NULL);
+    h->bg_running = false;
+  }
+}
+
+static int
+readahead_finalize (nbdkit_next *next, void *handle)
+{
+  struct readahead_handle *h = handle;
+
+  stop_background (h);
+  return 0;
+}
+
+static void
+readahead_close (void *handle)
+{
+  struct readahead_handle *h = handle;
+  struct readahead_handle **hp;
+  size_t i;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&handles_lock);
+    for (hp = &handles; *hp != h; hp = &(*hp)->next_handle)
+      ;
+    *hp = h->next_handle;
+  }
+
+  stop_background (h);
+
+  if (h->hits + h->misses > 0)
+    nbdkit_debug ("readahead: read %" PRIu64 " bytes from prefetch buffers, "
+                  "%" PRIu64 " bytes from the plugin",
+                  h->hits, h->misses);
+
+  for (i = 0; i < NR_BUFFERS; ++i)
+    free (h->buffers[i].data);
+  pthread_cond_destroy (&h->bg_cond);
+  pthread_cond_destroy (&h->cond);
+  pthread_mutex_destroy (&h->lock);
+  free (h);
 }
 
 /* Get the size. */
@@ -94,14 +251,15 @@ static int64_t
 readahead_get_size (nbdkit_next *next,
                     void *handle)
 {
+  struct readahead_handle *h = handle;
   int64_t r;
 
   r = next->get_size (next);
   if (r == -1)
     return -1;
 
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  size = r;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
+  h->size = r;
 
   return r;
 }
@@ -120,38 +278,207 @@ readahead_can_cache (nbdkit_next *next,
 
 /* Read data. */
 
+/* Fetch a buffer which the caller has changed to BUFFER_FETCHING.
+ * This is called without the lock held.
+ */
 static int
-fill_readahead (nbdkit_next *next,
-                uint32_t count, uint64_t offset, uint32_t flags, int *err)
+fetch_buffer (nbdkit_next *next, struct buffer *b)
 {
-  position = offset;
-
-  /* Read at least window bytes, but if count is larger read that.
-   * Note that the count cannot be bigger than the buffer size.
-   */
-  length = MAX (count, window);
-
-  /* Don't go beyond the end of the underlying file. */
-  length = MIN (length, size - position);
+  int err;
 
-  /* Grow the buffer if necessary. */
-  if (bufsize < length) {
-    char *new_buffer = realloc (buffer, length);
-    if (new_buffer == NULL) {
-      *err = errno;
+  if (b->cap < b->length) {
+    char *new_data = realloc (b->data, b->length);
+    if (new_data == NULL) {
       nbdkit_error ("realloc: %m");
       return -1;
     }
-    buffer = new_buffer;
-    bufsize = length;
+    b->data = new_data;
+    b->cap = b->length;
   }
 
-  if (next->pread (next, buffer, length, offset, flags, err) == -1) {
-    length = 0;           /* failed to fill the prefetch buffer */
-    return -1;
+  return next->pread (next, b->data, b->length, b->offset, 0, &err);
+}
+
+/* Must be called with the lock held after fetch_buffer. */
+static void
+fetch_done (struct readahead_handle *h, struct buffer *b, int r)
+{
+  if (r == -1 || b->invalid)
+    b->state = BUFFER_EMPTY;
+  else
+    b->state = BUFFER_READY;
+  b->invalid = false;
+  pthread_cond_broadcast (&h->cond);
+}
+
+static void *
+readahead_thread (void *vp)
+{
+  struct readahead_handle *h = vp;
+  struct buffer *b;
+  size_t i;
+  int r;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
+  while (!h->bg_quit) {
+    /* Fetch queued buffers in the order they were queued. */
+    b = NULL;
+    for (i = 0; i < NR_BUFFERS; ++i) {
+      if (h->buffers[i].state == BUFFER_QUEUED &&
+          (b == NULL || h->buffers[i].seq < b->seq))
+        b = &h->buffers[i];
+    }
+    if (b == NULL) {
+      pthread_cond_wait (&h->bg_cond, &h->lock);
+      continue;
+    }
+
+    b->state = BUFFER_FETCHING;
+    pthread_mutex_unlock (&h->lock);
+    r = fetch_buffer (h->bg_next, b);
+    pthread_mutex_lock (&h->lock);
+    fetch_done (h, b, r);
   }
 
-  return 0;
+  return NULL;
+}
+
+/* Find the buffer containing offset, if any. */
+static struct buffer *
+find_buffer (struct readahead_handle *h, uint64_t offset)
+{
+  size_t i;
+
+  for (i = 0; i < NR_BUFFERS; ++i) {
+    struct buffer *b = &h->buffers[i];
+
+    if (b->state != BUFFER_EMPTY && !b->invalid &&
+        b->offset <= offset && offset < b->offset + b->length)
+      return b;
+  }
+  return NULL;
+}
+
+/* Find how many bytes from offset can be read before the next
+ * buffer, so that we don't read data from the plugin twice.
+ */
+static uint32_t
+bytes_before_buffer (struct readahead_handle *h,
+                     uint32_t count, uint64_t offset)
+{
+  size_t i;
+
+  for (i = 0; i < NR_BUFFERS; ++i) {
+    const struct buffer *b = &h->buffers[i];
+
+    if (b->state != BUFFER_EMPTY && !b->invalid &&
+        offset < b->offset && b->offset < offset + count)
+      count = b->offset - offset;
+  }
+  return count;
+}
+
+/* Find the stream which a read belongs to, or replace the least
+ * recently used stream (and the caller must initialize it).  A read belongs to a stream if it is within
+ * one window of where the stream got to, which allows for clients
+ * such as qemu-img convert which issue several sequential requests
+ * in parallel that can arrive out of order.
+ */
+static struct stream *
+find_stream (struct readahead_handle *h, uint64_t offset, bool *is_new)
+{
+  struct stream *s, *lru = &h->streams[0];
+  size_t i;
+
+  for (i = 0; i < NR_STREAMS; ++i) {
+    s = &h->streams[i];
+    if (s->used &&
+        offset + s->window >= s->next && offset <= s->next + s->window) {
+      *is_new = false;
+      return s;
+    }
+    if (!s->used || (lru->used && s->seq < lru->seq))
+      lru = s;
+  }
+
+  /* Release the buffers of the old stream. */
+  for (i = 0; i < NR_BUFFERS; ++i) {
+    struct buffer *b = &h->buffers[i];
+
+    if (b->stream == lru - h->streams) {
+      b->stream = -1;
+      if (b->state == BUFFER_QUEUED || b->state == BUFFER_READY)
+        b->state = BUFFER_EMPTY;
+    }
+  }
+
+  lru->used = true;
+  lru->window = READAHEAD_MIN;
+  *is_new = true;
+  return lru;
+}
+
+/* Find a buffer to prefetch into: an empty buffer if possible, or
+ * else the least recently used buffer which is not being fetched.
+ */
+static struct buffer *
+get_free_buffer (struct readahead_handle *h)
+{
+  struct buffer *b, *lru = NULL;
+  size_t i;
+
+  for (i = 0; i < NR_BUFFERS; ++i) {
+    b = &h->buffers[i];
+    if (b->state == BUFFER_EMPTY)
+      return b;
+    if (b->state != BUFFER_FETCHING && (lru == NULL || b->seq < lru->seq))
+      lru = b;
+  }
+  return lru;
+}
+
+/* Update a stream after a read, and queue the next window of the
+ * stream for prefetching if there is less than one window queued
+ * ahead of the client.
+ */
+static void
+update_stream (struct readahead_handle *h, struct stream *s,
+               uint64_t end)
+{
+  struct buffer *b;
+  size_t i;
+
+  s->seq = ++h->seq;
+  s->next = MAX (s->next, end);
+
+  /* Buffers which the stream has gone past can be reused. */
+  for (i = 0; i < NR_BUFFERS; ++i) {
+    b = &h->buffers[i];
+    if (b->stream == s - h->streams && b->state == BUFFER_READY &&
+        b->offset + b->length <= s->next)
+      b->state = BUFFER_EMPTY;
+  }
+
+  s->ahead = MAX (s->ahead, s->next);
+  if (s->ahead >= h->size || s->ahead >= s->next + s->window)
+    return;
+
+  b = get_free_buffer (h);
+  if (b == NULL)
+    return;
+
+  b->state = BUFFER_QUEUED;
+  b->invalid = false;
+  b->stream = s - h->streams;
+  b->seq = ++h->seq;
+  b->offset = s->ahead;
+  b->length = MIN (s->window, h->size - s->ahead);
+  s->ahead += b->length;
+
+  /* Each time we prefetch, double the window. */
+  s->window = MIN (s->window * 2, READAHEAD_MAX);
+
+  pthread_cond_signal (&h->bg_cond);
 }
 
 static int
@@ -159,58 +486,93 @@ readahead_pread (nbdkit_next *next,
                  void *handle, void *buf, uint32_t count, uint64_t offset,
                  uint32_t flags, int *err)
 {
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  struct readahead_handle *h = handle;
+  const uint64_t start = offset, end = offset + count;
+  struct stream *s;
+  struct buffer *b;
+  bool is_new;
+  uint32_t n;
+  int r;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
 
   while (count > 0) {
-    if (length == 0) {
-      /* We don't have a prefetch buffer at all.  This could be the
-       * first request or reset after a miss.
-       */
-      window = READAHEAD_MIN;
-      if (fill_readahead (next, count, offset, flags, err) == -1)
+    b = find_buffer (h, offset);
+
+    if (b == NULL) {
+      /* Not prefetched, read directly from the plugin. */
+      n = bytes_before_buffer (h, count, offset);
+      pthread_mutex_unlock (&h->lock);
+      r = next->pread (next, buf, n, offset, flags, err);
+      pthread_mutex_lock (&h->lock);
+      if (r == -1)
         return -1;
+      h->misses += n;
     }
-
-    /* Can we satisfy this request partly or entirely from the prefetch
-     * buffer?
-     */
-    else if (position <= offset && offset < position + length) {
-      uint32_t n = MIN (position - offset + length, count);
-      memcpy (buf, &buffer[offset-position], n);
-      buf += n;
-      offset += n;
-      count -= n;
+    else if (b->state == BUFFER_FETCHING) {
+      /* Wait for the fetch to finish, then look again. */
+      pthread_cond_wait (&h->cond, &h->lock);
+      continue;
     }
-
-    /* Does the request start immediately after the prefetch buffer?
-     * This is a “hit” allowing us to double the window size.
-     */
-    else if (offset == position + length) {
-      window = MIN (window * 2, READAHEAD_MAX);
-      if (fill_readahead (next, count, offset, flags, err) == -1)
-        return -1;
+    else if (b->state == BUFFER_QUEUED) {
+      /* The background thread has not got to this buffer yet (or
+       * there is no background thread), so fetch it now.
+       */
+      b->state = BUFFER_FETCHING;
+      pthread_mutex_unlock (&h->lock);
+      r = fetch_buffer (next, b);
+      pthread_mutex_lock (&h->lock);
+      fetch_done (h, b, r);
+      continue;
+    }
+    else /* b->state == BUFFER_READY */ {
+      n = MIN (b->offset + b->length - offset, count);
+      memcpy (buf, &b->data[offset - b->offset], n);
+      b->seq = ++h->seq;
+      h->hits += n;
     }
 
-    /* Else it's a “miss”.  Reset everything and start again. */
-    else
-      length = 0;
+    buf += n;
+    offset += n;
+    count -= n;
   }
 
+  s = find_stream (h, start, &is_new);
+  if (!is_new)
+    update_stream (h, s, end);
+  else {
+    s->seq = ++h->seq;
+    s->next = s->ahead = end;
+  }
   return 0;
 }
 
-/* Any writes or write-like operations kill the prefetch buffer.
- *
- * We could do better here, but for the current use case of this
- * filter it doesn't matter. XXX
+/* Writes or write-like operations invalidate any overlapping
+ * prefetched data in all connections.  This is done after the
+ * operation, so that data prefetched while it was in progress is
+ * also discarded.
  */
-
 static void
-kill_readahead (void)
+kill_readahead (uint64_t offset, uint64_t count)
 {
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-  window = READAHEAD_MIN;
-  length = 0;
+  struct readahead_handle *h;
+  size_t i;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&handles_lock);
+  for (h = handles; h != NULL; h = h->next_handle) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->lock);
+    for (i = 0; i < NR_BUFFERS; ++i) {
+      struct buffer *b = &h->buffers[i];
+
+      if (b->state == BUFFER_EMPTY ||
+          b->offset >= offset + count || offset >= b->offset + b->length)
+        continue;
+      if (b->state == BUFFER_FETCHING)
+        b->invalid = true;
+      else
+        b->state = BUFFER_EMPTY;
+    }
+  }
 }
 
 static int
@@ -219,8 +581,11 @@ readahead_pwrite (nbdkit_next *next,
                   const void *buf, uint32_t count, uint64_t offset,
                   uint32_t flags, int *err)
 {
-  kill_readahead ();
-  return next->pwrite (next, buf, count, offset, flags, err);
+  int r;
+
+  r = next->pwrite (next, buf, count, offset, flags, err);
+  kill_readahead (offset, count);
+  return r;
 }
 
 static int
@@ -229,8 +594,11 @@ readahead_trim (nbdkit_next *next,
                 uint32_t count, uint64_t offset, uint32_t flags,
                 int *err)
 {
-  kill_readahead ();
-  return next->trim (next, count, offset, flags, err);
+  int r;
+
+  r = next->trim (next, count, offset, flags, err);
+  kill_readahead (offset, count);
+  return r;
 }
 
 static int
@@ -239,23 +607,32 @@ readahead_zero (nbdkit_next *next,
                 uint32_t count, uint64_t offset, uint32_t flags,
                 int *err)
 {
-  kill_readahead ();
-  return next->zero (next, count, offset, flags, err);
+  int r;
+
+  r = next->zero (next, count, offset, flags, err);
+  kill_readahead (offset, count);
+  return r;
 }
 
 static int
 readahead_flush (nbdkit_next *next,
                  void *handle, uint32_t flags, int *err)
 {
-  kill_readahead ();
-  return next->flush (next, flags, err);
+  int r;
+
+  r = next->flush (next, flags, err);
+  kill_readahead (0, UINT64_MAX);
+  return r;
 }
 
 static struct nbdkit_filter filter = {
   .name              = "readahead",
   .longname          = "nbdkit readahead filter",
-  .unload            = readahead_unload,
+  .get_ready         = readahead_get_ready,
+  .open              = readahead_open,
   .prepare           = readahead_prepare,
+  .finalize          = readahead_finalize,
+  .close             = readahead_close,
   .get_size          = readahead_get_size,
   .can_cache         = readahead_can_cache,
   .pread             = readahead_pread,
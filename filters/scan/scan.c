@@ -0,0 +1,450 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* The scan filter reads the whole disk in the background by issuing
+ * cache requests to the underlying layers, so that a cache filter
+ * below it (or a plugin which supports caching) has a local copy of
+ * the data before clients need it.
+ *
+ * There is a single scanning thread which uses a shared context into
+ * the plugin opened in .after_fork, so the disk is only scanned once
+ * however many clients connect.  The disk is divided into chunks of
+ * scan-size bytes, and a bitmap records which chunks have still to
+ * be scanned.  The thread scans chunks in order, except that with
+ * scan-ahead it first scans the chunks just after the most recent
+ * client read.  Holes and zero extents are skipped, and the thread
+ * waits (for a bounded time) while client requests are in flight.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "bitmap.h"
+#include "cleanup.h"
+#include "ispowerof2.h"
+#include "minmax.h"
+
+/* How many chunks after the most recent client read to scan before
+ * continuing with the main scan.
+ */
+#define SCAN_AHEAD_CHUNKS 16
+
+/* Maximum time to wait for client requests to finish before issuing
+ * the next scan request anyway.
+ */
+#define YIELD_MAX_MS 100
+
+static bool scan_ahead = true;
+static unsigned scan_size = 2 * 1024 * 1024;
+
+static int thread_model;
+
+/* The lock protects everything below. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_t thread;
+static bool running = false;
+static bool stopping = false;
+
+/* Bitmap with one bit per chunk, set if the chunk has not been
+ * scanned yet.
+ */
+static struct bitmap bm;
+
+/* Number of client requests in flight, and the offset just after
+ * the most recent client read (or -1).
+ */
+static unsigned in_flight = 0;
+static int64_t hint = -1;
+
+static void
+scan_unload (void)
+{
+  bitmap_free (&bm);
+}
+
+static int
+scan_config (nbdkit_next_config *next, nbdkit_backend *nxdata,
+             const char *key, const char *value)
+{
+  int r;
+  int64_t size;
+
+  if (strcmp (key, "scan-ahead") == 0) {
+    r = nbdkit_parse_bool (value);
+    if (r == -1)
+      return -1;
+    scan_ahead = r;
+    return 0;
+  }
+  else if (strcmp (key, "scan-size") == 0) {
+    size = nbdkit_parse_size (value);
+    if (size == -1)
+      return -1;
+    if (size < 4096 || size > 32 * 1024 * 1024 || !is_power_of_2 (size)) {
+      nbdkit_error ("scan-size must be a power of 2 between 4K and 32M");
+      return -1;
+    }
+    scan_size = size;
+    return 0;
+  }
+  else
+    return next (nxdata, key, value);
+}
+
+#define scan_config_help \
+  "scan-ahead=false          Do not prioritize areas clients are reading.\n" \
+  "scan-size=SIZE            Size of each scan request (default 2M).\n"
+
+static int
+scan_get_ready (int tm)
+{
+  thread_model = tm;
+  return 0;
+}
+
+/* Wait until there are no client requests in flight, or for at most
+ * YIELD_MAX_MS.  Returns false if the thread should stop.
+ */
+static bool
+yield_to_clients (void)
+{
+  struct timespec deadline;
+
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += YIELD_MAX_MS * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  while (!stopping && in_flight > 0) {
+    if (pthread_cond_timedwait (&cond, &lock, &deadline) == ETIMEDOUT)
+      break;
+  }
+  return !stopping;
+}
+
+/* Choose the next chunk to scan and clear its bit, or return -1 if
+ * the whole disk has been scanned.
+ */
+static int64_t
+next_chunk (int64_t *cursor)
+{
+  const int64_t nr_chunks = bm.size * bm.ibpb;
+  int64_t chunk = -1, c, end;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+  if (hint >= 0) {
+    end = MIN (hint / scan_size + SCAN_AHEAD_CHUNKS, nr_chunks);
+    for (c = hint / scan_size; c < end; ++c) {
+      if (bitmap_get_blk (&bm, c, 0)) {
+        chunk = c;
+        break;
+      }
+    }
+    if (chunk == -1)
+      hint = -1;
+  }
+
+  if (chunk == -1) {
+    chunk = bitmap_next (&bm, *cursor);
+    if (chunk == -1)
+      chunk = bitmap_next (&bm, 0);
+    if (chunk == -1)
+      return -1;
+    *cursor = chunk + 1;
+  }
+
+  bitmap_set_blk (&bm, chunk, 0);
+  return chunk;
+}
+
+/* Issue cache requests for the chunk, skipping holes and zeroes. */
+static int
+scan_chunk (nbdkit_next *next, bool can_extents,
+            uint64_t offset, uint64_t end, int *err)
+{
+  CLEANUP_EXTENTS_FREE struct nbdkit_extents *extents = NULL;
+  size_t i;
+
+  if (can_extents) {
+    extents = nbdkit_extents_new (offset, end);
+    if (extents == NULL) {
+      *err = errno;
+      return -1;
+    }
+    if (next->extents (next, end - offset, offset, 0, extents, err) == -1)
+      return -1;
+
+    for (i = 0; i < nbdkit_extents_count (extents); ++i) {
+      const struct nbdkit_extent e = nbdkit_get_extent (extents, i);
+      const uint64_t e_end = MIN (e.offset + e.length, end);
+
+      if (e.offset >= end)
+        break;
+      if (!(e.type & NBDKIT_EXTENT_ZERO) &&
+          next->cache (next, e_end - e.offset, e.offset, 0, err) == -1)
+        return -1;
+      offset = e_end;
+    }
+  }
+
+  /* Anything not covered by the extents is scanned. */
+  if (offset < end)
+    return next->cache (next, end - offset, offset, 0, err);
+  return 0;
+}
+
+static void *
+scan_thread (void *vp)
+{
+  nbdkit_backend *backend = vp;
+  nbdkit_next *next;
+  int64_t size, chunk, cursor = 0;
+  uint64_t offset, nr_chunks = 0;
+  bool can_extents;
+  time_t start_t;
+  int err;
+
+  next = nbdkit_next_context_open (backend, true, "", true);
+  if (next == NULL) {
+    nbdkit_error ("scan: could not open plugin for background scan");
+    return NULL;
+  }
+  if (next->prepare (next) == -1)
+    goto out;
+  size = next->get_size (next);
+  if (size == -1)
+    goto out;
+  if (next->can_cache (next) != NBDKIT_CACHE_NATIVE) {
+    nbdkit_debug ("scan: the plugin does not support caching, "
+                  "not scanning");
+    goto out;
+  }
+  can_extents = next->can_extents (next) == 1;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    if (bitmap_resize (&bm, size) == -1)
+      goto out;
+    if (bm.size > 0)
+      memset (bm.bitmap, 0xff, bm.size);
+  }
+
+  nbdkit_debug ("scan: scanning %" PRIi64 " bytes%s",
+                size, can_extents ? ", skipping holes" : "");
+  start_t = time (NULL);
+
+  while (yield_to_clients () && (chunk = next_chunk (&cursor)) >= 0) {
+    offset = chunk * scan_size;
+    if (offset >= size)
+      continue;
+
+    /* Errors are not fatal, since the client will read the data
+     * again from the plugin if necessary.
+     */
+    if (scan_chunk (next, can_extents,
+                    offset, MIN (offset + scan_size, size), &err) == -1)
+      nbdkit_debug ("scan: error scanning offset %" PRIu64 ": %s",
+                    offset, strerror (err));
+    nr_chunks++;
+  }
+
+  nbdkit_debug ("scan: scanned %" PRIu64 " chunks in %ld seconds",
+                nr_chunks, (long) (time (NULL) - start_t));
+
+ out:
+  next->finalize (next);
+  nbdkit_next_context_close (next);
+  return NULL;
+}
+
+/* Start the scanning thread. */
+static int
+scan_after_fork (nbdkit_backend *nxdata)
+{
+  int err;
+
+  /* The thread uses its own context into the plugin, which is only
+   * safe if the plugin can handle requests on different handles at
+   * the same time.
+   */
+  if (thread_model != NBDKIT_THREAD_MODEL_PARALLEL &&
+      thread_model != NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT &&
+      thread_model != NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS) {
+    nbdkit_debug ("scan: not scanning because of the thread model");
+    return 0;
+  }
+
+  bitmap_init (&bm, scan_size, 1 /* bits per block */);
+
+  err = pthread_create (&thread, NULL, scan_thread, nxdata);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_create: %m");
+    return -1;
+  }
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  running = true;
+  return 0;
+}
+
+static void
+scan_cleanup (nbdkit_backend *nxdata)
+{
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    if (!running)
+      return;
+    stopping = true;
+    pthread_cond_signal (&cond);
+  }
+
+  pthread_join (thread, NULL);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  running = false;
+}
+
+/* Keep track of client requests in flight. */
+static void
+begin_request (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  in_flight++;
+}
+
+static void
+end_request (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  if (--in_flight == 0)
+    pthread_cond_signal (&cond);
+}
+
+/* Read data. */
+static int
+scan_pread (nbdkit_next *next,
+            void *handle, void *buf, uint32_t count, uint64_t offset,
+            uint32_t flags, int *err)
+{
+  int r;
+
+  begin_request ();
+  r = next->pread (next, buf, count, offset, flags, err);
+  end_request ();
+
+  if (scan_ahead) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    hint = offset + count;
+  }
+  return r;
+}
+
+/* Write data. */
+static int
+scan_pwrite (nbdkit_next *next,
+             void *handle,
+             const void *buf, uint32_t count, uint64_t offset,
+             uint32_t flags, int *err)
+{
+  int r;
+
+  begin_request ();
+  r = next->pwrite (next, buf, count, offset, flags, err);
+  end_request ();
+  return r;
+}
+
+/* Zero data. */
+static int
+scan_zero (nbdkit_next *next,
+           void *handle,
+           uint32_t count, uint64_t offset, uint32_t flags,
+           int *err)
+{
+  int r;
+
+  begin_request ();
+  r = next->zero (next, count, offset, flags, err);
+  end_request ();
+  return r;
+}
+
+/* Trim data. */
+static int
+scan_trim (nbdkit_next *next,
+           void *handle,
+           uint32_t count, uint64_t offset, uint32_t flags,
+           int *err)
+{
+  int r;
+
+  begin_request ();
+  r = next->trim (next, count, offset, flags, err);
+  end_request ();
+  return r;
+}
+
+static struct nbdkit_filter filter = {
+  .name              = "scan",
+  .longname          = "nbdkit scan filter",
+  .unload            = scan_unload,
+  .config            = scan_config,
+  .config_help       = scan_config_help,
+  .get_ready         = scan_get_ready,
+  .after_fork        = scan_after_fork,
+  .cleanup           = scan_cleanup,
+  .pread             = scan_pread,
+  .pwrite            = scan_pwrite,
+  .zero              = scan_zero,
+  .trim              = scan_trim,
+};
+
+NBDKIT_REGISTER_FILTER(filter)
@@ -66,6 +66,8 @@ extern "C" {
 #define NBDKIT_THREAD_MODEL_SERIALIZE_ALL_REQUESTS    1
 #define NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS        2
 #define NBDKIT_THREAD_MODEL_PARALLEL                  3
+/* Between SERIALIZE_REQUESTS and PARALLEL, but numbered last. */
+#define NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT      4
 
 #define NBDKIT_FLAG_MAY_TRIM  (1<<0) /* Maps to !NBD_CMD_FLAG_NO_HOLE */
 #define NBDKIT_FLAG_FUA       (1<<1) /* Maps to NBD_CMD_FLAG_FUA */
@@ -83,6 +85,9 @@ extern "C" {
 #define NBDKIT_EXTENT_HOLE    (1<<0) /* Same as NBD_STATE_HOLE */
 #define NBDKIT_EXTENT_ZERO    (1<<1) /* Same as NBD_STATE_ZERO */
 
+#define NBDKIT_METRIC_COUNTER 0
+#define NBDKIT_METRIC_GAUGE   1
+
 #ifndef WIN32
 #define NBDKIT_EXTERN_DECL(ret, fn, args) extern ret fn args
 #define NBDKIT_DLL_PUBLIC __attribute__((__visibility__("default")))
@@ -137,6 +142,9 @@ NBDKIT_EXTERN_DECL (int64_t, nbdkit_peer_pid, (void));
 NBDKIT_EXTERN_DECL (int64_t, nbdkit_peer_uid, (void));
 NBDKIT_EXTERN_DECL (int64_t, nbdkit_peer_gid, (void));
 NBDKIT_EXTERN_DECL (void, nbdkit_shutdown, (void));
+NBDKIT_EXTERN_DECL (int, nbdkit_add_metric,
+                    (const char *name, const char *help, int type,
+                     uint64_t (*get) (void)));
 
 NBDKIT_EXTERN_DECL (const char *, nbdkit_strdup_intern,
                     (const char *str));
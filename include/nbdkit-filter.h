@@ -84,6 +84,8 @@ struct nbdkit_next_ops {
   /* These callbacks are the same as normal plugin operations. */
   int64_t (*get_size) (nbdkit_next *nxdata);
   const char * (*export_description) (nbdkit_next *nxdata);
+  int (*block_size) (nbdkit_next *nxdata,
+                     uint32_t *minimum, uint32_t *preferred, uint32_t *maximum);
 
   int (*can_write) (nbdkit_next *nxdata);
   int (*can_flush) (nbdkit_next *nxdata);
@@ -111,6 +113,8 @@ struct nbdkit_next_ops {
                   uint32_t flags, struct nbdkit_extents *extents, int *err);
   int (*cache) (nbdkit_next *nxdata, uint32_t count, uint64_t offset,
                 uint32_t flags, int *err);
+  int (*pread_fd) (nbdkit_next *nxdata, uint32_t count, uint64_t offset,
+                   uint32_t flags, int *fd, uint64_t *fd_offset, int *err);
 
   /* Note: Actual instances of this struct contain additional opaque
    * data not listed in this header; you cannot manually copy or
@@ -219,6 +223,8 @@ struct nbdkit_filter {
   int64_t (*get_size) (nbdkit_next *next,
                        void *handle);
   const char * (*export_description) (nbdkit_next *next, void *handle);
+  int (*block_size) (nbdkit_next *next, void *handle,
+                     uint32_t *minimum, uint32_t *preferred, uint32_t *maximum);
 
   int (*can_write) (nbdkit_next *next,
                     void *handle);
@@ -259,6 +265,9 @@ struct nbdkit_filter {
   int (*cache) (nbdkit_next *next,
                 void *handle, uint32_t count, uint64_t offset, uint32_t flags,
                 int *err);
+  int (*pread_fd) (nbdkit_next *next,
+                   void *handle, uint32_t count, uint64_t offset,
+                   uint32_t flags, int *fd, uint64_t *fd_offset, int *err);
 };
 
 #define NBDKIT_REGISTER_FILTER(filter)                                  \
@@ -49,6 +49,8 @@ extern "C" {
 #error Unsupported API version
 #endif
 
+struct nbdkit_async;
+
 struct nbdkit_plugin {
   /* Do not set these fields directly; use NBDKIT_REGISTER_PLUGIN.
    * They exist so that we can support plugins compiled against
@@ -146,9 +148,34 @@ struct nbdkit_plugin {
   const char * (*export_description) (void *handle);
 
   void (*cleanup) (void);
+
+  int (*block_size) (void *handle,
+                     uint32_t *minimum, uint32_t *preferred, uint32_t *maximum);
+
+  int (*pread_fd) (void *handle, uint32_t count, uint64_t offset,
+                   uint32_t flags, int *fd, uint64_t *fd_offset);
+
+  int (*pread_async) (void *handle, void *buf, uint32_t count,
+                      uint64_t offset, uint32_t flags,
+                      struct nbdkit_async *async);
+  int (*pwrite_async) (void *handle, const void *buf, uint32_t count,
+                       uint64_t offset, uint32_t flags,
+                       struct nbdkit_async *async);
+  int (*flush_async) (void *handle, uint32_t flags,
+                      struct nbdkit_async *async);
+  int (*trim_async) (void *handle, uint32_t count, uint64_t offset,
+                     uint32_t flags, struct nbdkit_async *async);
+  int (*zero_async) (void *handle, uint32_t count, uint64_t offset,
+                     uint32_t flags, struct nbdkit_async *async);
+
+  int (*pread_sparse) (void *handle, void *buf, uint32_t count,
+                       uint64_t offset, uint32_t flags,
+                       struct nbdkit_extents *extents);
 };
 
 NBDKIT_EXTERN_DECL (void, nbdkit_set_error, (int err));
+NBDKIT_EXTERN_DECL (void, nbdkit_async_complete,
+                    (struct nbdkit_async *async, int err));
 NBDKIT_EXTERN_DECL (const char *, nbdkit_export_name, (void));
 NBDKIT_EXTERN_DECL (int, nbdkit_is_tls, (void));
 
@@ -310,6 +310,16 @@ data_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   return a->f->read (a, buf, count, offset);
 }
 
+/* Read data, leaving out the holes. */
+static int
+data_pread_sparse (void *handle, void *buf, uint32_t count,
+                   uint64_t offset, uint32_t flags,
+                   struct nbdkit_extents *extents)
+{
+  assert (!flags);
+  return a->f->read_sparse (a, buf, count, offset, extents);
+}
+
 /* Write data. */
 static int
 data_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
@@ -372,6 +382,7 @@ static struct nbdkit_plugin plugin = {
   .can_cache         = data_can_cache,
   .can_fast_zero     = data_can_fast_zero,
   .pread             = data_pread,
+  .pread_sparse      = data_pread_sparse,
   .pwrite            = data_pwrite,
   .zero              = data_zero,
   .trim              = data_trim,
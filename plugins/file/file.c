@@ -372,6 +372,7 @@ struct handle {
   bool can_zero_range;
   bool can_fallocate;
   bool can_zeroout;
+  bool may_have_holes;          /* If false, .pread_sparse skips lseek. */
 };
 
 /* Create the per-connection handle. */
@@ -485,6 +486,13 @@ file_open (int readonly)
   h->can_fallocate = true;
   h->can_zeroout = h->is_block_device;
 
+  /* A file with every block allocated has no holes, unless we punch
+   * some later.  Holes made by other processes are read as data.
+   */
+  h->may_have_holes =
+    !h->is_block_device &&
+    (uint64_t) statbuf.st_blocks * 512 < (uint64_t) statbuf.st_size;
+
   return h;
 }
 
@@ -642,6 +650,24 @@ file_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   return 0;
 }
 
+/* Return the file descriptor for a read, so the server can send the
+ * data without copying it through a buffer.  With cache=none we have
+ * to evict the pages after reading, so use file_pread instead.
+ */
+static int
+file_pread_fd (void *handle, uint32_t count, uint64_t offset,
+               uint32_t flags, int *fd, uint64_t *fd_offset)
+{
+  struct handle *h = handle;
+
+  if (cache_mode == cache_none)
+    return 0;
+
+  *fd = h->fd;
+  *fd_offset = offset;
+  return 1;
+}
+
 /* Write data to the file. */
 static int
 file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
@@ -702,6 +728,7 @@ file_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
     r = do_fallocate (h->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
                       offset, count);
     if (r == 0) {
+      h->may_have_holes = true;
       if (file_debug_zero)
         nbdkit_debug ("h->can_punch_hole && may_trim: "
                       "zero succeeded using fallocate");
@@ -814,7 +841,9 @@ file_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
   if (h->can_punch_hole) {
     r = do_fallocate (h->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
                       offset, count);
-    if (r == -1) {
+    if (r == 0)
+      h->may_have_holes = true;
+    else {
       /* Trim is advisory; we don't care if it fails for anything other
        * than EIO or EPERM. */
       if (errno == EPERM || errno == EIO) {
@@ -925,6 +954,61 @@ file_extents (void *handle, uint32_t count, uint64_t offset,
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lseek_lock);
   return do_extents (handle, count, offset, flags, extents);
 }
+
+/* Read data from the file, but only the ranges which SEEK_DATA finds.
+ * Holes are left out of the buffer and reported as zero extents.
+ */
+static int
+file_pread_sparse (void *handle, void *buf, uint32_t count, uint64_t offset,
+                   uint32_t flags, struct nbdkit_extents *extents)
+{
+  struct handle *h = handle;
+  const uint64_t start = offset, end = offset + count;
+  off_t data, hole;
+
+  /* Avoid the lock and the lseek calls if there are no holes. */
+  if (!h->may_have_holes) {
+    if (file_pread (handle, buf, count, offset, 0) == -1)
+      return -1;
+    return nbdkit_add_extent (extents, offset, count, 0 /* allocated data */);
+  }
+
+  while (offset < end) {
+    hole = end;
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lseek_lock);
+      data = lseek (h->fd, offset, SEEK_DATA);
+      if (data == -1)
+        /* ENXIO means offset is in the final hole of the file.  If
+         * there is some other error, read the rest as data.
+         */
+        data = errno == ENXIO ? end : offset;
+      else if (data > end)
+        data = end;
+      if (data < end) {
+        hole = lseek (h->fd, data, SEEK_HOLE);
+        if (hole == -1 || hole > end)
+          hole = end;
+      }
+    }
+
+    if (data > offset &&
+        nbdkit_add_extent (extents, offset, data - offset,
+                           NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO) == -1)
+      return -1;
+    if (hole > data) {
+      if (file_pread (handle, (char *) buf + (data - start), hole - data,
+                      data, 0) == -1)
+        return -1;
+      if (nbdkit_add_extent (extents, data, hole - data,
+                             0 /* allocated data */) == -1)
+        return -1;
+    }
+    offset = hole;
+  }
+
+  return 0;
+}
 #endif /* SEEK_HOLE */
 
 #if HAVE_POSIX_FADVISE
@@ -966,6 +1050,7 @@ static struct nbdkit_plugin plugin = {
   .can_fua           = file_can_fua,
   .can_cache         = file_can_cache,
   .pread             = file_pread,
+  .pread_fd          = file_pread_fd,
   .pwrite            = file_pwrite,
   .flush             = file_flush,
   .trim              = file_trim,
@@ -973,6 +1058,7 @@ static struct nbdkit_plugin plugin = {
 #ifdef SEEK_HOLE
   .can_extents       = file_can_extents,
   .extents           = file_extents,
+  .pread_sparse      = file_pread_sparse,
 #endif
 #if HAVE_POSIX_FADVISE
   .cache             = file_cache,
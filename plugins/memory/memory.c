@@ -179,6 +179,16 @@ memory_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   return a->f->read (a, buf, count, offset);
 }
 
+/* Read data, leaving out the holes. */
+static int
+memory_pread_sparse (void *handle, void *buf, uint32_t count,
+                     uint64_t offset, uint32_t flags,
+                     struct nbdkit_extents *extents)
+{
+  assert (!flags);
+  return a->f->read_sparse (a, buf, count, offset, extents);
+}
+
 /* Write data. */
 static int
 memory_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
@@ -242,6 +252,7 @@ static struct nbdkit_plugin plugin = {
   .can_cache         = memory_can_cache,
   .can_fast_zero     = memory_can_fast_zero,
   .pread             = memory_pread,
+  .pread_sparse      = memory_pread_sparse,
   .pwrite            = memory_pwrite,
   .zero              = memory_zero,
   .trim              = memory_trim,
@@ -523,6 +523,38 @@ nbdplug_register (struct handle *h, struct transaction *trans, int64_t cookie)
     nbdkit_debug ("failed to kick reader thread: %m");
 }
 
+/* Callback used at end of an asynchronous request. */
+static int
+nbdplug_async_notify (void *opaque, int *error)
+{
+  struct nbdkit_async *async = opaque;
+
+  nbdkit_async_complete (async, *error);
+  return 1;
+}
+
+/* Register the cookie of an asynchronous request and kick the I/O
+ * thread.  The reply is passed to nbdkit from the reader thread by
+ * nbdplug_async_notify, so the nbdkit thread does not wait for it.
+ */
+static int
+nbdplug_register_async (struct handle *h, int64_t cookie)
+{
+  char c = 0;
+
+  if (cookie == -1) {
+    nbdkit_error ("command failed: %s", nbd_get_error ());
+    nbdkit_set_error (nbd_get_errno ());
+    return -1;
+  }
+
+  nbdkit_debug ("cookie %" PRId64 " started by state machine", cookie);
+
+  if (write (h->fds[1], &c, 1) == -1 && errno != EAGAIN)
+    nbdkit_debug ("failed to kick reader thread: %m");
+  return 0;
+}
+
 /* Perform the reply half of a transaction. */
 static int
 nbdplug_reply (struct handle *h, struct transaction *trans)
@@ -1005,12 +1037,10 @@ nbdplug_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
   return nbdplug_reply (h, &s);
 }
 
-/* Write zeroes to the file. */
-static int
-nbdplug_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+/* Translate the flags of a zero request. */
+static uint32_t
+nbdplug_zero_flags (uint32_t flags)
 {
-  struct handle *h = handle;
-  struct transaction s;
   uint32_t f = 0;
 
   assert (!(flags & ~(NBDKIT_FLAG_FUA | NBDKIT_FLAG_MAY_TRIM |
@@ -1026,6 +1056,17 @@ nbdplug_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 #else
   assert (!(flags & NBDKIT_FLAG_FAST_ZERO));
 #endif
+  return f;
+}
+
+/* Write zeroes to the file. */
+static int
+nbdplug_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
+{
+  struct handle *h = handle;
+  struct transaction s;
+  uint32_t f = nbdplug_zero_flags (flags);
+
   nbdplug_prepare (&s);
   nbdplug_register (h, &s, nbd_aio_zero (h->nbd, count, offset, s.cb, f));
   return nbdplug_reply (h, &s);
@@ -1058,6 +1099,72 @@ nbdplug_flush (void *handle, uint32_t flags)
   return nbdplug_reply (h, &s);
 }
 
+/* Asynchronous versions of the functions above.  The request is
+ * started and the reply is delivered by nbdplug_async_notify.
+ */
+static int
+nbdplug_pread_async (void *handle, void *buf, uint32_t count,
+                     uint64_t offset, uint32_t flags,
+                     struct nbdkit_async *async)
+{
+  struct handle *h = handle;
+  nbd_completion_callback cb = { nbdplug_async_notify, async };
+
+  assert (!flags);
+  return nbdplug_register_async (h, nbd_aio_pread (h->nbd, buf, count,
+                                                   offset, cb, 0));
+}
+
+static int
+nbdplug_pwrite_async (void *handle, const void *buf, uint32_t count,
+                      uint64_t offset, uint32_t flags,
+                      struct nbdkit_async *async)
+{
+  struct handle *h = handle;
+  nbd_completion_callback cb = { nbdplug_async_notify, async };
+  uint32_t f = flags & NBDKIT_FLAG_FUA ? LIBNBD_CMD_FLAG_FUA : 0;
+
+  assert (!(flags & ~NBDKIT_FLAG_FUA));
+  return nbdplug_register_async (h, nbd_aio_pwrite (h->nbd, buf, count,
+                                                    offset, cb, f));
+}
+
+static int
+nbdplug_zero_async (void *handle, uint32_t count, uint64_t offset,
+                    uint32_t flags, struct nbdkit_async *async)
+{
+  struct handle *h = handle;
+  nbd_completion_callback cb = { nbdplug_async_notify, async };
+  uint32_t f = nbdplug_zero_flags (flags);
+
+  return nbdplug_register_async (h, nbd_aio_zero (h->nbd, count, offset,
+                                                  cb, f));
+}
+
+static int
+nbdplug_trim_async (void *handle, uint32_t count, uint64_t offset,
+                    uint32_t flags, struct nbdkit_async *async)
+{
+  struct handle *h = handle;
+  nbd_completion_callback cb = { nbdplug_async_notify, async };
+  uint32_t f = flags & NBDKIT_FLAG_FUA ? LIBNBD_CMD_FLAG_FUA : 0;
+
+  assert (!(flags & ~NBDKIT_FLAG_FUA));
+  return nbdplug_register_async (h, nbd_aio_trim (h->nbd, count, offset,
+                                                  cb, f));
+}
+
+static int
+nbdplug_flush_async (void *handle, uint32_t flags,
+                     struct nbdkit_async *async)
+{
+  struct handle *h = handle;
+  nbd_completion_callback cb = { nbdplug_async_notify, async };
+
+  assert (!flags);
+  return nbdplug_register_async (h, nbd_aio_flush (h->nbd, cb, 0));
+}
+
 static int
 nbdplug_extent (void *opaque, const char *metacontext, uint64_t offset,
                 uint32_t *entries, size_t nr_entries, int *error)
@@ -1144,6 +1251,11 @@ static struct nbdkit_plugin plugin = {
   .extents            = nbdplug_extents,
   .cache              = nbdplug_cache,
   .errno_is_preserved = 1,
+  .pread_async        = nbdplug_pread_async,
+  .pwrite_async       = nbdplug_pwrite_async,
+  .zero_async         = nbdplug_zero_async,
+  .flush_async        = nbdplug_flush_async,
+  .trim_async         = nbdplug_trim_async,
 };
 
 NBDKIT_REGISTER_PLUGIN (plugin)
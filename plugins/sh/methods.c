@@ -108,6 +108,9 @@ sh_thread_model (void)
       s[slen-1] = '\0';
     if (ascii_strcasecmp (s, "parallel") == 0)
       r = NBDKIT_THREAD_MODEL_PARALLEL;
+    else if (ascii_strcasecmp (s, "serialize_retirement") == 0 ||
+             ascii_strcasecmp (s, "serialize-retirement") == 0)
+      r = NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT;
     else if (ascii_strcasecmp (s, "serialize_requests") == 0 ||
              ascii_strcasecmp (s, "serialize-requests") == 0)
       r = NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS;
@@ -526,6 +529,62 @@ sh_get_size (void *handle)
   }
 }
 
+int
+sh_block_size (void *handle,
+               uint32_t *minimum, uint32_t *preferred, uint32_t *maximum)
+{
+  const char *method = "block_size";
+  const char *script = get_script (method);
+  struct sh_handle *h = handle;
+  const char *args[] = { script, method, h->h, NULL };
+  CLEANUP_FREE char *s = NULL;
+  size_t slen;
+  const char *delim = " \t\n";
+  char *sp, *p;
+  uint32_t *sizes[3] = { minimum, preferred, maximum };
+  int64_t r;
+  size_t i;
+
+  switch (call_read (&s, &slen, args)) {
+  case OK:
+    /* Three sizes, separated by whitespace. */
+    p = strtok_r (s, delim, &sp);
+    for (i = 0; i < 3; ++i) {
+      if (p == NULL) {
+        nbdkit_error ("%s: %s method should print minimum, preferred "
+                      "and maximum block sizes", script, method);
+        return -1;
+      }
+      r = nbdkit_parse_size (p);
+      if (r == -1)
+        return -1;
+      if (r > UINT32_MAX) {
+        nbdkit_error ("%s: %s method: block size too large: %s",
+                      script, method, p);
+        return -1;
+      }
+      *sizes[i] = r;
+      p = strtok_r (NULL, delim, &sp);
+    }
+    return 0;
+
+  case MISSING:
+    *minimum = *preferred = *maximum = 0;
+    return 0;
+
+  case ERROR:
+    return -1;
+
+  case RET_FALSE:
+    nbdkit_error ("%s: %s method returned unexpected code (3/false)",
+                  script, method);
+    errno = EIO;
+    return -1;
+
+  default: abort ();
+  }
+}
+
 int
 sh_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
           uint32_t flags)
@@ -283,6 +283,25 @@ split_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
   return 0;
 }
 
+/* Return the file descriptor for a read, if it lies within a single
+ * file.  Reads which span files use split_pread.
+ */
+static int
+split_pread_fd (void *handle, uint32_t count, uint64_t offset,
+                uint32_t flags, int *fd, uint64_t *fd_offset)
+{
+  struct handle *h = handle;
+  struct file *file = get_file (h, offset);
+  uint64_t foffs = offset - file->offset;
+
+  if (foffs + count > file->size)
+    return 0;
+
+  *fd = file->fd;
+  *fd_offset = foffs;
+  return 1;
+}
+
 /* Write data to the file. */
 static int
 split_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
@@ -454,6 +473,7 @@ static struct nbdkit_plugin plugin = {
   .get_size          = split_get_size,
   .can_cache         = split_can_cache,
   .pread             = split_pread,
+  .pread_fd          = split_pread_fd,
   .pwrite            = split_pwrite,
 #if HAVE_POSIX_FADVISE
   .cache             = split_cache,
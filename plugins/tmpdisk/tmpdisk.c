@@ -405,6 +405,20 @@ tmpdisk_pread (void *handle, void *buf,
   return 0;
 }
 
+/* Return the file descriptor for a read, so the server can send the
+ * data without copying it through a buffer.
+ */
+static int
+tmpdisk_pread_fd (void *handle, uint32_t count, uint64_t offset,
+                  uint32_t flags, int *fd, uint64_t *fd_offset)
+{
+  struct handle *h = handle;
+
+  *fd = h->fd;
+  *fd_offset = offset;
+  return 1;
+}
+
 /* Write data to the file. */
 static int
 tmpdisk_pwrite (void *handle, const void *buf,
@@ -513,6 +527,7 @@ static struct nbdkit_plugin plugin = {
   .open              = tmpdisk_open,
   .close             = tmpdisk_close,
   .pread             = tmpdisk_pread,
+  .pread_fd          = tmpdisk_pread_fd,
   .pwrite            = tmpdisk_pwrite,
   .flush             = tmpdisk_flush,
   .trim              = tmpdisk_trim,
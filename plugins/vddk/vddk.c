@@ -874,6 +874,34 @@ vddk_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   return send_command_and_wait (h, &read_cmd);
 }
 
+/* Start a read and return without waiting for it.  VDDK will call
+ * complete_command (in worker.c) when it is done.
+ */
+static int
+vddk_pread_async (void *handle, void *buf, uint32_t count, uint64_t offset,
+                  uint32_t flags, struct nbdkit_async *async)
+{
+  struct vddk_handle *h = handle;
+  struct command *read_cmd;
+
+  read_cmd = calloc (1, sizeof *read_cmd);
+  if (read_cmd == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  read_cmd->type = READ;
+  read_cmd->ptr = buf;
+  read_cmd->count = count;
+  read_cmd->offset = offset;
+  read_cmd->async = async;
+
+  if (send_command_async (h, read_cmd) == -1) {
+    free (read_cmd);
+    return -1;
+  }
+  return 0;
+}
+
 static int vddk_flush (void *handle, uint32_t flags);
 
 /* Write data to the file.
@@ -904,6 +932,44 @@ vddk_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
   return 0;
 }
 
+/* Start a write and return without waiting for it.
+ *
+ * FUA writes are done synchronously because the flush must not begin
+ * until the write has finished.
+ */
+static int
+vddk_pwrite_async (void *handle, const void *buf, uint32_t count,
+                   uint64_t offset, uint32_t flags,
+                   struct nbdkit_async *async)
+{
+  struct vddk_handle *h = handle;
+  struct command *write_cmd;
+
+  if (flags & NBDKIT_FLAG_FUA) {
+    if (vddk_pwrite (handle, buf, count, offset, flags) == -1)
+      return -1;
+    nbdkit_async_complete (async, 0);
+    return 0;
+  }
+
+  write_cmd = calloc (1, sizeof *write_cmd);
+  if (write_cmd == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  write_cmd->type = WRITE;
+  write_cmd->ptr = (void *) buf;
+  write_cmd->count = count;
+  write_cmd->offset = offset;
+  write_cmd->async = async;
+
+  if (send_command_async (h, write_cmd) == -1) {
+    free (write_cmd);
+    return -1;
+  }
+  return 0;
+}
+
 /* Flush data to the file. */
 static int
 vddk_flush (void *handle, uint32_t flags)
@@ -914,6 +980,28 @@ vddk_flush (void *handle, uint32_t flags)
   return send_command_and_wait (h, &flush_cmd);
 }
 
+/* Queue a flush.  The worker waits for outstanding writes first. */
+static int
+vddk_flush_async (void *handle, uint32_t flags, struct nbdkit_async *async)
+{
+  struct vddk_handle *h = handle;
+  struct command *flush_cmd;
+
+  flush_cmd = calloc (1, sizeof *flush_cmd);
+  if (flush_cmd == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  flush_cmd->type = FLUSH;
+  flush_cmd->async = async;
+
+  if (send_command_async (h, flush_cmd) == -1) {
+    free (flush_cmd);
+    return -1;
+  }
+  return 0;
+}
+
 static int
 vddk_can_extents (void *handle)
 {
@@ -966,6 +1054,9 @@ static struct nbdkit_plugin plugin = {
   .flush             = vddk_flush,
   .can_extents       = vddk_can_extents,
   .extents           = vddk_extents,
+  .pread_async       = vddk_pread_async,
+  .pwrite_async      = vddk_pwrite_async,
+  .flush_async       = vddk_flush_async,
 };
 
 NBDKIT_REGISTER_PLUGIN(plugin)
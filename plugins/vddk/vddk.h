@@ -136,6 +136,7 @@ struct command {
   uint32_t count;               /* READ, WRITE, EXTENTS */
   uint64_t offset;              /* READ, WRITE, EXTENTS */
   bool req_one;                 /* EXTENTS NBDKIT_FLAG_REQ_ONE */
+  struct nbdkit_async *async;   /* send_command_async completion */
 
   /* This field is set to a unique value by send_command_and_wait. */
   uint64_t id;                  /* serial number */
@@ -194,6 +195,7 @@ extern void trim (char *str);
 /* worker.c */
 extern const char *command_type_string (enum command_type type);
 extern int send_command_and_wait (struct vddk_handle *h, struct command *cmd);
+extern int send_command_async (struct vddk_handle *h, struct command *cmd);
 extern void *vddk_worker_thread (void *handle);
 
 #endif /* NBDKIT_VDDK_H */
@@ -35,7 +35,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <assert.h>
 
 #include <pthread.h>
 
@@ -64,6 +67,29 @@ command_type_string (enum command_type type)
   }
 }
 
+/* Add the command to the command queue. */
+static int
+queue_command (struct vddk_handle *h, struct command *cmd)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->commands_lock);
+  cmd->id = h->id++;
+
+  if (command_queue_append (&h->commands, cmd) == -1)
+    /* On error command_queue_append will call nbdkit_error. */
+    return -1;
+
+  /* Signal the caller if it could be sleeping on an empty queue. */
+  if (h->commands.len == 1)
+    pthread_cond_signal (&h->commands_cond);
+
+  /* This will be used to signal command completion back to us. */
+  if (!cmd->async) {
+    pthread_mutex_init (&cmd->mutex, NULL);
+    pthread_cond_init (&cmd->cond, NULL);
+  }
+  return 0;
+}
+
 /* Send command to the background thread and wait for completion.
  *
  * Returns 0 for OK
@@ -72,23 +98,8 @@ command_type_string (enum command_type type)
 int
 send_command_and_wait (struct vddk_handle *h, struct command *cmd)
 {
-  /* Add the command to the command queue. */
-  {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&h->commands_lock);
-    cmd->id = h->id++;
-
-    if (command_queue_append (&h->commands, cmd) == -1)
-      /* On error command_queue_append will call nbdkit_error. */
-      return -1;
-
-    /* Signal the caller if it could be sleeping on an empty queue. */
-    if (h->commands.len == 1)
-      pthread_cond_signal (&h->commands_cond);
-
-    /* This will be used to signal command completion back to us. */
-    pthread_mutex_init (&cmd->mutex, NULL);
-    pthread_cond_init (&cmd->cond, NULL);
-  }
+  if (queue_command (h, cmd) == -1)
+    return -1;
 
   /* Wait for the command to be completed by the background thread. */
   {
@@ -108,6 +119,37 @@ send_command_and_wait (struct vddk_handle *h, struct command *cmd)
   }
 }
 
+/* Send command to the background thread without waiting.  The
+ * command must be allocated with malloc and have cmd->async set.  When
+ * the command has finished, nbdkit_async_complete is called and the
+ * command is freed.
+ *
+ * Returns 0 for OK
+ * On error, calls nbdkit_error and returns -1 (the command is not
+ * freed).
+ */
+int
+send_command_async (struct vddk_handle *h, struct command *cmd)
+{
+  assert (cmd->async);
+  return queue_command (h, cmd);
+}
+
+/* Set the final status of the command and notify the caller. */
+static void
+retire_command (struct command *cmd, bool ok)
+{
+  if (cmd->async) {
+    nbdkit_async_complete (cmd->async, ok ? 0 : EIO);
+    free (cmd);
+    return;
+  }
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cmd->mutex);
+  cmd->status = ok ? SUCCEEDED : FAILED;
+  pthread_cond_signal (&cmd->cond);
+}
+
 /* Asynchronous commands are completed when this function is called. */
 static void
 complete_command (void *vp, VixError result)
@@ -117,17 +159,11 @@ complete_command (void *vp, VixError result)
   if (vddk_debug_datapath)
     nbdkit_debug ("command %" PRIu64 " completed", cmd->id);
 
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cmd->mutex);
-
-  if (result == VIX_OK) {
-    cmd->status = SUCCEEDED;
-  } else {
+  if (result != VIX_OK)
     VDDK_ERROR (result, "command %" PRIu64 ": asynchronous %s failed",
                 cmd->id, command_type_string (cmd->type));
-    cmd->status = FAILED;
-  }
 
-  pthread_cond_signal (&cmd->cond);
+  retire_command (cmd, result == VIX_OK);
 }
 
 /* Wait for any asynchronous commands to complete. */
@@ -549,17 +585,12 @@ vddk_worker_thread (void *handle)
     default: abort (); /* impossible, but keeps GCC happy */
     } /* switch */
 
-    if (!async) {
-      /* Update the command status. */
-      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cmd->mutex);
-      cmd->status = r >= 0 ? SUCCEEDED : FAILED;
-
-      /* For synchronous commands signal the caller thread that the
-       * command has completed.  (Asynchronous commands are completed in
-       * the callback handler).
-       */
-      pthread_cond_signal (&cmd->cond);
-    }
+    /* For synchronous commands signal the caller thread that the
+     * command has completed.  (Asynchronous commands are completed in
+     * the callback handler).
+     */
+    if (!async)
+      retire_command (cmd, r >= 0);
   } /* while (!stop) */
 
   /* Exit the worker thread. */
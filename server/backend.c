@@ -213,6 +213,7 @@ static struct nbdkit_next_ops next_ops = {
   .prepare = backend_prepare,
   .finalize = backend_finalize,
   .export_description = backend_export_description,
+  .block_size = backend_block_size,
   .get_size = backend_get_size,
   .can_write = backend_can_write,
   .can_flush = backend_can_flush,
@@ -231,6 +232,7 @@ static struct nbdkit_next_ops next_ops = {
   .zero = backend_zero,
   .extents = backend_extents,
   .cache = backend_cache,
+  .pread_fd = backend_pread_fd,
 };
 
 struct context *
@@ -263,8 +265,10 @@ backend_open (struct backend *b, int readonly, const char *exportname,
   c->b = b;
   c->c_next = NULL;
   c->conn = shared ? NULL : conn;
+  c->metrics = NULL;
   c->state = 0;
   c->exportsize = -1;
+  c->minimum_block_size = -1;
   c->can_write = readonly ? 0 : -1;
   c->can_flush = -1;
   c->is_rotational = -1;
@@ -285,6 +289,7 @@ backend_open (struct backend *b, int readonly, const char *exportname,
       return NULL;
     }
   }
+  c->metrics = metrics_get (b, exportname);
 
   /* Most filters will call next_open first, resulting in
    * inner-to-outer ordering.
@@ -373,11 +378,11 @@ backend_close (struct context *c)
 }
 
 bool
-backend_valid_range (struct context *c, uint64_t offset, uint32_t count)
+backend_valid_range (struct context *c, uint64_t offset, uint64_t count)
 {
   assert (c->exportsize <= INT64_MAX); /* Guaranteed by negotiation phase */
   return count > 0 && offset <= c->exportsize &&
-    offset + count <= c->exportsize;
+    count <= c->exportsize - offset;
 }
 
 /* Wrappers for all callbacks in a filter's struct nbdkit_next_ops. */
@@ -418,6 +423,32 @@ backend_get_size (struct context *c)
   return c->exportsize;
 }
 
+int
+backend_block_size (struct context *c,
+                    uint32_t *minimum, uint32_t *preferred, uint32_t *maximum)
+{
+  PUSH_CONTEXT_FOR_SCOPE (c);
+  struct backend *b = c->b;
+  int r;
+
+  assert (c->handle && (c->state & HANDLE_CONNECTED));
+  if (c->minimum_block_size == -1) {
+    controlpath_debug ("%s: block_size", b->name);
+    r = b->block_size (c, minimum, preferred, maximum);
+    if (r == -1)
+      return -1;
+    c->minimum_block_size = *minimum;
+    c->preferred_block_size = *preferred;
+    c->maximum_block_size = *maximum;
+  }
+  else {
+    *minimum = c->minimum_block_size;
+    *preferred = c->preferred_block_size;
+    *maximum = c->maximum_block_size;
+  }
+  return 0;
+}
+
 int
 backend_can_write (struct context *c)
 {
@@ -589,6 +620,7 @@ backend_pread (struct context *c,
 {
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
+  uint64_t start;
   int r;
 
   assert (c->handle && (c->state & HANDLE_CONNECTED));
@@ -597,7 +629,9 @@ backend_pread (struct context *c,
   datapath_debug ("%s: pread count=%" PRIu32 " offset=%" PRIu64,
                   b->name, count, offset);
 
+  start = metrics_start (c->metrics);
   r = b->pread (c, buf, count, offset, flags, err);
+  metrics_record (c->metrics, METRICS_PREAD, start, count, r == -1);
   if (r == -1)
     assert (*err);
   return r;
@@ -611,6 +645,7 @@ backend_pwrite (struct context *c,
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
   bool fua = !!(flags & NBDKIT_FLAG_FUA);
+  uint64_t start;
   int r;
 
   assert (c->handle && (c->state & HANDLE_CONNECTED));
@@ -622,7 +657,9 @@ backend_pwrite (struct context *c,
   datapath_debug ("%s: pwrite count=%" PRIu32 " offset=%" PRIu64 " fua=%d",
                   b->name, count, offset, fua);
 
+  start = metrics_start (c->metrics);
   r = b->pwrite (c, buf, count, offset, flags, err);
+  metrics_record (c->metrics, METRICS_PWRITE, start, count, r == -1);
   if (r == -1)
     assert (*err);
   return r;
@@ -634,6 +671,7 @@ backend_flush (struct context *c,
 {
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
+  uint64_t start;
   int r;
 
   assert (c->handle && (c->state & HANDLE_CONNECTED));
@@ -641,7 +679,9 @@ backend_flush (struct context *c,
   assert (flags == 0);
   datapath_debug ("%s: flush", b->name);
 
+  start = metrics_start (c->metrics);
   r = b->flush (c, flags, err);
+  metrics_record (c->metrics, METRICS_FLUSH, start, 0, r == -1);
   if (r == -1)
     assert (*err);
   return r;
@@ -655,6 +695,7 @@ backend_trim (struct context *c,
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
   bool fua = !!(flags & NBDKIT_FLAG_FUA);
+  uint64_t start;
   int r;
 
   assert (c->handle && (c->state & HANDLE_CONNECTED));
@@ -667,7 +708,9 @@ backend_trim (struct context *c,
   datapath_debug ("%s: trim count=%" PRIu32 " offset=%" PRIu64 " fua=%d",
                   b->name, count, offset, fua);
 
+  start = metrics_start (c->metrics);
   r = b->trim (c, count, offset, flags, err);
+  metrics_record (c->metrics, METRICS_TRIM, start, count, r == -1);
   if (r == -1)
     assert (*err);
   return r;
@@ -682,6 +725,7 @@ backend_zero (struct context *c,
   struct backend *b = c->b;
   bool fua = !!(flags & NBDKIT_FLAG_FUA);
   bool fast = !!(flags & NBDKIT_FLAG_FAST_ZERO);
+  uint64_t start;
   int r;
 
   assert (c->handle && (c->state & HANDLE_CONNECTED));
@@ -699,7 +743,9 @@ backend_zero (struct context *c,
                   b->name, count, offset,
                   !!(flags & NBDKIT_FLAG_MAY_TRIM), fua, fast);
 
+  start = metrics_start (c->metrics);
   r = b->zero (c, count, offset, flags, err);
+  metrics_record (c->metrics, METRICS_ZERO, start, count, r == -1);
   if (r == -1) {
     assert (*err);
     if (!fast)
@@ -715,6 +761,7 @@ backend_extents (struct context *c,
 {
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
+  uint64_t start;
   int r;
 
   assert (c->handle && (c->state & HANDLE_CONNECTED));
@@ -733,7 +780,9 @@ backend_extents (struct context *c,
       *err = errno;
     return r;
   }
+  start = metrics_start (c->metrics);
   r = b->extents (c, count, offset, flags, extents, err);
+  metrics_record (c->metrics, METRICS_EXTENTS, start, count, r == -1);
   if (r == -1)
     assert (*err);
   return r;
@@ -746,6 +795,7 @@ backend_cache (struct context *c,
 {
   PUSH_CONTEXT_FOR_SCOPE (c);
   struct backend *b = c->b;
+  uint64_t start;
   int r;
 
   assert (c->handle && (c->state & HANDLE_CONNECTED));
@@ -767,7 +817,127 @@ backend_cache (struct context *c,
     }
     return 0;
   }
+  start = metrics_start (c->metrics);
   r = b->cache (c, count, offset, flags, err);
+  metrics_record (c->metrics, METRICS_CACHE, start, count, r == -1);
+  if (r == -1)
+    assert (*err);
+  return r;
+}
+
+int
+backend_pread_fd (struct context *c,
+                  uint32_t count, uint64_t offset, uint32_t flags,
+                  int *fd, uint64_t *fd_offset, int *err)
+{
+  PUSH_CONTEXT_FOR_SCOPE (c);
+  struct backend *b = c->b;
+  uint64_t start;
+  int r;
+
+  assert (c->handle && (c->state & HANDLE_CONNECTED));
+  assert (backend_valid_range (c, offset, count));
+  assert (flags == 0);
+  datapath_debug ("%s: pread_fd count=%" PRIu32 " offset=%" PRIu64,
+                  b->name, count, offset);
+
+  start = metrics_start (c->metrics);
+  r = b->pread_fd (c, count, offset, flags, fd, fd_offset, err);
+  if (r != 0)             /* 0 means the caller falls back to pread */
+    metrics_record (c->metrics, METRICS_PREAD, start, count, r == -1);
+  if (r == -1)
+    assert (*err);
+  else if (r == 1)
+    assert (*fd >= 0);
+  return r;
+}
+
+int
+backend_pread_sparse (struct context *c,
+                      void *buf, uint32_t count, uint64_t offset,
+                      uint32_t flags, struct nbdkit_extents *extents,
+                      int *err)
+{
+  PUSH_CONTEXT_FOR_SCOPE (c);
+  struct backend *b = c->b;
+  uint64_t start;
+  int r;
+
+  assert (c->handle && (c->state & HANDLE_CONNECTED));
+  assert (backend_valid_range (c, offset, count));
+  assert (flags == 0);
+  datapath_debug ("%s: pread_sparse count=%" PRIu32 " offset=%" PRIu64,
+                  b->name, count, offset);
+
+  start = metrics_start (c->metrics);
+  r = b->pread_sparse (c, buf, count, offset, flags, extents, err);
+  if (r != 0)             /* 0 means the caller falls back to pread */
+    metrics_record (c->metrics, METRICS_PREAD, start, count, r == -1);
+  if (r == -1)
+    assert (*err);
+  return r;
+}
+
+/* Start a data request in the plugin's asynchronous callbacks.
+ * Returns 1 if the plugin will call nbdkit_async_complete, 0 if the
+ * request cannot be done asynchronously (the caller should use the
+ * normal function instead), or -1 on error.
+ */
+int
+backend_async (struct context *c, struct nbdkit_async *async, int *err)
+{
+  PUSH_CONTEXT_FOR_SCOPE (c);
+  struct backend *b = c->b;
+  bool fua = !!(async->flags & NBDKIT_FLAG_FUA);
+  int r;
+
+  assert (c->handle && (c->state & HANDLE_CONNECTED));
+  switch (async->cmd) {
+  case NBD_CMD_READ:
+    assert (backend_valid_range (c, async->offset, async->count));
+    assert (async->flags == 0);
+    datapath_debug ("%s: pread_async count=%" PRIu32 " offset=%" PRIu64,
+                    b->name, async->count, async->offset);
+    break;
+  case NBD_CMD_WRITE:
+    assert (c->can_write == 1);
+    assert (backend_valid_range (c, async->offset, async->count));
+    assert (!(async->flags & ~NBDKIT_FLAG_FUA));
+    datapath_debug ("%s: pwrite_async count=%" PRIu32 " offset=%" PRIu64
+                    " fua=%d", b->name, async->count, async->offset, fua);
+    break;
+  case NBD_CMD_FLUSH:
+    assert (c->can_flush == 1);
+    assert (async->flags == 0);
+    datapath_debug ("%s: flush_async", b->name);
+    break;
+  case NBD_CMD_TRIM:
+    assert (c->can_write == 1);
+    assert (c->can_trim == 1);
+    assert (backend_valid_range (c, async->offset, async->count));
+    assert (!(async->flags & ~NBDKIT_FLAG_FUA));
+    datapath_debug ("%s: trim_async count=%" PRIu32 " offset=%" PRIu64
+                    " fua=%d", b->name, async->count, async->offset, fua);
+    break;
+  case NBD_CMD_WRITE_ZEROES:
+    assert (c->can_write == 1);
+    assert (c->can_zero > NBDKIT_ZERO_NONE);
+    assert (backend_valid_range (c, async->offset, async->count));
+    assert (!(async->flags & ~(NBDKIT_FLAG_MAY_TRIM | NBDKIT_FLAG_FUA |
+                               NBDKIT_FLAG_FAST_ZERO)));
+    datapath_debug ("%s: zero_async count=%" PRIu32 " offset=%" PRIu64
+                    " may_trim=%d fua=%d fast=%d",
+                    b->name, async->count, async->offset,
+                    !!(async->flags & NBDKIT_FLAG_MAY_TRIM), fua,
+                    !!(async->flags & NBDKIT_FLAG_FAST_ZERO));
+    break;
+  default:
+    abort ();
+  }
+  if (fua)
+    assert (c->can_fua > NBDKIT_FUA_NONE);
+
+  r = b->async (c, async, err);
   if (r == -1)
     assert (*err);
   return r;
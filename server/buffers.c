@@ -0,0 +1,284 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* A pool of buffers for request data, shared by all connections.
+ *
+ * Buffers are lent out for the duration of a single request (see
+ * protocol.c) and then returned.  They come in size classes which are
+ * powers of 2 from MIN_BUFFER_SIZE up to MAX_REQUEST_SIZE, and every
+ * buffer is aligned to at least MIN_BUFFER_SIZE, so plugins can use
+ * them for O_DIRECT.  Buffers of HUGE_PAGE_SIZE or more may be backed
+ * by huge pages (--buffer-hugepages).
+ *
+ * Returned buffers are kept for reuse, as long as the total size of
+ * all buffers (lent out or not) is within the budget set by
+ * --buffer-memory.  If a request needs a new buffer and the budget is
+ * exceeded, idle buffers of other sizes are freed first.  We never
+ * make a request wait for memory, since the requests holding buffers
+ * might be waiting for this thread.  Instead buffers above the budget
+ * are freed as soon as they are returned.
+ *
+ * New buffers start out as zeroes but after use may contain data from
+ * previous requests.  This is fine because: (a) Correctly written
+ * plugins should overwrite the whole buffer on each request so no
+ * leak should occur.  (b) The aim is to avoid leaking random heap
+ * data from the core server; previous request data from the plugin is
+ * not considered sensitive.  For the same reason we clear the pointers
+ * we store in idle buffers before lending them out again.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "internal.h"
+
+#define MIN_BUFFER_SHIFT 12
+#define MIN_BUFFER_SIZE (UINT64_C (1) << MIN_BUFFER_SHIFT)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define NR_CLASSES 15           /* 4K .. MAX_REQUEST_SIZE */
+
+/* Idle buffers are linked through their first bytes. */
+struct idle_buffer {
+  struct idle_buffer *next;
+  size_t size;                  /* Only used by trim_idle. */
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The fields below are protected by the lock. */
+static struct idle_buffer *idle[NR_CLASSES];
+static uint64_t allocated;      /* Bytes in all buffers, lent or idle. */
+static uint64_t peak;           /* Highest value of allocated. */
+static uint64_t nr_allocs;      /* Number of buffers allocated. */
+static uint64_t nr_reuses;      /* Number of times a buffer was reused. */
+
+/* Size class of a buffer which can hold size bytes. */
+static unsigned
+size_class (size_t size)
+{
+  unsigned c = 0;
+
+  while ((MIN_BUFFER_SIZE << c) < size)
+    c++;
+  return c;
+}
+
+static void *
+alloc_buffer (size_t size)
+{
+#ifdef HAVE_SYS_MMAN_H
+  void *p;
+
+#ifdef MAP_HUGETLB
+  if (buffer_hugepages == BUFFER_HUGEPAGES_HUGETLB &&
+      size >= HUGE_PAGE_SIZE) {
+    p = mmap (NULL, size, PROT_READ|PROT_WRITE,
+              MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+      return p;
+    /* Fall back to normal pages if none are reserved. */
+  }
+#endif
+
+  p = mmap (NULL, size, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+
+#ifdef MADV_HUGEPAGE
+  if (buffer_hugepages != BUFFER_HUGEPAGES_NONE && size >= HUGE_PAGE_SIZE)
+    madvise (p, size, MADV_HUGEPAGE);
+#endif
+
+  return p;
+#elif defined (HAVE_POSIX_MEMALIGN)
+  void *p;
+  int err;
+
+  err = posix_memalign (&p, MIN_BUFFER_SIZE, size);
+  if (err) {
+    errno = err;
+    return NULL;
+  }
+  memset (p, 0, size);
+  return p;
+#else
+  return calloc (1, size);
+#endif
+}
+
+static void
+free_buffer (void *buf, size_t size)
+{
+#ifdef HAVE_SYS_MMAN_H
+  munmap (buf, size);
+#else
+  free (buf);
+#endif
+}
+
+/* Take idle buffers out of the pool, largest first, until 'need'
+ * more bytes fit within the budget.  Called with the lock held.  The
+ * buffers are returned as a list so the caller can free them after
+ * releasing the lock.
+ */
+static struct idle_buffer *
+trim_idle (uint64_t need)
+{
+  struct idle_buffer *list = NULL;
+  int c;
+
+  for (c = NR_CLASSES-1; c >= 0 && allocated + need > buffer_memory; --c) {
+    while (idle[c] && allocated + need > buffer_memory) {
+      struct idle_buffer *b = idle[c];
+
+      idle[c] = b->next;
+      allocated -= MIN_BUFFER_SIZE << c;
+      b->size = MIN_BUFFER_SIZE << c;
+      b->next = list;
+      list = b;
+    }
+  }
+  return list;
+}
+
+/* Get a buffer of at least 'size' bytes.  It must be returned by
+ * calling buffer_put with the same size.  On error this calls
+ * nbdkit_error and returns NULL.
+ */
+void *
+buffer_get (size_t size)
+{
+  unsigned c;
+  uint64_t csize;
+  struct idle_buffer *trimmed;
+  void *buf;
+
+  assert ((MIN_BUFFER_SIZE << (NR_CLASSES-1)) == MAX_REQUEST_SIZE);
+  if (size > MAX_REQUEST_SIZE) {
+    nbdkit_error ("buffer_get: buffer too large (%zu bytes)", size);
+    errno = ENOMEM;
+    return NULL;
+  }
+  c = size_class (size);
+  csize = MIN_BUFFER_SIZE << c;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    if (idle[c]) {
+      buf = idle[c];
+      idle[c] = idle[c]->next;
+      memset (buf, 0, sizeof (struct idle_buffer));
+      nr_reuses++;
+      return buf;
+    }
+    trimmed = trim_idle (csize);
+    allocated += csize;
+    if (allocated > peak)
+      peak = allocated;
+    nr_allocs++;
+  }
+
+  while (trimmed) {
+    struct idle_buffer *b = trimmed;
+
+    trimmed = b->next;
+    free_buffer (b, b->size);
+  }
+
+  buf = alloc_buffer (csize);
+  if (buf == NULL) {
+    nbdkit_error ("buffer_get: allocating %" PRIu64 " bytes: %m", csize);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    allocated -= csize;
+  }
+  return buf;
+}
+
+/* Return a buffer to the pool. */
+void
+buffer_put (void *buf, size_t size)
+{
+  unsigned c;
+  struct idle_buffer *b = buf;
+
+  if (buf == NULL)
+    return;
+
+  c = size_class (size);
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    if (allocated <= buffer_memory) {
+      b->next = idle[c];
+      idle[c] = b;
+      return;
+    }
+    allocated -= MIN_BUFFER_SIZE << c;
+  }
+  free_buffer (buf, MIN_BUFFER_SIZE << c);
+}
+
+/* Free all idle buffers when the server exits. */
+void
+buffer_pool_free (void)
+{
+  unsigned c;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  debug ("buffers: %" PRIu64 " allocated, %" PRIu64 " reused, "
+         "peak %" PRIu64 " bytes",
+         nr_allocs, nr_reuses, peak);
+
+  for (c = 0; c < NR_CLASSES; ++c) {
+    while (idle[c]) {
+      struct idle_buffer *b = idle[c];
+
+      idle[c] = b->next;
+      allocated -= MIN_BUFFER_SIZE << c;
+      free_buffer (b, MIN_BUFFER_SIZE << c);
+    }
+  }
+}
@@ -40,18 +40,30 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <assert.h>
 
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
 
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
 #include "internal.h"
+#include "minmax.h"
+#include "poll.h"
 #include "utils.h"
 
-/* Default number of parallel requests. */
-#define DEFAULT_PARALLEL_REQUESTS 16
-
 static struct connection *new_connection (int sockin, int sockout,
                                           int nworkers);
 static void free_connection (struct connection *conn);
@@ -62,7 +74,11 @@ static int raw_send_socket (const void *buf, size_t len, int flags);
 #ifndef WIN32
 static int raw_send_other (const void *buf, size_t len, int flags);
 #endif
+#if defined (HAVE_SENDFILE) && defined (HAVE_SYS_SENDFILE_H)
+static int raw_send_fd (int fd, uint64_t offset, size_t len, int flags);
+#endif
 static void raw_close (void);
+static void set_cork (struct connection *conn, bool cork);
 
 int
 connection_get_status (void)
@@ -107,29 +123,394 @@ connection_set_status (int value)
   return value;
 }
 
-struct worker_data {
+/* When requests are processed in parallel, the connection thread
+ * reads requests (including write payloads) from the client and
+ * submits them to the pool of worker threads shared by all
+ * connections (see pool.c).  The worker calls into the plugin and
+ * sends the reply.  So receiving the next request overlaps with
+ * processing the previous ones, and a connection only uses as many
+ * worker threads as it has requests in flight.
+ *
+ * In the SERIALIZE_RETIREMENT thread model the replies must be sent
+ * in the order the requests were received.  Requests which finish
+ * early are held in a reorder buffer (the 'retire' list, sorted by
+ * sequence number) until all earlier requests have been replied to.
+ * The worker which sends the reply to the oldest request also sends
+ * any following replies which are ready, without blocking the other
+ * workers.
+ *
+ * With --merge-writes, contiguous write requests received back to
+ * back are chained together on the 'merged' list of the first one,
+ * which is the only request of the chain submitted to the worker
+ * pool.  The worker performs them as a single write and then sends
+ * a reply for each of them.
+ */
+struct request_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t space;         /* Signalled when a request completes. */
   struct connection *conn;
-  char *name;
+  const char *name;             /* Thread name and instance number of */
+  size_t instance_num;          /* the connection, for messages. */
+  struct queued_request *free;  /* Completed requests for reuse. */
+  unsigned outstanding;         /* Requests submitted and not finished. */
+  bool in_order;                /* Replies must be sent in order. */
+  uint64_t next_seq;            /* Sequence number of the next request. */
+  uint64_t retire_seq;          /* Sequence number of the next reply. */
+  struct queued_request *retire; /* Reorder buffer. */
+  bool retiring;                /* A worker is sending replies. */
+  unsigned async_pending;       /* Requests waiting for the plugin. */
+  uint64_t merge_limit;         /* Largest merged write, or 0. */
+};
+
+struct queued_request {
+  struct pool_job job;
+  struct pool_job reply_job;    /* Sends the reply of an async request. */
+  struct request_queue *queue;
+  struct queued_request *next;  /* Free list or reorder buffer. */
+  struct queued_request *merged; /* Next write merged with this one. */
+  uint64_t merged_count;        /* Total length of the merged writes. */
+  uint64_t seq;
+  struct request req;
+  struct nbdkit_async async;
+  enum {
+    ASYNC_SUBMITTING,           /* Being started by run_request. */
+    ASYNC_PENDING,              /* Started, waiting for the plugin. */
+    ASYNC_COMPLETED,            /* Finished by the plugin. */
+  } async_state;
+  int async_err;
 };
 
-static void *
-connection_worker (void *data)
+/* Called with q->lock held. */
+static void
+finish_request (struct request_queue *q, struct queued_request *qr)
 {
-  struct worker_data *worker = data;
-  struct connection *conn = worker->conn;
-  char *name = worker->name;
+  struct queued_request *next;
 
-  debug ("starting worker thread %s", name);
-  threadlocal_new_server_thread ();
-  threadlocal_set_name (name);
-  threadlocal_set_conn (conn);
-  free (worker);
+  for (; qr; qr = next) {
+    next = qr->merged;
+    qr->next = q->free;
+    q->free = qr;
+  }
+  q->outstanding--;
+  pthread_cond_signal (&q->space);
+}
 
-  while (!quit && connection_get_status () > 0)
-    protocol_recv_request_send_reply ();
-  debug ("exiting worker thread %s", threadlocal_get_name ());
-  free (name);
-  return NULL;
+/* Send the replies to a request and to any writes merged with it. */
+static void
+send_replies (struct queued_request *qr)
+{
+  for (; qr; qr = qr->merged)
+    protocol_send_reply (&qr->req);
+}
+
+/* Add a handled request to the reorder buffer, and send the replies
+ * which are now in order unless another worker is already doing so.
+ */
+static void
+retire_request (struct request_queue *q, struct queued_request *qr)
+{
+  struct queued_request **pp;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&q->lock);
+
+  for (pp = &q->retire; *pp && (*pp)->seq < qr->seq; pp = &(*pp)->next)
+    ;
+  qr->next = *pp;
+  *pp = qr;
+
+  if (q->retiring)
+    return;
+  q->retiring = true;
+  while ((qr = q->retire) != NULL && qr->seq == q->retire_seq) {
+    q->retire = qr->next;
+    q->retire_seq++;
+
+    pthread_mutex_unlock (&q->lock);
+    send_replies (qr);
+    pthread_mutex_lock (&q->lock);
+
+    finish_request (q, qr);
+  }
+  q->retiring = false;
+}
+
+/* Send the reply to a handled request and finish it. */
+static void
+reply_request (struct request_queue *q, struct queued_request *qr)
+{
+  if (q->in_order) {
+    retire_request (q, qr);
+    return;
+  }
+
+  send_replies (qr);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&q->lock);
+  finish_request (q, qr);
+}
+
+static void
+set_threadlocals (struct request_queue *q)
+{
+  threadlocal_set_conn (q->conn);
+  threadlocal_set_name (q->name);
+  threadlocal_set_instance_num (q->instance_num);
+}
+
+/* Perform a chain of merged writes as one write of the whole range.
+ * The result is copied to each request of the chain.
+ */
+static void
+handle_merged_writes (struct queued_request *qr)
+{
+  struct request req = qr->req;
+  struct queued_request *m;
+  char *p;
+
+  req.count = qr->merged_count;
+  req.buf = buffer_get ((size_t) req.count);
+  if (req.buf == NULL) {
+    /* Fall back to performing the writes separately. */
+    for (m = qr; m; m = m->merged)
+      protocol_handle_request (&m->req, NULL);
+    return;
+  }
+
+  p = req.buf;
+  for (m = qr; m; m = m->merged) {
+    memcpy (p, m->req.buf, m->req.count);
+    p += m->req.count;
+    req.flags |= m->req.flags & NBD_CMD_FLAG_FUA;
+  }
+  protocol_handle_request (&req, NULL);
+  buffer_put (req.buf, (size_t) req.count);
+
+  for (m = qr; m; m = m->merged)
+    m->req.error = req.error;
+}
+
+static void
+run_request (struct pool_job *job)
+{
+  struct queued_request *qr = container_of (job, struct queued_request, job);
+  struct request_queue *q = qr->queue;
+
+  set_threadlocals (q);
+
+  if (qr->merged) {
+    handle_merged_writes (qr);
+    reply_request (q, qr);
+    return;
+  }
+
+  qr->async_state = ASYNC_SUBMITTING;
+  if (!protocol_handle_request (&qr->req, &qr->async)) {
+    /* The plugin started the request asynchronously.  Unless it has
+     * already completed, the worker is free to run other requests and
+     * the reply is sent by run_async_reply.
+     */
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&q->lock);
+      if (qr->async_state == ASYNC_SUBMITTING) {
+        qr->async_state = ASYNC_PENDING;
+        q->async_pending++;
+        pthread_cond_signal (&q->space);
+        return;
+      }
+    }
+    protocol_finish_async (&qr->req, qr->async_err);
+  }
+
+  reply_request (q, qr);
+}
+
+static void
+run_async_reply (struct pool_job *job)
+{
+  struct queued_request *qr =
+    container_of (job, struct queued_request, reply_job);
+  struct request_queue *q = qr->queue;
+
+  set_threadlocals (q);
+  protocol_finish_async (&qr->req, qr->async_err);
+  reply_request (q, qr);
+}
+
+/* Called by the plugin (through nbdkit_async_complete) from any
+ * thread when an asynchronous request has finished.
+ */
+static void
+async_complete (struct nbdkit_async *async, int err)
+{
+  struct queued_request *qr =
+    container_of (async, struct queued_request, async);
+  struct request_queue *q = qr->queue;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&q->lock);
+    qr->async_err = err;
+    if (qr->async_state == ASYNC_SUBMITTING) {
+      /* run_request sends the reply itself. */
+      qr->async_state = ASYNC_COMPLETED;
+      return;
+    }
+    assert (qr->async_state == ASYNC_PENDING);
+    qr->async_state = ASYNC_COMPLETED;
+    q->async_pending--;
+  }
+  pool_submit (&qr->reply_job);
+}
+
+/* Submit a request, or a chain of merged writes, to the worker pool.
+ * At most conn->nworkers requests are running in the plugin at any
+ * time, as the -t option promises.  Requests waiting for the plugin's
+ * asynchronous callbacks don't count against this, up to
+ * MAX_ASYNC_REQUESTS in flight.
+ */
+static void
+submit_request (struct request_queue *q, struct queued_request *qr)
+{
+  GET_CONN;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&q->lock);
+    while (q->outstanding - q->async_pending >= conn->nworkers ||
+           q->outstanding >= MAX (conn->nworkers, MAX_ASYNC_REQUESTS))
+      pthread_cond_wait (&q->space, &q->lock);
+    q->outstanding++;
+    qr->seq = q->next_seq++;
+  }
+  pool_submit (&qr->job);
+}
+
+/* Can the write request qr be appended to the chain of merged writes
+ * starting at first and ending at last?
+ */
+static bool
+can_merge_write (struct request_queue *q, struct queued_request *first,
+                 struct queued_request *last, struct queued_request *qr)
+{
+  return qr->req.cmd == NBD_CMD_WRITE && qr->req.error == 0 &&
+    qr->req.offset == last->req.offset + last->req.count &&
+    first->merged_count + qr->req.count <= q->merge_limit;
+}
+
+/* Merged writes must not be larger than the maximum block size which
+ * the plugin and filters advertise to the client.
+ */
+static void
+set_merge_limit (struct request_queue *q)
+{
+  GET_CONN;
+  uint32_t minimum, preferred, maximum;
+
+  q->merge_limit = merge_writes;
+  if (q->merge_limit == 0)
+    return;
+  if (backend_block_size (conn->top_context,
+                          &minimum, &preferred, &maximum) == -1) {
+    q->merge_limit = 0;
+    return;
+  }
+  if (maximum != 0)
+    q->merge_limit = MIN (q->merge_limit, maximum);
+}
+
+/* Wait up to --merge-wait milliseconds for the client to send another
+ * request.  Returns true if there is data to read.
+ */
+static bool
+next_request_ready (void)
+{
+  GET_CONN;
+  struct pollfd fds[1];
+  int r;
+
+  fds[0].fd = conn->sockin;
+  fds[0].events = POLLIN;
+  fds[0].revents = 0;
+  do {
+    r = poll (fds, 1, merge_wait);
+  } while (r == -1 && errno == EINTR);
+  return r > 0;
+}
+
+/* Read requests from the client and submit them to the worker pool,
+ * until the connection is closed.  Returns when all requests have
+ * finished.
+ */
+static void
+read_requests (struct request_queue *q)
+{
+  struct queued_request *qr;
+  struct queued_request *first = NULL, *last = NULL;
+
+  set_merge_limit (q);
+
+  while (!quit && connection_get_status () > 0) {
+    /* Submit the chain of merged writes once it is full, or when the
+     * client has not sent another request in time.
+     */
+    if (first &&
+        (first->merged_count >= q->merge_limit || !next_request_ready ())) {
+      submit_request (q, first);
+      first = NULL;
+    }
+
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&q->lock);
+      qr = q->free;
+      if (qr)
+        q->free = qr->next;
+    }
+    if (qr == NULL) {
+      qr = calloc (1, sizeof *qr);
+      if (unlikely (!qr)) {
+        perror ("malloc");
+        connection_set_status (-1);
+        break;
+      }
+      qr->job.run = run_request;
+      qr->reply_job.run = run_async_reply;
+      qr->async.complete = async_complete;
+      qr->queue = q;
+    }
+
+    if (protocol_recv_request (&qr->req) <= 0) {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&q->lock);
+      qr->next = q->free;
+      q->free = qr;
+      break;
+    }
+    qr->merged = NULL;
+    qr->merged_count = qr->req.count;
+
+    if (first && can_merge_write (q, first, last, qr)) {
+      last->merged = qr;
+      last = qr;
+      first->merged_count += qr->req.count;
+      continue;
+    }
+    if (first) {
+      submit_request (q, first);
+      first = NULL;
+    }
+
+    /* Hold back a small write in case the following requests can be
+     * merged with it.
+     */
+    if (qr->req.cmd == NBD_CMD_WRITE && qr->req.error == 0 &&
+        qr->req.count < q->merge_limit)
+      first = last = qr;
+    else
+      submit_request (q, qr);
+  }
+  if (first)
+    submit_request (q, first);
+
+  /* Wait for the requests in flight. */
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&q->lock);
+  while (q->outstanding > 0)
+    pthread_cond_wait (&q->space, &q->lock);
 }
 
 void
@@ -139,7 +520,11 @@ handle_single_connection (int sockin, int sockout)
   int r;
   struct connection *conn;
   int nworkers = threads ? threads : DEFAULT_PARALLEL_REQUESTS;
-  pthread_t *workers = NULL;
+  struct request_queue queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .space = PTHREAD_COND_INITIALIZER,
+  };
+  struct queued_request *qr;
 
   lock_connection ();
 
@@ -174,6 +559,14 @@ handle_single_connection (int sockin, int sockout)
     goto done;
   conn->handshake_complete = true;
 
+  /* The io_uring engine takes over the connection from here, and
+   * finishes it when the client disconnects.
+   */
+  if (engine == ENGINE_URING && uring_add_connection (conn)) {
+    unlock_connection ();
+    return;
+  }
+
   if (!nworkers) {
     /* No need for a separate thread. */
     debug ("handshake complete, processing requests serially");
@@ -181,47 +574,20 @@ handle_single_connection (int sockin, int sockout)
       protocol_recv_request_send_reply ();
   }
   else {
-    /* Create thread pool to process requests. */
-    debug ("handshake complete, processing requests with %d threads",
-           nworkers);
-    workers = calloc (nworkers, sizeof *workers);
-    if (unlikely (!workers)) {
-      perror ("malloc");
-      goto done;
+    /* Process requests using the worker pool. */
+    queue.in_order =
+      thread_model == NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT;
+    debug ("handshake complete, processing up to %d requests in parallel%s",
+           nworkers, queue.in_order ? " with replies in order" : "");
+    queue.conn = conn;
+    queue.name = plugin_name;
+    queue.instance_num = threadlocal_get_instance_num ();
+    read_requests (&queue);
+
+    while ((qr = queue.free) != NULL) {
+      queue.free = qr->next;
+      free (qr);
     }
-
-    for (nworkers = 0; nworkers < conn->nworkers; nworkers++) {
-      struct worker_data *worker = malloc (sizeof *worker);
-      int err;
-
-      if (unlikely (!worker)) {
-        perror ("malloc");
-        connection_set_status (-1);
-        goto wait;
-      }
-      if (unlikely (asprintf (&worker->name, "%s.%d", plugin_name, nworkers)
-                    < 0)) {
-        perror ("asprintf");
-        connection_set_status (-1);
-        free (worker);
-        goto wait;
-      }
-      worker->conn = conn;
-      err = pthread_create (&workers[nworkers], NULL, connection_worker,
-                            worker);
-      if (unlikely (err)) {
-        errno = err;
-        perror ("pthread_create");
-        connection_set_status (-1);
-        free (worker);
-        goto wait;
-      }
-    }
-
-  wait:
-    while (nworkers)
-      pthread_join (workers[--nworkers], NULL);
-    free (workers);
   }
 
   /* Finalize (for filters), called just before close. */
@@ -236,6 +602,16 @@ handle_single_connection (int sockin, int sockout)
   unlock_connection ();
 }
 
+/* Finalize and free a connection handed over to the io_uring engine. */
+void
+finish_connection (struct connection *conn)
+{
+  lock_request ();
+  backend_finalize (conn->top_context);
+  unlock_request ();
+  free_connection (conn);
+}
+
 static struct connection *
 new_connection (int sockin, int sockout, int nworkers)
 {
@@ -318,6 +694,9 @@ new_connection (int sockin, int sockout, int nworkers)
     conn->send = raw_send_other;
 #else
   conn->send = raw_send_socket;
+#endif
+#if defined (HAVE_SENDFILE) && defined (HAVE_SYS_SENDFILE_H)
+  conn->send_fd = raw_send_fd;
 #endif
   conn->close = raw_close;
 
@@ -415,6 +794,8 @@ raw_send_socket (const void *vbuf, size_t len, int flags)
     len -= r;
   }
 
+  if (!(flags & SEND_MORE))
+    set_cork (conn, false);
   return 0;
 }
 
@@ -445,6 +826,109 @@ raw_send_other (const void *vbuf, size_t len, int flags)
 }
 #endif /* !WIN32 */
 
+#if defined (HAVE_SENDFILE) && defined (HAVE_SYS_SENDFILE_H)
+/* Write len bytes starting at offset in the file descriptor fd to
+ * conn->sockout using sendfile(2), so the data is copied to the
+ * socket in the kernel without passing through a user space buffer.
+ * Either succeed completely (returns 0) or fail (returns -1).  flags
+ * may include SEND_MORE as for conn->send.
+ *
+ * If the kernel cannot sendfile from this file descriptor then we
+ * fall back to reading the data and sending it with conn->send.
+ */
+static int
+raw_send_fd (int fd, uint64_t offset, size_t len, int flags)
+{
+  GET_CONN;
+  int sock = conn->sockout;
+  off_t off = offset;
+  ssize_t r;
+  char *buf;
+  size_t buf_size, n;
+  int saved_errno;
+
+  /* sendfile has no equivalent of MSG_MORE, so cork the socket until
+   * the next send without SEND_MORE.
+   */
+  if (flags & SEND_MORE)
+    set_cork (conn, true);
+
+  while (len > 0) {
+    r = sendfile (sock, fd, &off, len);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      if (errno == EINVAL || errno == ENOSYS)
+        goto fallback;
+      return -1;
+    }
+    if (r == 0) {
+      /* The file is shorter than the plugin told us. */
+      errno = EIO;
+      return -1;
+    }
+    len -= r;
+  }
+
+  if (!(flags & SEND_MORE))
+    set_cork (conn, false);
+  return 0;
+
+ fallback:
+  buf_size = MIN (len, MAX_REQUEST_SIZE);
+  buf = buffer_get (buf_size);
+  if (buf == NULL)
+    return -1;
+
+  while (len > 0) {
+    n = MIN (len, buf_size);
+    r = pread (fd, buf, n, off);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      goto err;
+    }
+    if (r == 0) {
+      errno = EIO;
+      goto err;
+    }
+    if (conn->send (buf, r, len > r ? SEND_MORE : flags) == -1)
+      goto err;
+    off += r;
+    len -= r;
+  }
+
+  buffer_put (buf, buf_size);
+  return 0;
+
+ err:
+  saved_errno = errno;
+  buffer_put (buf, buf_size);
+  errno = saved_errno;
+  return -1;
+}
+#endif /* HAVE_SENDFILE && HAVE_SYS_SENDFILE_H */
+
+/* Set or clear TCP_CORK on conn->sockout, which holds back partial
+ * frames until it is cleared.  Sockets which are not TCP do not
+ * support this, but they do not need it either.  The caller holds
+ * conn->write_lock.
+ */
+static void
+set_cork (struct connection *conn, bool cork)
+{
+#ifdef TCP_CORK
+  int v = cork;
+
+  if (conn->corked == cork || conn->no_cork)
+    return;
+  if (setsockopt (conn->sockout, IPPROTO_TCP, TCP_CORK, &v, sizeof v) == -1)
+    conn->no_cork = true;
+  else
+    conn->corked = cork;
+#endif
+}
+
 /* Read buffer from conn->sockin and either succeed completely
  * (returns > 0), read an EOF (returns 0), or fail (returns -1).
  */
@@ -55,6 +55,33 @@
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
 
+#ifdef HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED
+#include <gnutls/socket.h>
+#endif
+
+/* Kernel TLS (kTLS) offload.  After the handshake we hand the session
+ * keys to the kernel so that the connection can use the plain socket
+ * functions, including sendfile(2).
+ */
+#if defined(HAVE_LINUX_TLS_H) && defined(HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED)
+#define USE_KTLS 1
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+/* TLS record content types (RFC 8446 section 5.1). */
+#define TLS_RECORD_ALERT 21
+#define TLS_RECORD_APPLICATION_DATA 23
+#endif /* HAVE_LINUX_TLS_H && HAVE_GNUTLS_TRANSPORT_IS_KTLS_ENABLED */
+
 static int crypto_auth;
 #define CRYPTO_AUTH_CERTIFICATES 1
 #define CRYPTO_AUTH_PSK 2
@@ -398,6 +425,95 @@ crypto_send (const void *vbuf, size_t len, int flags)
   return 0;
 }
 
+#ifdef USE_KTLS
+/* Replaces crypto_recv when the kernel decrypts incoming records.
+ * This is the same as raw_recv in connections.c, except that the
+ * kernel returns non-application records (alerts, or TLS 1.3
+ * post-handshake messages) separately, tagged with their type in a
+ * control message.  A close_notify alert is treated as EOF, anything
+ * else is an error since GnuTLS no longer owns the receive side.
+ */
+static int
+ktls_recv (void *vbuf, size_t len)
+{
+  GET_CONN;
+  int sock = conn->sockin;
+  char *buf = vbuf;
+  ssize_t r;
+  bool first_read = true;
+
+  while (len > 0) {
+    char cmsgbuf[CMSG_SPACE (sizeof (unsigned char))];
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = {
+      .msg_iov = &iov, .msg_iovlen = 1,
+      .msg_control = cmsgbuf, .msg_controllen = sizeof cmsgbuf,
+    };
+    struct cmsghdr *cmsg;
+
+    r = recvmsg (sock, &msg, 0);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    cmsg = CMSG_FIRSTHDR (&msg);
+    if (cmsg != NULL &&
+        cmsg->cmsg_level == SOL_TLS &&
+        cmsg->cmsg_type == TLS_GET_RECORD_TYPE) {
+      unsigned char type = *(unsigned char *) CMSG_DATA (cmsg);
+
+      if (type != TLS_RECORD_APPLICATION_DATA) {
+        /* Alert level and description.  0 is close_notify. */
+        if (type == TLS_RECORD_ALERT && r >= 2 && buf[1] == 0)
+          r = 0;
+        else {
+          nbdkit_error ("kTLS: unexpected TLS record type %u", type);
+          errno = EIO;
+          return -1;
+        }
+      }
+    }
+    if (r == 0) {
+      if (first_read)
+        return 0;
+      /* Partial record read.  This is an error. */
+      errno = EBADMSG;
+      return -1;
+    }
+    first_read = false;
+    buf += r;
+    len -= r;
+  }
+
+  return 1;
+}
+
+/* Send a close_notify alert through the kernel, since GnuTLS no
+ * longer knows the sequence numbers of the send side.
+ */
+static void
+ktls_send_close_notify (int sock)
+{
+  unsigned char alert[2] = { 1 /* warning */, 0 /* close_notify */ };
+  char cmsgbuf[CMSG_SPACE (sizeof (unsigned char))];
+  struct iovec iov = { .iov_base = alert, .iov_len = sizeof alert };
+  struct msghdr msg = {
+    .msg_iov = &iov, .msg_iovlen = 1,
+    .msg_control = cmsgbuf, .msg_controllen = sizeof cmsgbuf,
+  };
+  struct cmsghdr *cmsg;
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_TLS;
+  cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (unsigned char));
+  *(unsigned char *) CMSG_DATA (cmsg) = TLS_RECORD_ALERT;
+
+  sendmsg (sock, &msg, MSG_NOSIGNAL);
+}
+#endif /* USE_KTLS */
+
 /* There's no place in the NBD protocol to send back errors from
  * close, so this function ignores errors.
  */
@@ -412,7 +528,19 @@ crypto_close (void)
 
   gnutls_transport_get_int2 (session, &sockin, &sockout);
 
+#ifdef USE_KTLS
+  /* If either direction was offloaded to the kernel we must not let
+   * GnuTLS use that direction again.
+   */
+  if (conn->send != crypto_send)
+    ktls_send_close_notify (sockout);
+  else if (conn->recv != crypto_recv)
+    gnutls_bye (session, GNUTLS_SHUT_WR);
+  else
+    gnutls_bye (session, GNUTLS_SHUT_RDWR);
+#else
   gnutls_bye (session, GNUTLS_SHUT_RDWR);
+#endif
 
   if (sockin >= 0)
     closesocket (sockin);
@@ -607,6 +735,151 @@ debug_session (gnutls_session_t session)
   }
 }
 
+#ifdef USE_KTLS
+/* Offload the record layer to the kernel after the handshake.
+ * Setting nbdkit -D nbdkit.tls.ktls=0 keeps all encryption in GnuTLS.
+ */
+NBDKIT_DLL_PUBLIC int nbdkit_debug_tls_ktls = 1;
+
+/* Pass the keys for one direction of the session to the kernel. */
+static int
+ktls_set_keys (gnutls_session_t session, int sock, unsigned read)
+{
+  union {
+    struct tls_crypto_info info;
+    struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+    struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+#endif
+  } ci;
+  gnutls_datum_t iv, key;
+  unsigned char seq[8];
+  socklen_t len;
+  int version, r;
+
+  switch (gnutls_protocol_get_version (session)) {
+  case GNUTLS_TLS1_2: version = TLS_1_2_VERSION; break;
+#ifdef TLS_1_3_VERSION
+  case GNUTLS_TLS1_3: version = TLS_1_3_VERSION; break;
+#endif
+  default:
+    errno = EPROTONOSUPPORT;
+    return -1;
+  }
+
+  r = gnutls_record_get_state (session, read, NULL, &iv, &key, seq);
+  if (r < 0) {
+    debug ("kTLS: gnutls_record_get_state: %s", gnutls_strerror (r));
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* For AES-GCM, the IV from GnuTLS is the 4 byte implicit salt in
+   * TLS 1.2, where the explicit nonce is the sequence number, or the
+   * salt followed by the 8 byte static IV in TLS 1.3.
+   */
+#define SET_AES_GCM(c, cipher)                                          \
+  do {                                                                  \
+    if (key.size != sizeof (c)->key ||                                  \
+        iv.size < sizeof (c)->salt +                                    \
+        (version == TLS_1_2_VERSION ? 0 : sizeof (c)->iv))              \
+      goto unsupported;                                                 \
+    (c)->info.version = version;                                        \
+    (c)->info.cipher_type = (cipher);                                   \
+    memcpy ((c)->salt, iv.data, sizeof (c)->salt);                      \
+    if (version == TLS_1_2_VERSION)                                     \
+      memcpy ((c)->iv, seq, sizeof (c)->iv);                            \
+    else                                                                \
+      memcpy ((c)->iv, iv.data + sizeof (c)->salt, sizeof (c)->iv);     \
+    memcpy ((c)->rec_seq, seq, sizeof (c)->rec_seq);                    \
+    memcpy ((c)->key, key.data, sizeof (c)->key);                       \
+    len = sizeof *(c);                                                  \
+  } while (0)
+
+  memset (&ci, 0, sizeof ci);
+  switch (gnutls_cipher_get (session)) {
+  case GNUTLS_CIPHER_AES_128_GCM:
+    SET_AES_GCM (&ci.aes_gcm_128, TLS_CIPHER_AES_GCM_128);
+    break;
+  case GNUTLS_CIPHER_AES_256_GCM:
+    SET_AES_GCM (&ci.aes_gcm_256, TLS_CIPHER_AES_GCM_256);
+    break;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+  case GNUTLS_CIPHER_CHACHA20_POLY1305:
+    if (key.size != sizeof ci.chacha20_poly1305.key ||
+        iv.size != sizeof ci.chacha20_poly1305.iv)
+      goto unsupported;
+    ci.info.version = version;
+    ci.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+    memcpy (ci.chacha20_poly1305.iv, iv.data, iv.size);
+    memcpy (ci.chacha20_poly1305.rec_seq, seq, sizeof seq);
+    memcpy (ci.chacha20_poly1305.key, key.data, key.size);
+    len = sizeof ci.chacha20_poly1305;
+    break;
+#endif
+  default:
+    goto unsupported;
+  }
+#undef SET_AES_GCM
+
+  r = setsockopt (sock, SOL_TLS, read ? TLS_RX : TLS_TX, &ci, len);
+  memset (&ci, 0, sizeof ci);
+  return r;
+
+ unsupported:
+  errno = ENOTSUP;
+  return -1;
+}
+
+/* Try to hand the session over to the kernel.  Each direction is
+ * enabled independently, and any direction which cannot be offloaded
+ * (old kernel, unsupported cipher, not a TCP socket) stays in GnuTLS.
+ */
+static void
+ktls_enable (gnutls_session_t session, int sockin, int sockout,
+             bool *offload_send, bool *offload_recv)
+{
+  if (nbdkit_debug_tls_ktls <= 0)
+    return;
+
+  /* GnuTLS may have enabled kTLS itself if the system configuration
+   * allows it, in which case its record functions already go through
+   * the kernel.
+   */
+  if (gnutls_transport_is_ktls_enabled (session) != 0) {
+    debug ("kTLS: already enabled by GnuTLS");
+    return;
+  }
+
+  if (sockin != sockout)
+    return;
+  if (setsockopt (sockout, IPPROTO_TCP, TCP_ULP, "tls", sizeof "tls") == -1) {
+    debug ("kTLS: not available: setsockopt: TCP_ULP: %m");
+    return;
+  }
+
+  if (ktls_set_keys (session, sockout, 0) == 0)
+    *offload_send = true;
+  else
+    debug ("kTLS: cannot offload send: %m");
+
+  /* Records which GnuTLS has already read and decrypted cannot be
+   * handed to the kernel.
+   */
+  if (gnutls_record_check_pending (session) > 0)
+    debug ("kTLS: cannot offload receive: data pending in GnuTLS");
+  else if (ktls_set_keys (session, sockin, 1) == 0)
+    *offload_recv = true;
+  else
+    debug ("kTLS: cannot offload receive: %m");
+
+  debug ("kTLS: send %s, receive %s",
+         *offload_send ? "offloaded" : "in GnuTLS",
+         *offload_recv ? "offloaded" : "in GnuTLS");
+}
+#endif /* USE_KTLS */
+
 /* Upgrade an existing connection to TLS.  Also this should do access
  * control if enabled.  The protocol code ensures this function can
  * only be called once per connection.
@@ -617,6 +890,7 @@ crypto_negotiate_tls (int sockin, int sockout)
   GET_CONN;
   gnutls_session_t session;
   CLEANUP_FREE char *priority = NULL;
+  bool offload_send = false, offload_recv = false;
   int err;
 
   /* Create the GnuTLS session. */
@@ -722,12 +996,27 @@ crypto_negotiate_tls (int sockin, int sockout)
   debug ("TLS handshake completed");
   debug_session (session);
 
+#ifdef USE_KTLS
+  ktls_enable (session, sockin, sockout, &offload_send, &offload_recv);
+#endif
+
   /* Set up the connection recv/send/close functions so they call
-   * GnuTLS wrappers instead.
+   * GnuTLS wrappers instead.  Where the kernel has taken over the
+   * encryption, the plain socket functions from connections.c stay in
+   * place for sending (so sendfile still works), and receiving only
+   * has to check for non-data records.
    */
   conn->crypto_session = session;
-  conn->recv = crypto_recv;
-  conn->send = crypto_send;
+  if (!offload_recv)
+    conn->recv = crypto_recv;
+#ifdef USE_KTLS
+  else
+    conn->recv = ktls_recv;
+#endif
+  if (!offload_send) {
+    conn->send = crypto_send;
+    conn->send_fd = NULL;
+  }
   conn->close = crypto_close;
   return 0;
 
@@ -74,10 +74,7 @@ filter_thread_model (struct backend *b)
       exit (EXIT_FAILURE);
   }
 
-  if (filter_thread_model < model) /* more serialized */
-    model = filter_thread_model;
-
-  return model;
+  return thread_model_min (model, filter_thread_model);
 }
 
 /* This is actually passing the request through to the final plugin,
@@ -358,6 +355,21 @@ filter_get_size (struct context *c)
     return backend_get_size (c_next);
 }
 
+static int
+filter_block_size (struct context *c,
+                   uint32_t *minimum, uint32_t *preferred, uint32_t *maximum)
+{
+  struct backend *b = c->b;
+  struct backend_filter *f = container_of (b, struct backend_filter, backend);
+  struct context *c_next = c->c_next;
+
+  if (f->filter.block_size)
+    return f->filter.block_size (c_next, c->handle,
+                                 minimum, preferred, maximum);
+  else
+    return backend_block_size (c_next, minimum, preferred, maximum);
+}
+
 static int
 filter_can_write (struct context *c)
 {
@@ -599,6 +611,69 @@ filter_cache (struct context *c,
     return backend_cache (c_next, count, offset, flags, err);
 }
 
+static int
+filter_pread_fd (struct context *c,
+                 uint32_t count, uint64_t offset, uint32_t flags,
+                 int *fd, uint64_t *fd_offset, int *err)
+{
+  struct backend *b = c->b;
+  struct backend_filter *f = container_of (b, struct backend_filter, backend);
+  struct context *c_next = c->c_next;
+
+  /* Unlike other callbacks, we don't pass through to the underlying
+   * layer if the filter doesn't provide .pread_fd, since the filter
+   * might modify the data returned by .pread.
+   */
+  if (f->filter.pread_fd)
+    return f->filter.pread_fd (c_next, c->handle,
+                               count, offset, flags, fd, fd_offset, err);
+  else
+    return 0;
+}
+
+static int
+filter_pread_sparse (struct context *c,
+                     void *buf, uint32_t count, uint64_t offset,
+                     uint32_t flags, struct nbdkit_extents *extents,
+                     int *err)
+{
+  struct backend *b = c->b;
+  struct backend_filter *f = container_of (b, struct backend_filter, backend);
+
+  /* Filters have no sparse read callback.  Sparse reads pass through
+   * filters which don't intercept .pread.
+   */
+  if (f->filter.pread)
+    return 0;
+  return backend_pread_sparse (c->c_next, buf, count, offset, flags,
+                               extents, err);
+}
+
+static int
+filter_async (struct context *c, struct nbdkit_async *async, int *err)
+{
+  struct backend *b = c->b;
+  struct backend_filter *f = container_of (b, struct backend_filter, backend);
+  struct context *c_next = c->c_next;
+  bool intercepted;
+
+  /* Filters have no asynchronous callbacks.  Asynchronous requests
+   * pass through filters which don't intercept the request, exactly
+   * as the synchronous request would.
+   */
+  switch (async->cmd) {
+  case NBD_CMD_READ:         intercepted = f->filter.pread != NULL; break;
+  case NBD_CMD_WRITE:        intercepted = f->filter.pwrite != NULL; break;
+  case NBD_CMD_FLUSH:        intercepted = f->filter.flush != NULL; break;
+  case NBD_CMD_TRIM:         intercepted = f->filter.trim != NULL; break;
+  case NBD_CMD_WRITE_ZEROES: intercepted = f->filter.zero != NULL; break;
+  default: abort ();
+  }
+  if (intercepted)
+    return 0;
+  return backend_async (c_next, async, err);
+}
+
 static struct backend filter_functions = {
   .free = filter_free,
   .thread_model = filter_thread_model,
@@ -621,6 +696,7 @@ static struct backend filter_functions = {
   .close = filter_close,
   .export_description = filter_export_description,
   .get_size = filter_get_size,
+  .block_size = filter_block_size,
   .can_write = filter_can_write,
   .can_flush = filter_can_flush,
   .is_rotational = filter_is_rotational,
@@ -638,6 +714,9 @@ static struct backend filter_functions = {
   .zero = filter_zero,
   .extents = filter_extents,
   .cache = filter_cache,
+  .pread_fd = filter_pread_fd,
+  .async = filter_async,
+  .pread_sparse = filter_pread_sparse,
 };
 
 /* Register and load a filter. */
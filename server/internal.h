@@ -103,6 +103,17 @@
 /* Maximum read or write request that we will handle. */
 #define MAX_REQUEST_SIZE (64 * 1024 * 1024)
 
+/* Default memory budget for the request buffer pool (--buffer-memory). */
+#define DEFAULT_BUFFER_MEMORY (256 * 1024 * 1024)
+
+/* Default number of parallel requests. */
+#define DEFAULT_PARALLEL_REQUESTS 16
+
+/* Maximum number of requests in flight per connection when the plugin
+ * uses the asynchronous callbacks.
+ */
+#define MAX_ASYNC_REQUESTS 256
+
 /* main.c */
 enum log_to {
   LOG_TO_DEFAULT,        /* --log not specified: log to stderr, unless
@@ -113,13 +124,29 @@ enum log_to {
   LOG_TO_NULL,           /* --log=null forced on the command line */
 };
 
+enum engine {
+  ENGINE_THREADS,        /* default: threads per connection */
+  ENGINE_URING,          /* --engine=uring */
+};
+
+enum buffer_hugepages {
+  BUFFER_HUGEPAGES_NONE,    /* --buffer-hugepages=none */
+  BUFFER_HUGEPAGES_THP,     /* default: transparent huge pages */
+  BUFFER_HUGEPAGES_HUGETLB, /* --buffer-hugepages=hugetlb */
+};
+
 extern int tcpip_sock_af;
 extern struct debug_flag *debug_flags;
+extern uint64_t buffer_memory;
+extern enum buffer_hugepages buffer_hugepages;
+extern enum engine engine;
 extern const char *export_name;
 extern bool foreground;
 extern const char *ipaddr;
 extern enum log_to log_to;
 extern unsigned mask_handshake;
+extern unsigned merge_wait;
+extern uint64_t merge_writes;
 extern bool newstyle;
 extern bool no_sr;
 extern const char *port;
@@ -193,6 +220,8 @@ typedef int (*connection_recv_function) (void *buf, size_t len)
 typedef int (*connection_send_function) (const void *buf, size_t len,
                                          int flags)
   __attribute__((__nonnull__ (1)));
+typedef int (*connection_send_fd_function) (int fd, uint64_t offset,
+                                            size_t len, int flags);
 typedef void (*connection_close_function) (void);
 
 /* struct context stores data per connection and backend.  Primarily
@@ -212,10 +241,14 @@ struct context {
   struct backend *b;    /* Backend that provided handle. */
   struct context *c_next; /* Underlying context, only when b->next != NULL. */
   struct connection *conn; /* Active connection at context creation, if any. */
+  struct metrics *metrics; /* Counters for --metrics-*, or NULL. */
 
   unsigned char state;  /* Bitmask of HANDLE_* values */
 
   uint64_t exportsize;
+  int64_t minimum_block_size;   /* -1 until cached */
+  uint32_t preferred_block_size;
+  uint32_t maximum_block_size;
   int can_write;
   int can_flush;
   int is_rotational;
@@ -248,19 +281,26 @@ struct connection {
   bool handshake_complete;
   bool using_tls;
   bool structured_replies;
+  bool extended_headers;
   bool meta_context_base_allocation;
+  bool no_pread_sparse;         /* Backend has no .pread_sparse. */
 
   string_vector interns;
   char *exportname_from_set_meta_context;
   const char *exportname;
 
   int sockin, sockout;
+  bool corked, no_cork;         /* TCP_CORK on sockout, see raw_send_fd. */
   connection_recv_function recv;
   connection_send_function send;
+  connection_send_fd_function send_fd; /* NULL if not supported. */
   connection_close_function close;
+
+  struct uring_connection *uring; /* Set if using the io_uring engine. */
 };
 
 extern void handle_single_connection (int sockin, int sockout);
+extern void finish_connection (struct connection *conn);
 extern int connection_get_status (void);
 extern int connection_set_status (int value);
 
@@ -277,7 +317,110 @@ extern int protocol_handshake_oldstyle (void);
 extern int protocol_handshake_newstyle (void);
 
 /* protocol.c */
+struct request {
+  uint64_t handle;
+  uint16_t cmd;
+  uint16_t flags;
+  uint64_t offset;
+  uint64_t count;
+  uint32_t error;               /* Set if the request was invalid, or
+                                   by protocol_handle_request. */
+  char *buf;                    /* Write payload or read data, or NULL.
+                                   From buffer_get, and returned by
+                                   protocol_send_reply. */
+  int fd;                       /* Read data from .pread_fd, or -1. */
+  uint64_t fd_offset;
+  struct nbdkit_extents *extents; /* Block status result, or zero
+                                     ranges of a sparse read, or NULL. */
+};
+
+/* A data request passed to the plugin's asynchronous callbacks.  The
+ * plugin calls nbdkit_async_complete, possibly from another thread,
+ * which calls 'complete'.
+ */
+struct nbdkit_async {
+  uint16_t cmd;                 /* NBD_CMD_READ, _WRITE, _FLUSH, _TRIM
+                                   or _WRITE_ZEROES. */
+  uint32_t flags;               /* NBDKIT_FLAG_* */
+  void *buf;
+  uint32_t count;
+  uint64_t offset;
+  void (*complete) (struct nbdkit_async *async, int err);
+  struct context *c;            /* Context the request was started in, */
+  uint64_t start;               /* and when, for metrics. */
+};
+
+/* A request header from the client, which is an extended request if
+ * the client negotiated extended headers.
+ */
+union request_header {
+  struct nbd_request compact;
+  struct nbd_extended_request extended;
+};
+
 extern int protocol_recv_request_send_reply (void);
+extern int protocol_parse_request (const union request_header *request,
+                                   struct request *req)
+  __attribute__((__nonnull__ (1, 2)));
+extern int protocol_recv_request (struct request *req)
+  __attribute__((__nonnull__ (1)));
+extern bool protocol_handle_request (struct request *req,
+                                     struct nbdkit_async *async)
+  __attribute__((__nonnull__ (1)));
+extern void protocol_finish_async (struct request *req, int err)
+  __attribute__((__nonnull__ (1)));
+extern int protocol_send_reply (struct request *req)
+  __attribute__((__nonnull__ (1)));
+extern int protocol_handle_request_send_reply (struct request *req)
+  __attribute__((__nonnull__ (1)));
+
+/* buffers.c */
+extern void *buffer_get (size_t size);
+extern void buffer_put (void *buf, size_t size);
+extern void buffer_pool_free (void);
+
+/* pool.c */
+struct pool_job {
+  struct pool_job *next;
+  void (*run) (struct pool_job *job);
+};
+
+extern void pool_stop (void);
+extern void pool_submit (struct pool_job *job)
+  __attribute__((__nonnull__ (1)));
+
+/* uring.c */
+extern int uring_probe (void);
+extern void uring_start (void);
+extern void uring_stop (void);
+extern bool uring_add_connection (struct connection *conn)
+  __attribute__((__nonnull__ (1)));
+
+/* metrics.c */
+enum metrics_op {
+  METRICS_PREAD,
+  METRICS_PWRITE,
+  METRICS_FLUSH,
+  METRICS_TRIM,
+  METRICS_ZERO,
+  METRICS_EXTENTS,
+  METRICS_CACHE,
+  METRICS_NR_OPS
+};
+
+extern char *metrics_file;
+extern char *metrics_socket;
+extern void metrics_init (void);
+extern void metrics_start_thread (void);
+extern void metrics_stop (void);
+extern struct metrics *metrics_get (struct backend *b, const char *exportname)
+  __attribute__((__nonnull__ (1, 2)));
+extern uint64_t metrics_now (void);
+extern uint64_t metrics_start (struct metrics *m);
+extern void metrics_record (struct metrics *m, enum metrics_op op,
+                            uint64_t start, uint64_t count, bool error);
+extern void metrics_record_async (struct nbdkit_async *async, int err)
+  __attribute__((__nonnull__ (1)));
 
 /* The context ID of base:allocation.  As far as I can tell it doesn't
  * matter what this is as long as nbdkit always returns the same
@@ -368,6 +511,9 @@ struct backend {
 
   const char *(*export_description) (struct context *);
   int64_t (*get_size) (struct context *);
+  int (*block_size) (struct context *,
+                     uint32_t *minimum, uint32_t *preferred,
+                     uint32_t *maximum);
   int (*can_write) (struct context *);
   int (*can_flush) (struct context *);
   int (*is_rotational) (struct context *);
@@ -395,6 +541,14 @@ struct backend {
                   struct nbdkit_extents *extents, int *err);
   int (*cache) (struct context *,
                 uint32_t count, uint64_t offset, uint32_t flags, int *err);
+  int (*pread_fd) (struct context *,
+                   uint32_t count, uint64_t offset, uint32_t flags,
+                   int *fd, uint64_t *fd_offset, int *err);
+  int (*async) (struct context *, struct nbdkit_async *async, int *err);
+  int (*pread_sparse) (struct context *,
+                       void *buf, uint32_t count, uint64_t offset,
+                       uint32_t flags, struct nbdkit_extents *extents,
+                       int *err);
 };
 
 extern void backend_init (struct backend *b, struct backend *next, size_t index,
@@ -426,13 +580,17 @@ extern int backend_finalize (struct context *c)
 extern void backend_close (struct context *c)
   __attribute__((__nonnull__ (1)));
 extern bool backend_valid_range (struct context *c,
-                                 uint64_t offset, uint32_t count)
+                                 uint64_t offset, uint64_t count)
   __attribute__((__nonnull__ (1)));
 
 extern const char *backend_export_description (struct context *c)
   __attribute__((__nonnull__ (1)));
 extern int64_t backend_get_size (struct context *c)
   __attribute__((__nonnull__ (1)));
+extern int backend_block_size (struct context *c,
+                               uint32_t *minimum, uint32_t *preferred,
+                               uint32_t *maximum)
+  __attribute__((__nonnull__ (1, 2, 3, 4)));
 extern int backend_can_write (struct context *c)
   __attribute__((__nonnull__ (1)));
 extern int backend_can_flush (struct context *c)
@@ -481,6 +639,18 @@ extern int backend_cache (struct context *c,
                           uint32_t count, uint64_t offset,
                           uint32_t flags, int *err)
   __attribute__((__nonnull__ (1, 5)));
+extern int backend_pread_fd (struct context *c,
+                             uint32_t count, uint64_t offset, uint32_t flags,
+                             int *fd, uint64_t *fd_offset, int *err)
+  __attribute__((__nonnull__ (1, 5, 6, 7)));
+extern int backend_async (struct context *c, struct nbdkit_async *async,
+                          int *err)
+  __attribute__((__nonnull__ (1, 2, 3)));
+extern int backend_pread_sparse (struct context *c,
+                                 void *buf, uint32_t count, uint64_t offset,
+                                 uint32_t flags,
+                                 struct nbdkit_extents *extents, int *err)
+  __attribute__((__nonnull__ (1, 2, 6, 7)));
 
 /* plugins.c */
 extern struct backend *plugin_register (size_t index, const char *filename,
@@ -497,6 +667,7 @@ extern struct backend *filter_register (struct backend *next, size_t index,
 extern unsigned thread_model;
 extern void lock_init_thread_model (void);
 extern const char *name_of_thread_model (int model);
+extern int thread_model_min (int model1, int model2);
 extern void lock_connection (void);
 extern void unlock_connection (void);
 extern void lock_request (void);
@@ -522,7 +693,6 @@ extern void threadlocal_set_instance_num (size_t instance_num);
 extern size_t threadlocal_get_instance_num (void);
 extern void threadlocal_set_error (int err);
 extern int threadlocal_get_error (void);
-extern void *threadlocal_buffer (size_t size);
 extern void threadlocal_set_conn (struct connection *conn);
 extern struct connection *threadlocal_get_conn (void);
 extern struct context *threadlocal_get_context (void);
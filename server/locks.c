@@ -59,6 +59,8 @@ name_of_thread_model (int model)
     return "serialize_all_requests";
   case NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS:
     return "serialize_requests";
+  case NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT:
+    return "serialize_retirement";
   case NBDKIT_THREAD_MODEL_PARALLEL:
     return "parallel";
   }
@@ -66,12 +68,33 @@ name_of_thread_model (int model)
   return buf;
 }
 
+/* Return the more serialized of two thread models.  The thread models
+ * are numbered in order of increasing parallelism, except for
+ * SERIALIZE_RETIREMENT which was added later and sits between
+ * SERIALIZE_REQUESTS and PARALLEL.
+ */
+static int
+rank_of_thread_model (int model)
+{
+  if (model == NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT)
+    return NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS * 2 + 1;
+  return model * 2;
+}
+
+int
+thread_model_min (int model1, int model2)
+{
+  if (rank_of_thread_model (model2) < rank_of_thread_model (model1))
+    return model2;
+  return model1;
+}
+
 void
 lock_init_thread_model (void)
 {
   thread_model = top->thread_model (top);
   debug ("using thread model: %s", name_of_thread_model (thread_model));
-  assert (thread_model <= NBDKIT_THREAD_MODEL_PARALLEL);
+  assert (thread_model <= NBDKIT_THREAD_MODEL_SERIALIZE_RETIREMENT);
 }
 
 void
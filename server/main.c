@@ -88,12 +88,18 @@ static void winsock_init (void);
 
 int tcpip_sock_af = AF_UNSPEC;  /* -4, -6 */
 struct debug_flag *debug_flags; /* -D */
+uint64_t buffer_memory = DEFAULT_BUFFER_MEMORY; /* --buffer-memory */
+enum buffer_hugepages buffer_hugepages = BUFFER_HUGEPAGES_THP;
+                                /* --buffer-hugepages */
+enum engine engine = ENGINE_THREADS; /* --engine */
 bool exit_with_parent;          /* --exit-with-parent */
 const char *export_name;        /* -e */
 bool foreground;                /* -f */
 const char *ipaddr;             /* -i */
 enum log_to log_to = LOG_TO_DEFAULT; /* --log */
 unsigned mask_handshake = ~0U;  /* --mask-handshake */
+unsigned merge_wait;            /* --merge-wait */
+uint64_t merge_writes;          /* --merge-writes */
 bool newstyle = true;           /* false = -o, true = -n */
 bool no_sr;                     /* --no-sr */
 char *pidfile;                  /* -P */
@@ -173,6 +179,11 @@ dump_config (void)
   printf ("%s=%s\n", "filterdir", filterdir);
   printf ("%s=%s\n", "host_cpu", host_cpu);
   printf ("%s=%s\n", "host_os", host_os);
+#ifdef HAVE_URING_ENGINE
+  printf ("%s=%s\n", "io_uring", "yes");
+#else
+  printf ("%s=%s\n", "io_uring", "no");
+#endif
   printf ("%s=%s\n", "libdir", libdir);
   printf ("%s=%s\n", "mandir", mandir);
   printf ("%s=%s\n", "name", PACKAGE_NAME);
@@ -285,6 +296,43 @@ main (int argc, char *argv[])
       }
       break;
 
+    case BUFFER_HUGEPAGES_OPTION:
+      if (strcmp (optarg, "none") == 0)
+        buffer_hugepages = BUFFER_HUGEPAGES_NONE;
+      else if (strcmp (optarg, "thp") == 0)
+        buffer_hugepages = BUFFER_HUGEPAGES_THP;
+      else if (strcmp (optarg, "hugetlb") == 0)
+        buffer_hugepages = BUFFER_HUGEPAGES_HUGETLB;
+      else {
+        fprintf (stderr, "%s: --buffer-hugepages must be "
+                 "\"none\", \"thp\" or \"hugetlb\"\n",
+                 program_name);
+        exit (EXIT_FAILURE);
+      }
+      break;
+
+    case BUFFER_MEMORY_OPTION:
+      {
+        int64_t r = nbdkit_parse_size (optarg);
+
+        if (r == -1)
+          exit (EXIT_FAILURE);
+        buffer_memory = r;
+      }
+      break;
+
+    case ENGINE_OPTION:
+      if (strcmp (optarg, "threads") == 0)
+        engine = ENGINE_THREADS;
+      else if (strcmp (optarg, "uring") == 0)
+        engine = ENGINE_URING;
+      else {
+        fprintf (stderr, "%s: --engine must be \"threads\" or \"uring\"\n",
+                 program_name);
+        exit (EXIT_FAILURE);
+      }
+      break;
+
     case LOG_OPTION:
       if (strcmp (optarg, "stderr") == 0)
         log_to = LOG_TO_STDERR;
@@ -407,6 +455,44 @@ main (int argc, char *argv[])
         exit (EXIT_FAILURE);
       break;
 
+    case MERGE_WAIT_OPTION:
+      if (nbdkit_parse_unsigned ("merge-wait", optarg, &merge_wait) == -1)
+        exit (EXIT_FAILURE);
+      if (merge_wait > INT_MAX) {
+        fprintf (stderr, "%s: --merge-wait is too large\n", program_name);
+        exit (EXIT_FAILURE);
+      }
+      break;
+
+    case MERGE_WRITES_OPTION:
+      {
+        int64_t r = nbdkit_parse_size (optarg);
+
+        if (r == -1)
+          exit (EXIT_FAILURE);
+        if (r > MAX_REQUEST_SIZE) {
+          fprintf (stderr, "%s: --merge-writes cannot be larger than %d\n",
+                   program_name, MAX_REQUEST_SIZE);
+          exit (EXIT_FAILURE);
+        }
+        merge_writes = r;
+      }
+      break;
+
+    case METRICS_FILE_OPTION:
+      free (metrics_file);
+      metrics_file = nbdkit_absolute_path (optarg);
+      if (metrics_file == NULL)
+        exit (EXIT_FAILURE);
+      break;
+
+    case METRICS_SOCKET_OPTION:
+      free (metrics_socket);
+      metrics_socket = nbdkit_absolute_path (optarg);
+      if (metrics_socket == NULL)
+        exit (EXIT_FAILURE);
+      break;
+
     case 'n':
       newstyle = true;
       break;
@@ -587,6 +673,12 @@ main (int argc, char *argv[])
     exit (EXIT_FAILURE);
   }
 
+  /* Check early that the kernel supports io_uring, so that we don't
+   * fail later when the first client connects.
+   */
+  if (engine == ENGINE_URING && uring_probe () == -1)
+    exit (EXIT_FAILURE);
+
   /* The remaining command line arguments are the plugin name and
    * parameters.  If --help, --version or --dump-plugin were specified
    * then we open the plugin so that we can display the per-plugin
@@ -743,6 +835,7 @@ main (int argc, char *argv[])
   configured = true;
 
   start_serving ();
+  metrics_stop ();
 
   top->cleanup (top);
   top->free (top);
@@ -750,6 +843,8 @@ main (int argc, char *argv[])
 
   free (unixsocket);
   free (pidfile);
+  free (metrics_file);
+  free (metrics_socket);
 
   if (random_fifo) {
     unlink (random_fifo);
@@ -763,6 +858,7 @@ main (int argc, char *argv[])
 
   crypto_free ();
   close_quit_pipe ();
+  buffer_pool_free ();
 
   free_interns ();
 
@@ -918,6 +1014,7 @@ start_serving (void)
 #if !ENABLE_LIBFUZZER
   set_up_signals ();
 #endif
+  metrics_init ();
 
   /* Lock the process into memory if requested. */
   if (swap) {
@@ -952,6 +1049,7 @@ start_serving (void)
     debug ("using socket activation, nr_socks = %zu", socks.len);
     change_user ();
     write_pidfile ();
+    metrics_start_thread ();
     top->after_fork (top);
     accept_incoming_connections (&socks);
     return;
@@ -961,9 +1059,11 @@ start_serving (void)
   if (listen_stdin) {
     change_user ();
     write_pidfile ();
+    metrics_start_thread ();
     top->after_fork (top);
     threadlocal_new_server_thread ();
     handle_single_connection (saved_stdin, saved_stdout);
+    pool_stop ();
     return;
   }
 
@@ -981,6 +1081,7 @@ start_serving (void)
   change_user ();
   fork_into_background ();
   write_pidfile ();
+  metrics_start_thread ();
   top->after_fork (top);
   accept_incoming_connections (&socks);
 }
@@ -0,0 +1,889 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Metrics about the requests handled by each plugin and filter, in
+ * the Prometheus text format (--metrics-file and --metrics-socket).
+ *
+ * There is a set of counters for each backend (layer) and export
+ * name, found when the backend's context is opened.  Each set is
+ * split into METRICS_SHARDS shards, and each thread updates the
+ * counters of its own shard with relaxed atomic additions, so
+ * requests never take a lock or share a cache line with requests
+ * running on other threads.  The shards are added together when the
+ * metrics are written out.
+ *
+ * Plugins and filters can add their own values with
+ * nbdkit_add_metric.
+ *
+ * The metrics are written by a separate thread, to clients which
+ * connect to the metrics socket and to the metrics file (or stderr)
+ * when nbdkit receives SIGUSR1.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_SYS_UN_H
+#include <sys/un.h>
+#endif
+
+#include <pthread.h>
+
+#include "internal.h"
+#include "ascii-ctype.h"
+#include "open_memstream.h"
+#include "poll.h"
+#include "utils.h"
+
+char *metrics_file;             /* --metrics-file */
+char *metrics_socket;           /* --metrics-socket */
+
+#ifndef WIN32
+
+#define METRICS_SHARDS 16
+
+/* Latency histogram buckets.  Bucket i counts requests which took at
+ * most 2^i microseconds, up to 2^24 µs (about 17 seconds).  The last
+ * bucket counts slower requests.
+ */
+#define METRICS_BUCKETS 25
+
+/* Limit the number of sets of counters, as clients can choose the
+ * export name.  Exports opened after this are not counted.
+ */
+#define METRICS_MAX 1024
+
+/* The metrics thread serves one client at a time, so give up on a
+ * client which is not reading the metrics after this many seconds.
+ */
+#define METRICS_SEND_TIMEOUT 5
+
+static const char *op_names[METRICS_NR_OPS] = {
+  [METRICS_PREAD] = "pread",
+  [METRICS_PWRITE] = "pwrite",
+  [METRICS_FLUSH] = "flush",
+  [METRICS_TRIM] = "trim",
+  [METRICS_ZERO] = "zero",
+  [METRICS_EXTENTS] = "extents",
+  [METRICS_CACHE] = "cache",
+};
+
+struct metrics_counters {
+  uint64_t requests;
+  uint64_t errors;
+  uint64_t bytes;
+  uint64_t duration_ns;
+  uint64_t buckets[METRICS_BUCKETS + 1];
+};
+
+struct metrics_shard {
+  struct metrics_counters ops[METRICS_NR_OPS];
+} __attribute__((__aligned__ (64)));
+
+struct metrics {
+  struct metrics *next;
+  struct backend *b;
+  size_t layer;                 /* Copied from the backend, which may */
+  char *type;                   /* be unloaded while the metrics */
+  char *name;                   /* thread is still running. */
+  char *exportname;
+  struct metrics_shard shards[METRICS_SHARDS];
+};
+
+static bool enabled;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics *list;    /* Protected by the lock. */
+static size_t nr_metrics;       /* Protected by the lock. */
+static pthread_key_t shard_key;
+static unsigned next_shard;
+
+/* Values added by plugins and filters, in the order they were added. */
+struct plugin_metric {
+  struct plugin_metric *next;
+  char *name;
+  char *help;
+  int type;
+  uint64_t (*get) (void);
+};
+static struct plugin_metric *plugin_metrics; /* Protected by the lock. */
+
+static int sock = -1;           /* Listening metrics socket. */
+static int read_fd = -1, write_fd = -1; /* Pipe to the metrics thread. */
+static pthread_t thread;
+static bool thread_started;
+
+uint64_t
+metrics_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINT64_C (1000000000) + ts.tv_nsec;
+}
+
+uint64_t
+metrics_start (struct metrics *m)
+{
+  return m ? metrics_now () : 0;
+}
+
+/* Find or create the counters for a backend and export name.
+ * Returns NULL if metrics are not enabled.
+ */
+struct metrics *
+metrics_get (struct backend *b, const char *exportname)
+{
+  struct metrics *m;
+  int err;
+
+  if (!enabled)
+    return NULL;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  for (m = list; m; m = m->next) {
+    if (m->b == b && strcmp (m->exportname, exportname) == 0)
+      return m;
+  }
+
+  if (nr_metrics >= METRICS_MAX) {
+    if (nr_metrics++ == METRICS_MAX)
+      debug ("metrics: too many exports, not counting export \"%s\"",
+             exportname);
+    return NULL;
+  }
+
+  err = posix_memalign ((void **) &m, __alignof__ (struct metrics),
+                        sizeof *m);
+  if (err) {
+    errno = err;
+    perror ("metrics: posix_memalign");
+    return NULL;
+  }
+  memset (m, 0, sizeof *m);
+  m->b = b;
+  m->layer = b->i;
+  m->type = strdup (b->type);
+  m->name = strdup (b->name);
+  m->exportname = strdup (exportname);
+  if (!m->type || !m->name || !m->exportname) {
+    perror ("metrics: strdup");
+    free (m->type);
+    free (m->name);
+    free (m->exportname);
+    free (m);
+    return NULL;
+  }
+  m->next = list;
+  list = m;
+  nr_metrics++;
+  return m;
+}
+
+/* Each thread uses its own shard, chosen the first time it records a
+ * request.  Threads share shards only when there are more than
+ * METRICS_SHARDS of them.
+ */
+static size_t
+get_shard (void)
+{
+  uintptr_t s = (uintptr_t) pthread_getspecific (shard_key);
+
+  if (s == 0) {
+    s = __atomic_add_fetch (&next_shard, 1, __ATOMIC_RELAXED);
+    pthread_setspecific (shard_key, (void *) s);
+  }
+  return (s - 1) % METRICS_SHARDS;
+}
+
+static size_t
+get_bucket (uint64_t ns)
+{
+  uint64_t us = (ns + 999) / 1000;
+  size_t i;
+
+  for (i = 0; i < METRICS_BUCKETS && us > UINT64_C (1) << i; ++i)
+    ;
+  return i;
+}
+
+#define ADD(field, n) __atomic_add_fetch (&(field), (n), __ATOMIC_RELAXED)
+
+/* Record a request which started at 'start' (from metrics_start). */
+void
+metrics_record (struct metrics *m, enum metrics_op op, uint64_t start,
+                uint64_t count, bool error)
+{
+  struct metrics_counters *mc;
+  uint64_t ns;
+
+  if (m == NULL)
+    return;
+
+  ns = metrics_now () - start;
+  mc = &m->shards[get_shard ()].ops[op];
+  ADD (mc->requests, 1);
+  if (error)
+    ADD (mc->errors, 1);
+  ADD (mc->bytes, count);
+  ADD (mc->duration_ns, ns);
+  ADD (mc->buckets[get_bucket (ns)], 1);
+}
+
+/* Record an asynchronous request when it completes.  The request
+ * was passed through every layer from async->c down to the plugin.
+ */
+void
+metrics_record_async (struct nbdkit_async *async, int err)
+{
+  enum metrics_op op;
+  struct context *c;
+
+  switch (async->cmd) {
+  case NBD_CMD_READ: op = METRICS_PREAD; break;
+  case NBD_CMD_WRITE: op = METRICS_PWRITE; break;
+  case NBD_CMD_FLUSH: op = METRICS_FLUSH; break;
+  case NBD_CMD_TRIM: op = METRICS_TRIM; break;
+  case NBD_CMD_WRITE_ZEROES:
+    /* This is retried synchronously, see protocol_finish_async. */
+    if (err == ENOTSUP || err == EOPNOTSUPP)
+      return;
+    op = METRICS_ZERO;
+    break;
+  default: abort ();
+  }
+
+  for (c = async->c; c; c = c->c_next)
+    metrics_record (c->metrics, op, async->start, async->count, err != 0);
+}
+
+static void
+sum_counters (const struct metrics *m, enum metrics_op op,
+              struct metrics_counters *total)
+{
+  const struct metrics_counters *mc;
+  size_t i, j;
+
+  memset (total, 0, sizeof *total);
+  for (i = 0; i < METRICS_SHARDS; ++i) {
+    mc = &m->shards[i].ops[op];
+#define LOAD(field) __atomic_load_n (&(field), __ATOMIC_RELAXED)
+    total->requests += LOAD (mc->requests);
+    total->errors += LOAD (mc->errors);
+    total->bytes += LOAD (mc->bytes);
+    total->duration_ns += LOAD (mc->duration_ns);
+    for (j = 0; j <= METRICS_BUCKETS; ++j)
+      total->buckets[j] += LOAD (mc->buckets[j]);
+#undef LOAD
+  }
+}
+
+/* Print the labels of a series, without the closing brace. */
+static void
+print_labels (FILE *fp, const struct metrics *m, enum metrics_op op)
+{
+  const char *p;
+
+  fprintf (fp, "{layer=\"%zu\",type=\"%s\",name=\"%s\",export=\"",
+           m->layer, m->type, m->name);
+  for (p = m->exportname; *p; ++p) {
+    switch (*p) {
+    case '\\': fputs ("\\\\", fp); break;
+    case '"': fputs ("\\\"", fp); break;
+    case '\n': fputs ("\\n", fp); break;
+    default: fputc (*p, fp);
+    }
+  }
+  fprintf (fp, "\",op=\"%s\"", op_names[op]);
+}
+
+enum counter { REQUESTS, ERRORS, BYTES };
+
+static void
+print_counter (FILE *fp, const char *family, const char *help,
+               enum counter counter)
+{
+  const struct metrics *m;
+  struct metrics_counters total;
+  enum metrics_op op;
+  uint64_t v;
+
+  fprintf (fp, "# HELP %s %s\n", family, help);
+  fprintf (fp, "# TYPE %s counter\n", family);
+  for (m = list; m; m = m->next) {
+    for (op = 0; op < METRICS_NR_OPS; ++op) {
+      sum_counters (m, op, &total);
+      if (total.requests == 0)
+        continue;
+      switch (counter) {
+      case REQUESTS: v = total.requests; break;
+      case ERRORS: v = total.errors; break;
+      case BYTES: v = total.bytes; break;
+      default: abort ();
+      }
+      fputs (family, fp);
+      print_labels (fp, m, op);
+      fprintf (fp, "} %" PRIu64 "\n", v);
+    }
+  }
+}
+
+static void
+print_histogram (FILE *fp)
+{
+  const char *family = "nbdkit_request_duration_seconds";
+  const struct metrics *m;
+  struct metrics_counters total;
+  enum metrics_op op;
+  uint64_t n;
+  size_t i;
+
+  fprintf (fp, "# HELP %s Time taken by requests.\n", family);
+  fprintf (fp, "# TYPE %s histogram\n", family);
+  for (m = list; m; m = m->next) {
+    for (op = 0; op < METRICS_NR_OPS; ++op) {
+      sum_counters (m, op, &total);
+      if (total.requests == 0)
+        continue;
+      n = 0;
+      for (i = 0; i <= METRICS_BUCKETS; ++i) {
+        n += total.buckets[i];
+        fprintf (fp, "%s_bucket", family);
+        print_labels (fp, m, op);
+        if (i < METRICS_BUCKETS)
+          fprintf (fp, ",le=\"%.6f\"} %" PRIu64 "\n",
+                   (UINT64_C (1) << i) / 1e6, n);
+        else
+          fprintf (fp, ",le=\"+Inf\"} %" PRIu64 "\n", n);
+      }
+      fprintf (fp, "%s_sum", family);
+      print_labels (fp, m, op);
+      fprintf (fp, "} %.9f\n", total.duration_ns / 1e9);
+      fprintf (fp, "%s_count", family);
+      print_labels (fp, m, op);
+      fprintf (fp, "} %" PRIu64 "\n", n);
+    }
+  }
+}
+
+static void
+print_plugin_metrics (FILE *fp)
+{
+  const struct plugin_metric *pm;
+
+  for (pm = plugin_metrics; pm; pm = pm->next) {
+    fprintf (fp, "# HELP nbdkit_%s %s\n", pm->name, pm->help);
+    fprintf (fp, "# TYPE nbdkit_%s %s\n", pm->name,
+             pm->type == NBDKIT_METRIC_GAUGE ? "gauge" : "counter");
+    fprintf (fp, "nbdkit_%s %" PRIu64 "\n", pm->name, pm->get ());
+  }
+}
+
+/* Format the metrics.  The caller must free the string. */
+static char *
+format_metrics (size_t *len)
+{
+  char *str = NULL;
+  FILE *fp;
+
+  fp = open_memstream (&str, len);
+  if (fp == NULL) {
+    perror ("metrics: open_memstream");
+    return NULL;
+  }
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    print_counter (fp, "nbdkit_requests_total",
+                   "Requests handled.", REQUESTS);
+    print_counter (fp, "nbdkit_request_errors_total",
+                   "Requests which failed.", ERRORS);
+    print_counter (fp, "nbdkit_request_bytes_total",
+                   "Bytes covered by requests.", BYTES);
+    print_histogram (fp);
+    print_plugin_metrics (fp);
+  }
+
+  if (fclose (fp) == EOF) {
+    perror ("metrics: open_memstream");
+    free (str);
+    return NULL;
+  }
+  return str;
+}
+
+/* Write the metrics to the metrics file, replacing it atomically, or
+ * to stderr if there is no metrics file.
+ */
+static void
+dump_metrics (void)
+{
+  CLEANUP_FREE char *str = NULL;
+  CLEANUP_FREE char *tmp = NULL;
+  size_t len;
+  FILE *fp;
+
+  str = format_metrics (&len);
+  if (str == NULL)
+    return;
+
+  if (!metrics_file) {
+    fwrite (str, 1, len, stderr);
+    fflush (stderr);
+    return;
+  }
+
+  if (asprintf (&tmp, "%s.tmp", metrics_file) == -1) {
+    perror ("asprintf");
+    return;
+  }
+  fp = fopen (tmp, "w");
+  if (fp == NULL) {
+    perror (tmp);
+    return;
+  }
+  if (fwrite (str, 1, len, fp) != len || fclose (fp) == EOF) {
+    perror (tmp);
+    unlink (tmp);
+    return;
+  }
+  if (rename (tmp, metrics_file) == -1) {
+    perror (metrics_file);
+    unlink (tmp);
+  }
+}
+
+/* Send the metrics to a client of the metrics socket. */
+static void
+send_metrics (int s)
+{
+  CLEANUP_FREE char *str = NULL;
+  const struct timeval tv = { .tv_sec = METRICS_SEND_TIMEOUT };
+  const uint64_t deadline =
+    metrics_now () + METRICS_SEND_TIMEOUT * UINT64_C (1000000000);
+  size_t len;
+  ssize_t r;
+  char *p;
+
+  /* Each send times out, and the deadline stops a client which reads
+   * slowly from keeping the thread busy.
+   */
+  if (setsockopt (s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv) == -1) {
+    debug ("metrics: setsockopt: SO_SNDTIMEO: %m");
+    return;
+  }
+
+  str = format_metrics (&len);
+  if (str == NULL)
+    return;
+
+  for (p = str; len > 0; p += r, len -= r) {
+    if (metrics_now () > deadline) {
+      debug ("metrics: send: client is too slow, giving up");
+      return;
+    }
+    r = send (s, p, len, 0);
+    if (r == -1) {
+      if (errno == EINTR) {
+        r = 0;
+        continue;
+      }
+      debug ("metrics: send: %m");
+      return;
+    }
+  }
+}
+
+static void *
+metrics_thread (void *unused)
+{
+  struct pollfd fds[2];
+  char buf[64];
+  ssize_t n, i;
+  int s;
+
+  threadlocal_new_server_thread ();
+  threadlocal_set_name ("metrics");
+
+  for (;;) {
+    fds[0].fd = read_fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = sock;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    if (poll (fds, sock >= 0 ? 2 : 1, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      perror ("metrics: poll");
+      return NULL;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      n = read (read_fd, buf, sizeof buf);
+      for (i = 0; i < n; ++i) {
+        if (buf[i] == 's')      /* metrics_stop */
+          return NULL;
+      }
+      if (n > 0)                /* SIGUSR1 */
+        dump_metrics ();
+    }
+
+    if (fds[1].revents & POLLIN) {
+      s = accept (sock, NULL, NULL);
+      if (s == -1) {
+        if (errno != EINTR && errno != EAGAIN)
+          debug ("metrics: accept: %m");
+        continue;
+      }
+      send_metrics (s);
+      close (s);
+    }
+  }
+}
+
+static void
+handle_sigusr1 (int sig)
+{
+  int err = errno;
+  char c = 'u';
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-result"
+  write (write_fd, &c, 1);
+#pragma GCC diagnostic pop
+  errno = err;
+}
+
+static void
+bind_metrics_socket (void)
+{
+  size_t len = strlen (metrics_socket);
+  struct sockaddr_un addr;
+
+  if (len >= UNIX_PATH_MAX) {
+    fprintf (stderr, "%s: --metrics-socket: path too long: "
+             "length %zu > max %d bytes\n",
+             program_name, len, UNIX_PATH_MAX-1);
+    exit (EXIT_FAILURE);
+  }
+
+#ifdef SOCK_CLOEXEC
+  sock = socket (AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+#else
+  sock = set_cloexec (socket (AF_UNIX, SOCK_STREAM, 0));
+#endif
+  if (sock == -1) {
+    perror ("metrics: socket");
+    exit (EXIT_FAILURE);
+  }
+
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  memcpy (addr.sun_path, metrics_socket, len+1 /* trailing \0 */);
+  if (bind (sock, (struct sockaddr *) &addr, sizeof addr) == -1) {
+    perror (metrics_socket);
+    exit (EXIT_FAILURE);
+  }
+  if (listen (sock, SOMAXCONN) == -1) {
+    perror ("metrics: listen");
+    exit (EXIT_FAILURE);
+  }
+
+  debug ("metrics: bound to unix socket %s", metrics_socket);
+}
+
+/* Called before serving clients.  Does nothing unless metrics were
+ * requested on the command line.
+ */
+void
+metrics_init (void)
+{
+  struct sigaction sa;
+  int fds[2];
+  int err;
+
+  if (!metrics_file && !metrics_socket)
+    return;
+
+  err = pthread_key_create (&shard_key, NULL);
+  if (err) {
+    errno = err;
+    perror ("pthread_key_create");
+    exit (EXIT_FAILURE);
+  }
+
+#ifdef HAVE_PIPE2
+  if (pipe2 (fds, O_CLOEXEC) == -1) {
+    perror ("pipe2");
+    exit (EXIT_FAILURE);
+  }
+#else
+  if (pipe (fds) == -1) {
+    perror ("pipe");
+    exit (EXIT_FAILURE);
+  }
+  if (set_cloexec (fds[0]) == -1 ||
+      set_cloexec (fds[1]) == -1) {
+    perror ("fcntl");
+    exit (EXIT_FAILURE);
+  }
+#endif
+  /* The signal handler must never block. */
+  if (set_nonblock (fds[1]) == -1) {
+    perror ("fcntl");
+    exit (EXIT_FAILURE);
+  }
+  read_fd = fds[0];
+  write_fd = fds[1];
+
+  if (metrics_socket)
+    bind_metrics_socket ();
+
+  memset (&sa, 0, sizeof sa);
+  sa.sa_flags = SA_RESTART;
+  sa.sa_handler = handle_sigusr1;
+  sigaction (SIGUSR1, &sa, NULL);
+
+  enabled = true;
+}
+
+/* Start the metrics thread.  This must be called after forking into
+ * the background.
+ */
+void
+metrics_start_thread (void)
+{
+  int err;
+
+  if (!enabled)
+    return;
+
+  err = pthread_create (&thread, NULL, metrics_thread, NULL);
+  if (err) {
+    errno = err;
+    perror ("metrics: pthread_create");
+    exit (EXIT_FAILURE);
+  }
+  thread_started = true;
+}
+
+NBDKIT_DLL_PUBLIC int
+nbdkit_add_metric (const char *name, const char *help, int type,
+                   uint64_t (*get) (void))
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  struct plugin_metric *pm, **p;
+  const char *q;
+
+  if (type != NBDKIT_METRIC_COUNTER && type != NBDKIT_METRIC_GAUGE) {
+    nbdkit_error ("nbdkit_add_metric: %s: invalid type %d", name, type);
+    return -1;
+  }
+  if (!ascii_islower (name[0])) {
+    nbdkit_error ("nbdkit_add_metric: %s: invalid name", name);
+    return -1;
+  }
+  for (q = name; *q; ++q) {
+    if (!ascii_islower (*q) && !ascii_isdigit (*q) && *q != '_') {
+      nbdkit_error ("nbdkit_add_metric: %s: invalid name", name);
+      return -1;
+    }
+  }
+  if (strchr (help, '\n') != NULL || strchr (help, '\\') != NULL) {
+    nbdkit_error ("nbdkit_add_metric: %s: invalid help text", name);
+    return -1;
+  }
+
+  for (p = &plugin_metrics; *p; p = &(*p)->next) {
+    if (strcmp ((*p)->name, name) == 0) {
+      /* The same plugin or filter may be loaded twice. */
+      if ((*p)->get == get)
+        return 0;
+      nbdkit_error ("nbdkit_add_metric: %s: name is already used", name);
+      return -1;
+    }
+  }
+
+  pm = calloc (1, sizeof *pm);
+  if (pm == NULL) {
+    nbdkit_error ("calloc: %m");
+    return -1;
+  }
+  pm->name = strdup (name);
+  pm->help = strdup (help);
+  if (pm->name == NULL || pm->help == NULL) {
+    nbdkit_error ("strdup: %m");
+    free (pm->name);
+    free (pm->help);
+    free (pm);
+    return -1;
+  }
+  pm->type = type;
+  pm->get = get;
+  *p = pm;
+  return 0;
+}
+
+static void
+free_plugin_metrics (void)
+{
+  struct plugin_metric *pm;
+
+  while ((pm = plugin_metrics) != NULL) {
+    plugin_metrics = pm->next;
+    free (pm->name);
+    free (pm->help);
+    free (pm);
+  }
+}
+
+/* Stop the metrics thread, and write the final metrics to the
+ * metrics file.  This must be called before the plugin and filters
+ * are unloaded.
+ */
+void
+metrics_stop (void)
+{
+  struct metrics *m;
+  char c = 's';
+
+  if (!enabled) {
+    free_plugin_metrics ();
+    return;
+  }
+
+  if (thread_started) {
+    if (write (write_fd, &c, 1) != 1)
+      perror ("metrics: write");
+    else
+      pthread_join (thread, NULL);
+    thread_started = false;
+  }
+
+  if (metrics_file)
+    dump_metrics ();
+
+  if (sock >= 0) {
+    close (sock);
+    unlink (metrics_socket);
+    sock = -1;
+  }
+  close (read_fd);
+  close (write_fd);
+
+  while ((m = list) != NULL) {
+    list = m->next;
+    free (m->type);
+    free (m->name);
+    free (m->exportname);
+    free (m);
+  }
+  nr_metrics = 0;
+  free_plugin_metrics ();
+  enabled = false;
+}
+
+#else /* WIN32 */
+
+uint64_t
+metrics_now (void)
+{
+  return 0;
+}
+
+uint64_t
+metrics_start (struct metrics *m)
+{
+  return 0;
+}
+
+struct metrics *
+metrics_get (struct backend *b, const char *exportname)
+{
+  return NULL;
+}
+
+void
+metrics_record (struct metrics *m, enum metrics_op op, uint64_t start,
+                uint64_t count, bool error)
+{
+}
+
+void
+metrics_record_async (struct nbdkit_async *async, int err)
+{
+}
+
+void
+metrics_init (void)
+{
+  if (metrics_file || metrics_socket) {
+    fprintf (stderr, "%s: metrics are not supported on Windows\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+}
+
+void
+metrics_start_thread (void)
+{
+}
+
+NBDKIT_DLL_PUBLIC int
+nbdkit_add_metric (const char *name, const char *help, int type,
+                   uint64_t (*get) (void))
+{
+  return 0;
+}
+
+void
+metrics_stop (void)
+{
+}
+
+#endif /* WIN32 */
@@ -40,13 +40,20 @@
 
 enum {
   HELP_OPTION = CHAR_MAX + 1,
+  BUFFER_HUGEPAGES_OPTION,
+  BUFFER_MEMORY_OPTION,
   DUMP_CONFIG_OPTION,
   DUMP_PLUGIN_OPTION,
+  ENGINE_OPTION,
   EXIT_WITH_PARENT_OPTION,
   FILTER_OPTION,
   LOG_OPTION,
   LONG_OPTIONS_OPTION,
   MASK_HANDSHAKE_OPTION,
+  METRICS_FILE_OPTION,
+  METRICS_SOCKET_OPTION,
+  MERGE_WAIT_OPTION,
+  MERGE_WRITES_OPTION,
   NO_SR_OPTION,
   RUN_OPTION,
   SELINUX_LABEL_OPTION,
@@ -63,6 +70,8 @@ static const char *short_options = "46D:e:fg:i:nop:P:rst:u:U:vV";
 static const struct option long_options[] = {
   { "ipv4-only",        no_argument,       NULL, '4' },
   { "ipv6-only",        no_argument,       NULL, '6' },
+  { "buffer-hugepages", required_argument, NULL, BUFFER_HUGEPAGES_OPTION },
+  { "buffer-memory",    required_argument, NULL, BUFFER_MEMORY_OPTION },
   { "debug",            required_argument, NULL, 'D' },
   { "dump-config",      no_argument,       NULL, DUMP_CONFIG_OPTION },
   { "dump-plugin",      no_argument,       NULL, DUMP_PLUGIN_OPTION },
@@ -74,12 +83,17 @@ static const struct option long_options[] = {
   { "foreground",       no_argument,       NULL, 'f' },
   { "no-fork",          no_argument,       NULL, 'f' },
   { "group",            required_argument, NULL, 'g' },
+  { "engine",           required_argument, NULL, ENGINE_OPTION },
   { "help",             no_argument,       NULL, HELP_OPTION },
   { "ip-addr",          required_argument, NULL, 'i' },
   { "ipaddr",           required_argument, NULL, 'i' },
   { "log",              required_argument, NULL, LOG_OPTION },
   { "long-options",     no_argument,       NULL, LONG_OPTIONS_OPTION },
   { "mask-handshake",   required_argument, NULL, MASK_HANDSHAKE_OPTION },
+  { "merge-wait",       required_argument, NULL, MERGE_WAIT_OPTION },
+  { "merge-writes",     required_argument, NULL, MERGE_WRITES_OPTION },
+  { "metrics-file",     required_argument, NULL, METRICS_FILE_OPTION },
+  { "metrics-socket",   required_argument, NULL, METRICS_SOCKET_OPTION },
   { "new-style",        no_argument,       NULL, 'n' },
   { "newstyle",         no_argument,       NULL, 'n' },
   { "no-sr",            no_argument,       NULL, NO_SR_OPTION },
@@ -45,6 +45,7 @@
 #endif
 
 #include "internal.h"
+#include "ispowerof2.h"
 #include "minmax.h"
 
 /* We extend the generic backend struct with extra fields relating
@@ -83,8 +84,7 @@ plugin_thread_model (struct backend *b)
     r = p->plugin.thread_model ();
     if (r == -1)
       exit (EXIT_FAILURE);
-    if (r < model)
-      model = r;
+    model = thread_model_min (model, r);
   }
 
   return model;
@@ -173,6 +173,7 @@ plugin_dump_fields (struct backend *b)
   HAS (close);
   HAS (export_description);
   HAS (get_size);
+  HAS (block_size);
   HAS (can_write);
   HAS (can_flush);
   HAS (is_rotational);
@@ -191,6 +192,13 @@ plugin_dump_fields (struct backend *b)
   HAS (zero);
   HAS (extents);
   HAS (cache);
+  HAS (pread_fd);
+  HAS (pread_async);
+  HAS (pwrite_async);
+  HAS (flush_async);
+  HAS (trim_async);
+  HAS (zero_async);
+  HAS (pread_sparse);
 
   HAS (_pread_v1);
   HAS (_pwrite_v1);
@@ -408,6 +416,47 @@ plugin_get_size (struct context *c)
   return p->plugin.get_size (c->handle);
 }
 
+static int
+plugin_block_size (struct context *c,
+                   uint32_t *minimum, uint32_t *preferred, uint32_t *maximum)
+{
+  struct backend *b = c->b;
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+
+  *minimum = *preferred = *maximum = 0;
+  if (!p->plugin.block_size)
+    return 0; /* no constraints */
+
+  if (p->plugin.block_size (c->handle, minimum, preferred, maximum) == -1)
+    return -1;
+
+  /* All zeroes means the plugin has no constraints after all. */
+  if (*minimum == 0 && *preferred == 0 && *maximum == 0)
+    return 0;
+
+  if (*minimum < 1 || *minimum > 65536 || !is_power_of_2 (*minimum)) {
+    nbdkit_error ("%s: block_size: minimum block size must be a power "
+                  "of 2 between 1 and 64K", b->name);
+    return -1;
+  }
+  if (*preferred < 512 || *preferred > 32 * 1024 * 1024 ||
+      !is_power_of_2 (*preferred) || *preferred < *minimum) {
+    nbdkit_error ("%s: block_size: preferred block size must be a power "
+                  "of 2 between 512 and 32M, and at least the minimum",
+                  b->name);
+    return -1;
+  }
+  if (*maximum < *preferred ||
+      (*maximum != UINT32_MAX && *maximum % *minimum != 0)) {
+    nbdkit_error ("%s: block_size: maximum block size must be at least "
+                  "the preferred block size, and a multiple of the "
+                  "minimum (or 0xffffffff)", b->name);
+    return -1;
+  }
+
+  return 0;
+}
+
 static int
 normalize_bool (int value)
 {
@@ -802,6 +851,141 @@ plugin_cache (struct context *c,
   return r;
 }
 
+static int
+plugin_pread_fd (struct context *c,
+                 uint32_t count, uint64_t offset, uint32_t flags,
+                 int *fd, uint64_t *fd_offset, int *err)
+{
+  struct backend *b = c->b;
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  int r;
+
+  if (!p->plugin.pread_fd)
+    return 0;
+
+  r = p->plugin.pread_fd (c->handle, count, offset, flags, fd, fd_offset);
+  if (r == -1)
+    *err = get_error (p);
+  else if (r == 1 && *fd < 0) {
+    nbdkit_error ("%s: pread_fd: returned an invalid file descriptor",
+                  b->name);
+    *err = EIO;
+    r = -1;
+  }
+  return r;
+}
+
+static int
+plugin_pread_sparse (struct context *c,
+                     void *buf, uint32_t count, uint64_t offset,
+                     uint32_t flags, struct nbdkit_extents *extents,
+                     int *err)
+{
+  struct backend *b = c->b;
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  size_t i, n;
+  struct nbdkit_extent e;
+
+  if (!p->plugin.pread_sparse)
+    return 0;
+
+  if (p->plugin.pread_sparse (c->handle, buf, count, offset, flags,
+                              extents) == -1) {
+    *err = get_error (p);
+    return -1;
+  }
+
+  /* The parts of the buffer which the plugin did not describe have
+   * not been filled in, so the extents must cover the whole read.
+   * Only zero extents are sent as holes, and anything else is sent
+   * from the buffer, so it must be data which the plugin copied.
+   */
+  n = nbdkit_extents_count (extents);
+  for (i = 0; i < n; ++i) {
+    e = nbdkit_get_extent (extents, i);
+    if (e.type != 0 && !(e.type & NBDKIT_EXTENT_ZERO)) {
+      nbdkit_error ("%s: pread_sparse: extent at offset %" PRIu64 " "
+                    "has type %" PRIu32 " which is neither data nor zero",
+                    b->name, e.offset, e.type);
+      *err = EIO;
+      return -1;
+    }
+  }
+  if (n > 0) {
+    e = nbdkit_get_extent (extents, n - 1);
+    if (e.offset + e.length == offset + count)
+      return 1;
+  }
+  nbdkit_error ("%s: pread_sparse: extents do not cover the whole read",
+                b->name);
+  *err = EIO;
+  return -1;
+}
+
+/* Plugins call this when a request started by one of the
+ * asynchronous callbacks has finished.
+ */
+NBDKIT_DLL_PUBLIC void
+nbdkit_async_complete (struct nbdkit_async *async, int err)
+{
+  err = err > 0 ? err : (err < 0 ? EIO : 0);
+  metrics_record_async (async, err);
+  async->complete (async, err);
+}
+
+static int
+plugin_async (struct context *c, struct nbdkit_async *async, int *err)
+{
+  struct backend *b = c->b;
+  struct backend_plugin *p = container_of (b, struct backend_plugin, backend);
+  uint32_t flags = async->flags;
+  int r;
+
+  /* FUA and zeroing are emulated by the synchronous functions. */
+  if ((flags & NBDKIT_FLAG_FUA) && backend_can_fua (c) != NBDKIT_FUA_NATIVE)
+    return 0;
+
+  switch (async->cmd) {
+  case NBD_CMD_READ:
+    if (!p->plugin.pread_async)
+      return 0;
+    r = p->plugin.pread_async (c->handle, async->buf, async->count,
+                               async->offset, flags, async);
+    break;
+  case NBD_CMD_WRITE:
+    if (!p->plugin.pwrite_async)
+      return 0;
+    r = p->plugin.pwrite_async (c->handle, async->buf, async->count,
+                                async->offset, flags, async);
+    break;
+  case NBD_CMD_FLUSH:
+    if (!p->plugin.flush_async)
+      return 0;
+    r = p->plugin.flush_async (c->handle, flags, async);
+    break;
+  case NBD_CMD_TRIM:
+    if (!p->plugin.trim_async)
+      return 0;
+    r = p->plugin.trim_async (c->handle, async->count, async->offset,
+                              flags, async);
+    break;
+  case NBD_CMD_WRITE_ZEROES:
+    if (!p->plugin.zero_async || !async->count ||
+        backend_can_zero (c) != NBDKIT_ZERO_NATIVE)
+      return 0;
+    r = p->plugin.zero_async (c->handle, async->count, async->offset,
+                              flags, async);
+    break;
+  default:
+    abort ();
+  }
+  if (r == -1) {
+    *err = get_error (p);
+    return -1;
+  }
+  return 1;
+}
+
 static struct backend plugin_functions = {
   .free = plugin_free,
   .thread_model = plugin_thread_model,
@@ -824,6 +1008,7 @@ static struct backend plugin_functions = {
   .close = plugin_close,
   .export_description = plugin_export_description,
   .get_size = plugin_get_size,
+  .block_size = plugin_block_size,
   .can_write = plugin_can_write,
   .can_flush = plugin_can_flush,
   .is_rotational = plugin_is_rotational,
@@ -841,6 +1026,9 @@ static struct backend plugin_functions = {
   .zero = plugin_zero,
   .extents = plugin_extents,
   .cache = plugin_cache,
+  .pread_fd = plugin_pread_fd,
+  .async = plugin_async,
+  .pread_sparse = plugin_pread_sparse,
 };
 
 /* Register and load a plugin. */
@@ -910,6 +1098,22 @@ plugin_register (size_t index, const char *filename,
     exit (EXIT_FAILURE);
   }
 
+  /* The synchronous callbacks are still used when a request cannot be
+   * done asynchronously, so they must exist too.
+   */
+#define CHECK_ASYNC(fn)                                                 \
+  if (p->plugin.fn##_async && p->plugin.fn == NULL) {                   \
+    fprintf (stderr, "%s: %s: plugin with a ." #fn "_async callback "   \
+             "must also have a ." #fn " callback\n",                    \
+             program_name, filename);                                   \
+    exit (EXIT_FAILURE);                                                \
+  }
+  CHECK_ASYNC (pwrite);
+  CHECK_ASYNC (flush);
+  CHECK_ASYNC (trim);
+  CHECK_ASYNC (zero);
+#undef CHECK_ASYNC
+
   backend_load (&p->backend, p->plugin.name, p->plugin.load);
 
   return (struct backend *) p;
@@ -0,0 +1,218 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* A pool of worker threads shared by all connections.  Jobs are
+ * queued in FIFO order and run by the first free thread.
+ *
+ * Threads are only created when a job is submitted and no thread is
+ * free, so a client which never has more than one request in flight
+ * only ever needs one thread.  We keep about one idle thread per CPU.
+ * Threads above that exit when they have had nothing to do for
+ * IDLE_TIMEOUT seconds, so that bursts of requests do not create and
+ * destroy threads all the time.
+ *
+ * The pool does not limit the number of threads.  Plugins may block
+ * for a long time (eg. the delay filter, or a remote server), and
+ * each connection is allowed -t requests in parallel, which must not
+ * wait for requests from other connections.  The number of requests
+ * in flight on each connection is limited by the callers.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include "internal.h"
+
+#define IDLE_TIMEOUT 1          /* seconds */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t exited = PTHREAD_COND_INITIALIZER;
+
+/* The fields below are protected by the lock. */
+static struct pool_job *head = NULL, *tail = NULL;
+static unsigned nr_queued = 0;  /* Jobs in the queue. */
+static unsigned nr_threads = 0; /* Running threads. */
+static unsigned nr_idle = 0;    /* Threads waiting for a job. */
+static unsigned max_idle = 0;   /* Number of idle threads to keep. */
+static unsigned next_id = 0;    /* For thread names. */
+static bool stopping = false;
+
+/* Add a job to the queue.  Called with the lock held. */
+static void
+enqueue (struct pool_job *job)
+{
+  job->next = NULL;
+  if (tail)
+    tail->next = job;
+  else
+    head = job;
+  tail = job;
+  nr_queued++;
+}
+
+static void *
+pool_worker (void *datav)
+{
+  unsigned id = (uintptr_t) datav;
+  char name[32];
+  struct pool_job *job;
+
+  threadlocal_new_server_thread ();
+  snprintf (name, sizeof name, "pool.%u", id);
+  threadlocal_set_name (name);
+  debug ("starting worker thread %s", name);
+
+  for (;;) {
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+      if (head == NULL && !stopping) {
+        if (nr_idle < max_idle) {
+          nr_idle++;
+          while (head == NULL && !stopping)
+            pthread_cond_wait (&cond, &lock);
+          nr_idle--;
+        }
+        else {
+          struct timespec ts;
+          int r = 0;
+
+          clock_gettime (CLOCK_REALTIME, &ts);
+          ts.tv_sec += IDLE_TIMEOUT;
+          nr_idle++;
+          while (head == NULL && !stopping && r != ETIMEDOUT)
+            r = pthread_cond_timedwait (&cond, &lock, &ts);
+          nr_idle--;
+        }
+      }
+      if (head == NULL)
+        break;
+      job = head;
+      head = job->next;
+      if (head == NULL)
+        tail = NULL;
+      nr_queued--;
+    }
+
+    job->run (job);
+
+    /* Jobs may change the thread-local data to act on behalf of a
+     * connection, so put it back afterwards.
+     */
+    threadlocal_set_conn (NULL);
+    threadlocal_set_name (name);
+    threadlocal_set_instance_num (0);
+  }
+
+  debug ("exiting worker thread %s", name);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  nr_threads--;
+  pthread_cond_broadcast (&exited);
+  return NULL;
+}
+
+void
+pool_submit (struct pool_job *job)
+{
+  pthread_attr_t attrs;
+  pthread_t thread;
+  int err;
+
+  pthread_mutex_lock (&lock);
+
+  if (max_idle == 0) {
+    long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+    max_idle = ncpus > 0 ? ncpus : 1;
+  }
+
+  /* If there is an idle thread for the job, wake it up. */
+  if (nr_queued < nr_idle) {
+    enqueue (job);
+    pthread_cond_signal (&cond);
+    pthread_mutex_unlock (&lock);
+    return;
+  }
+
+  /* Otherwise start a new thread. */
+  pthread_attr_init (&attrs);
+  pthread_attr_setdetachstate (&attrs, PTHREAD_CREATE_DETACHED);
+  err = pthread_create (&thread, &attrs, pool_worker,
+                        (void *) (uintptr_t) next_id);
+  pthread_attr_destroy (&attrs);
+  if (err == 0) {
+    next_id++;
+    nr_threads++;
+    enqueue (job);
+    pthread_mutex_unlock (&lock);
+    return;
+  }
+  errno = err;
+  perror ("pthread_create");
+
+  /* If we could not create a thread, the job will run when one of the
+   * existing threads is free.  If there are none, run it here.
+   */
+  if (nr_threads > 0) {
+    enqueue (job);
+    pthread_mutex_unlock (&lock);
+    return;
+  }
+  pthread_mutex_unlock (&lock);
+  job->run (job);
+}
+
+/* Wait for all queued jobs to finish and the threads to exit.  This
+ * must only be called once no more jobs can be submitted.
+ */
+void
+pool_stop (void)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+
+  stopping = true;
+  pthread_cond_broadcast (&cond);
+  while (nr_threads > 0)
+    pthread_cond_wait (&exited, &lock);
+  stopping = false;
+}
@@ -41,6 +41,7 @@
 
 #include "internal.h"
 #include "byte-swapping.h"
+#include "minmax.h"
 #include "nbd-protocol.h"
 #include "protostrings.h"
 #include "strndup.h"
@@ -164,6 +165,51 @@ send_newstyle_option_reply_info_export (uint32_t option, uint32_t reply,
   return 0;
 }
 
+/* Send NBD_INFO_BLOCK_SIZE.  If the plugin and filters did not set
+ * any block size constraints this still tells the client about the
+ * largest read or write request that we accept.
+ */
+static int
+send_newstyle_option_reply_info_block_size (uint32_t option, uint32_t reply)
+{
+  GET_CONN;
+  struct nbd_fixed_new_option_reply fixed_new_option_reply;
+  struct nbd_fixed_new_option_reply_info_block_size block_size;
+  uint32_t minimum, preferred, maximum;
+
+  if (backend_block_size (conn->top_context,
+                          &minimum, &preferred, &maximum) == -1)
+    return -1;
+  if (minimum == 0) {
+    minimum = 1;
+    preferred = 4096;
+    maximum = UINT32_MAX;
+  }
+  maximum = MIN (maximum, MAX_REQUEST_SIZE);
+
+  debug ("newstyle negotiation: %s: block size: "
+         "minimum=%" PRIu32 " preferred=%" PRIu32 " maximum=%" PRIu32,
+         name_of_nbd_opt (option), minimum, preferred, maximum);
+
+  fixed_new_option_reply.magic = htobe64 (NBD_REP_MAGIC);
+  fixed_new_option_reply.option = htobe32 (option);
+  fixed_new_option_reply.reply = htobe32 (reply);
+  fixed_new_option_reply.replylen = htobe32 (sizeof block_size);
+  block_size.info = htobe16 (NBD_INFO_BLOCK_SIZE);
+  block_size.minimum = htobe32 (minimum);
+  block_size.preferred = htobe32 (preferred);
+  block_size.maximum = htobe32 (maximum);
+
+  if (conn->send (&fixed_new_option_reply,
+                  sizeof fixed_new_option_reply, SEND_MORE) == -1 ||
+      conn->send (&block_size, sizeof block_size, 0) == -1) {
+    nbdkit_error ("write: %s: %m", name_of_nbd_opt (option));
+    return -1;
+  }
+
+  return 0;
+}
+
 /* Can be used for NBD_INFO_NAME and NBD_INFO_DESCRIPTION. */
 static int
 send_newstyle_option_reply_info_str (uint32_t option, uint32_t reply,
@@ -498,6 +544,7 @@ negotiate_handshake_newstyle_options (void)
         debug ("using TLS on this connection");
         /* Wipe out any cached state. */
         conn->structured_replies = false;
+        conn->extended_headers = false;
         free (conn->exportname_from_set_meta_context);
         conn->exportname_from_set_meta_context = NULL;
         conn->meta_context_base_allocation = false;
@@ -589,16 +636,25 @@ negotiate_handshake_newstyle_options (void)
                                                     exportsize) == -1)
           return -1;
 
+        /* The spec allows NBD_INFO_BLOCK_SIZE to be sent even if the
+         * client did not request it, and clients which don't
+         * understand it will ignore it.
+         */
+        if (send_newstyle_option_reply_info_block_size (option,
+                                                        NBD_REP_INFO) == -1)
+          return -1;
+
         /* For now we send NBD_INFO_NAME and NBD_INFO_DESCRIPTION if
          * requested, and ignore all other info requests (including
-         * NBD_INFO_EXPORT if it was requested, because we replied
-         * already above).
+         * NBD_INFO_EXPORT and NBD_INFO_BLOCK_SIZE if they were
+         * requested, because we replied already above).
          */
         for (i = 0; i < nrinfos; ++i) {
           memcpy (&info, &data[4 + exportnamelen + 2 + i*2], 2);
           info = be16toh (info);
           switch (info) {
           case NBD_INFO_EXPORT: /* ignore - reply sent above */ break;
+          case NBD_INFO_BLOCK_SIZE: /* ignore - reply sent above */ break;
           case NBD_INFO_NAME:
             {
               const char *name = &data[4];
@@ -686,9 +742,53 @@ negotiate_handshake_newstyle_options (void)
         break;
       }
 
+      /* Extended headers imply structured replies, and the spec says
+       * the client must not also ask for compact structured replies.
+       */
+      if (conn->extended_headers) {
+        if (send_newstyle_option_reply (option, NBD_REP_ERR_EXT_HEADER_REQD)
+            == -1)
+          return -1;
+        debug ("newstyle negotiation: %s: extended headers are already "
+               "in use", name_of_nbd_opt (option));
+        break;
+      }
+
+      if (send_newstyle_option_reply (option, NBD_REP_ACK) == -1)
+        return -1;
+
+      conn->structured_replies = true;
+      break;
+
+    case NBD_OPT_EXTENDED_HEADERS:
+      if (optlen != 0) {
+        if (send_newstyle_option_reply (option, NBD_REP_ERR_INVALID)
+            == -1)
+          return -1;
+        if (conn_recv_full (data, optlen,
+                            "read: %s: %m", name_of_nbd_opt (option)) == -1)
+          return -1;
+        continue;
+      }
+
+      debug ("newstyle negotiation: %s: client requested extended headers",
+             name_of_nbd_opt (option));
+
+      /* Extended headers include structured replies, so --no-sr
+       * disables them as well.
+       */
+      if (no_sr) {
+        if (send_newstyle_option_reply (option, NBD_REP_ERR_UNSUP) == -1)
+          return -1;
+        debug ("newstyle negotiation: %s: extended headers are disabled",
+               name_of_nbd_opt (option));
+        break;
+      }
+
       if (send_newstyle_option_reply (option, NBD_REP_ACK) == -1)
         return -1;
 
+      conn->extended_headers = true;
       conn->structured_replies = true;
       break;
 
@@ -78,6 +78,7 @@ protocol_common_open (uint64_t *exportsize, uint16_t *flags,
   GET_CONN;
   int64_t size;
   uint16_t eflags = NBD_FLAG_HAS_FLAGS;
+  uint32_t minimum, preferred, maximum;
   int fl;
 
   conn->top_context = backend_open (top, read_only, exportname, false);
@@ -97,6 +98,13 @@ protocol_common_open (uint64_t *exportsize, uint16_t *flags,
     return -1;
   }
 
+  /* Prime the block size cache, so that sending NBD_INFO_BLOCK_SIZE
+   * in the newstyle handshake doesn't have to worry about errors.
+   */
+  if (backend_block_size (conn->top_context,
+                          &minimum, &preferred, &maximum) == -1)
+    return -1;
+
   /* Check all flags even if they won't be advertised, to prime the
    * cache and make later request validation easier.
    */
@@ -44,12 +44,34 @@
 
 #include "internal.h"
 #include "byte-swapping.h"
+#include "iszero.h"
 #include "minmax.h"
 #include "nbd-protocol.h"
 #include "protostrings.h"
 
+/* Requests sent with extended headers can have 64 bit counts, but
+ * the plugin and filter APIs only take 32 bit counts, so larger
+ * requests are split into several calls to the backend.  Each call
+ * starts at a multiple of this from the request offset, so the calls
+ * are as aligned as the request itself.
+ */
+#define MAX_BACKEND_COUNT (UINT32_C (1) << 31)
+
+/* A large block status request is answered by repeatedly querying
+ * the backend until the request is covered, but stop adding more
+ * extents to the reply after this many.
+ */
+#define MAX_BLOCK_STATUS_EXTENTS 65536
+
+/* Size of the next backend call for a request of 'count' bytes. */
+static uint32_t
+backend_count (uint64_t count)
+{
+  return count > UINT32_MAX ? MAX_BACKEND_COUNT : count;
+}
+
 static bool
-validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
+validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint64_t count,
                   uint32_t *error)
 {
   GET_CONN;
@@ -75,7 +97,7 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
     if (!backend_valid_range (conn->top_context, offset, count)) {
       /* XXX Allow writes to extend the disk? */
       nbdkit_error ("invalid request: %s: offset and count are out of range: "
-                    "offset=%" PRIu64 " count=%" PRIu32,
+                    "offset=%" PRIu64 " count=%" PRIu64,
                     name_of_nbd_cmd (cmd), offset, count);
       *error = (cmd == NBD_CMD_WRITE ||
                 cmd == NBD_CMD_WRITE_ZEROES) ? ENOSPC : EINVAL;
@@ -149,7 +171,7 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
   /* Refuse over-large read and write requests. */
   if ((cmd == NBD_CMD_WRITE || cmd == NBD_CMD_READ) &&
       count > MAX_REQUEST_SIZE) {
-    nbdkit_error ("invalid request: %s: data request is too large (%" PRIu32
+    nbdkit_error ("invalid request: %s: data request is too large (%" PRIu64
                   " > %d)",
                   name_of_nbd_cmd (cmd), count, MAX_REQUEST_SIZE);
     *error = ENOMEM;
@@ -210,6 +232,54 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
   return true;                     /* Command validates. */
 }
 
+/* Fetch the extents for a block status request.  A request which
+ * fits in a single backend call gets whatever the backend returns,
+ * but larger requests query the backend repeatedly until the request
+ * is covered (the reply is allowed to be shorter than the request, so
+ * we also stop once there are enough extents).
+ */
+static int
+get_extents (struct context *c, uint64_t count, uint64_t offset,
+             uint32_t flags, struct nbdkit_extents *extents, int *err)
+{
+  const uint64_t end = offset + count;
+  struct nbdkit_extent e;
+  size_t i, nr;
+
+  if (backend_extents (c, backend_count (count), offset, flags,
+                       extents, err) == -1)
+    return -1;
+  if (count <= UINT32_MAX || (flags & NBDKIT_FLAG_REQ_ONE))
+    return 0;
+
+  while ((nr = nbdkit_extents_count (extents)) < MAX_BLOCK_STATUS_EXTENTS) {
+    CLEANUP_EXTENTS_FREE struct nbdkit_extents *t = NULL;
+
+    e = nbdkit_get_extent (extents, nr - 1);
+    offset = e.offset + e.length;
+    if (offset >= end)
+      break;
+
+    t = nbdkit_extents_new (offset, backend_get_size (c));
+    if (t == NULL) {
+      *err = errno;
+      return -1;
+    }
+    if (backend_extents (c, backend_count (end - offset), offset, flags,
+                         t, err) == -1)
+      return -1;
+    for (i = 0; i < nbdkit_extents_count (t); ++i) {
+      e = nbdkit_get_extent (t, i);
+      if (nbdkit_add_extent (extents, e.offset, e.length, e.type) == -1) {
+        *err = errno;
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
 /* This is called with the request lock held to actually execute the
  * request (by calling the plugin).  Note that the request fields have
  * been validated already in 'validate_request' so we don't have to
@@ -226,12 +296,12 @@ validate_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
  * for success).
  */
 static uint32_t
-handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
+handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint64_t count,
                 void *buf, struct nbdkit_extents *extents)
 {
   GET_CONN;
   struct context *c = conn->top_context;
-  uint32_t f = 0;
+  uint32_t f = 0, n;
   int err = 0;
 
   /* Clear the error, so that we know if the plugin calls
@@ -259,13 +329,23 @@ handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
   case NBD_CMD_TRIM:
     if (flags & NBD_CMD_FLAG_FUA)
       f |= NBDKIT_FLAG_FUA;
-    if (backend_trim (c, count, offset, f, &err) == -1)
-      return err;
+    do {
+      n = backend_count (count);
+      if (backend_trim (c, n, offset, f, &err) == -1)
+        return err;
+      offset += n;
+      count -= n;
+    } while (count > 0);
     break;
 
   case NBD_CMD_CACHE:
-    if (backend_cache (c, count, offset, 0, &err) == -1)
-      return err;
+    do {
+      n = backend_count (count);
+      if (backend_cache (c, n, offset, 0, &err) == -1)
+        return err;
+      offset += n;
+      count -= n;
+    } while (count > 0);
     break;
 
   case NBD_CMD_WRITE_ZEROES:
@@ -275,15 +355,19 @@ handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
       f |= NBDKIT_FLAG_FUA;
     if (flags & NBD_CMD_FLAG_FAST_ZERO)
       f |= NBDKIT_FLAG_FAST_ZERO;
-    if (backend_zero (c, count, offset, f, &err) == -1)
-      return err;
+    do {
+      n = backend_count (count);
+      if (backend_zero (c, n, offset, f, &err) == -1)
+        return err;
+      offset += n;
+      count -= n;
+    } while (count > 0);
     break;
 
   case NBD_CMD_BLOCK_STATUS:
     if (flags & NBD_CMD_FLAG_REQ_ONE)
       f |= NBDKIT_FLAG_REQ_ONE;
-    if (backend_extents (c, count, offset, f,
-                         extents, &err) == -1)
+    if (get_extents (c, count, offset, f, extents, &err) == -1)
       return err;
     break;
 
@@ -362,10 +446,87 @@ nbd_errno (int error, uint16_t flags)
   }
 }
 
+/* This is called with the request lock held to ask the plugin for a
+ * file descriptor containing the data of a read request, which can
+ * then be sent to the client without copying it through a buffer.
+ * If the plugin (or a filter) cannot do this, *fd is left as -1 and
+ * the caller should fall back to handle_request.  The return value is
+ * the same as for handle_request.
+ */
+static uint32_t
+handle_read_fd (uint64_t offset, uint32_t count,
+                int *fd, uint64_t *fd_offset)
+{
+  GET_CONN;
+  struct context *c = conn->top_context;
+  int err = 0;
+  int r;
+
+  threadlocal_set_error (0);
+
+  r = backend_pread_fd (c, count, offset, 0, fd, fd_offset, &err);
+  if (r == -1)
+    return err;
+  if (r == 0)
+    *fd = -1;
+  return 0;
+}
+
+/* This is called with the request lock held to ask the plugin to
+ * read into buf, leaving out the ranges which are zeroes and listing
+ * them in *extents instead.  If the plugin (or a filter) cannot do
+ * this, *extents is left as NULL and the caller should fall back to
+ * handle_request.  The return value is the same as for
+ * handle_request.
+ */
+static uint32_t
+handle_read_sparse (uint64_t offset, uint32_t count, void *buf,
+                    struct nbdkit_extents **extents)
+{
+  GET_CONN;
+  struct context *c = conn->top_context;
+  CLEANUP_EXTENTS_FREE struct nbdkit_extents *e = NULL;
+  int err = 0;
+  int r;
+
+  e = nbdkit_extents_new (offset, offset + count);
+  if (e == NULL)
+    return ENOMEM;
+
+  threadlocal_set_error (0);
+
+  r = backend_pread_sparse (c, buf, count, offset, 0, e, &err);
+  if (r == -1)
+    return err;
+  if (r == 0) {
+    /* Whether this is supported doesn't change during the connection. */
+    conn->no_pread_sparse = true;
+    return 0;
+  }
+  *extents = e;
+  e = NULL;
+  return 0;
+}
+
+/* Send the data of a read reply, either from buf or, if buf is NULL,
+ * from the file descriptor returned by handle_read_fd.
+ */
+static int
+send_read_data (const char *buf, int fd, uint64_t fd_offset,
+                uint32_t count, int flags)
+{
+  GET_CONN;
+
+  if (buf)
+    return conn->send (buf, count, flags);
+  assert (fd >= 0 && conn->send_fd);
+  return conn->send_fd (fd, fd_offset, count, flags);
+}
+
 static int
 send_simple_reply (uint64_t handle, uint16_t cmd, uint16_t flags,
-                   const char *buf, uint32_t count,
-                   uint32_t error)
+                   const char *buf, int fd, uint64_t fd_offset,
+                   uint32_t count, uint32_t error)
 {
   GET_CONN;
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
@@ -385,7 +546,7 @@ send_simple_reply (uint64_t handle, uint16_t cmd, uint16_t flags,
 
   /* Send the read data buffer. */
   if (cmd == NBD_CMD_READ && !error) {
-    r = conn->send (buf, count, 0);
+    r = send_read_data (buf, fd, fd_offset, count, 0);
     if (r == -1) {
       nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
       return connection_set_status (-1);
@@ -395,35 +556,103 @@ send_simple_reply (uint64_t handle, uint16_t cmd, uint16_t flags,
   return 1;                     /* command processed ok */
 }
 
+/* Send the header of a structured reply chunk, or an extended reply
+ * header if the client negotiated extended headers.  'offset' is the
+ * offset of the request, which only extended replies carry.  This
+ * must be called with the write lock held.
+ */
 static int
-send_structured_reply_read (uint64_t handle, uint16_t cmd,
-                            const char *buf, uint32_t count, uint64_t offset)
+send_structured_reply_header (uint64_t handle, uint16_t cmd, uint64_t offset,
+                              uint16_t flags, uint16_t type, uint64_t length,
+                              int f)
 {
   GET_CONN;
-  /* Once we are really using structured replies and sending data back
-   * in chunks, we'll be able to grab the write lock for each chunk,
-   * allowing other threads to interleave replies.  As we're not doing
-   * that yet we acquire the lock for the whole function.
-   */
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
-  struct nbd_structured_reply reply;
-  struct nbd_structured_reply_offset_data offset_data;
   int r;
 
-  assert (cmd == NBD_CMD_READ);
-
-  reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
-  reply.handle = handle;
-  reply.flags = htobe16 (NBD_REPLY_FLAG_DONE);
-  reply.type = htobe16 (NBD_REPLY_TYPE_OFFSET_DATA);
-  reply.length = htobe32 (count + sizeof offset_data);
+  if (conn->extended_headers) {
+    struct nbd_extended_reply reply;
 
-  r = conn->send (&reply, sizeof reply, SEND_MORE);
+    reply.magic = htobe32 (NBD_EXTENDED_REPLY_MAGIC);
+    reply.handle = handle;
+    reply.flags = htobe16 (flags);
+    reply.type = htobe16 (type);
+    reply.offset = htobe64 (offset);
+    reply.length = htobe64 (length);
+    r = conn->send (&reply, sizeof reply, f);
+  }
+  else {
+    struct nbd_structured_reply reply;
+
+    assert (length <= UINT32_MAX);
+    reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
+    reply.handle = handle;
+    reply.flags = htobe16 (flags);
+    reply.type = htobe16 (type);
+    reply.length = htobe32 (length);
+    r = conn->send (&reply, sizeof reply, f);
+  }
   if (r == -1) {
     nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
     return connection_set_status (-1);
   }
 
+  return 1;
+}
+
+/* Structured read replies are split into chunks of at most this much
+ * data.  The write lock is dropped between chunks, so a large read
+ * doesn't hold up the replies to other requests.
+ */
+#define READ_CHUNK_SIZE (1024 * 1024)
+
+/* Whole blocks of this size (aligned to the disk offset) which contain
+ * only zeroes are sent as holes.
+ */
+#define READ_HOLE_SIZE 4096
+
+/* Send one chunk of a structured read reply, either the data in
+ * buf[0..count-1] (or in the file descriptor if buf is NULL, see
+ * send_read_data) or (if hole is true) a hole of that size.
+ * 'req_offset' is the offset of the whole read request.
+ */
+static int
+send_structured_reply_read_chunk (uint64_t handle, uint16_t cmd,
+                                  uint64_t req_offset, bool last,
+                                  bool hole, const char *buf,
+                                  int fd, uint64_t fd_offset,
+                                  uint32_t count, uint64_t offset)
+{
+  GET_CONN;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+  struct nbd_structured_reply_offset_data offset_data;
+  struct nbd_structured_reply_offset_hole offset_hole;
+  int more = last ? 0 : SEND_MORE;
+  int r;
+
+  if (hole)
+    r = send_structured_reply_header (handle, cmd, req_offset,
+                                      last ? NBD_REPLY_FLAG_DONE : 0,
+                                      NBD_REPLY_TYPE_OFFSET_HOLE,
+                                      sizeof offset_hole, SEND_MORE);
+  else
+    r = send_structured_reply_header (handle, cmd, req_offset,
+                                      last ? NBD_REPLY_FLAG_DONE : 0,
+                                      NBD_REPLY_TYPE_OFFSET_DATA,
+                                      count + sizeof offset_data, SEND_MORE);
+  if (r <= 0)
+    return r;
+
+  if (hole) {
+    offset_hole.offset = htobe64 (offset);
+    offset_hole.length = htobe32 (count);
+    r = conn->send (&offset_hole, sizeof offset_hole, more);
+    if (r == -1) {
+      nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
+      return connection_set_status (-1);
+    }
+    return 1;
+  }
+
   /* Send the offset + read data buffer. */
   offset_data.offset = htobe64 (offset);
   r = conn->send (&offset_data, sizeof offset_data, SEND_MORE);
@@ -432,35 +661,176 @@ send_structured_reply_read (uint64_t handle, uint16_t cmd,
     return connection_set_status (-1);
   }
 
-  r = conn->send (buf, count, 0);
+  r = send_read_data (buf, fd, fd_offset, count, more);
   if (r == -1) {
     nbdkit_error ("write data: %s: %m", name_of_nbd_cmd (cmd));
     return connection_set_status (-1);
   }
 
+  return 1;
+}
+
+/* Is the block of buf at [pos, pos+len) a whole block of zeroes? */
+static bool
+is_hole_block (const char *buf, uint32_t pos, uint32_t len)
+{
+  return len == READ_HOLE_SIZE && is_zero (&buf[pos], len);
+}
+
+/* Length of the block starting at pos, up to the next aligned
+ * boundary on the disk.
+ */
+static uint32_t
+read_block_len (uint64_t offset, uint32_t pos, uint32_t count)
+{
+  uint32_t len = READ_HOLE_SIZE - (offset + pos) % READ_HOLE_SIZE;
+
+  return MIN (len, count - pos);
+}
+
+/* Send buf[pos..end-1] of the data of a read reply as chunks, with
+ * runs of whole zero blocks sent as holes.
+ */
+static int
+send_read_chunks (uint64_t handle, uint16_t cmd, const char *buf,
+                  uint32_t pos, uint32_t end, uint32_t count, uint64_t offset)
+{
+  uint32_t len, n;
+  bool hole;
+  int r;
+
+  do {
+    /* Find the next run of data or of whole zero blocks. */
+    n = read_block_len (offset, pos, end);
+    hole = is_hole_block (buf, pos, n);
+    for (len = n; pos + len < end; len += n) {
+      if (!hole && len >= READ_CHUNK_SIZE)
+        break;
+      n = read_block_len (offset, pos + len, end);
+      if (is_hole_block (buf, pos + len, n) != hole)
+        break;
+    }
+
+    r = send_structured_reply_read_chunk (handle, cmd, offset,
+                                          pos + len == count,
+                                          hole, &buf[pos], -1, 0, len,
+                                          offset + pos);
+    if (r <= 0)
+      return r;
+    pos += len;
+  } while (pos < end);
+
+  return 1;                     /* command processed ok */
+}
+
+static int
+send_structured_reply_read (uint64_t handle, uint16_t cmd, uint16_t flags,
+                            const char *buf, uint32_t count, uint64_t offset)
+{
+  assert (cmd == NBD_CMD_READ);
+
+  /* The client can ask for the reply not to be fragmented, in which
+   * case we must send a single chunk.
+   */
+  if (flags & NBD_CMD_FLAG_DF)
+    return send_structured_reply_read_chunk (handle, cmd, offset, true,
+                                             count > 0 &&
+                                             is_zero (buf, count),
+                                             buf, -1, 0, count, offset);
+
+  return send_read_chunks (handle, cmd, buf, 0, count, count, offset);
+}
+
+/* As above, but for a read done by handle_read_sparse.  The ranges
+ * which the plugin said are zeroes were not filled in, and are sent
+ * as holes without looking at the buffer.
+ */
+static int
+send_structured_reply_read_sparse (uint64_t handle, uint16_t cmd,
+                                   const char *buf,
+                                   const struct nbdkit_extents *extents,
+                                   uint32_t count, uint64_t offset)
+{
+  struct nbdkit_extent e;
+  uint32_t pos, end;
+  size_t i;
+  int r;
+
+  assert (cmd == NBD_CMD_READ);
+
+  for (i = 0; i < nbdkit_extents_count (extents); ++i) {
+    e = nbdkit_get_extent (extents, i);
+    pos = e.offset - offset;
+    end = pos + e.length;
+    assert (end <= count);
+
+    if (e.type & NBDKIT_EXTENT_ZERO)
+      r = send_structured_reply_read_chunk (handle, cmd, offset,
+                                            end == count, true, NULL,
+                                            -1, 0, e.length, e.offset);
+    else
+      r = send_read_chunks (handle, cmd, buf, pos, end, count, offset);
+    if (r <= 0)
+      return r;
+  }
+
+  return 1;                     /* command processed ok */
+}
+
+/* As above, but the data is sent from the file descriptor returned
+ * by handle_read_fd.  We cannot look for holes without reading the
+ * data, so this is only split into chunks of READ_CHUNK_SIZE.
+ */
+static int
+send_structured_reply_read_fd (uint64_t handle, uint16_t cmd, uint16_t flags,
+                               int fd, uint64_t fd_offset,
+                               uint32_t count, uint64_t offset)
+{
+  uint32_t pos = 0, len;
+  int r;
+
+  assert (cmd == NBD_CMD_READ);
+
+  do {
+    len = count - pos;
+    if (!(flags & NBD_CMD_FLAG_DF))
+      len = MIN (len, READ_CHUNK_SIZE);
+
+    r = send_structured_reply_read_chunk (handle, cmd, offset,
+                                          pos + len == count,
+                                          false, NULL, fd, fd_offset + pos,
+                                          len, offset + pos);
+    if (r <= 0)
+      return r;
+    pos += len;
+  } while (pos < count);
+
   return 1;                     /* command processed ok */
 }
 
-/* Convert a list of extents into NBD_REPLY_TYPE_BLOCK_STATUS blocks.
- * The rules here are very complicated.  Read the spec carefully!
+/* Convert a list of extents into NBD_REPLY_TYPE_BLOCK_STATUS or
+ * NBD_REPLY_TYPE_BLOCK_STATUS_EXT blocks (in host byte order, each
+ * block no longer than 'max_length').  The rules here are very
+ * complicated.  Read the spec carefully!
  */
-static struct nbd_block_descriptor *
+static struct nbd_block_descriptor_ext *
 extents_to_block_descriptors (struct nbdkit_extents *extents,
                               uint16_t flags,
-                              uint32_t count, uint64_t offset,
+                              uint64_t count, uint64_t offset,
+                              uint64_t max_length,
                               size_t *nr_blocks)
 {
   const bool req_one = flags & NBD_CMD_FLAG_REQ_ONE;
   const size_t nr_extents = nbdkit_extents_count (extents);
   size_t i;
-  struct nbd_block_descriptor *blocks;
+  struct nbd_block_descriptor_ext *blocks;
 
   /* This is checked in server/plugins.c. */
   assert (nr_extents >= 1);
 
   /* We may send fewer than nr_extents blocks, but never more. */
   blocks = calloc (req_one ? 1 : nr_extents,
-                   sizeof (struct nbd_block_descriptor));
+                   sizeof (struct nbd_block_descriptor_ext));
   if (blocks == NULL) {
     nbdkit_error ("calloc: %m");
     return NULL;
@@ -475,7 +845,7 @@ extents_to_block_descriptors (struct nbdkit_extents *extents,
     *nr_blocks = 1;
 
     /* Must not exceed count of the original request. */
-    blocks[0].length = MIN (e.length, (uint64_t) count);
+    blocks[0].length = MIN (e.length, count);
     blocks[0].status_flags = e.type & 3;
   }
   else {
@@ -489,20 +859,19 @@ extents_to_block_descriptors (struct nbdkit_extents *extents,
       if (i == 0)
         assert (e.offset == offset);
 
-      /* Must not exceed UINT32_MAX. */
-      blocks[i].length = length = MIN (e.length, UINT32_MAX);
+      /* Must not exceed UINT32_MAX unless using extended headers. */
+      blocks[i].length = length = MIN (e.length, max_length);
       blocks[i].status_flags = e.type & 3;
       (*nr_blocks)++;
 
       pos += length;
-      if (pos > offset + count) /* this must be the last block */
+      if (pos >= offset + count) /* this must be the last block */
         break;
 
       /* If we reach here then we must have consumed this whole
-       * extent.  This is currently true because the server only sends
-       * 32 bit requests, but if we move to 64 bit requests we will
-       * need to revisit this code so it can split extents into
-       * multiple blocks.  XXX
+       * extent.  This is true because requests are only larger than
+       * UINT32_MAX when using extended headers, which have no limit
+       * on the block length.
        */
       assert (e.length <= length);
     }
@@ -510,31 +879,23 @@ extents_to_block_descriptors (struct nbdkit_extents *extents,
 
 #if 0
   for (i = 0; i < *nr_blocks; ++i)
-    debug ("block status: sending block %" PRIu32 " type %" PRIu32,
+    debug ("block status: sending block %" PRIu64 " type %" PRIu64,
            blocks[i].length, blocks[i].status_flags);
 #endif
 
-  /* Convert to big endian for the protocol. */
-  for (i = 0; i < *nr_blocks; ++i) {
-    blocks[i].length = htobe32 (blocks[i].length);
-    blocks[i].status_flags = htobe32 (blocks[i].status_flags);
-  }
-
   return blocks;
 }
 
 static int
 send_structured_reply_block_status (uint64_t handle,
                                     uint16_t cmd, uint16_t flags,
-                                    uint32_t count, uint64_t offset,
+                                    uint64_t count, uint64_t offset,
                                     struct nbdkit_extents *extents)
 {
   GET_CONN;
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
-  struct nbd_structured_reply reply;
-  CLEANUP_FREE struct nbd_block_descriptor *blocks = NULL;
+  CLEANUP_FREE struct nbd_block_descriptor_ext *blocks = NULL;
   size_t nr_blocks;
-  uint32_t context_id;
   size_t i;
   int r;
 
@@ -542,35 +903,73 @@ send_structured_reply_block_status (uint64_t handle,
   assert (cmd == NBD_CMD_BLOCK_STATUS);
 
   blocks = extents_to_block_descriptors (extents, flags, count, offset,
+                                         conn->extended_headers
+                                         ? UINT64_MAX : UINT32_MAX,
                                          &nr_blocks);
   if (blocks == NULL)
     return connection_set_status (-1);
 
-  reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
-  reply.handle = handle;
-  reply.flags = htobe16 (NBD_REPLY_FLAG_DONE);
-  reply.type = htobe16 (NBD_REPLY_TYPE_BLOCK_STATUS);
-  reply.length = htobe32 (sizeof context_id +
-                          nr_blocks * sizeof (struct nbd_block_descriptor));
+  if (conn->extended_headers) {
+    struct nbd_structured_reply_block_status_ext_hdr hdr;
 
-  r = conn->send (&reply, sizeof reply, SEND_MORE);
-  if (r == -1) {
-    nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
-    return connection_set_status (-1);
+    r = send_structured_reply_header (handle, cmd, offset,
+                                      NBD_REPLY_FLAG_DONE,
+                                      NBD_REPLY_TYPE_BLOCK_STATUS_EXT,
+                                      sizeof hdr +
+                                      nr_blocks * sizeof blocks[0],
+                                      SEND_MORE);
+    if (r <= 0)
+      return r;
+
+    /* Send the base:allocation context ID and number of blocks. */
+    hdr.context_id = htobe32 (base_allocation_id);
+    hdr.count = htobe32 (nr_blocks);
+    r = conn->send (&hdr, sizeof hdr, SEND_MORE);
+    if (r == -1) {
+      nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
+      return connection_set_status (-1);
+    }
   }
+  else {
+    uint32_t context_id;
+
+    r = send_structured_reply_header (handle, cmd, offset,
+                                      NBD_REPLY_FLAG_DONE,
+                                      NBD_REPLY_TYPE_BLOCK_STATUS,
+                                      sizeof context_id +
+                                      nr_blocks *
+                                      sizeof (struct nbd_block_descriptor),
+                                      SEND_MORE);
+    if (r <= 0)
+      return r;
 
-  /* Send the base:allocation context ID. */
-  context_id = htobe32 (base_allocation_id);
-  r = conn->send (&context_id, sizeof context_id, SEND_MORE);
-  if (r == -1) {
-    nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
-    return connection_set_status (-1);
+    /* Send the base:allocation context ID. */
+    context_id = htobe32 (base_allocation_id);
+    r = conn->send (&context_id, sizeof context_id, SEND_MORE);
+    if (r == -1) {
+      nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
+      return connection_set_status (-1);
+    }
   }
 
-  /* Send each block descriptor. */
+  /* Send each block descriptor, converted to big endian. */
   for (i = 0; i < nr_blocks; ++i) {
-    r = conn->send (&blocks[i], sizeof blocks[i],
-                    i == nr_blocks - 1 ? 0 : SEND_MORE);
+    const int f = i == nr_blocks - 1 ? 0 : SEND_MORE;
+
+    if (conn->extended_headers) {
+      struct nbd_block_descriptor_ext block;
+
+      block.length = htobe64 (blocks[i].length);
+      block.status_flags = htobe64 (blocks[i].status_flags);
+      r = conn->send (&block, sizeof block, f);
+    }
+    else {
+      struct nbd_block_descriptor block;
+
+      block.length = htobe32 (blocks[i].length);
+      block.status_flags = htobe32 (blocks[i].status_flags);
+      r = conn->send (&block, sizeof block, f);
+    }
     if (r == -1) {
       nbdkit_error ("write reply: %s: %m", name_of_nbd_cmd (cmd));
       return connection_set_status (-1);
@@ -582,25 +981,20 @@ send_structured_reply_block_status (uint64_t handle,
 
 static int
 send_structured_reply_error (uint64_t handle, uint16_t cmd, uint16_t flags,
-                             uint32_t error)
+                             uint64_t offset, uint32_t error)
 {
   GET_CONN;
   ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
-  struct nbd_structured_reply reply;
   struct nbd_structured_reply_error error_data;
   int r;
 
-  reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
-  reply.handle = handle;
-  reply.flags = htobe16 (NBD_REPLY_FLAG_DONE);
-  reply.type = htobe16 (NBD_REPLY_TYPE_ERROR);
-  reply.length = htobe32 (0 /* no human readable error */ + sizeof error_data);
-
-  r = conn->send (&reply, sizeof reply, SEND_MORE);
-  if (r == -1) {
-    nbdkit_error ("write error reply: %m");
-    return connection_set_status (-1);
-  }
+  r = send_structured_reply_header (handle, cmd, offset,
+                                    NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR,
+                                    0 /* no human readable error */ +
+                                    sizeof error_data,
+                                    SEND_MORE);
+  if (r <= 0)
+    return r;
 
   /* Send the error. */
   error_data.error = htobe32 (nbd_errno (error, flags));
@@ -615,111 +1009,248 @@ send_structured_reply_error (uint64_t handle, uint16_t cmd, uint16_t flags,
   return 1;                     /* command processed ok */
 }
 
+/* With extended headers there are no simple replies, so successful
+ * requests which return no data get an empty final chunk.
+ */
+static int
+send_structured_reply_none (uint64_t handle, uint16_t cmd, uint64_t offset)
+{
+  GET_CONN;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->write_lock);
+
+  return send_structured_reply_header (handle, cmd, offset,
+                                       NBD_REPLY_FLAG_DONE,
+                                       NBD_REPLY_TYPE_NONE, 0, 0);
+}
+
+/* Parse and validate a request header received from the client,
+ * filling in 'req'.  Returns 1 if the request should be processed, or
+ * the (new) connection status if the connection should be closed.
+ *
+ * If the request is invalid then 'req->error' is set and the reply
+ * will be an error, but note that the payload of an invalid write
+ * request must still be read (or skipped) by the caller.
+ */
 int
-protocol_recv_request_send_reply (void)
+protocol_parse_request (const union request_header *request,
+                        struct request *req)
 {
   GET_CONN;
-  int r;
-  struct nbd_request request;
-  uint16_t cmd, flags;
-  uint32_t magic, count, error = 0;
-  uint64_t offset;
-  char *buf = NULL;
-  CLEANUP_EXTENTS_FREE struct nbdkit_extents *extents = NULL;
-
-  /* Read the request packet. */
-  {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->read_lock);
-    r = connection_get_status ();
-    if (r <= 0)
-      return r;
-    r = conn->recv (&request, sizeof request);
-    if (r == -1) {
-      nbdkit_error ("read request: %m");
-      return connection_set_status (-1);
-    }
-    if (r == 0) {
-      debug ("client closed input socket, closing connection");
-      return connection_set_status (0); /* disconnect */
-    }
+  uint32_t magic;
+
+  /* The magic is at the same place in both kinds of header. */
+  magic = be32toh (request->compact.magic);
+  if (magic != (conn->extended_headers
+                ? NBD_EXTENDED_REQUEST_MAGIC : NBD_REQUEST_MAGIC)) {
+    nbdkit_error ("invalid request: 'magic' field is incorrect (0x%x)",
+                  magic);
+    return connection_set_status (-1);
+  }
 
-    magic = be32toh (request.magic);
-    if (magic != NBD_REQUEST_MAGIC) {
-      nbdkit_error ("invalid request: 'magic' field is incorrect (0x%x)",
-                    magic);
-      return connection_set_status (-1);
-    }
+  if (conn->extended_headers) {
+    req->handle = request->extended.handle;
+    req->flags = be16toh (request->extended.flags);
+    req->cmd = be16toh (request->extended.type);
+    req->offset = be64toh (request->extended.offset);
+    req->count = be64toh (request->extended.count);
+  }
+  else {
+    req->handle = request->compact.handle;
+    req->flags = be16toh (request->compact.flags);
+    req->cmd = be16toh (request->compact.type);
+    req->offset = be64toh (request->compact.offset);
+    req->count = be32toh (request->compact.count);
+  }
+  req->error = 0;
+  req->buf = NULL;
+  req->fd = -1;
+  req->fd_offset = 0;
+  req->extents = NULL;
+
+  if (req->cmd == NBD_CMD_DISC) {
+    debug ("client sent %s, closing connection", name_of_nbd_cmd (req->cmd));
+    return connection_set_status (0); /* disconnect */
+  }
 
-    flags = be16toh (request.flags);
-    cmd = be16toh (request.type);
+  validate_request (req->cmd, req->flags, req->offset, req->count,
+                    &req->error);
+  return 1;
+}
 
-    offset = be64toh (request.offset);
-    count = be32toh (request.count);
+/* Try to start a request using the plugin's asynchronous callbacks.
+ * Returns 1 if the request was started, 0 if it must be done
+ * synchronously instead, or -1 if it failed (req->error is set).
+ */
+static int
+handle_request_async (struct request *req, struct nbdkit_async *async)
+{
+  GET_CONN;
+  uint16_t cmd = req->cmd, flags = req->flags;
+  uint32_t f = 0;
+  int err = 0, r;
 
-    if (cmd == NBD_CMD_DISC) {
-      debug ("client sent %s, closing connection", name_of_nbd_cmd (cmd));
-      return connection_set_status (0); /* disconnect */
-    }
+  switch (cmd) {
+  case NBD_CMD_READ:
+  case NBD_CMD_WRITE:
+  case NBD_CMD_FLUSH:
+  case NBD_CMD_TRIM:
+  case NBD_CMD_WRITE_ZEROES:
+    break;
+  default:
+    return 0;
+  }
+  if (req->count > UINT32_MAX)
+    return 0;
 
-    /* Validate the request. */
-    if (!validate_request (cmd, flags, offset, count, &error)) {
-      if (cmd == NBD_CMD_WRITE &&
-          skip_over_write_buffer (conn->sockin, count) < 0)
-        return connection_set_status (-1);
-      goto send_reply;
-    }
+  if (cmd != NBD_CMD_READ && cmd != NBD_CMD_FLUSH &&
+      (flags & NBD_CMD_FLAG_FUA))
+    f |= NBDKIT_FLAG_FUA;
+  if (cmd == NBD_CMD_WRITE_ZEROES) {
+    if (!(flags & NBD_CMD_FLAG_NO_HOLE))
+      f |= NBDKIT_FLAG_MAY_TRIM;
+    if (flags & NBD_CMD_FLAG_FAST_ZERO)
+      f |= NBDKIT_FLAG_FAST_ZERO;
+  }
 
-    /* Get the data buffer used for either read or write requests.
-     * This is a common per-thread data buffer, it must not be freed.
-     */
-    if (cmd == NBD_CMD_READ || cmd == NBD_CMD_WRITE) {
-      buf = threadlocal_buffer ((size_t) count);
-      if (buf == NULL) {
-        error = ENOMEM;
-        if (cmd == NBD_CMD_WRITE &&
-            skip_over_write_buffer (conn->sockin, count) < 0)
-          return connection_set_status (-1);
-        goto send_reply;
-      }
+  async->cmd = cmd;
+  async->flags = f;
+  async->buf = req->buf;
+  async->count = req->count;
+  async->offset = req->offset;
+  async->c = conn->top_context;
+  async->start = metrics_start (conn->top_context->metrics);
+
+  threadlocal_set_error (0);
+  lock_request ();
+  r = backend_async (conn->top_context, async, &err);
+  unlock_request ();
+  if (r == -1)
+    req->error = err;
+  return r;
+}
+
+/* Perform a request which has been parsed (and for writes, whose
+ * payload has been received into 'req->buf').  The result is left in
+ * 'req' for protocol_send_reply.
+ *
+ * If 'async' is not NULL the request may be started in the plugin's
+ * asynchronous callbacks.  In that case this returns false, and the
+ * completion function in 'async' is called (possibly before this
+ * returns) when the request has finished.  The caller must then call
+ * protocol_finish_async before sending the reply.  Otherwise this
+ * returns true.
+ */
+bool
+protocol_handle_request (struct request *req, struct nbdkit_async *async)
+{
+  GET_CONN;
+  uint16_t cmd = req->cmd, flags = req->flags;
+  uint64_t offset = req->offset, count = req->count;
+  uint32_t error;
+
+  if (req->error)
+    return true;
+
+  /* If the connection can send data directly from a file descriptor,
+   * first ask the plugin if it can return read data that way.  This
+   * avoids copying the data through the buffer below.
+   */
+  if (cmd == NBD_CMD_READ && count > 0 && conn->send_fd) {
+    if (quit || !connection_get_status ()) {
+      req->error = ESHUTDOWN;
+      return true;
     }
+    lock_request ();
+    error = handle_read_fd (offset, count, &req->fd, &req->fd_offset);
+    assert ((int) error >= 0);
+    unlock_request ();
+    if (error || req->fd >= 0) {
+      req->error = error;
+      return true;
+    }
+  }
 
-    /* Allocate the extents list for block status only. */
-    if (cmd == NBD_CMD_BLOCK_STATUS) {
-      extents = nbdkit_extents_new (offset,
-                                    backend_get_size (conn->top_context));
-      if (extents == NULL) {
-        error = ENOMEM;
-        goto send_reply;
-      }
+  /* Get the data buffer used for read requests.  It is returned to
+   * the pool by protocol_send_reply.
+   */
+  if (cmd == NBD_CMD_READ) {
+    req->buf = buffer_get ((size_t) count);
+    if (req->buf == NULL) {
+      req->error = ENOMEM;
+      return true;
     }
+  }
 
-    /* Receive the write data buffer. */
-    if (cmd == NBD_CMD_WRITE) {
-      r = conn->recv (buf, count);
-      if (r == 0) {
-        errno = EBADMSG;
-        r = -1;
-      }
-      if (r == -1) {
-        nbdkit_error ("read data: %s: %m", name_of_nbd_cmd (cmd));
-        return connection_set_status (-1);
-      }
+  /* Allocate the extents list for block status only. */
+  if (cmd == NBD_CMD_BLOCK_STATUS) {
+    req->extents = nbdkit_extents_new (offset,
+                                       backend_get_size (conn->top_context));
+    if (req->extents == NULL) {
+      req->error = ENOMEM;
+      return true;
     }
   }
 
   /* Perform the request.  Only this part happens inside the request lock. */
   if (quit || !connection_get_status ()) {
-    error = ESHUTDOWN;
+    req->error = ESHUTDOWN;
+    return true;
   }
-  else {
+  if (async) {
+    switch (handle_request_async (req, async)) {
+    case 1: return false;
+    case -1: return true;
+    }
+  }
+  lock_request ();
+  /* With structured replies, holes in read data can be sent without
+   * the plugin filling them in, if it has a .pread_sparse callback.
+   */
+  if (cmd == NBD_CMD_READ && count > 0 && !conn->no_pread_sparse &&
+      (conn->structured_replies || conn->extended_headers) &&
+      !(flags & NBD_CMD_FLAG_DF)) {
+    error = handle_read_sparse (offset, count, req->buf, &req->extents);
+    if (error || req->extents) {
+      unlock_request ();
+      req->error = error;
+      return true;
+    }
+  }
+  error = handle_request (cmd, flags, offset, count, req->buf,
+                          req->extents);
+  assert ((int) error >= 0);
+  unlock_request ();
+  req->error = error;
+  return true;
+}
+
+/* Record the result of a request which was started asynchronously. */
+void
+protocol_finish_async (struct request *req, int err)
+{
+  /* Zero requests which the plugin cannot do are emulated by writing
+   * zeroes, unless the client asked for a fast zero.  The synchronous
+   * path already knows how to do this.
+   */
+  if (req->cmd == NBD_CMD_WRITE_ZEROES &&
+      (err == ENOTSUP || err == EOPNOTSUPP) &&
+      !(req->flags & NBD_CMD_FLAG_FAST_ZERO)) {
     lock_request ();
-    error = handle_request (cmd, flags, offset, count, buf, extents);
-    assert ((int) error >= 0);
+    err = handle_request (req->cmd, req->flags, req->offset, req->count,
+                          NULL, NULL);
     unlock_request ();
   }
+  req->error = err;
+}
+
+static int
+send_reply (const struct request *req)
+{
+  GET_CONN;
+  uint16_t cmd = req->cmd, flags = req->flags;
+  uint32_t error = req->error;
+  uint64_t offset = req->offset, count = req->count;
 
-  /* Send the reply packet. */
- send_reply:
   if (connection_get_status () < 0)
     return -1;
 
@@ -734,27 +1265,141 @@ protocol_recv_request_send_reply (void)
 
   /* Currently we prefer to send simple replies for everything except
    * where we have to (ie. NBD_CMD_READ and NBD_CMD_BLOCK_STATUS when
-   * structured_replies have been negotiated).  However this prevents
+   * structured_replies have been negotiated, and everything when
+   * extended headers have been negotiated).  However this prevents
    * us from sending human-readable error messages to the client, so
    * we should reconsider this in future.
    */
-  if (conn->structured_replies &&
-      (cmd == NBD_CMD_READ || cmd == NBD_CMD_BLOCK_STATUS)) {
+  if (conn->extended_headers ||
+      (conn->structured_replies &&
+       (cmd == NBD_CMD_READ || cmd == NBD_CMD_BLOCK_STATUS))) {
     if (!error) {
-      if (cmd == NBD_CMD_READ)
-        return send_structured_reply_read (request.handle, cmd,
-                                           buf, count, offset);
-      else /* NBD_CMD_BLOCK_STATUS */
-        return send_structured_reply_block_status (request.handle,
+      if (cmd == NBD_CMD_READ && req->fd >= 0)
+        return send_structured_reply_read_fd (req->handle, cmd, flags,
+                                              req->fd, req->fd_offset,
+                                              count, offset);
+      else if (cmd == NBD_CMD_READ && req->extents)
+        return send_structured_reply_read_sparse (req->handle, cmd,
+                                                  req->buf, req->extents,
+                                                  count, offset);
+      else if (cmd == NBD_CMD_READ)
+        return send_structured_reply_read (req->handle, cmd, flags,
+                                           req->buf, count, offset);
+      else if (cmd == NBD_CMD_BLOCK_STATUS)
+        return send_structured_reply_block_status (req->handle,
                                                    cmd, flags,
                                                    count, offset,
-                                                   extents);
+                                                   req->extents);
+      else
+        return send_structured_reply_none (req->handle, cmd, offset);
     }
     else
-      return send_structured_reply_error (request.handle, cmd, flags,
-                                          error);
+      return send_structured_reply_error (req->handle, cmd, flags,
+                                          offset, error);
   }
   else
-    return send_simple_reply (request.handle, cmd, flags, buf, count,
-                              error);
+    return send_simple_reply (req->handle, cmd, flags, req->buf,
+                              req->fd, req->fd_offset, count, error);
+}
+
+/* Send the reply to a request performed by protocol_handle_request.
+ * The request buffer is returned to the pool afterwards.
+ */
+int
+protocol_send_reply (struct request *req)
+{
+  int r;
+
+  r = send_reply (req);
+  buffer_put (req->buf, (size_t) req->count);
+  req->buf = NULL;
+  nbdkit_extents_free (req->extents);
+  req->extents = NULL;
+  return r;
+}
+
+int
+protocol_handle_request_send_reply (struct request *req)
+{
+  protocol_handle_request (req, NULL);
+  return protocol_send_reply (req);
+}
+
+/* Receive the next request from the client, including the payload of
+ * write requests into a buffer from the pool.  Returns 1 if a request
+ * was received, or the (new) connection status if the connection
+ * should be closed.
+ */
+int
+protocol_recv_request (struct request *req)
+{
+  GET_CONN;
+  int r;
+  union request_header request;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->read_lock);
+
+  r = connection_get_status ();
+  if (r <= 0)
+    return r;
+  if (conn->extended_headers)
+    r = conn->recv (&request.extended, sizeof request.extended);
+  else
+    r = conn->recv (&request.compact, sizeof request.compact);
+  if (r == -1) {
+    nbdkit_error ("read request: %m");
+    return connection_set_status (-1);
+  }
+  if (r == 0) {
+    debug ("client closed input socket, closing connection");
+    return connection_set_status (0); /* disconnect */
+  }
+
+  r = protocol_parse_request (&request, req);
+  if (r <= 0)
+    return r;
+
+  if (req->cmd != NBD_CMD_WRITE)
+    return 1;
+
+  /* Get the data buffer used for write requests. */
+  if (!req->error) {
+    req->buf = buffer_get ((size_t) req->count);
+    if (req->buf == NULL)
+      req->error = ENOMEM;
+  }
+
+  /* Receive the write data buffer, or skip over it if the request
+   * will fail anyway.
+   */
+  if (req->error) {
+    if (skip_over_write_buffer (conn->sockin, req->count) < 0)
+      return connection_set_status (-1);
+  }
+  else {
+    r = conn->recv (req->buf, req->count);
+    if (r == 0) {
+      errno = EBADMSG;
+      r = -1;
+    }
+    if (r == -1) {
+      nbdkit_error ("read data: %s: %m", name_of_nbd_cmd (req->cmd));
+      buffer_put (req->buf, (size_t) req->count);
+      req->buf = NULL;
+      return connection_set_status (-1);
+    }
+  }
+
+  return 1;
+}
+
+int
+protocol_recv_request_send_reply (void)
+{
+  struct request req;
+  int r;
+
+  r = protocol_recv_request (&req);
+  if (r <= 0)
+    return r;
+  return protocol_handle_request_send_reply (&req);
 }
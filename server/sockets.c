@@ -544,6 +544,9 @@ accept_incoming_connections (const sockets *socks)
   size_t i;
   int err;
 
+  if (engine == ENGINE_URING)
+    uring_start ();
+
   while (!quit)
     check_sockets_and_quit_fd (socks);
 
@@ -560,6 +563,13 @@ accept_incoming_connections (const sockets *socks)
   }
   pthread_mutex_unlock (&count_mutex);
 
+  /* Wait for connections handed over to the io_uring engine. */
+  if (engine == ENGINE_URING)
+    uring_stop ();
+
+  /* Stop the worker threads. */
+  pool_stop ();
+
   for (i = 0; i < socks->len; ++i)
     closesocket (socks->ptr[i]);
   free (socks->ptr);
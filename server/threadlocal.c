@@ -56,8 +56,6 @@ struct threadlocal {
   char *name;                   /* Can be NULL. */
   size_t instance_num;          /* Can be 0. */
   int err;
-  void *buffer;                 /* Can be NULL. */
-  size_t buffer_size;
   struct connection *conn;      /* Can be NULL. */
   struct context *ctx;          /* Can be NULL. */
 };
@@ -70,7 +68,6 @@ free_threadlocal (void *threadlocalv)
   struct threadlocal *threadlocal = threadlocalv;
 
   free (threadlocal->name);
-  free (threadlocal->buffer);
   free (threadlocal);
 }
 
@@ -176,40 +173,6 @@ threadlocal_get_error (void)
   return threadlocal ? threadlocal->err : 0;
 }
 
-/* Return the single pread/pwrite buffer for this thread.  The buffer
- * size is increased to ‘size’ bytes if required.
- *
- * The buffer starts out as zeroes but after use may contain data from
- * previous requests.  This is fine because: (a) Correctly written
- * plugins should overwrite the whole buffer on each request so no
- * leak should occur.  (b) The aim of this buffer is to avoid leaking
- * random heap data from the core server; previous request data from
- * the plugin is not considered sensitive.
- */
-extern void *
-threadlocal_buffer (size_t size)
-{
-  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
-
-  if (!threadlocal)
-    abort ();
-
-  if (threadlocal->buffer_size < size) {
-    void *ptr;
-
-    ptr = realloc (threadlocal->buffer, size);
-    if (ptr == NULL) {
-      nbdkit_error ("threadlocal_buffer: realloc: %m");
-      return NULL;
-    }
-    memset (ptr, 0, size);
-    threadlocal->buffer = ptr;
-    threadlocal->buffer_size = size;
-  }
-
-  return threadlocal->buffer;
-}
-
 /* Set (or clear) the connection that is using the current thread */
 void
 threadlocal_set_conn (struct connection *conn)
@@ -0,0 +1,1099 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* The io_uring connection engine (--engine=uring).
+ *
+ * With the default threads engine each connection has its own thread
+ * which does the handshake and then blocks reading requests from the
+ * socket.  With this engine, once the handshake is complete the
+ * connection is handed over to one of a small number of event loop
+ * threads.  The event loop receives requests using io_uring.  In both
+ * cases the requests are processed by the pool of worker threads
+ * shared by all connections (see pool.c), but here the workers send
+ * the replies through the same io_uring.  An idle connection
+ * therefore costs no threads at all.
+ *
+ * The io_uring system calls are used directly so that we don't
+ * require liburing.
+ *
+ * Connections using TLS, or where the thread model does not allow
+ * parallel requests, are still handled by the threads engine.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include "internal.h"
+#include "minmax.h"
+#include "protostrings.h"
+#include "vector.h"
+
+#ifdef HAVE_URING_ENGINE
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+#ifdef HAVE_URING_ENGINE
+
+/* Maximum number of event loop threads. */
+#define MAX_LOOPS 4
+
+/* Size of the submission queue of each ring.  We always submit
+ * entries as soon as they are added, so this can be small.
+ */
+#define RING_ENTRIES 256
+
+/* Size of the completion queue of each ring.  Each connection has at
+ * most one receive (or no-op to start one) and one send outstanding,
+ * and each loop has two operations of its own, so this limits the
+ * number of connections served by each event loop.  Further
+ * connections use the threads engine.  If the completion queue
+ * overflowed, some kernels would refuse new submissions with EBUSY
+ * until the event loop had caught up.
+ */
+#define CQ_ENTRIES 16384
+#define MAX_LOOP_CONNECTIONS ((CQ_ENTRIES - 2) / 2)
+
+/* Small replies (headers) sent with SEND_MORE are collected in a
+ * per-connection buffer of this size and sent with the data which
+ * follows, to save a round trip through the event loop.
+ */
+#define CORK_SIZE 4096
+
+/* Each operation submitted to a ring points to one of these (in the
+ * user_data field).  When the operation completes the event loop
+ * calls the complete function with the result.
+ */
+struct uring_op {
+  void (*complete) (struct uring_op *op, int res);
+};
+
+DEFINE_VECTOR_TYPE (cqe_vector, struct io_uring_cqe);
+
+struct ring {
+  int fd;
+  pthread_mutex_t lock;         /* Protects the submission queue. */
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+
+  /* Completions taken off the queue early by the event loop thread
+   * (see ring_busy), in the order they completed.  Only that thread
+   * uses these fields.
+   */
+  cqe_vector reaped;
+  size_t reaped_next;
+};
+
+struct loop {
+  pthread_t thread;
+  struct ring ring;
+  struct uring_op quit_op;      /* Polls quit_fd. */
+  struct uring_op stop_op;      /* Sent by uring_stop. */
+  bool stop;
+
+  pthread_mutex_t lock;         /* Protects the list of connections. */
+  struct uring_connection *connections;
+  bool quitting;
+
+  unsigned nr_connections;      /* Protected by count_lock. */
+};
+
+enum recv_state {
+  RECV_HEADER,                  /* Receiving the request header. */
+  RECV_PAYLOAD,                 /* Receiving the write payload. */
+  RECV_SKIP,                    /* Skipping the payload of a bad write. */
+};
+
+/* A request being received or processed. */
+struct uring_request {
+  struct pool_job job;
+  struct uring_connection *uc;
+  struct request req;
+};
+
+struct uring_connection {
+  struct uring_op arm_op;
+  struct uring_op recv_op;
+  struct pool_job finish_job;
+  struct loop *loop;
+  struct connection *conn;
+  struct uring_connection *next; /* List of connections in the loop. */
+  char *name;                   /* Thread name, for messages. */
+  size_t instance_num;
+
+  /* Receive state.  This is only used by the thread which has just
+   * seen a receive complete, or which is arming a receive.
+   */
+  enum recv_state state;
+  union request_header request;
+  struct uring_request *ureq;
+  char *rbuf;
+  uint32_t rlen, rdone;
+  uint32_t skip;                /* Bytes left to skip. */
+  char skip_buf[BUFSIZ];
+
+  pthread_mutex_t lock;         /* Protects the fields below. */
+  unsigned in_flight;           /* Requests running in the pool. */
+  bool recv_active;             /* Set if a receive is outstanding. */
+  bool closing;
+
+  /* Cork buffer, protected by conn->write_lock. */
+  char cork[CORK_SIZE];
+  size_t cork_len;
+};
+
+static bool started = false;
+static struct loop loops[MAX_LOOPS];
+static unsigned nr_loops = 0;
+
+/* Number of connections using the engine, so that uring_stop can wait
+ * for them to finish.
+ */
+static pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t count_cond = PTHREAD_COND_INITIALIZER;
+static unsigned count = 0;
+
+static int
+ring_init (struct ring *r)
+{
+  struct io_uring_params p;
+
+  memset (&p, 0, sizeof p);
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = CQ_ENTRIES;
+  r->fd = syscall (__NR_io_uring_setup, RING_ENTRIES, &p);
+  if (r->fd == -1)
+    return -1;
+
+  r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->sq_ring_size = r->cq_ring_size = MAX (r->sq_ring_size, r->cq_ring_size);
+  r->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+
+  r->sq_ring = mmap (NULL, r->sq_ring_size, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED)
+    goto err1;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ring = r->sq_ring;
+  else {
+    r->cq_ring = mmap (NULL, r->cq_ring_size, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED)
+      goto err2;
+  }
+  r->sqes = mmap (NULL, r->sqes_size, PROT_READ|PROT_WRITE,
+                  MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    goto err3;
+
+  r->sq_head = r->sq_ring + p.sq_off.head;
+  r->sq_tail = r->sq_ring + p.sq_off.tail;
+  r->sq_mask = r->sq_ring + p.sq_off.ring_mask;
+  r->sq_array = r->sq_ring + p.sq_off.array;
+  r->cq_head = r->cq_ring + p.cq_off.head;
+  r->cq_tail = r->cq_ring + p.cq_off.tail;
+  r->cq_mask = r->cq_ring + p.cq_off.ring_mask;
+  r->cqes = r->cq_ring + p.cq_off.cqes;
+  r->sq_entries = p.sq_entries;
+  r->reaped = (cqe_vector) empty_vector;
+  r->reaped_next = 0;
+
+  pthread_mutex_init (&r->lock, NULL);
+  return 0;
+
+ err3:
+  if (r->cq_ring != r->sq_ring)
+    munmap (r->cq_ring, r->cq_ring_size);
+ err2:
+  munmap (r->sq_ring, r->sq_ring_size);
+ err1:
+  close (r->fd);
+  return -1;
+}
+
+static void
+ring_free (struct ring *r)
+{
+  munmap (r->sqes, r->sqes_size);
+  if (r->cq_ring != r->sq_ring)
+    munmap (r->cq_ring, r->cq_ring_size);
+  munmap (r->sq_ring, r->sq_ring_size);
+  close (r->fd);
+  pthread_mutex_destroy (&r->lock);
+  free (r->reaped.ptr);
+}
+
+/* Move the completions which are ready off the completion queue, so
+ * that the kernel can flush any overflow into it.  ring_wait returns
+ * them later.  Only the event loop thread may call this.  Returns -1
+ * if no space could be made.
+ */
+static int
+ring_reap (struct ring *r)
+{
+  unsigned head = *r->cq_head;
+  unsigned tail = __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE);
+  int ret = 0;
+
+  for (; head != tail; head++) {
+    if (cqe_vector_append (&r->reaped, r->cqes[head & *r->cq_mask]) == -1) {
+      ret = -1;
+      break;
+    }
+  }
+  __atomic_store_n (r->cq_head, head, __ATOMIC_RELEASE);
+  return ret;
+}
+
+/* The kernel cannot accept submissions until there is space in the
+ * completion queue.  Called with r->lock held, which is dropped while
+ * waiting so that the event loop can make progress.  The event loop
+ * thread is the only one which takes completions off the queue, so it
+ * must do that itself rather than wait.
+ */
+static int
+ring_busy (struct ring *r, bool in_loop)
+{
+  const struct timespec ts = { .tv_nsec = 1000000 };
+  int ret = 0;
+
+  pthread_mutex_unlock (&r->lock);
+  if (in_loop) {
+    ret = ring_reap (r);
+    if (ret == -1)
+      errno = ENOMEM;
+  }
+  else
+    nanosleep (&ts, NULL);
+  pthread_mutex_lock (&r->lock);
+  return ret;
+}
+
+/* Add an operation to the submission queue and submit it.  This may
+ * be called from any thread, but in_loop must be set if it is the
+ * event loop thread of the ring.  On error this returns -1 with errno
+ * set, and the operation will never complete.
+ */
+static int
+ring_submit (struct ring *r, const struct io_uring_sqe *sqe,
+             struct uring_op *op, bool in_loop)
+{
+  unsigned tail, idx, pending;
+  int err = 0;
+
+  pthread_mutex_lock (&r->lock);
+
+  /* The submission queue is normally empty, because every entry is
+   * submitted immediately.  It can only fill up while submissions are
+   * being refused with EBUSY.
+   */
+  while (*r->sq_tail - __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE) ==
+         r->sq_entries) {
+    if (ring_busy (r, in_loop) == -1) {
+      err = errno;
+      pthread_mutex_unlock (&r->lock);
+      errno = err;
+      return -1;
+    }
+  }
+
+  tail = *r->sq_tail;
+  idx = tail & *r->sq_mask;
+  r->sqes[idx] = *sqe;
+  r->sqes[idx].user_data = (uintptr_t) op;
+  r->sq_array[idx] = idx;
+  __atomic_store_n (r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  /* Submit everything up to and including our entry.  While the lock
+   * is dropped other threads may add entries, and may submit ours.
+   */
+  for (;;) {
+    pending = *r->sq_tail - __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE);
+    if (pending <= *r->sq_tail - (tail + 1))
+      break;                    /* Our entry has been submitted. */
+    if (err != 0) {
+      /* Entries added by other threads may follow ours, so it cannot
+       * be removed.  Replace it with a no-op which the event loop
+       * ignores.
+       */
+      memset (&r->sqes[idx], 0, sizeof r->sqes[idx]);
+      r->sqes[idx].opcode = IORING_OP_NOP;
+      pthread_mutex_unlock (&r->lock);
+      errno = err;
+      return -1;
+    }
+    if (syscall (__NR_io_uring_enter, r->fd, pending, 0, 0, NULL, 0) == -1) {
+      if (errno == EBUSY || errno == EAGAIN) {
+        if (ring_busy (r, in_loop) == -1)
+          err = errno;
+      }
+      else if (errno != EINTR)
+        err = errno;
+    }
+  }
+
+  pthread_mutex_unlock (&r->lock);
+  return 0;
+}
+
+/* Wait for the next completion.  Only the event loop thread may call
+ * this.
+ */
+static void
+ring_wait (struct ring *r, struct uring_op **op, int *res)
+{
+  unsigned head = *r->cq_head;
+  struct io_uring_cqe *cqe;
+
+  if (r->reaped_next < r->reaped.len) {
+    cqe = &r->reaped.ptr[r->reaped_next++];
+    *op = (struct uring_op *) (uintptr_t) cqe->user_data;
+    *res = cqe->res;
+    if (r->reaped_next == r->reaped.len)
+      r->reaped.len = r->reaped_next = 0;
+    return;
+  }
+
+  while (head == __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE)) {
+    if (syscall (__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS,
+                 NULL, 0) == -1 &&
+        errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      perror ("io_uring_enter");
+      abort ();
+    }
+  }
+
+  cqe = &r->cqes[head & *r->cq_mask];
+  *op = (struct uring_op *) (uintptr_t) cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n (r->cq_head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Act on behalf of a connection in the current thread, so that
+ * messages and locking work as they do in the threads engine.
+ */
+static void
+set_conn (struct uring_connection *uc)
+{
+  threadlocal_set_conn (uc->conn);
+  threadlocal_set_name (uc->name);
+  threadlocal_set_instance_num (uc->instance_num);
+}
+
+static const struct io_uring_sqe nop = { .opcode = IORING_OP_NOP };
+
+static bool close_connection (struct uring_connection *uc);
+
+/* Submit a receive for the remainder of the current buffer.  Only the
+ * event loop thread may call this.  On error the connection status is
+ * set and this returns -1.
+ */
+static int
+submit_recv (struct uring_connection *uc)
+{
+  struct io_uring_sqe sqe = { .opcode = IORING_OP_RECV };
+
+  sqe.fd = uc->conn->sockin;
+  sqe.addr = (uintptr_t) (uc->rbuf + uc->rdone);
+  sqe.len = uc->rlen - uc->rdone;
+  if (ring_submit (&uc->loop->ring, &sqe, &uc->recv_op, true) == -1) {
+    nbdkit_error ("io_uring_enter: %m");
+    connection_set_status (-1);
+    return -1;
+  }
+  return 0;
+}
+
+/* Start receiving the next request header.  Called with uc->lock held
+ * and recv_active set.
+ */
+static int
+arm_recv (struct uring_connection *uc)
+{
+  uc->state = RECV_HEADER;
+  uc->rbuf = (char *) &uc->request;
+  if (uc->conn->extended_headers)
+    uc->rlen = sizeof uc->request.extended;
+  else
+    uc->rlen = sizeof uc->request.compact;
+  uc->rdone = 0;
+  return submit_recv (uc);
+}
+
+static void
+finish_connection_job (struct pool_job *job)
+{
+  struct uring_connection *uc =
+    container_of (job, struct uring_connection, finish_job);
+  struct loop *loop = uc->loop;
+  struct uring_connection **p;
+
+  set_conn (uc);
+  finish_connection (uc->conn);
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&loop->lock);
+    for (p = &loop->connections; *p != uc; p = &(*p)->next)
+      ;
+    *p = uc->next;
+  }
+
+  pthread_mutex_destroy (&uc->lock);
+  free (uc->name);
+  free (uc);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&count_lock);
+  loop->nr_connections--;
+  count--;
+  pthread_cond_broadcast (&count_cond);
+}
+
+/* Stop receiving from the connection.  When the last request has
+ * finished the connection is finalized and freed.  Called with
+ * uc->lock held, and no receive outstanding.  Returns true if the
+ * caller must submit uc->finish_job (after dropping the lock).
+ */
+static bool
+close_connection (struct uring_connection *uc)
+{
+  assert (!uc->recv_active);
+  uc->closing = true;
+  return uc->in_flight == 0;
+}
+
+static void
+run_request (struct pool_job *job)
+{
+  struct uring_request *ureq = container_of (job, struct uring_request, job);
+  struct uring_connection *uc = ureq->uc;
+  struct connection *conn = uc->conn;
+  bool finish = false, rearm = false;
+
+  set_conn (uc);
+  protocol_handle_request_send_reply (&ureq->req);
+  free (ureq);
+
+  /* If the connection failed, make sure the event loop notices. */
+  if (connection_get_status () < 0)
+    shutdown (conn->sockin, SHUT_RDWR);
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&uc->lock);
+    uc->in_flight--;
+    if (uc->closing)
+      finish = uc->in_flight == 0;
+    else if (!uc->recv_active) {
+      /* The event loop stopped receiving because too many requests
+       * were in flight.  Restart it.
+       */
+      if (quit || connection_get_status () <= 0)
+        finish = close_connection (uc);
+      else
+        rearm = uc->recv_active = true;
+    }
+  }
+
+  /* This thread may exit before the receive completes, which would
+   * cancel it, so ask the event loop to submit it.
+   */
+  if (rearm &&
+      ring_submit (&uc->loop->ring, &nop, &uc->arm_op, false) == -1) {
+    nbdkit_error ("io_uring_enter: %m");
+    connection_set_status (-1);
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&uc->lock);
+    uc->recv_active = false;
+    finish = close_connection (uc);
+  }
+  if (finish)
+    pool_submit (&uc->finish_job);
+}
+
+/* A request has been received completely. */
+static void
+dispatch_request (struct uring_connection *uc)
+{
+  struct uring_request *ureq = uc->ureq;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&uc->lock);
+    uc->ureq = NULL;
+    uc->in_flight++;
+
+    /* Limit the number of requests in flight on each connection to
+     * the same number as the threads engine.
+     */
+    if (quit || connection_get_status () <= 0) {
+      uc->recv_active = false;
+      close_connection (uc);    /* Cannot finish, request in flight. */
+    }
+    else if (uc->in_flight >= uc->conn->nworkers)
+      uc->recv_active = false;
+    else if (arm_recv (uc) == -1) {
+      uc->recv_active = false;
+      close_connection (uc);    /* Cannot finish, request in flight. */
+    }
+  }
+
+  ureq->job.run = run_request;
+  pool_submit (&ureq->job);
+}
+
+/* The request header has been received. */
+static bool
+got_header (struct uring_connection *uc)
+{
+  struct uring_request *ureq;
+  int r;
+
+  ureq = malloc (sizeof *ureq);
+  if (ureq == NULL) {
+    nbdkit_error ("malloc: %m");
+    connection_set_status (-1);
+    return false;
+  }
+  ureq->uc = uc;
+
+  r = protocol_parse_request (&uc->request, &ureq->req);
+  if (r <= 0) {
+    free (ureq);
+    return false;
+  }
+  uc->ureq = ureq;
+
+  if (ureq->req.cmd != NBD_CMD_WRITE || ureq->req.count == 0) {
+    dispatch_request (uc);
+    return true;
+  }
+
+  if (!ureq->req.error) {
+    ureq->req.buf = buffer_get (ureq->req.count);
+    if (ureq->req.buf == NULL)
+      ureq->req.error = ENOMEM;
+  }
+
+  if (ureq->req.error) {
+    /* Skip over the write payload. */
+    if (ureq->req.count > MAX_REQUEST_SIZE * 2) {
+      nbdkit_error ("write request too large to skip");
+      connection_set_status (-1);
+      return false;
+    }
+    uc->state = RECV_SKIP;
+    uc->skip = ureq->req.count;
+    uc->rbuf = uc->skip_buf;
+    uc->rlen = MIN (uc->skip, sizeof uc->skip_buf);
+  }
+  else {
+    uc->state = RECV_PAYLOAD;
+    uc->rbuf = ureq->req.buf;
+    uc->rlen = ureq->req.count;
+  }
+  uc->rdone = 0;
+  return submit_recv (uc) == 0;
+}
+
+/* Called from the event loop when a receive completes.  Returns false
+ * if the connection should be closed.
+ */
+static bool
+recv_completed (struct uring_connection *uc, int res)
+{
+  if (res == -EINTR || res == -EAGAIN)
+    return submit_recv (uc) == 0;
+  if (res < 0) {
+    errno = -res;
+    if (uc->state == RECV_HEADER)
+      nbdkit_error ("read request: %m");
+    else
+      nbdkit_error ("read data: %s: %m", name_of_nbd_cmd (NBD_CMD_WRITE));
+    connection_set_status (-1);
+    return false;
+  }
+  if (res == 0) {
+    if (uc->state == RECV_HEADER && uc->rdone == 0) {
+      debug ("client closed input socket, closing connection");
+      connection_set_status (0); /* disconnect */
+    }
+    else {
+      /* Partial record read.  This is an error. */
+      errno = EBADMSG;
+      nbdkit_error ("read data: %m");
+      connection_set_status (-1);
+    }
+    return false;
+  }
+
+  uc->rdone += res;
+  if (uc->rdone < uc->rlen)
+    return submit_recv (uc) == 0;
+
+  switch (uc->state) {
+  case RECV_HEADER:
+    return got_header (uc);
+
+  case RECV_PAYLOAD:
+    dispatch_request (uc);
+    return true;
+
+  case RECV_SKIP:
+    uc->skip -= uc->rlen;
+    if (uc->skip > 0) {
+      uc->rlen = MIN (uc->skip, sizeof uc->skip_buf);
+      uc->rdone = 0;
+      return submit_recv (uc) == 0;
+    }
+    dispatch_request (uc);
+    return true;
+  }
+  abort ();
+}
+
+/* Operations are cancelled when the thread which submitted them
+ * exits.  So threads which may exit (the thread which did the
+ * handshake, and pool threads) do not submit receives directly.
+ * Instead they set recv_active and submit a no-op, and the event loop
+ * starts receiving when that completes.
+ */
+static void
+arm_complete (struct uring_op *op, int res)
+{
+  struct uring_connection *uc =
+    container_of (op, struct uring_connection, arm_op);
+  bool finish = false;
+
+  set_conn (uc);
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&uc->lock);
+    assert (uc->recv_active);
+    if (arm_recv (uc) == -1) {
+      uc->recv_active = false;
+      finish = close_connection (uc);
+    }
+  }
+  threadlocal_set_conn (NULL);
+  if (finish)
+    pool_submit (&uc->finish_job);
+}
+
+static void
+recv_complete (struct uring_op *op, int res)
+{
+  struct uring_connection *uc =
+    container_of (op, struct uring_connection, recv_op);
+
+  bool finish = false;
+
+  set_conn (uc);
+  if (!recv_completed (uc, res)) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&uc->lock);
+    if (uc->ureq) {
+      buffer_put (uc->ureq->req.buf, uc->ureq->req.count);
+      free (uc->ureq);
+      uc->ureq = NULL;
+    }
+    uc->recv_active = false;
+    finish = close_connection (uc);
+  }
+  threadlocal_set_conn (NULL);
+  if (finish)
+    pool_submit (&uc->finish_job);
+}
+
+/* Sending is done by the worker threads.  Each send is submitted to
+ * the connection's ring, and the worker waits for it to complete.
+ */
+struct send_op {
+  struct uring_op op;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool done;
+  int res;
+};
+
+static void
+send_complete (struct uring_op *op, int res)
+{
+  struct send_op *so = container_of (op, struct send_op, op);
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&so->lock);
+
+  so->res = res;
+  so->done = true;
+  pthread_cond_signal (&so->cond);
+}
+
+/* Send all of iov[0..niov-1], returning 0 or -1 on error. */
+static int
+send_iov (struct uring_connection *uc, struct iovec *iov, int niov, int flags)
+{
+  struct send_op so = {
+    .op.complete = send_complete,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+  };
+  struct msghdr msg = { .msg_iov = iov, .msg_iovlen = niov };
+  struct io_uring_sqe sqe;
+  size_t n;
+
+  while (msg.msg_iovlen > 0) {
+    memset (&sqe, 0, sizeof sqe);
+    sqe.opcode = IORING_OP_SENDMSG;
+    sqe.fd = uc->conn->sockout;
+    sqe.addr = (uintptr_t) &msg;
+    sqe.len = 1;
+    sqe.msg_flags = flags;
+
+    so.done = false;
+    if (ring_submit (&uc->loop->ring, &sqe, &so.op, false) == -1)
+      return -1;
+    {
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&so.lock);
+      while (!so.done)
+        pthread_cond_wait (&so.cond, &so.lock);
+    }
+
+    if (so.res < 0) {
+      if (so.res == -EINTR || so.res == -EAGAIN)
+        continue;
+      errno = -so.res;
+      return -1;
+    }
+
+    /* Skip over what was sent. */
+    n = so.res;
+    while (msg.msg_iovlen > 0 && n >= msg.msg_iov[0].iov_len) {
+      n -= msg.msg_iov[0].iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (n > 0) {
+      msg.msg_iov[0].iov_base = (char *) msg.msg_iov[0].iov_base + n;
+      msg.msg_iov[0].iov_len -= n;
+    }
+  }
+
+  pthread_mutex_destroy (&so.lock);
+  pthread_cond_destroy (&so.cond);
+  return 0;
+}
+
+/* Replaces conn->send for connections using this engine.  All callers
+ * hold conn->write_lock, which also protects the cork buffer.
+ */
+static int
+uring_send (const void *buf, size_t len, int flags)
+{
+  GET_CONN;
+  struct uring_connection *uc = conn->uring;
+  struct iovec iov[2];
+  int niov = 0;
+  int r;
+
+  if ((flags & SEND_MORE) && uc->cork_len + len <= CORK_SIZE) {
+    memcpy (&uc->cork[uc->cork_len], buf, len);
+    uc->cork_len += len;
+    return 0;
+  }
+
+  if (uc->cork_len > 0) {
+    iov[niov].iov_base = uc->cork;
+    iov[niov].iov_len = uc->cork_len;
+    niov++;
+  }
+  iov[niov].iov_base = (void *) buf;
+  iov[niov].iov_len = len;
+  niov++;
+
+  r = send_iov (uc, iov, niov, (flags & SEND_MORE) ? MSG_MORE : 0);
+  uc->cork_len = 0;
+  return r;
+}
+
+static void
+quit_complete (struct uring_op *op, int res)
+{
+  struct loop *loop = container_of (op, struct loop, quit_op);
+  struct uring_connection *uc;
+
+  /* Shut down the sockets so that outstanding receives complete.  The
+   * connections are then closed as if the client had disconnected.
+   */
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&loop->lock);
+  loop->quitting = true;
+  for (uc = loop->connections; uc != NULL; uc = uc->next)
+    shutdown (uc->conn->sockin, SHUT_RDWR);
+}
+
+static void
+stop_complete (struct uring_op *op, int res)
+{
+  struct loop *loop = container_of (op, struct loop, stop_op);
+
+  loop->stop = true;
+}
+
+static void *
+loop_thread (void *loopv)
+{
+  struct loop *loop = loopv;
+  struct io_uring_sqe sqe = { .opcode = IORING_OP_POLL_ADD };
+  struct uring_op *op;
+  int res;
+
+  threadlocal_new_server_thread ();
+  threadlocal_set_name ("uring");
+
+  sqe.fd = quit_fd;
+  sqe.poll_events = POLLIN;
+  if (ring_submit (&loop->ring, &sqe, &loop->quit_op, true) == -1) {
+    perror ("io_uring_enter");
+    exit (EXIT_FAILURE);
+  }
+
+  while (!loop->stop) {
+    ring_wait (&loop->ring, &op, &res);
+    if (op != NULL)             /* See ring_submit. */
+      op->complete (op, res);
+  }
+
+  return NULL;
+}
+
+int
+uring_probe (void)
+{
+  struct ring r;
+
+  if (ring_init (&r) == -1) {
+    fprintf (stderr, "%s: --engine=uring: io_uring_setup: %s\n",
+             program_name, strerror (errno));
+    return -1;
+  }
+  ring_free (&r);
+  return 0;
+}
+
+void
+uring_start (void)
+{
+  long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+  unsigned nworkers = threads ? threads : DEFAULT_PARALLEL_REQUESTS;
+  unsigned i;
+  int err;
+
+  if (thread_model != NBDKIT_THREAD_MODEL_PARALLEL || nworkers == 1) {
+    debug ("io_uring engine not used because the thread model "
+           "is not parallel");
+    return;
+  }
+
+  nr_loops = ncpus > 0 ? MIN (ncpus, MAX_LOOPS) : 1;
+  for (i = 0; i < nr_loops; ++i) {
+    struct loop *loop = &loops[i];
+
+    if (ring_init (&loop->ring) == -1) {
+      perror ("io_uring_setup");
+      exit (EXIT_FAILURE);
+    }
+    loop->quit_op.complete = quit_complete;
+    loop->stop_op.complete = stop_complete;
+    pthread_mutex_init (&loop->lock, NULL);
+    err = pthread_create (&loop->thread, NULL, loop_thread, loop);
+    if (err != 0) {
+      errno = err;
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  debug ("io_uring engine: %u event loops", nr_loops);
+  started = true;
+}
+
+/* Wait for all connections to finish, then stop the engine. */
+void
+uring_stop (void)
+{
+  unsigned i;
+
+  if (!started)
+    return;
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&count_lock);
+    while (count > 0)
+      pthread_cond_wait (&count_cond, &count_lock);
+  }
+
+  for (i = 0; i < nr_loops; ++i) {
+    if (ring_submit (&loops[i].ring, &nop, &loops[i].stop_op, false) == -1) {
+      /* Leave the event loop running, the server is exiting anyway. */
+      perror ("io_uring_enter");
+      continue;
+    }
+    pthread_join (loops[i].thread, NULL);
+    ring_free (&loops[i].ring);
+    pthread_mutex_destroy (&loops[i].lock);
+  }
+  started = false;
+}
+
+/* Called after the handshake.  If the connection can use this engine,
+ * hand it over to an event loop and return true.  The connection is
+ * then finalized and freed by the engine.
+ */
+bool
+uring_add_connection (struct connection *conn)
+{
+  struct uring_connection *uc;
+  struct loop *loop;
+  const char *name = threadlocal_get_name ();
+
+  if (!started)
+    return false;
+  if (conn->nworkers == 0 || conn->using_tls ||
+      conn->sockin != conn->sockout)
+    return false;
+
+  uc = calloc (1, sizeof *uc);
+  if (uc == NULL) {
+    perror ("calloc");
+    return false;
+  }
+  uc->name = strdup (name ? name : "");
+  if (uc->name == NULL) {
+    perror ("strdup");
+    free (uc);
+    return false;
+  }
+  uc->arm_op.complete = arm_complete;
+  uc->recv_op.complete = recv_complete;
+  uc->finish_job.run = finish_connection_job;
+  uc->conn = conn;
+  uc->instance_num = threadlocal_get_instance_num ();
+  pthread_mutex_init (&uc->lock, NULL);
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&count_lock);
+    unsigned i;
+
+    /* Use the least busy event loop, if it has space. */
+    loop = &loops[0];
+    for (i = 1; i < nr_loops; ++i)
+      if (loops[i].nr_connections < loop->nr_connections)
+        loop = &loops[i];
+    if (loop->nr_connections >= MAX_LOOP_CONNECTIONS) {
+      debug ("io_uring engine is full, using a thread for this connection");
+      pthread_mutex_destroy (&uc->lock);
+      free (uc->name);
+      free (uc);
+      return false;
+    }
+    loop->nr_connections++;
+    count++;
+  }
+
+  {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&loop->lock);
+    uc->loop = loop;
+    uc->next = loop->connections;
+    loop->connections = uc;
+    if (loop->quitting)
+      shutdown (conn->sockin, SHUT_RDWR);
+  }
+
+  debug ("handshake complete, processing requests with the io_uring engine");
+  conn->uring = uc;
+  conn->send = uring_send;
+  conn->send_fd = NULL;
+
+  uc->recv_active = true;
+  if (ring_submit (&loop->ring, &nop, &uc->arm_op, false) == -1) {
+    nbdkit_error ("io_uring_enter: %m");
+    connection_set_status (-1);
+    uc->recv_active = false;
+    close_connection (uc);
+    pool_submit (&uc->finish_job);
+  }
+  return true;
+}
+
+#else /* !HAVE_URING_ENGINE */
+
+int
+uring_probe (void)
+{
+  fprintf (stderr, "%s: --engine=uring is not supported on this platform\n",
+           program_name);
+  return -1;
+}
+
+void
+uring_start (void)
+{
+  /* nothing */
+}
+
+void
+uring_stop (void)
+{
+  /* nothing */
+}
+
+bool
+uring_add_connection (struct connection *conn)
+{
+  return false;
+}
+
+#endif /* !HAVE_URING_ENGINE */
@@ -0,0 +1,210 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/* Test plugin for the asynchronous callbacks.  Reads return a
+ * pattern and writes are discarded, but every request is completed
+ * one second after it was started by a background thread, like a
+ * backend with high latency.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#undef NDEBUG /* Keep test strong even for nbdkit built without assertions */
+#include <assert.h>
+
+#define NBDKIT_API_VERSION 2
+#include <nbdkit-plugin.h>
+
+#define DELAY 1
+
+struct pending {
+  struct pending *next;
+  struct nbdkit_async *async;
+  time_t deadline;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct pending *head, **tail = &head;
+
+static void *
+completion_thread (void *vp)
+{
+  struct pending *p;
+  time_t now;
+
+  for (;;) {
+    pthread_mutex_lock (&lock);
+    while (head == NULL)
+      pthread_cond_wait (&cond, &lock);
+    p = head;
+    head = p->next;
+    if (head == NULL)
+      tail = &head;
+    pthread_mutex_unlock (&lock);
+
+    now = time (NULL);
+    if (p->deadline > now)
+      sleep (p->deadline - now);
+    nbdkit_async_complete (p->async, 0);
+    free (p);
+  }
+  return NULL;
+}
+
+static int
+async_get_ready (void)
+{
+  pthread_t thread;
+
+  if (pthread_create (&thread, NULL, completion_thread, NULL) != 0) {
+    nbdkit_error ("pthread_create failed");
+    return -1;
+  }
+  pthread_detach (thread);
+  return 0;
+}
+
+static void *
+async_open (int readonly)
+{
+  return NBDKIT_HANDLE_NOT_NEEDED;
+}
+
+static int64_t
+async_get_size (void *handle)
+{
+  return 1024 * 1024;
+}
+
+static int
+async_can_flush (void *handle)
+{
+  return 1;
+}
+
+static int
+start (struct nbdkit_async *async)
+{
+  struct pending *p;
+
+  p = malloc (sizeof *p);
+  if (p == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  p->next = NULL;
+  p->async = async;
+  p->deadline = time (NULL) + DELAY;
+
+  pthread_mutex_lock (&lock);
+  *tail = p;
+  tail = &p->next;
+  pthread_cond_signal (&cond);
+  pthread_mutex_unlock (&lock);
+  return 0;
+}
+
+static int
+async_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+             uint32_t flags)
+{
+  memset (buf, offset >> 9, count);
+  sleep (DELAY);
+  return 0;
+}
+
+static int
+async_pread_async (void *handle, void *buf, uint32_t count,
+                   uint64_t offset, uint32_t flags,
+                   struct nbdkit_async *async)
+{
+  memset (buf, offset >> 9, count);
+  return start (async);
+}
+
+static int
+async_pwrite (void *handle, const void *buf, uint32_t count,
+              uint64_t offset, uint32_t flags)
+{
+  sleep (DELAY);
+  return 0;
+}
+
+static int
+async_pwrite_async (void *handle, const void *buf, uint32_t count,
+                    uint64_t offset, uint32_t flags,
+                    struct nbdkit_async *async)
+{
+  return start (async);
+}
+
+static int
+async_flush (void *handle, uint32_t flags)
+{
+  sleep (DELAY);
+  return 0;
+}
+
+static int
+async_flush_async (void *handle, uint32_t flags, struct nbdkit_async *async)
+{
+  return start (async);
+}
+
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
+
+static struct nbdkit_plugin plugin = {
+  .name              = "testasync",
+  .version           = PACKAGE_VERSION,
+  .get_ready         = async_get_ready,
+  .open              = async_open,
+  .get_size          = async_get_size,
+  .can_flush         = async_can_flush,
+  .pread             = async_pread,
+  .pwrite            = async_pwrite,
+  .flush             = async_flush,
+  .pread_async       = async_pread_async,
+  .pwrite_async      = async_pwrite_async,
+  .flush_async       = async_flush_async,
+};
+
+NBDKIT_REGISTER_PLUGIN(plugin)
@@ -0,0 +1,67 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the asynchronous plugin callbacks.  Each request takes one
+# second in test-async-plugin, but because the plugin completes them
+# from its own thread, far more requests than threads (-t) can be in
+# flight at once.  The noextents filter doesn't intercept reads so
+# they pass through to the plugin asynchronously.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter noextents
+requires_nbdsh_uri
+
+nbdkit -U - -t 2 --filter=noextents .libs/test-async-plugin.$SOEXT \
+       --run 'nbdsh -u "$uri" -c "
+import time
+
+start_t = time.time()
+bufs = [nbd.Buffer(512) for i in range(64)]
+for i in range(64):
+    h.aio_pread(bufs[i], i * 512)
+h.aio_pwrite(nbd.Buffer.from_bytearray(bytearray(512)), 0)
+h.aio_flush()
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+t = time.time() - start_t
+print(t)
+
+for i in range(64):
+    assert bufs[i].to_bytearray() == bytearray([i]) * 512
+# With only 2 requests in the plugin at a time this would take at
+# least 33 seconds.
+assert t < 10
+"'
@@ -0,0 +1,84 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test that block size constraints from the plugin and filters are
+# advertised to the client.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin eval
+requires_filter blocksize
+requires_filter cow
+requires_nbdsh_uri
+requires nbdsh -c 'exit(not hasattr(h, "get_block_size"))'
+
+# The script checks the minimum, preferred and maximum block size.
+export check='
+import os
+expected = [int(x) for x in os.environ["expected"].split()]
+assert h.get_block_size(nbd.SIZE_MINIMUM) == expected[0]
+assert h.get_block_size(nbd.SIZE_PREFERRED) == expected[1]
+assert h.get_block_size(nbd.SIZE_MAXIMUM) == expected[2]
+'
+
+# No constraints, but nbdkit never accepts requests larger than 64M.
+export expected="1 4096 67108864"
+nbdkit -U - eval get_size='echo 1M' pread='exit 1' \
+       --run 'nbdsh -u "$uri" -c "$check"'
+
+# Constraints set by the plugin.
+export expected="512 65536 1048576"
+nbdkit -U - eval get_size='echo 1M' pread='exit 1' \
+       block_size='echo 512 64K 1M' \
+       --run 'nbdsh -u "$uri" -c "$check"'
+
+# The cow filter accepts any alignment, and prefers its block size.
+export expected="1 131072 67108864"
+nbdkit -U - --filter=cow eval get_size='echo 1M' pread='exit 1' \
+       block_size='echo 512 4K 1M' cow-block-size=128K \
+       --run 'nbdsh -u "$uri" -c "$check"'
+
+# The blocksize filter accepts any alignment, and prefers minblock.
+export expected="1 16384 67108864"
+nbdkit -U - --filter=blocksize eval get_size='echo 1M' pread='exit 1' \
+       block_size='echo 512 4K 1M' minblock=16K \
+       --run 'nbdsh -u "$uri" -c "$check"'
+
+# Invalid constraints from the plugin cause the connection to fail.
+if nbdkit -U - eval get_size='echo 1M' pread='exit 1' \
+          block_size='echo 3 4K 1M' \
+          --run 'nbdsh -u "$uri" -c pass'; then
+    echo "$0: expected invalid block size to fail"
+    exit 1
+fi
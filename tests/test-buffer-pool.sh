@@ -0,0 +1,63 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the request buffer pool with a small memory budget, so that
+# buffers are freed and reallocated, and with each kind of page.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin memory
+requires_nbdsh_uri
+
+# Invalid options are rejected.
+if nbdkit --buffer-hugepages=foo memory 1M --run true; then
+    echo "$0: expected --buffer-hugepages=foo to fail"
+    exit 1
+fi
+if nbdkit --buffer-memory=foo memory 1M --run true; then
+    echo "$0: expected --buffer-memory=foo to fail"
+    exit 1
+fi
+
+for pages in none thp hugetlb; do
+    nbdkit -U - --buffer-memory=64K --buffer-hugepages=$pages memory 16M \
+           --run 'nbdsh -u "$uri" -c "
+sizes = [512, 4096, 65536, 1024*1024, 3*1024*1024 + 5]
+for (i, size) in enumerate(sizes):
+    h.pwrite(bytearray([i+1]) * size, i * 3*1024*1024)
+for (i, size) in enumerate(sizes):
+    assert h.pread(size, i * 3*1024*1024) == bytearray([i+1]) * size
+"'
+done
@@ -0,0 +1,81 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter cache
+requires_filter delay
+requires_nbdsh_uri
+
+sock=$(mktemp -u /tmp/nbdkit-test-sock.XXXXXX)
+files="$sock cache-parallel.pid"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Run nbdkit with the cache filter and a read delay.  Cache misses on
+# different blocks should be fetched from the plugin in parallel.
+start_nbdkit -P cache-parallel.pid -U $sock \
+             --filter=cache --filter=delay \
+             memory 1M cache-on-read=true rdelay=5
+
+nbdsh --connect "nbd+unix://?socket=$sock" \
+      -c '
+from time import time
+
+# Issue 8 reads of different 64K blocks in parallel.  If the cache
+# filter serialized the misses this would take at least 40 seconds.
+st = time()
+for i in range(8):
+    buf = nbd.Buffer(65536)
+    h.aio_pread(buf, i * 65536)
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+et = time()
+el = et-st
+print("elapsed time: %g" % el)
+assert el >= 5
+assert el < 40
+
+# Reading the same blocks again should be served from the cache.
+st = time()
+for i in range(8):
+    buf = nbd.Buffer(65536)
+    h.aio_pread(buf, i * 65536)
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+et = time()
+el = et-st
+print("elapsed time: %g" % el)
+assert el < 5
+'
@@ -0,0 +1,95 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter cache
+requires_filter delay
+requires_nbdsh_uri
+
+files="cache-persistent.img cache-persistent.cache cache-persistent.cache.meta"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s 1M cache-persistent.img
+
+# Run nbdkit with a persistent cache and a read delay.
+run_nbdkit ()
+{
+    nbdkit -U - -v \
+           --filter=cache --filter=delay \
+           file cache-persistent.img rdelay=5 \
+           cache-on-read=true cache-file=cache-persistent.cache \
+           --run "nbdsh -u \"\$uri\" -c '$1'"
+}
+
+# The first read goes to the plugin and fills the cache.  The write
+# is flushed by the client, but also kept in the cache.
+run_nbdkit '
+from time import time
+h.pwrite(b"1" * 65536, 65536)
+h.flush()
+st = time()
+h.pread(65536, 131072)
+el = time() - st
+print("elapsed time: %g" % el)
+assert el >= 5
+'
+test -f cache-persistent.cache.meta
+
+# Restarting nbdkit should reuse the cache, so reads are fast.
+run_nbdkit '
+from time import time
+st = time()
+assert h.pread(65536, 65536) == b"1" * 65536
+assert h.pread(65536, 131072) == bytearray(65536)
+el = time() - st
+print("elapsed time: %g" % el)
+assert el < 5
+'
+
+# Changing the plugin parameters must discard the cache.
+nbdkit -U - -v \
+       --filter=cache --filter=delay \
+       file cache-persistent.img rdelay=5 wdelay=0 \
+       cache-on-read=true cache-file=cache-persistent.cache \
+       --run 'nbdsh -u "$uri" -c "
+from time import time
+st = time()
+h.pread(65536, 131072)
+el = time() - st
+print(\"elapsed time: %g\" % el)
+assert el >= 5
+"'
@@ -0,0 +1,72 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test cache-policy=2q under reclaim pressure.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter cache
+requires_nbdsh_uri
+
+files="cache-policy.img"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s 16M cache-policy.img
+
+# Use a small maximum cache size so that a sequential scan of the
+# disk forces blocks to be reclaimed.  The hot blocks are read
+# between parts of the scan, and the data must always be correct.
+nbdkit -U - -v \
+       --filter=cache \
+       file cache-policy.img \
+       cache=writethrough cache-on-read=true \
+       cache-max-size=1M cache-policy=2q \
+       --run 'nbdsh -u "$uri" -c "
+bs = 65536
+nr_blocks = h.get_size() // bs
+
+def pattern(i):
+    return bytes([i % 251 + 1]) * bs
+
+for i in range(nr_blocks):
+    h.pwrite(pattern(i), i * bs)
+
+hot = range(4)
+for i in range(nr_blocks):
+    for j in hot:
+        assert h.pread(bs, j * bs) == pattern(j)
+    assert h.pread(bs, i * bs) == pattern(i)
+"'
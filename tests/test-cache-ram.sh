@@ -0,0 +1,85 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the in-memory tier of the cache (cache-ram-size).
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter cache
+requires_nbdsh_uri
+
+files="cache-ram.img"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s 4M cache-ram.img
+
+# The RAM tier only holds 4 blocks so most reads have to evict
+# blocks.  Zeroing and trimming must drop stale copies from RAM.
+nbdkit -U - -v \
+       --filter=cache \
+       file cache-ram.img \
+       cache=writeback cache-on-read=true cache-ram-size=256K \
+       --run 'nbdsh -u "$uri" -c "
+bs = 65536
+nr_blocks = h.get_size() // bs
+
+def pattern(i):
+    return bytes([i % 251 + 1]) * bs
+
+for i in range(nr_blocks):
+    h.pwrite(pattern(i), i * bs)
+
+for k in range(3):
+    for i in range(nr_blocks):
+        assert h.pread(bs, i * bs) == pattern(i)
+        assert h.pread(bs, 0) == pattern(0)
+
+for i in range(0, nr_blocks, 3):
+    h.zero(bs, i * bs)
+h.flush()
+for i in range(nr_blocks):
+    expected = bytes(bs) if i % 3 == 0 else pattern(i)
+    assert h.pread(bs, i * bs) == expected
+"'
+
+# Check the data was written back to the plugin.
+nbdkit -U - file cache-ram.img \
+       --run 'nbdsh -u "$uri" -c "
+bs = 65536
+for i in range(h.get_size() // bs):
+    expected = bytes(bs) if i % 3 == 0 else bytes([i % 251 + 1]) * bs
+    assert h.pread(bs, i * bs) == expected
+"'
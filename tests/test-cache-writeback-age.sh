@@ -0,0 +1,70 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter cache
+requires_nbdsh_uri
+
+files="cache-writeback-age.img"
+rm -f $files
+cleanup_fn rm -f $files
+
+truncate -s 1M cache-writeback-age.img
+
+# Write without flushing.  The background writeback thread should
+# write the data to the plugin within 2 * cache-dirty-age seconds.
+nbdkit -U - -v \
+       --filter=cache \
+       file cache-writeback-age.img \
+       cache=writeback cache-dirty-age=1 \
+       --run 'nbdsh -u "$uri" -c "
+from time import sleep, time
+
+h.pwrite(b\"1\" * 65536, 0)
+h.pwrite(b\"2\" * 65536, 131072)
+
+# Poll the plugin file directly, without flushing.
+st = time()
+while True:
+    with open(\"cache-writeback-age.img\", \"rb\") as f:
+        data = f.read(196608)
+    if data[0:65536] == b\"1\" * 65536 and \\
+       data[131072:196608] == b\"2\" * 65536:
+        break
+    assert time() - st < 30
+    sleep(0.5)
+print(\"written back after %g seconds\" % (time() - st))
+"'
@@ -0,0 +1,77 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test the cow-allocator option, which stores the overlay in memory.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter cow
+requires_plugin pattern
+requires_nbdsh_uri
+
+# Because the overlay is in memory, no temporary file should be
+# created, so point TMPDIR at a directory which does not exist.
+export TMPDIR=/nonexistent
+
+# Which allocators can we test?
+allocators="sparse malloc"
+
+if nbdkit --dump-config | grep -sq zstd=yes; then
+    allocators="$allocators zstd"
+fi
+
+for a in $allocators; do
+    nbdkit -U - --filter=cow pattern 1M cow-block-size=4096 \
+           cow-allocator=$a \
+           --run 'nbdsh -u "$uri" -c "
+import struct
+
+def pattern(offset, count):
+    start = offset & ~7
+    end = (offset + count + 7) & ~7
+    b = b\"\".join(struct.pack(\">Q\", i) for i in range(start, end, 8))
+    return b[offset - start:offset - start + count]
+
+# Unaligned write spanning several blocks.
+h.pwrite(b\"x\" * 10000, 5000)
+assert h.pread(20000, 0) == \
+    pattern(0, 5000) + b\"x\" * 10000 + pattern(15000, 5000)
+
+# Trim a block, then check the data around it is preserved.
+h.trim(4096, 131072)
+assert h.pread(4096, 131072) == bytearray(4096)
+assert h.pread(4096, 126976) == pattern(126976, 4096)
+assert h.pread(4096, 135168) == pattern(135168, 4096)
+"'
+done
@@ -0,0 +1,94 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test --engine=uring with several connections and parallel requests.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin memory
+requires_nbdsh_uri
+
+if ! nbdkit --dump-config | grep -sq io_uring=yes; then
+    echo "$0: nbdkit was compiled without io_uring support"
+    exit 77
+fi
+requires nbdkit -U - --engine=uring null --run true
+
+log=engine-uring.log
+rm -f $log
+cleanup_fn rm -f $log
+
+export uri
+uri= # will be set by --run later
+nbdkit -U - -v --engine=uring memory 16M \
+       --run 'nbdsh -u "$uri" -c "
+import os
+
+# Open some more connections.
+hs = [h]
+for i in range(3):
+    h2 = nbd.NBD()
+    h2.connect_uri(os.environ[\"uri\"])
+    hs.append(h2)
+
+# Issue many parallel writes on each connection to separate areas.
+bufs = []
+for i, h2 in enumerate(hs):
+    for j in range(32):
+        buf = nbd.Buffer.from_bytearray(bytearray([i * 32 + j]) * 65536)
+        bufs.append(buf)
+        h2.aio_pwrite(buf, (i * 32 + j) * 65536)
+for h2 in hs:
+    while h2.aio_in_flight() > 0:
+        h2.poll(-1)
+
+# Read everything back through a different connection.
+for i in range(4):
+    for j in range(32):
+        off = (i * 32 + j) * 65536
+        assert hs[(i + 1) % 4].pread(65536, off) == \
+            bytearray([i * 32 + j]) * 65536
+
+# A write which is out of range must be rejected, without
+# breaking the connection.
+try:
+    h.pwrite(b\"x\" * 512, 16 * 1024 * 1024 - 256)
+    assert False
+except nbd.Error:
+    pass
+assert h.pread(512, 0) == bytearray(512)
+"' 2>$log
+
+cat $log
+grep "processing requests with the io_uring engine" $log
@@ -0,0 +1,76 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test that with extended headers, zero, trim and block status
+# requests larger than 4G are handled in a single request.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin memory
+requires_nbdsh_uri
+requires nbdsh -c 'exit(not hasattr(h, "set_request_extended_headers"))'
+
+nbdkit -U - memory 64G --run 'export uri
+nbdsh -c - <<\EOF
+import os
+
+G = 1024 * 1024 * 1024
+
+h.set_request_extended_headers(True)
+h.add_meta_context(nbd.CONTEXT_BASE_ALLOCATION)
+h.connect_uri(os.environ["uri"])
+assert h.get_extended_headers_negotiated()
+
+h.pwrite(b"hello", 10 * G)
+h.pwrite(b"world", 40 * G)
+
+# Zero the first 48G, including both writes.
+h.zero(48 * G, 0)
+assert h.pread(5, 10 * G) == bytearray(5)
+assert h.pread(5, 40 * G) == bytearray(5)
+
+h.pwrite(b"world", 40 * G)
+h.trim(16 * G, 48 * G)
+
+# A single block status request maps the whole disk, and extents
+# longer than 4G are not split.
+entries = []
+def f(metacontext, offset, e, err):
+    assert metacontext == nbd.CONTEXT_BASE_ALLOCATION
+    assert offset == 0
+    entries.extend(e)
+h.block_status_64(64 * G, 0, f)
+assert entries == [(40 * G, 3), (32768, 0), (24 * G - 32768, 3)]
+EOF
+'
@@ -224,6 +224,18 @@ test_layers_filter_get_size (nbdkit_next *next,
   return next->get_size (next);
 }
 
+static int
+test_layers_filter_block_size (nbdkit_next *next, void *handle,
+                               uint32_t *minimum, uint32_t *preferred,
+                               uint32_t *maximum)
+{
+  struct handle *h = handle;
+
+  assert (h->next == next);
+  DEBUG_FUNCTION;
+  return next->block_size (next, minimum, preferred, maximum);
+}
+
 static int
 test_layers_filter_can_write (nbdkit_next *next,
                               void *handle)
@@ -439,6 +451,7 @@ static struct nbdkit_filter filter = {
   .prepare           = test_layers_filter_prepare,
   .finalize          = test_layers_filter_finalize,
   .get_size          = test_layers_filter_get_size,
+  .block_size        = test_layers_filter_block_size,
   .can_write         = test_layers_filter_can_write,
   .can_flush         = test_layers_filter_can_flush,
   .is_rotational     = test_layers_filter_is_rotational,
@@ -308,6 +308,15 @@ main (int argc, char *argv[])
     exit (EXIT_FAILURE);
   }
 
+#if LIBNBD_HAVE_NBD_GET_BLOCK_SIZE
+  /* Verify block size (see tests/test-layers-plugin.c). */
+  if (nbd_get_block_size (nbd, LIBNBD_SIZE_PREFERRED) != 512) {
+    fprintf (stderr, "%s: unexpected preferred block size %" PRIi64 "\n",
+             program_name, nbd_get_block_size (nbd, LIBNBD_SIZE_PREFERRED));
+    exit (EXIT_FAILURE);
+  }
+#endif
+
   /* Verify export flags. */
   if (nbd_is_read_only (nbd) != 0) {
     fprintf (stderr, "%s: unexpected eflags: NBD_FLAG_READ_ONLY not clear\n",
@@ -392,6 +401,14 @@ main (int argc, char *argv[])
      "test_layers_plugin_get_size",
      NULL);
 
+  /* block_size methods called in order. */
+  log_verify_seen_in_order
+    ("filter3: test_layers_filter_block_size",
+     "filter2: test_layers_filter_block_size",
+     "filter1: test_layers_filter_block_size",
+     "test_layers_plugin_block_size",
+     NULL);
+
   /* can_* / is_* methods called in order. */
   log_verify_seen_in_order
     ("filter3: test_layers_filter_can_write",
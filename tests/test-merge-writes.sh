@@ -0,0 +1,66 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test --merge-writes.  The client sends many small sequential writes
+# without waiting for the replies, and nbdkit should pass them to the
+# plugin as a few large writes.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin memory
+requires_nbdsh_uri
+
+log=test-merge-writes.log
+files="$log"
+rm -f $files
+cleanup_fn rm -f $files
+
+nbdkit -U - -v --merge-writes=1M --merge-wait=1000 memory 1M \
+       --run 'nbdsh -u "$uri" -c "
+for i in range(64):
+    h.aio_pwrite(nbd.Buffer.from_bytearray(bytearray([i]) * 4096), i * 4096)
+while h.aio_in_flight() > 0:
+    h.poll(-1)
+
+buf = h.pread(64 * 4096, 0)
+for i in range(64):
+    assert buf[i * 4096:(i+1) * 4096] == bytearray([i]) * 4096
+"' 2>$log
+cat $log
+
+# Check the writes were merged.
+n=$(grep -c 'memory: pwrite count=' $log)
+test $n -ge 1
+test $n -lt 64
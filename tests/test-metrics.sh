@@ -0,0 +1,82 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test --metrics-file, which is written when nbdkit exits.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin memory
+requires_filter noextents
+requires_filter cow
+requires_filter cache
+requires_nbdsh_uri
+
+metrics=test-metrics.prom
+files="$metrics"
+rm -f $files
+cleanup_fn rm -f $files
+
+nbdkit -U - --metrics-file=$metrics --filter=noextents memory 1M \
+       --run 'nbdsh -u "$uri" -c "h.pwrite(bytearray(512), 0)" \
+                              -c "h.pread(512, 0)" -c "h.pread(512, 512)"'
+cat $metrics
+
+plugin='layer="0",type="plugin",name="memory",export=""'
+filter='layer="1",type="filter",name="noextents",export=""'
+grep "^nbdkit_requests_total{$plugin,op=\"pwrite\"} 1\$" $metrics
+grep "^nbdkit_requests_total{$filter,op=\"pread\"} 2\$" $metrics
+grep "^nbdkit_request_bytes_total{$plugin,op=\"pread\"} 1024\$" $metrics
+grep "^nbdkit_request_errors_total{$plugin,op=\"pread\"} 0\$" $metrics
+grep "^nbdkit_request_duration_seconds_bucket{$plugin,op=\"pread\",le=\"+Inf\"} 2\$" \
+     $metrics
+grep "^nbdkit_request_duration_seconds_count{$filter,op=\"pwrite\"} 1\$" \
+     $metrics
+
+# Filters can add their own metrics.
+nbdkit -U - --metrics-file=$metrics --filter=cow memory 1M \
+       --run 'nbdsh -u "$uri" -c "h.pwrite(b\"x\" * 65536, 0)" \
+                              -c "h.trim(65536, 0)"'
+cat $metrics
+grep "^# TYPE nbdkit_cow_overlay_bytes gauge\$" $metrics
+grep "^nbdkit_cow_overlay_bytes 0\$" $metrics
+grep "^nbdkit_cow_overlay_peak_bytes 65536\$" $metrics
+
+nbdkit -U - --metrics-file=$metrics --filter=cache memory 1M \
+       --run 'nbdsh -u "$uri" -c "h.pwrite(b\"x\" * 65536, 0)" \
+                              -c "h.pread(65536, 0)" \
+                              -c "h.pread(65536, 131072)"'
+cat $metrics
+grep "^nbdkit_cache_read_hits_total 1\$" $metrics
+grep "^nbdkit_cache_read_misses_total 1\$" $metrics
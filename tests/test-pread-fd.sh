@@ -0,0 +1,91 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test that reads which the plugin returns as a file descriptor (and
+# which the server sends with sendfile) return the right data.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin file
+requires_plugin split
+requires_filter cache
+requires_nbdsh_uri
+
+files="pread-fd-1.img pread-fd-2.img"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Create two files containing a pattern which is different in every
+# 512 byte sector.
+for f in 1 2; do
+    for i in `seq 0 511`; do
+        printf "%511d\n" $((f * 1000 + i))
+    done > pread-fd-$f.img
+done
+
+# Read from a file, with unaligned and multi-chunk reads.
+nbdkit -U - file pread-fd-1.img \
+       --run 'nbdsh -u "$uri" -c "
+with open(\"pread-fd-1.img\", \"rb\") as f:
+    expected = f.read()
+for (offset, count) in [(0, 512), (1, 1000), (0, 262144), (200000, 62144)]:
+    assert h.pread(count, offset) == expected[offset:offset+count]
+"'
+
+# Read from split files, including reads which span the two files.
+nbdkit -U - split pread-fd-1.img pread-fd-2.img \
+       --run 'nbdsh -u "$uri" -c "
+expected = b\"\"
+for n in [1, 2]:
+    with open(\"pread-fd-%d.img\" % n, \"rb\") as f:
+        expected += f.read()
+for (offset, count) in [(0, 512), (262000, 1000), (262144, 4096),
+                        (0, 524288)]:
+    assert h.pread(count, offset) == expected[offset:offset+count]
+"'
+
+# Read through the cache filter.  The second read of each range is
+# served directly from the cache file.
+nbdkit -U - --filter=cache file pread-fd-2.img cache-on-read=true \
+       --run 'nbdsh -u "$uri" -c "
+with open(\"pread-fd-2.img\", \"rb\") as f:
+    expected = f.read()
+for i in range(2):
+    for (offset, count) in [(100, 70000), (65536, 131072)]:
+        assert h.pread(count, offset) == expected[offset:offset+count]
+h.pwrite(b\"hello\", 65546)
+expected = expected[:65546] + b\"hello\" + expected[65551:]
+assert h.pread(65536, 65536) == expected[65536:131072]
+"'
@@ -0,0 +1,106 @@
+/* nbdkit
+ * Copyright (C) 2022 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* A plugin whose .pread_sparse callback fills in the first half of
+ * each read and describes the second half, which it leaves alone,
+ * with the extent type given by the type=N parameter.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define NBDKIT_API_VERSION 2
+#include <nbdkit-plugin.h>
+
+static uint32_t type = NBDKIT_EXTENT_HOLE;
+
+static int
+sparse_config (const char *key, const char *value)
+{
+  if (strcmp (key, "type") == 0)
+    return nbdkit_parse_uint32_t ("type", value, &type);
+
+  nbdkit_error ("unknown parameter '%s'", key);
+  return -1;
+}
+
+static void *
+sparse_open (int readonly)
+{
+  return NBDKIT_HANDLE_NOT_NEEDED;
+}
+
+static int64_t
+sparse_get_size (void *handle)
+{
+  return 1024*1024;
+}
+
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
+
+static int
+sparse_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+              uint32_t flags)
+{
+  memset (buf, 'd', count / 2);
+  memset ((char *) buf + count / 2, 0, count - count / 2);
+  return 0;
+}
+
+static int
+sparse_pread_sparse (void *handle, void *buf, uint32_t count,
+                     uint64_t offset, uint32_t flags,
+                     struct nbdkit_extents *extents)
+{
+  memset (buf, 'd', count / 2);
+  if (nbdkit_add_extent (extents, offset, count / 2, 0) == -1 ||
+      nbdkit_add_extent (extents, offset + count / 2, count - count / 2,
+                         type) == -1)
+    return -1;
+  return 0;
+}
+
+static struct nbdkit_plugin plugin = {
+  .name              = "sparse",
+  .version           = PACKAGE_VERSION,
+  .config            = sparse_config,
+  .open              = sparse_open,
+  .get_size          = sparse_get_size,
+  .pread             = sparse_pread,
+  .pread_sparse      = sparse_pread_sparse,
+};
+
+NBDKIT_REGISTER_PLUGIN(plugin)
@@ -0,0 +1,126 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test reads from plugins with a .pread_sparse callback, where holes
+# are not filled in by the plugin but sent to the client as hole
+# chunks.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin memory
+requires_plugin file
+requires_filter offset
+requires_nbdsh_uri
+requires truncate --version
+
+files="pread-sparse.img pread-sparse.log"
+rm -f $files
+cleanup_fn rm -f $files
+
+# Check the data and the chunks of some reads.  With structured
+# replies the unallocated parts are sent as holes, and the data
+# (including whole zero blocks inside allocated pages) is unchanged.
+export check='
+h.pwrite(b"x" * 10, 100000)
+h.pwrite(b"y" * (3 * 1024 * 1024), 5 * 1024 * 1024)
+
+def read_chunks(count, offset):
+    buf = bytearray(count)
+    chunks = []
+    def f(data, off, status, err):
+        buf[off-offset:off-offset+len(data)] = data
+        if status == nbd.READ_HOLE:
+            assert data == bytearray(len(data))
+            chunks.append(("hole", off, len(data)))
+        else:
+            chunks.append(("data", off, len(data)))
+    h.pread_structured(count, offset, f)
+    return (bytes(buf), chunks)
+
+buf, chunks = read_chunks(1024 * 1024, 0)
+assert buf == bytes(100000) + b"x" * 10 + bytes(1024 * 1024 - 100010)
+assert ("data", 98304, 4096) in chunks
+assert sum(c[2] for c in chunks if c[0] == "hole") == 1024 * 1024 - 4096
+
+buf, chunks = read_chunks(8 * 1024 * 1024, 4 * 1024 * 1024)
+assert buf == bytes(1024 * 1024) + b"y" * (3 * 1024 * 1024) + \
+    bytes(4 * 1024 * 1024)
+assert chunks[0] == ("hole", 4 * 1024 * 1024, 1024 * 1024)
+assert chunks[-1][0] == "hole"
+
+buf, chunks = read_chunks(1000, 100005)
+assert buf == b"x" * 5 + bytes(995)
+'
+
+nbdkit -U - -v memory 16M \
+       --run 'nbdsh -u "$uri" -c "$check"' 2>pread-sparse.log
+grep "memory: pread_sparse" pread-sparse.log
+
+# With cache=none the file plugin does not return a file descriptor,
+# so it uses .pread_sparse to skip the holes in a sparse file.
+truncate -s 16M pread-sparse.img
+nbdkit -U - -v file pread-sparse.img cache=none \
+       --run 'nbdsh -u "$uri" -c "$check"' 2>pread-sparse.log
+grep "file: pread_sparse" pread-sparse.log
+
+# A filter which intercepts .pread makes the read use .pread again.
+nbdkit -U - -v --filter=offset memory 17M offset=1M \
+       --run 'nbdsh -u "$uri" -c "$check"' 2>pread-sparse.log
+grep "memory: pread " pread-sparse.log
+if grep "memory: pread_sparse" pread-sparse.log; then
+    echo "$0: .pread_sparse should not be used through the offset filter"
+    exit 1
+fi
+
+# Extents which are neither data nor zero were not filled in by the
+# plugin, so the read must fail rather than send the buffer contents.
+export bad='
+try:
+    h.pread_structured(4096, 0, lambda *args: 0)
+    assert False
+except nbd.Error as ex:
+    assert ex.errno == "EIO"
+'
+nbdkit -U - .libs/test-pread-sparse-plugin.$SOEXT \
+       --run 'nbdsh -u "$uri" -c "$bad"'
+nbdkit -U - .libs/test-pread-sparse-plugin.$SOEXT type=4 \
+       --run 'nbdsh -u "$uri" -c "$bad"'
+
+# A hole which reads as zeroes is fine.
+nbdkit -U - .libs/test-pread-sparse-plugin.$SOEXT type=3 \
+       --run 'nbdsh -u "$uri" -c "
+assert h.pread_structured(4096, 0, lambda *args: 0) == \
+    b\"d\" * 2048 + bytes(2048)
+"'
@@ -0,0 +1,95 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Test that large structured reads are split into chunks, and that
+# blocks of zeroes are sent as holes.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin memory
+requires_nbdsh_uri
+
+nbdkit -U - memory 16M \
+       --run 'nbdsh -u "$uri" -c "
+h.pwrite(b\"x\" * 10, 12388)
+h.pwrite(b\"y\" * (3 * 1024 * 1024), 5 * 1024 * 1024)
+
+def read_chunks(count, offset, flags=0):
+    chunks = []
+    def f(buf, offset, status, err):
+        if status == nbd.READ_DATA:
+            chunks.append((\"data\", offset, len(buf)))
+        else:
+            assert status == nbd.READ_HOLE
+            assert buf == bytearray(len(buf))
+            chunks.append((\"hole\", offset, len(buf)))
+    h.pread_structured(count, offset, f, flags)
+    return chunks
+
+# Small reads and reads with the DF flag use a single chunk.
+assert read_chunks(512, 12288) == [(\"data\", 12288, 512)]
+assert read_chunks(512, 0) == [(\"data\", 0, 512)]
+assert read_chunks(32768, 0, nbd.CMD_FLAG_DF) == [(\"data\", 0, 32768)]
+assert read_chunks(8192, 0, nbd.CMD_FLAG_DF) == [(\"hole\", 0, 8192)]
+
+# Whole zero blocks are sent as holes.
+assert read_chunks(32768, 0) == [
+    (\"hole\", 0, 12288),
+    (\"data\", 12288, 4096),
+    (\"hole\", 16384, 16384),
+]
+
+# Unaligned ends are sent as data.
+assert read_chunks(20580, 100) == [
+    (\"data\", 100, 3996),
+    (\"hole\", 4096, 8192),
+    (\"data\", 12288, 4096),
+    (\"hole\", 16384, 4096),
+    (\"data\", 20480, 200),
+]
+
+# Large data is split into chunks.
+assert read_chunks(4 * 1024 * 1024, 5 * 1024 * 1024) == [
+    (\"data\", 5 * 1024 * 1024, 1024 * 1024),
+    (\"data\", 6 * 1024 * 1024, 1024 * 1024),
+    (\"data\", 7 * 1024 * 1024, 1024 * 1024),
+    (\"hole\", 8 * 1024 * 1024, 1024 * 1024),
+]
+
+# The contents are still correct.
+buf = h.pread(16 * 1024 * 1024, 0)
+assert buf[12388:12398] == b\"x\" * 10
+assert buf[5 * 1024 * 1024:8 * 1024 * 1024] == b\"y\" * (3 * 1024 * 1024)
+assert buf.count(0) == 16 * 1024 * 1024 - 10 - 3 * 1024 * 1024
+"'
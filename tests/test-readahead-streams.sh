@@ -0,0 +1,71 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the readahead filter with several interleaved sequential
+# streams, and that writes invalidate prefetched data.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_plugin memory
+requires_nbdsh_uri
+
+nbdkit -U - -v --filter=readahead memory 4M \
+       --run 'nbdsh -u "$uri" -c "
+bs = 4096
+size = h.get_size()
+
+def pattern(i, gen):
+    return bytes([(i + gen) % 251 + 1]) * bs
+
+for i in range(size // bs):
+    h.pwrite(pattern(i, 0), i * bs)
+
+# Read four interleaved sequential streams.
+starts = [0, size // 4, size // 2, 3 * size // 4]
+for i in range(0, size // 4, bs):
+    for s in starts:
+        assert h.pread(bs, s + i) == pattern((s + i) // bs, 0)
+
+# Start the streams again, then overwrite blocks which have probably
+# been prefetched already, and check the new data is read.
+for s in starts:
+    assert h.pread(bs, s) == pattern(s // bs, 0)
+for s in starts:
+    for i in range(1, 64):
+        h.pwrite(pattern(s // bs + i, 1), s + i * bs)
+for i in range(1, 64):
+    for s in starts:
+        assert h.pread(bs, s + i * bs) == pattern(s // bs + i, 1)
+"'
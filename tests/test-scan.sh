@@ -0,0 +1,78 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the scan filter issues cache requests for the whole disk,
+# skipping holes.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter scan
+requires_filter log
+requires_filter cache
+requires truncate --version
+requires dd --version
+
+files="scan.img scan.log"
+rm -f $files
+cleanup_fn rm -f $files
+
+# A sparse disk with data in two places.
+truncate -s 32M scan.img
+printf 'hello' | dd of=scan.img bs=1 seek=4194304 conv=notrunc
+printf 'world' | dd of=scan.img bs=1 seek=20971520 conv=notrunc
+
+# Wait for the scan to reach the second area of data.
+nbdkit -U - -v \
+       --filter=scan --filter=log --filter=cache \
+       file scan.img logfile=scan.log scan-size=1M \
+       --run '
+for i in $(seq 1 30); do
+    if grep -q "Cache .* offset=0x1400000" scan.log; then exit 0; fi
+    sleep 1
+done
+echo "$0: timed out waiting for the scan"
+exit 1
+'
+
+cat scan.log
+
+# The first area of data should have been scanned.
+grep "Cache .* offset=0x400000" scan.log
+
+# Holes should not have been scanned.
+if grep "Cache .* offset=0x0 " scan.log; then
+    echo "$0: hole at start of disk was scanned"
+    exit 1
+fi
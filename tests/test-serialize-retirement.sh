@@ -0,0 +1,75 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2022 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+
+# Test the SERIALIZE_RETIREMENT thread model: requests run in parallel
+# in the plugin, but the replies are sent back in request order.
+
+source ./functions.sh
+set -e
+set -x
+
+requires_filter noparallel
+requires_filter delay
+requires_nbdsh_uri
+
+# The noparallel filter can select the thread model.
+nbdkit --filter=noparallel memory 1M serialize=retirement --dump-plugin |
+    grep "^thread_model=serialize_retirement"
+
+# The write takes longer than the read, so in the parallel thread
+# model the read reply would arrive first.  Here the write reply must
+# arrive first, but both requests must still run at the same time.
+nbdkit -U - --filter=noparallel --filter=delay memory 1M \
+       serialize=retirement wdelay=2 rdelay=1 \
+       --run 'nbdsh -u "$uri" -c "
+import time
+
+start_t = time.time()
+wr = h.aio_pwrite(nbd.Buffer.from_bytearray(bytearray(512)), 512)
+rd = h.aio_pread(nbd.Buffer(512), 0)
+
+order = []
+while len(order) < 2:
+    c = h.aio_peek_command_completed()
+    if c == 0:
+        h.poll(-1)
+        continue
+    h.aio_command_completed(c)
+    order.append(c)
+t = time.time() - start_t
+print(t)
+
+assert order == [wr, rd]
+# Serialized requests would take at least 3 seconds.
+assert t < 2.9
+"'